@@ -9,6 +9,10 @@ EC_API_EXTERN void capture_stop(struct iface_env *);
 
 EC_API_EXTERN EC_THREAD_FUNC(capture);
 
+EC_API_EXTERN int capture_ring_open(struct iface_env *iface, struct bpf_program *filter);
+EC_API_EXTERN void capture_ring_close(struct iface_env *iface);
+EC_API_EXTERN void capture_setfilter(struct iface_env *iface, struct bpf_program *filter);
+
 EC_API_EXTERN int is_pcap_file(char *file, char *pcap_errbuf);
 EC_API_EXTERN void capture_getifs(void);
 
@@ -4,27 +4,23 @@
 #include <ec_inet.h>
 #include <ec_threads.h>
 
+/*
+ * the packets are kept as records in a ring of max_size bytes,
+ * allocated with the first one. the oldest records are overwritten.
+ */
 struct conn_buf {
    /* the lock */
    pthread_mutex_t connbuf_mutex;
    /* max buffer size */
    size_t max_size;
-   /* actual buffer size */
+   /* actual buffer size (records, headers and padding) */
    size_t size;
-   /* the real buffer made up of a tail of packets */
-   TAILQ_HEAD(connbuf_head, conn_pck_list) connbuf_tail;
-};
-
-/* an entry in the tail */
-struct conn_pck_list {
-   /* size of the element (including the struct size) */
-   size_t size;
-   /* the source of the packet */
-   struct ip_addr L3_src;
-   /* the data */
-   u_char *buf;
-   /* the link to the next element */
-   TAILQ_ENTRY(conn_pck_list) next;
+   /* the offset of the oldest record */
+   size_t head;
+   /* the real buffer */
+   u_char *ring;
+   /* the two ends of the connection, referenced by the records */
+   struct ip_addr L3_src[2];
 };
 
 /* functions */
@@ -7,6 +7,7 @@
 /* conntrack hook definition */
 struct ct_hook_list {
    void (*func)(struct packet_object *po);
+   struct metrics_acct *acct;
    SLIST_ENTRY (ct_hook_list) next;
 };
 
@@ -50,10 +51,19 @@ struct conn_object {
    SLIST_HEAD(, ct_hook_list) hook_head;
 };
 
+/* 
+ * the element of the connection list, allocated together with its
+ * connection object (co points to obj).
+ */
 struct conn_tail {
    struct conn_object *co; 
-   struct conn_hash_search *cs;
-   TAILQ_ENTRY(conn_tail) next;
+   u_int32 hash;
+   LIST_ENTRY(conn_tail) bucket;    /* in the hash table */
+   TAILQ_ENTRY(conn_tail) lru;      /* in its stripe, least recently updated first (or deleted) */
+   TAILQ_ENTRY(conn_tail) next;     /* in the list shown by the UIs (or new in its stripe) */
+   u_int8 listed;                   /* moved in the list of the UIs */
+   u_int8 dead;                     /* deleted, to be freed by the UIs side */
+   struct conn_object obj;
 };
 
 
@@ -76,6 +86,8 @@ enum {
 /* exported functions */
 EC_API_EXTERN void * conntrack_print(int mode, void *list, char **desc, size_t len);
 EC_API_EXTERN void * conntrack_get(int mode, void *list, struct conn_object **conn);
+EC_API_EXTERN void conntrack_lock(void);
+EC_API_EXTERN void conntrack_unlock(void);
 EC_API_EXTERN int conntrack_protostr(struct conn_object *conn, char *pstr, int len);
 EC_API_EXTERN int conntrack_flagstr(struct conn_object *conn, char *pstr, int len);
 EC_API_EXTERN int conntrack_statusstr(struct conn_object *conn, char *pstr, int len);
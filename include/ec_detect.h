@@ -0,0 +1,20 @@
+#ifndef ETTERCAP_DETECT_H
+#define ETTERCAP_DETECT_H
+
+#include <ec_packet.h>
+
+/*
+ * identification of the application protocol of a flow by the
+ * content of its first payloads, so that a dissector can handle
+ * its protocol on a port it is not registered on.
+ * the result is set in po->DETECT and kept for the whole flow.
+ */
+
+EC_API_EXTERN int detect_proto(struct packet_object *po);
+
+#endif
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
@@ -37,13 +37,17 @@ EC_API_EXTERN size_t dissect_create_ident(void **i, struct packet_object *po, vo
 
 EC_API_EXTERN int dissect_on_port(char *name, u_int16 port);
 EC_API_EXTERN int dissect_on_port_level(char *name, u_int16 port, u_int8 level);
+EC_API_EXTERN void * dissect_decoder(char *name, u_int8 level);
 
+/* the protocol 'name' was detected on the flow, with the server on 'srv' */
+#define DETECTED_ON_PORT(name, pack, srv) \
+   (pack->DETECT.proto != NULL && pack->DETECT.port == (srv) && !strcasecmp(pack->DETECT.proto, name))
 
 /* return true if the packet is coming from the server */
-#define FROM_SERVER(name, pack) (dissect_on_port(name, ntohs(pack->L4.src)) == E_SUCCESS)
+#define FROM_SERVER(name, pack) (dissect_on_port(name, ntohs(pack->L4.src)) == E_SUCCESS || DETECTED_ON_PORT(name, pack, pack->L4.src))
 
 /* return true if the packet is coming from the client */
-#define FROM_CLIENT(name, pack) (dissect_on_port(name, ntohs(pack->L4.dst)) == E_SUCCESS)
+#define FROM_CLIENT(name, pack) (dissect_on_port(name, ntohs(pack->L4.dst)) == E_SUCCESS || DETECTED_ON_PORT(name, pack, pack->L4.dst))
 
 
 /*
@@ -110,6 +110,10 @@ struct filter_env {
    void *map;
    struct filter_op *chain;
    size_t len;
+   /* the chain decoded at load time, NULL if it must be interpreted */
+   struct filter_insn *code;
+   /* the first automaton containing its literals */
+   u_int32 ac_gen;
 };
 
 /* filter list entry */
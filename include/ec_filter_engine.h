@@ -0,0 +1,31 @@
+#ifndef ETTERCAP_FILTER_ENGINE_H
+#define ETTERCAP_FILTER_ENGINE_H
+
+#include <ec_filter.h>
+
+/*
+ * the engine behind filter_load_file() and filter_packet():
+ * the interpreter, the decoder of the chains and the literals of
+ * the automaton. only ec_filter.c and the tests use them, the
+ * plugins and the UIs go through ec_filter.h.
+ */
+
+EC_API_EXTERN int filter_engine(struct filter_op *fop, struct packet_object *po);
+EC_API_EXTERN int filter_decode(struct filter_env *fenv);
+EC_API_EXTERN void filter_run(struct filter_insn *ins, struct packet_object *po);
+
+EC_API_EXTERN int filter_compile_regex(struct filter_env *fenv);
+EC_API_EXTERN void filter_free_regex(struct filter_env *fenv);
+EC_API_EXTERN size_t filter_regex_literal(const char *re, int icase, u_char **lit);
+
+EC_API_EXTERN void filter_literals_add(struct filter_env *fenv);
+EC_API_EXTERN void filter_literals_del(struct filter_env *fenv);
+EC_API_EXTERN int filter_literals_ready(struct filter_env *fenv);
+EC_API_EXTERN u_int32 filter_literals_refs(void);
+
+#endif
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
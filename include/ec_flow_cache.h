@@ -0,0 +1,54 @@
+#ifndef ETTERCAP_FLOW_CACHE_H
+#define ETTERCAP_FLOW_CACHE_H
+
+#include <ec_packet.h>
+
+/*
+ * the decisions taken on the first packets of a flow, reused for the
+ * following ones: whether the TARGETS match it and which dissectors
+ * handle it.
+ * every thread has its own cache, so it is used without locking.
+ * the entries are keyed on the mac addresses and the 5-tuple of one
+ * direction of the flow, and they are discarded as soon as something
+ * they depend on (TARGETS, options, decoders) is changed.
+ */
+
+#define FLOW_DISSECTORS_MAX   8
+
+struct flow_cache {
+   /* the key */
+   u_int8 L2_src[MEDIA_ADDR_LEN];
+   u_int8 L2_dst[MEDIA_ADDR_LEN];
+   struct ip_addr L3_src;
+   struct ip_addr L3_dst;
+   u_int16 L4_src;
+   u_int16 L4_dst;
+   u_int8 L4_proto;
+   /* the generation the entry was filled in, 0 if empty */
+   u_int32 gen;
+   u_int8 flags;
+      #define FLOW_VERDICT       1     /* the TARGETS were matched */
+      #define FLOW_INTERESTING   2     /* ...and the packets must not be ignored */
+      #define FLOW_RESOLVED      4     /* the dissectors are known */
+   /* the dissectors to run, in order */
+   u_int8 ndissectors;
+   void *dissectors[FLOW_DISSECTORS_MAX];
+   /* the content of po->DETECT */
+   const char *detect_proto;
+   void *detect_decoder;
+   u_int16 detect_port;
+};
+
+EC_API_EXTERN struct flow_cache * flow_cache_get(struct packet_object *po);
+EC_API_EXTERN u_int32 flow_cache_generation(void);
+EC_API_EXTERN void flow_cache_invalidate(void);
+
+EC_API_EXTERN int flow_cache_dissectors(struct packet_object *po, void **dissectors);
+EC_API_EXTERN void flow_cache_resolve(struct packet_object *po, u_int32 gen, void **dissectors, u_int n);
+
+#endif
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
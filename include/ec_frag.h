@@ -0,0 +1,46 @@
+#ifndef ETTERCAP_FRAG_H
+#define ETTERCAP_FRAG_H
+
+#include <ec_inet.h>
+
+/*
+ * identifies the fragments of the same datagram.
+ * it must be zeroed before filling it (it is hashed as a whole)
+ */
+struct frag_key {
+   struct ip_addr src;
+   struct ip_addr dst;
+   u_int32 id;
+   u_int8 proto;
+};
+
+/* what to do when a fragment overlaps the data already received */
+enum {
+   FRAG_POLICY_FIRST = 0,     /* keep the data received first */
+   FRAG_POLICY_LAST  = 1,     /* the new data overwrites the old one */
+   FRAG_POLICY_DROP  = 2,     /* discard the whole datagram (RFC 5722) */
+};
+
+/* 
+ * what precedes the data of a fragment in the packet: the link layer
+ * and the network headers, the latter starting at l3_off
+ */
+struct frag_hdr {
+   u_char *buf;
+   size_t len;
+   size_t l3_off;
+};
+
+/* the biggest payload that can be reassembled */
+#define FRAG_MAX_LEN    UINT16_MAX
+
+EC_API_EXTERN int frag_insert(struct frag_key *key, struct timeval *ts,
+                              u_int32 offset, u_char *data, size_t len, int more, size_t max,
+                              struct frag_hdr *hdr, u_char **dgram, size_t *dgram_len);
+
+#endif
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
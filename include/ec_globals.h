@@ -45,9 +45,23 @@ struct ec_conf {
    int connection_idle;
    int connection_buffer;
    int connect_timeout;
+   int frag_timeout;
+   int frag_memory;
+   int frag_policy;
+   int stream_buffer;
+   int stream_memory;
    int sampling_rate;
+   int hook_accounting;
+   int capture_ring;
+   int ring_block_size;
+   int ring_block_count;
+   int ring_block_timeout;
+   int capture_threads;
+   int dispatcher_threads;
+   int target_filter;
    int close_on_eof;
    int aggressive_dissectors;
+   int protocol_detection;
    int skip_forwarded;
    int checksum_check;
    int submit_fingerprint;
@@ -67,6 +81,7 @@ struct ec_conf {
    char *utf8_encoding;
    char *geoip_data_file;
    char *geoip_data_file_v6;
+   char *metrics_socket;
 };
 
 /* options from getopt */
@@ -143,6 +158,9 @@ struct ip_list {
    LIST_ENTRY(ip_list) next;
 };
 
+/* the same ips as sorted intervals, used to match the packets (ec_sniff.c) */
+struct ip_ranges;
+
 /* scanned hosts list */
 struct hosts_list {
    struct ip_addr ip;
@@ -162,6 +180,8 @@ struct target_env {
    u_char mac[MEDIA_ADDR_LEN];
    LIST_HEAD(, ip_list) ips;
    LIST_HEAD(, ip_list) ip6;
+   struct ip_ranges *ranges;
+   struct ip_ranges *ranges6;
    u_int8 ports[1<<13];       /* in 8192 byte we have 65535 bits, use one bit per port */
 };
 
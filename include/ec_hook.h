@@ -58,10 +58,19 @@ enum {
    HOOK_PROTO_MDNS,
    HOOK_PROTO_NBNS,
    HOOK_PROTO_HTTP,
-   HOOK_PROTO_KRB5
+   HOOK_PROTO_KRB5,
+
+   /* keep it the last one, the hook points are indexed by their value */
+   HOOK_POINTS_MAX
 };
 
+/* 
+ * hook_add() and hook_del() wait for the threads running the hooks of 
+ * the point: don't call them holding a lock that a hook function takes
+ */
 EC_API_EXTERN void hook_add(int point, void (*func)(struct packet_object *po) );
+EC_API_EXTERN void hook_add_flags(int point, void (*func)(struct packet_object *po), int flags);
+   #define HOOK_FL_SHARD_SAFE    1  /* can run concurrently on all the dispatcher threads */
 EC_API_EXTERN int hook_del(int point, void (*func)(struct packet_object *po) );
 
 #endif
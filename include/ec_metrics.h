@@ -0,0 +1,67 @@
+#ifndef ETTERCAP_METRICS_H
+#define ETTERCAP_METRICS_H
+
+#include <ec_threads.h>
+
+/*
+ * latency histograms of the packet pipeline.
+ * the buckets are powers of 2 of nanoseconds.
+ */
+
+#define METRICS_BUCKETS    32
+
+struct metrics_hist {
+   const char *family;     /* "stage", "dissector" or "hook" */
+   char label[32];
+   void *func;             /* the function measured, if any */
+   uint64_t count;
+   uint64_t sum;           /* ns */
+   uint64_t bucket[METRICS_BUCKETS];
+};
+
+/*
+ * cpu accounting of the hooked functions (if hook_accounting is set).
+ * unlike the histograms every call is measured
+ */
+struct metrics_acct {
+   void *func;
+   char label[32];
+   char plugin[32];        /* the plugin owning the function, empty for the core */
+   uint64_t calls;
+   uint64_t time;          /* ns */
+   uint64_t max;           /* ns */
+};
+
+enum {
+   METRICS_CAPTURE = 0,    /* from the kernel timestamp to ec_decode() */
+   METRICS_DECODE,         /* the whole decoders stack */
+   METRICS_DATA,           /* decode_data(): dissectors, filters and hooks */
+   METRICS_FILTER,         /* filter_packet() */
+   METRICS_QUEUE,          /* waiting in the top half queue */
+   METRICS_DISPATCH,       /* HOOK_DISPATCHER */
+   METRICS_STAGES,
+};
+
+/*
+ * set for the packet being processed by this thread
+ * if it was chosen for the latency sampling
+ */
+EC_API_EXTERN __thread int metrics_on;
+
+EC_API_EXTERN uint64_t metrics_clock(void);
+EC_API_EXTERN int metrics_sample(void);
+EC_API_EXTERN void metrics_stage(int stage, uint64_t ns);
+EC_API_EXTERN void metrics_func_add(void *func, const char *family, const char *label);
+EC_API_EXTERN void metrics_func(void *func, uint64_t ns);
+EC_API_EXTERN struct metrics_acct * metrics_acct_add(void *func);
+EC_API_EXTERN struct metrics_acct * metrics_acct_add_owned(void *key, const char *label, const char *owner);
+EC_API_EXTERN void metrics_acct(struct metrics_acct *a, uint64_t ns);
+EC_API_EXTERN char * metrics_acct_report(size_t max);
+EC_API_EXTERN EC_THREAD_FUNC(metrics_server);
+
+#endif
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
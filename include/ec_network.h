@@ -30,10 +30,14 @@ struct iface_env {
 
    u_char* pbuf; /* buffer to be used to handle the packet on the arriving interface*/
 
+   struct capture_ring* ring; /* AF_PACKET mmap ring, if the ring backend is used */
+   struct bpf_program* filter; /* a new filter, set by the capture thread */
+
 };
 
 
 EC_API_EXTERN void network_init();
+EC_API_EXTERN void network_filter_update(void);
 EC_API_EXTERN void secondary_sources_foreach(void (*callback)(struct iface_env*));
 EC_API_EXTERN struct iface_env* iface_by_mac(u_int8 mac[MEDIA_ADDR_LEN]);
 
@@ -102,6 +102,13 @@ struct packet_object {
     * the "char *" are malloc(ed) by dissectors
     */
    struct dissector_info DISSECTOR;
+
+   /* the protocol recognized by the content of the flow (ec_detect.c) */
+   struct {
+      const char *proto;      /* the name of the dissector */
+      void *decoder;
+      u_int16 port;           /* the server port */
+   } DETECT;
   
    /* the struct for passive identification */
    struct passive_info PASSIVE;
@@ -113,6 +120,8 @@ EC_API_EXTERN int packet_create_object(struct packet_object *po, u_char * buf, u
 EC_API_EXTERN int packet_destroy_object(struct packet_object *po);
 EC_API_EXTERN int packet_disp_data(struct packet_object *po, u_char *buf, u_int len);
 EC_API_EXTERN struct packet_object * packet_dup(struct packet_object *po, u_char flag);
+/* the duplicates come from a pool, release them instead of free() */
+EC_API_EXTERN void packet_release_object(struct packet_object *po);
 
 /* Do we want to duplicate data? */
 #define PO_DUP_NONE     0
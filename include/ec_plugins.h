@@ -38,6 +38,7 @@ EC_API_EXTERN int plugin_list_walk(int min, int max, void (*func)(char, struct p
 
 EC_API_EXTERN int plugin_is_activated(char *name);
 EC_API_EXTERN int search_plugin(char *name);
+EC_API_EXTERN int plugin_owner(void *func, char *name, size_t len);
 
 /* use these to activate and deactivate a plugin; these are *imported* from plugins */
 EC_API_EXTERN int plugin_init(char *name);
@@ -37,6 +37,10 @@ struct open_port {
    
    /* the list of users */
    LIST_HEAD(, active_user) users_list_head;
+   /* ...and the same users sorted by name, for the lookups */
+   struct active_user **users;
+   u_int32 nusers;
+   u_int32 users_size;
    
    LIST_ENTRY(open_port) next;
 };
@@ -56,6 +60,10 @@ struct host_profile {
 
    /* the list of open ports */
    LIST_HEAD(, open_port) open_ports_head;
+   /* ...and the same ports sorted by port and proto, for the lookups */
+   struct open_port **ports;
+   u_int32 nports;
+   u_int32 ports_size;
    
    /* distance in hop (TTL) */
    u_int8 distance;
@@ -66,6 +74,12 @@ struct host_profile {
    u_char fingerprint[FINGER_LEN+1];
 
    TAILQ_ENTRY(host_profile) next;
+
+   /* the indexes on the profile list */
+   LIST_ENTRY(host_profile) ip_next;      /* hash on the ip address */
+   LIST_ENTRY(host_profile) mac_next;     /* hash on the mac address */
+   struct host_profile **skip;            /* the ordered one, a skip list */
+   u_int8 skip_level;
 };
 
 /* exported functions */
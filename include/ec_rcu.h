@@ -0,0 +1,33 @@
+#ifndef ETTERCAP_RCU_H
+#define ETTERCAP_RCU_H
+
+/*
+ * read-copy-update of the structures used on every packet.
+ * the readers take no lock: they mark the section where they use
+ * the structure, the writers publish a modified copy and free the
+ * old one when all the sections running at that time are over.
+ * every domain has its own readers, so a writer waits only for the
+ * threads reading what it has replaced.
+ */
+
+enum {
+   RCU_HOOKS,
+   RCU_RANGES,
+   RCU_FILTERS,
+   RCU_DECODERS,
+   RCU_DOMAINS,
+};
+
+EC_API_EXTERN void rcu_read_begin(int domain);
+EC_API_EXTERN void rcu_read_end(int domain);
+EC_API_EXTERN int rcu_reading(int domain);
+EC_API_EXTERN void rcu_synchronize(int domain);
+EC_API_EXTERN void rcu_retire(int domain, void *ptr, void (*release)(void *ptr));
+EC_API_EXTERN void rcu_thread_exit(int domain, void (*func)(void));
+
+#endif
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
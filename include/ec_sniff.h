@@ -16,6 +16,26 @@ struct sniffing_method {
    void (*interesting)(struct packet_object *po);  /* this function set the PO_IGNORE flag */
 };
 
+/*
+ * the ip lists of a target hold every single address (they are used
+ * to scan and poison the hosts), but the packets are matched against
+ * the same addresses merged into sorted intervals, so a range like
+ * 10.0.0-255.1-254 is a few hundreds entries instead of 65k.
+ * the lookup is a binary search without any lock: the writers build
+ * a new array, publish it and free the replaced one when the lookups
+ * which may still be using it are over.
+ */
+struct ip_range {
+   u_int8 lo[MAX_IP_ADDR_LEN];
+   u_int8 hi[MAX_IP_ADDR_LEN];
+};
+
+struct ip_ranges {
+   size_t len;                   /* of the addresses */
+   u_int n;
+   struct ip_range r[];
+};
+
 /* exported functions */
 
 /* forwarder (the struct is in ec_globals.h) */
@@ -30,11 +50,16 @@ EC_API_EXTERN int compile_display_filter(void);
 EC_API_EXTERN int compile_target(char *string, struct target_env *target);
 
 EC_API_EXTERN void reset_display_filter(struct target_env *t);
+EC_API_EXTERN void sniff_targets_changed(void);
 
 EC_API_EXTERN void del_ip_list(struct ip_addr *ip, struct target_env *t);
 EC_API_EXTERN int cmp_ip_list(struct ip_addr *ip, struct target_env *t);
 EC_API_EXTERN void add_ip_list(struct ip_addr *ip, struct target_env *t);
+EC_API_EXTERN int insert_ip_list(struct ip_addr *ip, struct target_env *t);
+EC_API_EXTERN int remove_ip_list(struct ip_addr *ip, struct target_env *t);
+EC_API_EXTERN void commit_ip_list(struct target_env *t);
 EC_API_EXTERN void free_ip_list(struct target_env *t);
+EC_API_EXTERN void free_ip_ranges(struct target_env *t);
 
 #endif
 
@@ -0,0 +1,15 @@
+#ifndef ETTERCAP_SNIFF_BPF_H
+#define ETTERCAP_SNIFF_BPF_H
+
+#include <ec_network.h>
+
+/* exported functions */
+
+EC_API_EXTERN char * sniff_bpf_filter(struct iface_env *iface);
+
+#endif
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
@@ -1,20 +1,28 @@
 #ifndef ETTERCAP_STATS_H
 #define ETTERCAP_STATS_H
 
+#include <ec_threads.h>
+
 /*
  * this struct contains all field to collect 
  * statistics about packet and byte rate
- * for the bottom and top half
+ * for the bottom and top half.
+ * it is filled by the stats timer from the
+ * per thread counters (see ec_stats.c)
  */
 
 struct half_stats {
    uint64_t pck_recv;
    uint64_t pck_size;
-   struct timeval ttot;
-   struct timeval tpar;
-   struct timeval ts;
-   struct timeval te;
-   uint64_t tmp_size;
+   uint64_t busy;             /* estimated processing time (ns) */
+   /* values at the last worst rate sample */
+   uint64_t last_recv;
+   uint64_t last_size;
+   uint64_t last_busy;
+   /* thread counters at the last stats_wipe() */
+   uint64_t base_recv;
+   uint64_t base_size;
+   uint64_t base_busy;
    unsigned long rate_adv;
    unsigned long rate_worst;
    unsigned long thru_adv;
@@ -39,6 +47,28 @@ struct gbl_stats {
    struct half_stats th;
    unsigned long queue_max;
    unsigned long queue_curr;
+   unsigned long queue_drop;  /* packets lost because the queue was full */
+   /* mmap ring capture (see capture_ring in etter.conf) */
+   uint64_t ring_blocks;      /* blocks walked */
+   uint64_t ring_lost;        /* blocks flagged by the kernel as losing packets */
+   uint64_t ring_freeze;      /* times the kernel froze the queue */
+   /* packet pool, zero delta at steady state */
+   uint64_t pool_heap_alloc;  /* elements malloc(ed) to grow the pool */
+   uint64_t pool_heap_free;   /* elements given back to the heap */
+   /* IP fragments reassembly (see ec_frag.c) */
+   uint64_t frag_mem;         /* bytes held by the pending datagrams */
+   uint64_t frag_pending;     /* datagrams waiting for their missing fragments */
+   uint64_t frag_reassembled; /* datagrams completed */
+   uint64_t frag_expired;     /* datagrams not completed within frag_timeout */
+   uint64_t frag_evicted;     /* datagrams discarded to stay within frag_memory */
+   uint64_t frag_overlap;     /* fragments overlapping the data received */
+   uint64_t frag_dropped;     /* invalid fragments */
+   /* TCP reassembly for the dissectors (see ec_tcp_stream.c) */
+   uint64_t stream_mem;       /* bytes buffered by all the streams */
+   uint64_t stream_ooo;       /* segments queued after a hole */
+   uint64_t stream_gaps;      /* holes given up */
+   uint64_t stream_dropped;   /* segments not queued for lack of memory */
+   uint64_t stream_overflow;  /* unparsed data discarded (over stream_buffer) */
 };
 
 #define time_sub(a, b, result) do {                  \
@@ -64,9 +94,11 @@ struct gbl_stats {
 
 EC_API_EXTERN void stats_wipe(void);
 EC_API_EXTERN void stats_update(void);
+EC_API_EXTERN EC_THREAD_FUNC(stats_timer);
 
 EC_API_EXTERN unsigned long stats_queue_add(void);
 EC_API_EXTERN unsigned long stats_queue_del(void);
+EC_API_EXTERN unsigned long stats_queue_drop(void);
 
 EC_API_EXTERN void stats_half_start(struct half_stats *hs);
 EC_API_EXTERN void stats_half_end(struct half_stats *hs, u_int len);
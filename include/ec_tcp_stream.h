@@ -0,0 +1,60 @@
+#ifndef ETTERCAP_TCP_STREAM_H
+#define ETTERCAP_TCP_STREAM_H
+
+#include <ec_packet.h>
+
+/*
+ * TCP reassembly for the dissectors.
+ *
+ * a dissector calling tcp_stream_add() for each packet gets its
+ * callback invoked with the payload of one direction of the
+ * connection, in order and without duplicates. the callback returns
+ * the number of bytes it has parsed, the rest is given back to it
+ * (followed by the new data) at the next invocation.
+ */
+
+struct tcp_stream_seg {
+   u_int32 seq;
+   size_t len;
+   TAILQ_ENTRY(tcp_stream_seg) next;
+   u_char data[];
+};
+
+struct tcp_stream_half {
+   u_int32 next_seq;          /* the next byte to be delivered */
+   u_char synced;
+   u_char closed;
+   u_char gap;                /* data was lost before the buffer */
+   /* in order data not yet parsed by the callback (null terminated) */
+   u_char *buf;
+   size_t len;
+   size_t size;
+   /* segments after a hole, sorted by sequence number */
+   TAILQ_HEAD(, tcp_stream_seg) ooo;
+   size_t ooo_len;
+};
+
+struct tcp_stream {
+   /* the source of the direction 0 */
+   struct ip_addr L3_src;
+   u_int16 L4_src;
+   struct tcp_stream_half way[2];
+   /* private to the dissector, freed with the stream */
+   void *data;
+};
+
+#define TCP_STREAM_FUNC(func) size_t func(struct tcp_stream *ts, struct packet_object *po, u_char *data, size_t len, int flags)
+#define TCP_STREAM_FUNC_PTR(func) size_t (*func)(struct tcp_stream *ts, struct packet_object *po, u_char *data, size_t len, int flags)
+
+/* flags passed to the callback */
+#define TCP_STREAM_GAP  1     /* some data before this buffer is missing, resync the parser */
+#define TCP_STREAM_END  2     /* this direction was closed, no more data will come */
+
+EC_API_EXTERN int tcp_stream_add(struct packet_object *po, TCP_STREAM_FUNC_PTR(func));
+
+#endif
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
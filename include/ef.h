@@ -11,6 +11,8 @@ struct ef_globals {
    u_int32 lineno;
    u_int8 debug;
    u_int8 suppress_warnings;
+   u_int8 optimize_report;
+   u_int8 no_optimize;
 };
 
 /* in el_main.c */
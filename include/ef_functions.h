@@ -82,6 +82,10 @@ EC_API_EXTERN struct condition * compiler_concat_conditions(struct condition *a,
 EC_API_EXTERN struct ifblock * compiler_create_ifblock(struct condition *conds, struct block *blk);
 EC_API_EXTERN struct ifblock * compiler_create_ifelseblock(struct condition *conds, struct block *blk, struct block *elseblk);
 
+/* ef_optimizer */
+EC_API_EXTERN void optimize_conds(struct condition **cnd);
+EC_API_EXTERN size_t optimize_code(struct filter_op *fop, size_t n);
+
 #endif
 
 /* EOF */
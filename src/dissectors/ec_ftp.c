@@ -24,10 +24,12 @@
 #include <ec_dissect.h>
 #include <ec_session.h>
 #include <ec_sslwrap.h>
+#include <ec_tcp_stream.h>
 
 /* protos */
 
 FUNC_DECODER(dissector_ftp);
+static TCP_STREAM_FUNC(ftp_stream);
 void ftp_init(void);
 
 /************************************************/
@@ -45,10 +47,9 @@ void __init ftp_init(void)
 
 FUNC_DECODER(dissector_ftp)
 {
-   DECLARE_DISP_PTR_END(ptr, end);
+   DECLARE_DISP_PTR(ptr);
    struct ec_session *s = NULL;
    void *ident = NULL;
-   char tmp[MAX_ASCII_ADDR_LEN];
 
    /* don't complain about unused var */
    (void) DECODE_DATA; 
@@ -76,92 +77,81 @@ FUNC_DECODER(dissector_ftp)
      
    } ENDIF_FIRST_PACKET_FROM_SERVER(s, ident)
 
-   /* skip empty packets (ACK packets) */
-   if (PACKET->DATA.len == 0)
-      return NULL;
-   
    /* skip messages coming from the server */
    if (FROM_SERVER("ftp", PACKET))
       return NULL;
    
    DEBUG_MSG("FTP --> TCP dissector_ftp");
- 
-   /* skip the whitespaces at the beginning */
-   while(*ptr == ' ' && ptr != end) ptr++;
- 
-   /* reached the end */
-   if (ptr == end) 
-      return NULL;
+
+   /* the commands may be split across the segments */
+   tcp_stream_add(PACKET, ftp_stream);
    
-   /* harvest the username */
-   if ( !strncasecmp((const char*)ptr, "USER ", 5) ) {
-
-      DEBUG_MSG("\tDissector_FTP USER");
-      
-      /* create the session */
-      dissect_create_session(&s, PACKET, DISSECT_CODE(dissector_ftp));
-      
-      ptr += 5;
-
-      /* if not null, free it */
-      SAFE_FREE(s->data);
-
-      /* fill the session data */
-      s->data = strdup((const char*)ptr);
-      s->data_len = strlen((const char*)ptr);
-      
-      if ( (ptr = (u_char*)strchr(s->data,'\r')) != NULL )
-         *ptr = '\0';
-      
-      /* save the session */
-      session_put(s);
-      
-      return NULL;
-   }
+   return NULL;
+}
+
+/*
+ * parse the complete lines sent by the client
+ */
+static TCP_STREAM_FUNC(ftp_stream)
+{
+   u_char *line = data, *eol, *ptr;
+   char tmp[MAX_ASCII_ADDR_LEN];
+
+   /* nothing to do when the gap or the end of the stream is reported */
+   (void) flags;
+
+   if (len == 0)
+      return 0;
 
-   /* harvest the password */
-   if ( !strncasecmp((const char*)ptr, "PASS ", 5) ) {
-
-      DEBUG_MSG("\tDissector_FTP PASS");
-      
-      ptr += 5;
-      
-      /* create an ident to retrieve the session */
-      dissect_create_ident(&ident, PACKET, DISSECT_CODE(dissector_ftp));
-      
-      /* retrieve the session and delete it */
-      if (session_get_and_del(&s, ident, DISSECT_IDENT_LEN) == -E_NOTFOUND) {
-         SAFE_FREE(ident);
-         return NULL;
+   while ((eol = memchr(line, '\n', data + len - line)) != NULL) {
+
+      /* terminate the line (it was already received) */
+      *eol = '\0';
+      if (eol > line && *(eol - 1) == '\r')
+         *(eol - 1) = '\0';
+
+      ptr = line;
+      line = eol + 1;
+
+      /* skip the whitespaces at the beginning */
+      while (*ptr == ' ')
+         ptr++;
+
+      /* harvest the username, it is kept in the stream until the password */
+      if ( !strncasecmp((const char*)ptr, "USER ", 5) ) {
+
+         DEBUG_MSG("\tDissector_FTP USER");
+
+         SAFE_FREE(ts->data);
+         ts->data = strdup((const char*)ptr + 5);
+         continue;
       }
-      
-      /* check that the user was sent before the pass */
-      if (s->data == NULL) {
-         SAFE_FREE(ident);
-         return NULL;
+
+      /* harvest the password */
+      if ( !strncasecmp((const char*)ptr, "PASS ", 5) ) {
+
+         DEBUG_MSG("\tDissector_FTP PASS");
+
+         /* check that the user was sent before the pass */
+         if (ts->data == NULL)
+            continue;
+
+         /* fill the structure */
+         SAFE_FREE(PACKET->DISSECTOR.user);
+         SAFE_FREE(PACKET->DISSECTOR.pass);
+         PACKET->DISSECTOR.user = ts->data;
+         PACKET->DISSECTOR.pass = strdup((const char*)ptr + 5);
+         ts->data = NULL;
+
+         DISSECT_MSG("FTP : %s:%d -> USER: %s  PASS: %s\n", ip_addr_ntoa(&PACKET->L3.dst, tmp),
+                                       ntohs(PACKET->L4.dst), 
+                                       PACKET->DISSECTOR.user,
+                                       PACKET->DISSECTOR.pass);
       }
-      
-      /* fill the structure */
-      PACKET->DISSECTOR.user = strdup(s->data);
-      
-      PACKET->DISSECTOR.pass = strdup((const char*)ptr);
-      if ( (ptr = (u_char*)strchr(PACKET->DISSECTOR.pass, '\r')) != NULL )
-         *ptr = '\0';
-
-      /* free the session */
-      session_free(s);
-      SAFE_FREE(ident);
-
-      DISSECT_MSG("FTP : %s:%d -> USER: %s  PASS: %s\n", ip_addr_ntoa(&PACKET->L3.dst, tmp),
-                                    ntohs(PACKET->L4.dst), 
-                                    PACKET->DISSECTOR.user,
-                                    PACKET->DISSECTOR.pass);
-
-      
-      return NULL;
    }
-   
-   return NULL;
+
+   /* the last line is not complete */
+   return line - data;
 }
 
 
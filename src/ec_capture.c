@@ -32,6 +32,21 @@
 #include <ifaddrs.h>
 #endif
 
+#ifdef OS_LINUX
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#endif
+
+#if defined(OS_LINUX) && defined(TPACKET3_HDRLEN)
+   #define HAVE_PACKET_RING
+#endif
+
 
 /* globals */
 
@@ -43,11 +58,57 @@ struct align_entry {
    SLIST_ENTRY (align_entry) next;
 };
 
+#ifdef HAVE_PACKET_RING
+/* 
+ * one AF_PACKET TPACKET_V3 receive ring.
+ * with capture_threads > 1 there is one of them per thread,
+ * all joined in the same PACKET_FANOUT group
+ */
+struct ring_rx {
+   struct iface_env *iface;
+   u_int id;
+   int fd;
+   u_char *map;
+   size_t map_len;
+   u_int cur;                 /* the next block to be walked */
+   u_char *pbuf;              /* private copy buffer of this thread */
+};
+
+struct capture_ring {
+   struct tpacket_req3 req;
+   u_int rx_nr;
+   struct ring_rx *rx;
+};
+
+static int ring_rx_open(struct iface_env *iface, struct ring_rx *rx, struct tpacket_req3 *req, struct bpf_program *filter);
+static int ring_rx_setfilter(struct ring_rx *rx, struct bpf_program *filter);
+static void ring_rx_close(struct ring_rx *rx);
+static int capture_ring_loop(struct ring_rx *rx);
+static void capture_ring_walk(struct ring_rx *rx, struct tpacket_block_desc *pbd);
+static void capture_ring_stats(struct ring_rx *rx, u_int32 status);
+static EC_THREAD_FUNC(capture_fanout);
+static void capture_ring_setfilter(struct iface_env *iface, struct bpf_program *filter);
+#endif
+
+static void capture_filter_apply(struct iface_env *iface);
+
 /*******************************************/
 
 void capture_start(struct iface_env *iface)
 {
    char thread_name[64];
+#ifdef HAVE_PACKET_RING
+   u_int i;
+
+   /* one decoder thread per fanout member */
+   if (iface->ring != NULL && iface->ring->rx_nr > 1) {
+      for (i = 0; i < iface->ring->rx_nr; i++) {
+         snprintf(thread_name, sizeof(thread_name), "capture[%s:%u]", iface->name, i);
+         ec_thread_new(thread_name, "fanout ring handler and packet decoder", &capture_fanout, &iface->ring->rx[i]);
+      }
+      return;
+   }
+#endif
 
    snprintf(thread_name, sizeof(thread_name), "capture[%s]", iface->name);
    ec_thread_new(thread_name, "pcap handler and packet decoder", &capture, iface);
@@ -57,6 +118,19 @@ void capture_stop(struct iface_env *iface)
 {
    pthread_t pid;
    char thread_name[64];
+#ifdef HAVE_PACKET_RING
+   u_int i;
+
+   if (iface->ring != NULL && iface->ring->rx_nr > 1) {
+      for (i = 0; i < iface->ring->rx_nr; i++) {
+         snprintf(thread_name, sizeof(thread_name), "capture[%s:%u]", iface->name, i);
+         pid = ec_thread_getpid(thread_name);
+         if(!pthread_equal(pid, EC_PTHREAD_NULL))
+            ec_thread_destroy(pid);
+      }
+      return;
+   }
+#endif
 
    snprintf(thread_name, sizeof(thread_name), "capture[%s]", iface->name);
    pid = ec_thread_getpid(thread_name);
@@ -83,11 +157,24 @@ EC_THREAD_FUNC(capture)
    /* wipe the stats */
    stats_wipe();
    
+#ifdef HAVE_PACKET_RING
+   /* the frames are walked directly in the mmap ring */
+   if (iface->ring != NULL) {
+      ret = capture_ring_loop(&iface->ring->rx[0]);
+      ON_ERROR(ret, -E_FATAL, "Error while capturing from the ring on %s", iface->name);
+      return NULL;
+   }
+#endif
+
    /* 
     * infinite loop 
-    * dispatch packets to ec_decode
+    * dispatch packets to ec_decode.
+    * it is broken to set a new filter posted by capture_setfilter()
     */
-   ret = pcap_loop(iface->pcap, -1, ec_decode, EC_THREAD_PARAM);
+   do {
+      capture_filter_apply(iface);
+      ret = pcap_loop(iface->pcap, -1, ec_decode, EC_THREAD_PARAM);
+   } while (ret == -2 && iface->is_live);   /* broken by pcap_breakloop() */
    ON_ERROR(ret, -1, "Error while capturing: %s", pcap_geterr(iface->pcap));
 
    if (EC_GBL_OPTIONS->read) {
@@ -99,6 +186,399 @@ EC_THREAD_FUNC(capture)
    return NULL;
 }
 
+#ifdef HAVE_PACKET_RING
+/*
+ * a member of a fanout group: same loop as capture(),
+ * but bound to its own ring
+ */
+static EC_THREAD_FUNC(capture_fanout)
+{
+   struct ring_rx *rx;
+   int ret;
+
+   ec_thread_init();
+
+   rx = EC_THREAD_PARAM;
+
+   DEBUG_MSG("neverending loop (capture fanout %u)", rx->id);
+
+   /* only the first member wipes the shared stats */
+   if (rx->id == 0)
+      stats_wipe();
+
+   ret = capture_ring_loop(rx);
+   ON_ERROR(ret, -E_FATAL, "Error while capturing from the ring on %s", rx->iface->name);
+
+   return NULL;
+}
+#endif
+
+/*
+ * open the TPACKET_V3 ring on a live interface.
+ * it must be called with privileges, before drop_privs().
+ *
+ * the pcap handle is kept open (it sets the promisc mode and
+ * gives us the datalink) but it is muted with a filter which
+ * rejects everything, so the kernel does not copy every frame
+ * twice. the user filter (if any) is moved on the ring sockets.
+ *
+ * if capture_threads is greater than one, that many rings are
+ * opened and joined in a PACKET_FANOUT_HASH group: the kernel
+ * hashes the flow (the same for both directions), so all the
+ * packets of a connection are decoded by the same thread.
+ */
+int capture_ring_open(struct iface_env *iface, struct bpf_program *filter)
+{
+#ifdef HAVE_PACKET_RING
+   struct capture_ring *ring;
+   struct bpf_insn reject[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+   struct bpf_program mute;
+   long page = sysconf(_SC_PAGESIZE);
+   u_int block_size, i;
+
+   DEBUG_MSG("capture_ring_open: %s", iface->name);
+
+   SAFE_CALLOC(ring, 1, sizeof(struct capture_ring));
+
+   /* the kernel wants page aligned blocks */
+   block_size = EC_GBL_CONF->ring_block_size;
+   block_size = (block_size + page - 1) / page * page;
+
+   ring->req.tp_block_size = block_size;
+   ring->req.tp_block_nr = EC_GBL_CONF->ring_block_count;
+   /* in V3 frames have variable length, this is used only to size the ring */
+   ring->req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+   ring->req.tp_frame_nr = (block_size / ring->req.tp_frame_size) * ring->req.tp_block_nr;
+   ring->req.tp_retire_blk_tov = EC_GBL_CONF->ring_block_timeout;
+
+#ifdef PACKET_FANOUT
+   ring->rx_nr = EC_GBL_CONF->capture_threads;
+#else
+   ring->rx_nr = 1;
+#endif
+   SAFE_CALLOC(ring->rx, ring->rx_nr, sizeof(struct ring_rx));
+
+   for (i = 0; i < ring->rx_nr; i++) {
+      ring->rx[i].id = i;
+      ring->rx[i].fd = -1;
+   }
+
+   for (i = 0; i < ring->rx_nr; i++)
+      if (ring_rx_open(iface, &ring->rx[i], &ring->req, filter) != E_SUCCESS)
+         goto error;
+
+   mute.bf_len = sizeof(reject) / sizeof(struct bpf_insn);
+   mute.bf_insns = reject;
+   if (pcap_setfilter(iface->pcap, &mute) == -1)
+      DEBUG_MSG("capture_ring_open: cannot mute pcap: %s", pcap_geterr(iface->pcap));
+
+   DEBUG_MSG("capture_ring_open: %u ring(s) of %u blocks of %u bytes", ring->rx_nr, 
+         ring->req.tp_block_nr, ring->req.tp_block_size);
+
+   iface->ring = ring;
+
+   return E_SUCCESS;
+
+error:
+   USER_MSG("Cannot use the mmap ring on %s (%s), falling back to libpcap\n", iface->name, strerror(errno));
+   for (i = 0; i < ring->rx_nr; i++)
+      ring_rx_close(&ring->rx[i]);
+   SAFE_FREE(ring->rx);
+   SAFE_FREE(ring);
+
+   return -E_INITFAIL;
+#else
+   (void) filter;
+   USER_MSG("The mmap ring is not supported on this system, using libpcap on %s\n", iface->name);
+   return -E_NOTHANDLED;
+#endif
+}
+
+/*
+ * replace the filter of a running interface. it takes the
+ * program (allocated with its struct) and frees it when done.
+ *
+ * the pcap handle can not be touched while the capture thread is
+ * in pcap_loop(), so the program is posted to it and the loop is
+ * broken: capture() sets it before entering the loop again.
+ * a program posted before is replaced, only the last one matters.
+ * the filter of the ring sockets is swapped by the kernel, it is
+ * set directly.
+ */
+void capture_setfilter(struct iface_env *iface, struct bpf_program *filter)
+{
+#ifdef HAVE_PACKET_RING
+   if (iface->ring != NULL) {
+      capture_ring_setfilter(iface, filter);
+      pcap_freecode(filter);
+      SAFE_FREE(filter);
+      return;
+   }
+#endif
+
+   filter = __atomic_exchange_n(&iface->filter, filter, __ATOMIC_ACQ_REL);
+   if (filter != NULL) {
+      pcap_freecode(filter);
+      SAFE_FREE(filter);
+   }
+
+   pcap_breakloop(iface->pcap);
+}
+
+/*
+ * set the filter posted by capture_setfilter(), 
+ * called by the capture thread outside of pcap_loop()
+ */
+static void capture_filter_apply(struct iface_env *iface)
+{
+   struct bpf_program *filter;
+
+   filter = __atomic_exchange_n(&iface->filter, NULL, __ATOMIC_ACQ_REL);
+   if (filter == NULL)
+      return;
+
+   if (pcap_setfilter(iface->pcap, filter) == -1)
+      USER_MSG("Cannot set pcap filter: %s - %s\n", iface->name, pcap_geterr(iface->pcap));
+
+   pcap_freecode(filter);
+   SAFE_FREE(filter);
+}
+
+#ifdef HAVE_PACKET_RING
+/*
+ * replace the filter of all the rings of the interface
+ */
+static void capture_ring_setfilter(struct iface_env *iface, struct bpf_program *filter)
+{
+   struct capture_ring *ring = iface->ring;
+   u_int i;
+
+   for (i = 0; i < ring->rx_nr; i++)
+      if (ring_rx_setfilter(&ring->rx[i], filter) != E_SUCCESS)
+         USER_MSG("Cannot set the filter of the ring on %s (%s)\n", iface->name, strerror(errno));
+}
+#endif
+
+void capture_ring_close(struct iface_env *iface)
+{
+#ifdef HAVE_PACKET_RING
+   struct capture_ring *ring = iface->ring;
+   u_int i;
+
+   if (ring == NULL)
+      return;
+
+   DEBUG_MSG("capture_ring_close: %s", iface->name);
+
+   iface->ring = NULL;
+
+   for (i = 0; i < ring->rx_nr; i++)
+      ring_rx_close(&ring->rx[i]);
+   SAFE_FREE(ring->rx);
+   SAFE_FREE(ring);
+#else
+   (void) iface;
+#endif
+}
+
+#ifdef HAVE_PACKET_RING
+static int ring_rx_open(struct iface_env *iface, struct ring_rx *rx, struct tpacket_req3 *req, struct bpf_program *filter)
+{
+   struct sockaddr_ll sll;
+   int version = TPACKET_V3;
+#ifdef PACKET_FANOUT
+   int fanout;
+#endif
+
+   rx->iface = iface;
+
+   rx->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+   if (rx->fd == -1)
+      return -E_INITFAIL;
+
+   if (setsockopt(rx->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+      return -E_INITFAIL;
+
+   if (setsockopt(rx->fd, SOL_PACKET, PACKET_RX_RING, req, sizeof(*req)) == -1)
+      return -E_INITFAIL;
+
+   rx->map_len = (size_t)req->tp_block_size * req->tp_block_nr;
+   rx->map = mmap(NULL, rx->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, rx->fd, 0);
+   if (rx->map == MAP_FAILED) {
+      rx->map = NULL;
+      return -E_INITFAIL;
+   }
+
+   /* the same filter the user asked for libpcap */
+   if (filter != NULL && ring_rx_setfilter(rx, filter) != E_SUCCESS)
+      return -E_INITFAIL;
+
+   memset(&sll, 0, sizeof(sll));
+   sll.sll_family = AF_PACKET;
+   sll.sll_protocol = htons(ETH_P_ALL);
+   sll.sll_ifindex = if_nametoindex(iface->name);
+   if (bind(rx->fd, (struct sockaddr *)&sll, sizeof(sll)) == -1)
+      return -E_INITFAIL;
+
+#ifdef PACKET_FANOUT
+   /* 
+    * the group id must be unique per interface. defrag the
+    * fragments before hashing, so they follow their flow
+    */
+   if (EC_GBL_CONF->capture_threads > 1) {
+      fanout = ((getpid() + sll.sll_ifindex) & 0xffff) | 
+               ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+      if (setsockopt(rx->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) == -1)
+         return -E_INITFAIL;
+   }
+#endif
+
+   return E_SUCCESS;
+}
+
+/* the kernel keeps its own copy of the program */
+static int ring_rx_setfilter(struct ring_rx *rx, struct bpf_program *filter)
+{
+   struct sock_fprog fprog;
+
+   fprog.len = filter->bf_len;
+   fprog.filter = (struct sock_filter *)filter->bf_insns;
+   if (setsockopt(rx->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == -1)
+      return -E_INVALID;
+
+   return E_SUCCESS;
+}
+
+static void ring_rx_close(struct ring_rx *rx)
+{
+   if (rx->map != NULL)
+      munmap(rx->map, rx->map_len);
+   if (rx->fd != -1)
+      close(rx->fd);
+   SAFE_FREE(rx->pbuf);
+
+   rx->map = NULL;
+   rx->fd = -1;
+}
+
+/*
+ * wait for the kernel to retire the blocks and walk them in order.
+ * a block belongs to us while TP_STATUS_USER is set and is given
+ * back to the kernel as soon as all its frames are decoded.
+ */
+static int capture_ring_loop(struct ring_rx *rx)
+{
+   struct tpacket_block_desc *pbd;
+   struct pollfd pfd;
+   size_t block_size = rx->iface->ring->req.tp_block_size;
+   u_int block_nr = rx->iface->ring->req.tp_block_nr;
+   u_int32 status;
+
+   DEBUG_MSG("capture_ring_loop: %s (%u)", rx->iface->name, rx->id);
+
+   /* 
+    * private copy buffer, used when the frame can not be 
+    * decoded in place. the alignment is known only now.
+    */
+   if (rx->pbuf == NULL)
+      SAFE_CALLOC(rx->pbuf, UINT16_MAX + EC_GBL_PCAP->align + 256, sizeof(char));
+
+   pfd.fd = rx->fd;
+   pfd.events = POLLIN | POLLERR;
+   pfd.revents = 0;
+
+   LOOP {
+      pbd = (struct tpacket_block_desc *)(rx->map + rx->cur * block_size);
+
+      status = __atomic_load_n(&pbd->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+
+      /* the kernel is still filling it, wait */
+      if ((status & TP_STATUS_USER) == 0) {
+         CANCELLATION_POINT();
+         if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            return -E_FATAL;
+         continue;
+      }
+
+      capture_ring_walk(rx, pbd);
+      capture_ring_stats(rx, status);
+
+      /* give it back */
+      __atomic_store_n(&pbd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+
+      rx->cur = (rx->cur + 1) % block_nr;
+   }
+
+   return E_SUCCESS;
+}
+
+/*
+ * feed all the frames of a block to the decoders
+ */
+static void capture_ring_walk(struct ring_rx *rx, struct tpacket_block_desc *pbd)
+{
+   struct tpacket3_hdr *ppd;
+   struct pcap_pkthdr pkthdr;
+   u_char *frame, *block_end, tail;
+   u_int32 i;
+
+   block_end = (u_char *)pbd + rx->iface->ring->req.tp_block_size;
+   ppd = (struct tpacket3_hdr *)((u_char *)pbd + pbd->hdr.bh1.offset_to_first_pkt);
+
+   for (i = 0; i < pbd->hdr.bh1.num_pkts; i++) {
+
+      pkthdr.ts.tv_sec = ppd->tp_sec;
+      pkthdr.ts.tv_usec = ppd->tp_nsec / 1000;
+      pkthdr.caplen = ppd->tp_snaplen;
+      pkthdr.len = ppd->tp_len;
+
+      frame = (u_char *)ppd + ppd->tp_mac;
+
+      /*
+       * decode it in place, unless a content filter is loaded:
+       * filters may enlarge the packet and overwrite the next frame.
+       * the decoder NULL terminates the frame, so the following
+       * byte (padding or the next header) is saved and restored.
+       */
+      if (*EC_GBL_FILTERS == NULL && frame + pkthdr.caplen < block_end) {
+         tail = frame[pkthdr.caplen];
+         ec_decode_in_place(rx->iface, &pkthdr, frame);
+         frame[pkthdr.caplen] = tail;
+      } else if (pkthdr.caplen <= UINT16_MAX) {
+         memcpy(rx->pbuf + EC_GBL_PCAP->align, frame, pkthdr.caplen);
+         ec_decode_in_place(rx->iface, &pkthdr, rx->pbuf + EC_GBL_PCAP->align);
+      } else {
+         /* it does not fit in the copy buffer, account it as lost */
+         __atomic_fetch_add(&EC_GBL_STATS->ps_drop, 1, __ATOMIC_RELAXED);
+      }
+
+      ppd = (struct tpacket3_hdr *)((u_char *)ppd + ppd->tp_next_offset);
+   }
+}
+
+/*
+ * the kernel counters are reset on every read,
+ * so they are accumulated once per block.
+ * fanout members update them concurrently.
+ */
+static void capture_ring_stats(struct ring_rx *rx, u_int32 status)
+{
+   struct tpacket_stats_v3 st;
+   socklen_t len = sizeof(st);
+
+   __atomic_fetch_add(&EC_GBL_STATS->ring_blocks, 1, __ATOMIC_RELAXED);
+
+   if (status & TP_STATUS_LOSING)
+      __atomic_fetch_add(&EC_GBL_STATS->ring_lost, 1, __ATOMIC_RELAXED);
+
+   if (getsockopt(rx->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0) {
+      __atomic_fetch_add(&EC_GBL_STATS->ps_recv, st.tp_packets, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&EC_GBL_STATS->ps_drop, st.tp_drops, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&EC_GBL_STATS->ring_freeze, st.tp_freeze_q_cnt, __ATOMIC_RELAXED);
+   }
+}
+#endif
+
 /*
  * get the list of all network interfaces
  */
@@ -64,11 +64,28 @@ static struct conf_entry connections[] = {
    { "connection_idle", NULL },
    { "connection_buffer", NULL },
    { "connect_timeout", NULL },
+   { "frag_timeout", NULL },
+   { "frag_memory", NULL },
+   { "frag_policy", NULL },
+   { "stream_buffer", NULL },
+   { "stream_memory", NULL },
+   { NULL, NULL },
+};
+
+static struct conf_entry capture[] = {
+   { "capture_ring", NULL },
+   { "ring_block_size", NULL },
+   { "ring_block_count", NULL },
+   { "ring_block_timeout", NULL },
+   { "capture_threads", NULL },
+   { "dispatcher_threads", NULL },
+   { "target_filter", NULL },
    { NULL, NULL },
 };
 
 static struct conf_entry stats[] = {
    { "sampling_rate", NULL },
+   { "hook_accounting", NULL },
    { NULL, NULL },
 };
 
@@ -76,6 +93,7 @@ static struct conf_entry misc[] = {
    { "close_on_eof", NULL },
    { "store_profiles", NULL },
    { "aggressive_dissectors", NULL },
+   { "protocol_detection", NULL },
    { "skip_forwarded_pcks", NULL },
    { "checksum_warning", NULL },
    { "checksum_check", NULL },
@@ -117,6 +135,7 @@ static struct conf_entry strings[] = {
    { "utf8_encoding", NULL },
    { "geoip_data_file", NULL },
    { "geoip_data_file_v6", NULL },
+   { "metrics_socket", NULL },
    { NULL, NULL },
 };
 
@@ -130,6 +149,7 @@ static struct conf_section sections[] = {
    { "privs", privs},
    { "mitm", mitm},
    { "connections", connections},
+   { "capture", capture},
    { "stats", stats},
    { "misc", misc},
    { "dissectors", dissectors},
@@ -189,10 +209,24 @@ static void init_structures(void)
    set_pointer(connections, "connection_idle", &EC_GBL_CONF->connection_idle);
    set_pointer(connections, "connection_buffer", &EC_GBL_CONF->connection_buffer);
    set_pointer(connections, "connect_timeout", &EC_GBL_CONF->connect_timeout);
+   set_pointer(connections, "frag_timeout", &EC_GBL_CONF->frag_timeout);
+   set_pointer(connections, "frag_memory", &EC_GBL_CONF->frag_memory);
+   set_pointer(connections, "frag_policy", &EC_GBL_CONF->frag_policy);
+   set_pointer(connections, "stream_buffer", &EC_GBL_CONF->stream_buffer);
+   set_pointer(connections, "stream_memory", &EC_GBL_CONF->stream_memory);
+   set_pointer(capture, "capture_ring", &EC_GBL_CONF->capture_ring);
+   set_pointer(capture, "ring_block_size", &EC_GBL_CONF->ring_block_size);
+   set_pointer(capture, "ring_block_count", &EC_GBL_CONF->ring_block_count);
+   set_pointer(capture, "ring_block_timeout", &EC_GBL_CONF->ring_block_timeout);
+   set_pointer(capture, "capture_threads", &EC_GBL_CONF->capture_threads);
+   set_pointer(capture, "dispatcher_threads", &EC_GBL_CONF->dispatcher_threads);
+   set_pointer(capture, "target_filter", &EC_GBL_CONF->target_filter);
    set_pointer(stats, "sampling_rate", &EC_GBL_CONF->sampling_rate);
+   set_pointer(stats, "hook_accounting", &EC_GBL_CONF->hook_accounting);
    set_pointer(misc, "close_on_eof", &EC_GBL_CONF->close_on_eof);
    set_pointer(misc, "store_profiles", &EC_GBL_CONF->store_profiles);
    set_pointer(misc, "aggressive_dissectors", &EC_GBL_CONF->aggressive_dissectors);
+   set_pointer(misc, "protocol_detection", &EC_GBL_CONF->protocol_detection);
    set_pointer(misc, "skip_forwarded_pcks", &EC_GBL_CONF->skip_forwarded);
    set_pointer(misc, "checksum_warning", &EC_GBL_CONF->checksum_warning);
    set_pointer(misc, "checksum_check", &EC_GBL_CONF->checksum_check);
@@ -227,6 +261,7 @@ static void init_structures(void)
    set_pointer(strings, "utf8_encoding", &EC_GBL_CONF->utf8_encoding);
    set_pointer(strings, "geoip_data_file", &EC_GBL_CONF->geoip_data_file);
    set_pointer(strings, "geoip_data_file_v6", &EC_GBL_CONF->geoip_data_file_v6);
+   set_pointer(strings, "metrics_socket", &EC_GBL_CONF->metrics_socket);
 
    /* sanity check */
    do {
@@ -262,6 +297,32 @@ static void sanity_checks()
    // sampling_rate cannot be equal to 0, since we divide by it
    if (EC_GBL_CONF->sampling_rate == 0)
       EC_GBL_CONF->sampling_rate = 50;
+
+   // the kernel refuses a ring without blocks
+   if (EC_GBL_CONF->ring_block_size <= 0)
+      EC_GBL_CONF->ring_block_size = 1 << 20;
+   if (EC_GBL_CONF->ring_block_count <= 0)
+      EC_GBL_CONF->ring_block_count = 64;
+   if (EC_GBL_CONF->ring_block_timeout <= 0)
+      EC_GBL_CONF->ring_block_timeout = 64;
+   if (EC_GBL_CONF->capture_threads <= 0)
+      EC_GBL_CONF->capture_threads = 1;
+   if (EC_GBL_CONF->dispatcher_threads <= 0)
+      EC_GBL_CONF->dispatcher_threads = 1;
+
+   // keep the fragments reassembly bounded
+   if (EC_GBL_CONF->frag_timeout <= 0)
+      EC_GBL_CONF->frag_timeout = 30;
+   if (EC_GBL_CONF->frag_memory <= 0)
+      EC_GBL_CONF->frag_memory = 4 << 20;
+   if (EC_GBL_CONF->frag_policy < 0 || EC_GBL_CONF->frag_policy > 2)
+      EC_GBL_CONF->frag_policy = 0;
+
+   // and the dissectors streams reassembly as well
+   if (EC_GBL_CONF->stream_buffer <= 0)
+      EC_GBL_CONF->stream_buffer = 65536;
+   if (EC_GBL_CONF->stream_memory <= 0)
+      EC_GBL_CONF->stream_memory = 16 << 20;
 }
 
 /*
@@ -29,6 +29,34 @@
 #define CONNBUF_LOCK(x)       do{ pthread_mutex_lock(&x); }while(0)
 #define CONNBUF_UNLOCK(x)     do{ pthread_mutex_unlock(&x); }while(0)
 
+/* 
+ * the header of a record in the ring.
+ * a record is never split at the end of the ring: if it does not
+ * fit, the remaining bytes are skipped (with a record of padding
+ * if there is room for its header) and it is written at the start.
+ * the data is followed by a NUL, for the callers using it as a string.
+ */
+struct conn_pck_hdr {
+   /* size of the record (including the header and the alignment) */
+   u_int32 size;
+   /* the length of the data */
+   u_int32 len;
+   /* the capture time */
+   u_int32 sec;
+   u_int32 usec;
+   /* the source of the packet in L3_src[], or CONNBUF_PAD */
+   u_int32 side;
+      #define CONNBUF_PAD  0xff
+};
+
+#define CONNBUF_HDR_LEN       sizeof(struct conn_pck_hdr)
+#define CONNBUF_ALIGN(x)      (((x) + sizeof(u_int32) - 1) & ~(sizeof(u_int32) - 1))
+
+/* protos */
+
+static void connbuf_evict(struct conn_buf *cb);
+static void connbuf_reserve(struct conn_buf *cb, size_t size, size_t *off);
+
 /************************************************/
 
 /*
@@ -41,81 +69,141 @@ void connbuf_init(struct conn_buf *cb, size_t size)
    /* init the size */
    cb->size = 0;
    cb->max_size = size;
-   /* init the tail */
-   TAILQ_INIT(&cb->connbuf_tail);
+   cb->head = 0;
+   /* the ring is allocated by the first packet */
+   cb->ring = NULL;
+   memset(cb->L3_src, 0, sizeof(cb->L3_src));
    /* init the mutex */
    CONNBUF_INIT_LOCK(cb->connbuf_mutex);
 }
 
+/*
+ * remove the oldest record
+ */
+static void connbuf_evict(struct conn_buf *cb)
+{
+   struct conn_pck_hdr *h;
+
+   /* no room for a header, the bytes up to the end were skipped */
+   if (cb->max_size - cb->head < CONNBUF_HDR_LEN) {
+      cb->size -= cb->max_size - cb->head;
+      cb->head = 0;
+      return;
+   }
+
+   h = (struct conn_pck_hdr *)(cb->ring + cb->head);
+
+   cb->size -= h->size;
+   cb->head += h->size;
+
+   if (cb->head == cb->max_size || cb->size == 0)
+      cb->head = 0;
+}
+
+/*
+ * find the room for a record of 'size' bytes, removing the
+ * oldest ones if needed. its offset is returned in 'off'
+ */
+static void connbuf_reserve(struct conn_buf *cb, size_t size, size_t *off)
+{
+   struct conn_pck_hdr *h;
+   size_t tail, skip;
+
+   for (;;) {
+      if (cb->size == 0)
+         cb->head = 0;
+
+      tail = cb->head + cb->size;
+
+      /* the records are wrapped, the free space is before the head */
+      if (tail >= cb->max_size) {
+         tail -= cb->max_size;
+         if (cb->head - tail >= size)
+            break;
+         connbuf_evict(cb);
+         continue;
+      }
+
+      /* at the end of the ring... */
+      if (cb->max_size - tail >= size)
+         break;
+
+      /* ...or at the start, skipping the end */
+      if (cb->head >= size) {
+         skip = cb->max_size - tail;
+         if (skip >= CONNBUF_HDR_LEN) {
+            h = (struct conn_pck_hdr *)(cb->ring + tail);
+            h->size = skip;
+            h->len = 0;
+            h->side = CONNBUF_PAD;
+         }
+         cb->size += skip;
+         tail = 0;
+         break;
+      }
+
+      connbuf_evict(cb);
+   }
+
+   *off = tail;
+   cb->size += size;
+}
+
 /* 
  * add the packet to the conn_buf.
- * check if the buffer has reached the max size
- * and in case delete the oldest elements to 
- * fit the predefined size.
- *
- * the tail has the newer packet in the head and
- * older in the tail.
+ * if the buffer has reached the max size the oldest 
+ * packets are overwritten to fit the predefined size.
  */
 int connbuf_add(struct conn_buf *cb, struct packet_object *po)
 {
-   struct conn_pck_list *p;
-   struct conn_pck_list *e;
+   struct conn_pck_hdr *h;
+   size_t size, off;
+   u_int32 side;
 
-   SAFE_CALLOC(p, 1, sizeof(struct conn_pck_list));
-   
-   /* 
-    * we add the sizeof because if the packets have 0 length
-    * (ack packets) the real memory occupation will overflow
-    * the max_size
-    */
-   p->size = sizeof(struct conn_pck_list) + po->DATA.disp_len;
-  
-   memcpy(&p->L3_src, &po->L3.src, sizeof(struct ip_addr));
+   /* nothing to show (ack packets) */
+   if (po->DATA.disp_len == 0)
+      return 0;
+
+   size = CONNBUF_ALIGN(CONNBUF_HDR_LEN + po->DATA.disp_len + 1);
 
    /* 
     * we cant handle the packet, the buffer
     * is too small
     */
-   if (p->size > cb->max_size) {
-      DEBUG_MSG("connbuf_add: buffer too small %d %d\n", (int)cb->max_size, (int)p->size);      
-      SAFE_FREE(p);
+   if (size > cb->max_size) {
+      DEBUG_MSG("connbuf_add: buffer too small %d %d\n", (int)cb->max_size, (int)size);      
       return 0;
    }
       
-   /* copy the buffer */
-   SAFE_CALLOC(p->buf, po->DATA.disp_len, sizeof(u_char));
-   
-   memcpy(p->buf, po->DATA.disp_data, po->DATA.disp_len);
-
    CONNBUF_LOCK(cb->connbuf_mutex);
-   
-   /* 
-    * check the total size and make adjustment 
-    * if we have to free some packets
-    */
-   if (cb->size + p->size > cb->max_size) {
-      struct conn_pck_list *tmp = NULL;
-      
-      TAILQ_FOREACH_REVERSE_SAFE(e, &cb->connbuf_tail, next, connbuf_head, tmp) {
-         
-         /* we have freed enough bytes */
-         if (cb->size + p->size <= cb->max_size)
-            break;
-         
-         /* calculate the new size */
-         cb->size -= e->size;
-         /* remove the elemnt */
-         SAFE_FREE(e->buf);
-         TAILQ_REMOVE(&cb->connbuf_tail, e, next);
-         SAFE_FREE(e);
-      }
+
+   if (cb->ring == NULL)
+      SAFE_CALLOC(cb->ring, cb->max_size, sizeof(u_char));
+
+   /* the first source seen is the side 0 */
+   if (cb->L3_src[0].addr_len == 0)
+      memcpy(&cb->L3_src[0], &po->L3.src, sizeof(struct ip_addr));
+
+   if (!ip_addr_cmp(&cb->L3_src[0], &po->L3.src))
+      side = 0;
+   else {
+      side = 1;
+      if (cb->L3_src[1].addr_len == 0)
+         memcpy(&cb->L3_src[1], &po->L3.src, sizeof(struct ip_addr));
    }
-   
-   /* insert the packet in the tail */
-   TAILQ_INSERT_HEAD(&cb->connbuf_tail, p, next);
-      
-   /* update the total buffer size */
-   cb->size += p->size;
+
+   connbuf_reserve(cb, size, &off);
+
+   h = (struct conn_pck_hdr *)(cb->ring + off);
+   h->size = size;
+   h->len = po->DATA.disp_len;
+   h->sec = po->ts.tv_sec;
+   h->usec = po->ts.tv_usec;
+   h->side = side;
+
+   /* copy the buffer */
+   memcpy(cb->ring + off + CONNBUF_HDR_LEN, po->DATA.disp_data, po->DATA.disp_len);
+   cb->ring[off + CONNBUF_HDR_LEN + po->DATA.disp_len] = '\0';
 
    CONNBUF_UNLOCK(cb->connbuf_mutex);
 
@@ -124,26 +212,19 @@ int connbuf_add(struct conn_buf *cb, struct packet_object *po)
 
 /*
  * empty a give buffer.
- * all the elements in the list are deleted
+ * the ring is released, it will be allocated again if needed
  */
 void connbuf_wipe(struct conn_buf *cb)
 {
-   struct conn_pck_list *e;
-
    DEBUG_MSG("connbuf_wipe");
    
    CONNBUF_LOCK(cb->connbuf_mutex);
    
-   /* delete the list */
-   while ((e = TAILQ_FIRST(&cb->connbuf_tail)) != TAILQ_END(&cb->connbuf_tail)) {
-      TAILQ_REMOVE(&cb->connbuf_tail, e, next);
-      SAFE_FREE(e->buf);
-      SAFE_FREE(e);
-   }
+   SAFE_FREE(cb->ring);
 
    /* reset the buffer */
    cb->size = 0;
-   TAILQ_INIT(&cb->connbuf_tail);
+   cb->head = 0;
    
    CONNBUF_UNLOCK(cb->connbuf_mutex);
 }
@@ -153,24 +234,39 @@ void connbuf_wipe(struct conn_buf *cb)
  * you can print only one side of the communication
  * by specifying the L3_src address, or NULL to 
  * print all the packet in order (joined view).
+ * 'func' receives the data in the ring, it must not keep it.
  *
  * returns the number of printed chars
  */
 int connbuf_print(struct conn_buf *cb, void (*func)(u_char *, size_t, struct ip_addr *L3_src))
 {
-   struct conn_pck_list *e;
+   struct conn_pck_hdr *h;
+   size_t off, left;
    int n = 0;
   
    CONNBUF_LOCK(cb->connbuf_mutex);
    
-   /* print the buffer */
-   TAILQ_FOREACH_REVERSE(e, &cb->connbuf_tail, next, connbuf_head) {
-      /* 
-       * remember that the size is comprehensive
-       * of the struct size
-       */
-      func(e->buf, e->size - sizeof(struct conn_pck_list), &e->L3_src);
-      n += e->size - sizeof(struct conn_pck_list);
+   /* print the buffer, from the oldest record */
+   for (off = cb->head, left = cb->size; left > 0; ) {
+
+      /* the end was skipped */
+      if (cb->max_size - off < CONNBUF_HDR_LEN) {
+         left -= cb->max_size - off;
+         off = 0;
+         continue;
+      }
+
+      h = (struct conn_pck_hdr *)(cb->ring + off);
+
+      if (h->side != CONNBUF_PAD) {
+         func(cb->ring + off + CONNBUF_HDR_LEN, h->len, &cb->L3_src[h->side]);
+         n += h->len;
+      }
+
+      left -= h->size;
+      off += h->size;
+      if (off == cb->max_size)
+         off = 0;
    }
    
    CONNBUF_UNLOCK(cb->connbuf_mutex);
@@ -24,53 +24,99 @@
 #include <ec_packet.h>
 #include <ec_proto.h>
 #include <ec_hook.h>
+#include <ec_metrics.h>
 #include <ec_conntrack.h>
-#include <ec_hash.h>
 #include <ec_sleep.h>
 #include <ec_geoip.h>
 
 /* globals */
 
-/* the hash table used to index the tailq */
-struct conn_hash_search {
-   struct conn_tail *cl;
-   LIST_ENTRY(conn_hash_search) next;
-};
+#define TABBIT     10            /* 2^10 bit tab entries: 1024 LISTS at startup */
+#define TABBIT_MAX 20
 
-#define TABBIT    10             /* 2^10 bit tab entries: 1024 LISTS */
-#define TABSIZE   (1 << TABBIT)
-#define TABMASK   (TABSIZE - 1)
+#define STRIPEBIT  6
+#define STRIPES    (1 << STRIPEBIT)
+#define STRIPEMASK (STRIPES - 1)
 
 /*
  * the connection list.
- * this list is created adding new element in the tail.
- * the search method is established in the search function. 
- * an hash table is used and it is double-linked with the 
- * tailq so from each element you can delete the corresponding
- * in the tailq or viceversa
+ * this list is created adding new element in the tail and it is
+ * only used by the UIs to show the connections.
+ *
+ * the connections are searched in a hash table, which doubles its
+ * size when the connections are more than twice its buckets.
+ * the buckets are protected by a set of stripe locks, selected by the
+ * low bits of the hash (so they don't change with the table size).
+ * every stripe also keeps its connections ordered by the last update,
+ * so the timeouter only visits the ones which are getting old.
+ *
+ * the packets never take the lock of the list: a new connection is
+ * queued in its stripe and a deleted one, if already listed, is only
+ * unlinked from the table. conntrack_merge() moves them in (or out
+ * of) the list, with the list lock held, when the UIs walk it and
+ * after every pass of the timeouter.
  */
 static TAILQ_HEAD(conn_head, conn_tail) conntrack_tail_head = TAILQ_HEAD_INITIALIZER(conntrack_tail_head);
-static LIST_HEAD(, conn_hash_search) conntrack_search_head[TABSIZE];
 
-/* global mutex on connections list */
+LIST_HEAD(conn_bucket, conn_tail);
+
+struct conntrack_table {
+   u_int32 mask;
+   struct conn_bucket bucket[];
+};
+
+struct conntrack_stripe {
+   pthread_mutex_t mutex;
+   TAILQ_HEAD(, conn_tail) lru;
+   TAILQ_HEAD(, conn_tail) pending;    /* new, not yet in the list (linked by next) */
+   TAILQ_HEAD(, conn_tail) dead;       /* deleted, still in the list (linked by lru) */
+};
+
+static struct conntrack_table *conntrack_table;
+static struct conntrack_stripe conntrack_stripes[STRIPES];
+static u_int32 conntrack_count;
+static u_int32 conntrack_buckets = 1 << TABBIT;    /* to be read without the locks */
+
+/* the stripe owning a connection */
+
+#define CONNTRACK_LOCK(h)     do{ pthread_mutex_lock(&conntrack_stripes[(h) & STRIPEMASK].mutex); }while(0)
+#define CONNTRACK_UNLOCK(h)   do{ pthread_mutex_unlock(&conntrack_stripes[(h) & STRIPEMASK].mutex); }while(0)
+
+/* 
+ * the list of the UIs, taken before the stripes (never by the packets).
+ * it is recursive: the UIs hold it with conntrack_lock()
+ * while they use the connections they got from the list
+ */
+
+static pthread_mutex_t conntrack_list_mutex;
+#define CONNTRACK_LIST_LOCK     do{ pthread_mutex_lock(&conntrack_list_mutex); }while(0)
+#define CONNTRACK_LIST_UNLOCK   do{ pthread_mutex_unlock(&conntrack_list_mutex); }while(0)
 
-static pthread_mutex_t conntrack_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define CONNTRACK_LOCK     do{ pthread_mutex_lock(&conntrack_mutex); }while(0)
-#define CONNTRACK_UNLOCK   do{ pthread_mutex_unlock(&conntrack_mutex); }while(0)
+/* the last element returned to the UIs, to validate the next one quickly */
+static struct conn_tail *conntrack_cursor;
 
 /* protos */
 
 void __init conntrack_init(void);
 
 static void conntrack_parse(struct packet_object *po);
-static u_int32 conntrack_hash(struct packet_object *po);
-static struct conn_object *conntrack_search(struct packet_object *po);
-static void conntrack_update(struct conn_object *co, struct packet_object *po);
-static void conntrack_add(struct packet_object *po);
-static void conntrack_del(struct conn_object *co);
+static inline u_int32 conntrack_hash(struct ip_addr *a1, u_int16 p1, struct ip_addr *a2, u_int16 p2, u_int8 proto);
+static inline void conntrack_clock(struct timeval *tv);
+static struct conn_tail *conntrack_search(u_int32 h, struct packet_object *po);
+static void conntrack_update(struct conn_tail *cl, struct packet_object *po);
+static struct conn_tail *conntrack_add(u_int32 h, struct packet_object *po);
+static void conntrack_del(struct conn_tail *cl);
+static void conntrack_free(struct conn_tail *cl);
+static void conntrack_merge(void);
+static void conntrack_grow(void);
+static struct conn_tail *conntrack_listed(struct conn_tail *c);
+static struct conn_tail *conntrack_step(int mode, struct conn_tail *c);
 static int conntrack_match(struct conn_object *co, struct packet_object *po);
 void conntrack_hook(struct conn_object *co, struct packet_object *po);
 
+#define CONNTRACK_HASH_PO(po)    conntrack_hash(&(po)->L3.src, (po)->L4.src, &(po)->L3.dst, (po)->L4.dst, (po)->L4.proto)
+#define CONNTRACK_HASH_CO(co)    conntrack_hash(&(co)->L3_addr1, (co)->L4_addr1, &(co)->L3_addr2, (co)->L4_addr2, (co)->L4_proto)
+
 /************************************************/
   
 /*
@@ -78,8 +124,30 @@ void conntrack_hook(struct conn_object *co, struct packet_object *po);
  */
 void __init conntrack_init(void)
 {
-   /* receive all the top half packets */
-   hook_add(HOOK_DISPATCHER, &conntrack_parse);
+   pthread_mutexattr_t at;
+   u_int i;
+
+   pthread_mutexattr_init(&at);
+   pthread_mutexattr_settype(&at, PTHREAD_MUTEX_RECURSIVE_NP);
+   pthread_mutex_init(&conntrack_list_mutex, &at);
+
+   SAFE_CALLOC(conntrack_table, 1, sizeof(struct conntrack_table) + 
+                                   (1 << TABBIT) * sizeof(struct conn_bucket));
+   conntrack_table->mask = (1 << TABBIT) - 1;
+
+   for (i = 0; i < STRIPES; i++) {
+      pthread_mutex_init(&conntrack_stripes[i].mutex, NULL);
+      TAILQ_INIT(&conntrack_stripes[i].lru);
+      TAILQ_INIT(&conntrack_stripes[i].pending);
+      TAILQ_INIT(&conntrack_stripes[i].dead);
+   }
+
+   /* 
+    * receive all the top half packets.
+    * shard-safe: a connection is searched and updated under the 
+    * lock of its stripe, the table grows under all of them
+    */
+   hook_add_flags(HOOK_DISPATCHER, &conntrack_parse, HOOK_FL_SHARD_SAFE);
 }
 
 /*
@@ -87,74 +155,90 @@ void __init conntrack_init(void)
  */
 static void conntrack_parse(struct packet_object *po)
 {
-   struct conn_object *conn;
+   struct conn_tail *cl;
+   u_int32 h = CONNTRACK_HASH_PO(po);
 
-   CONNTRACK_LOCK;
+   CONNTRACK_LOCK(h);
    
    /* search if the connection already exists */
-   conn = conntrack_search(po);
+   cl = conntrack_search(h, po);
 
    /* update if it was found, else add to the list */
-   if (conn)
-      conntrack_update(conn, po);
-   else
-      conntrack_add(po);
+   if (cl) {
+      conntrack_update(cl, po);
+      CONNTRACK_UNLOCK(h);
+      return;
+   }
+
+   conntrack_add(h, po);
    
-   CONNTRACK_UNLOCK;
+   CONNTRACK_UNLOCK(h);
+
+   conntrack_grow();
 }
 
 /* 
- * calculate the hash for a packet object 
+ * calculate the hash of a connection.
+ * the two ends are hashed separately and then summed, because 
+ * the hash must be equal for packets from dst to src and viceversa
  */
-static u_int32 conntrack_hash(struct packet_object *po)
+static inline u_int32 conntrack_hash(struct ip_addr *a1, u_int16 p1, struct ip_addr *a2, u_int16 p2, u_int8 proto)
 {
-   u_int32 hash_array[3];
+   struct ip_addr *a[2] = { a1, a2 };
+   u_int16 p[2] = { p1, p2 };
+   u_int32 hash = proto, h, w;
+   size_t i, k, len;
+
+   for (k = 0; k < 2; k++) {
+      h = (u_int32)p[k] * 0x85ebca6b;
+      len = MIN(ntohs(a[k]->addr_len), MAX_IP_ADDR_LEN);
+      for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+         memcpy(&w, a[k]->addr + i, sizeof(w));
+         h = (h ^ w) * 0x9e3779b1;
+      }
+      hash += h ^ (h >> 16);
+   }
 
-   /* 
-    * put them in an array and then compute the hash on the array.
-    * use XOR on src and dst because the hash must be equal for 
-    * packets from dst to src and viceversa
-    */
-   hash_array[0] = fnv_32((u_char *)&po->L3.src, sizeof(struct ip_addr)) ^
-                   fnv_32((u_char *)&po->L3.dst, sizeof(struct ip_addr));
-   hash_array[1] = po->L4.src ^ po->L4.dst;
-   hash_array[2] = po->L4.proto;
-   
-   /* compute the resulting hash */
-   return fnv_32((u_char *)&hash_array, sizeof(hash_array)) & TABMASK;
+   /* the low bits select the stripe and the bucket */
+   hash ^= hash >> 15;
+   hash *= 0x85ebca6b;
+   hash ^= hash >> 13;
+
+   return hash;
 }
 
-/* 
- * search the connection in the connection table
- * and return the pointer.
+/*
+ * the seconds are what matters for the timeouts, 
+ * don't pay for a precise clock on every packet
  */
-static struct conn_object *conntrack_search(struct packet_object *po)
+static inline void conntrack_clock(struct timeval *tv)
 {
-   struct conn_hash_search *cs;
-   u_int32 h;
-  
-   /* use the hash table to find the connection in the tailq */
-   h = conntrack_hash(po);
-   
-   LIST_FOREACH(cs, &conntrack_search_head[h], next) {
-      if (conntrack_match(cs->cl->co, po) == E_SUCCESS) {
-         return cs->cl->co;
-      }
-   }
+#ifdef CLOCK_REALTIME_COARSE
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+   tv->tv_sec = ts.tv_sec;
+   tv->tv_usec = ts.tv_nsec / 1000;
+#else
+   gettimeofday(tv, 0);
+#endif
+}
 
-   return NULL;
-#if 0   
+/* 
+ * search the connection in the hash table, 
+ * the stripe of the hash must be locked.
+ */
+static struct conn_tail *conntrack_search(u_int32 h, struct packet_object *po)
+{
    struct conn_tail *cl;
-   
-   /* search in the list sequentially */
-   TAILQ_FOREACH(cl, &conntrack_tail_head, next) {
-      if (conntrack_match(cl->co, po) == E_SUCCESS) {
-         return cl->co;
+  
+   LIST_FOREACH(cl, &conntrack_table->bucket[h & conntrack_table->mask], bucket) {
+      if (cl->hash == h && conntrack_match(cl->co, po) == E_SUCCESS) {
+         return cl;
       }
    }
 
    return NULL;
-#endif
 }
 
 
@@ -162,10 +246,19 @@ static struct conn_object *conntrack_search(struct packet_object *po)
  * update the variable parameters in the connection struct.
  * the status, the buffer and the timestamp will be updated
  */
-static void conntrack_update(struct conn_object *co, struct packet_object *po)
+static void conntrack_update(struct conn_tail *cl, struct packet_object *po)
 {
+   struct conn_object *co = cl->co;
+   struct conntrack_stripe *st = &conntrack_stripes[cl->hash & STRIPEMASK];
+
    /* update the timestamp */
-   gettimeofday(&co->ts, 0);
+   conntrack_clock(&co->ts);
+
+   /* it is now the most recently updated of the stripe */
+   if (TAILQ_NEXT(cl, lru) != NULL) {
+      TAILQ_REMOVE(&st->lru, cl, lru);
+      TAILQ_INSERT_TAIL(&st->lru, cl, lru);
+   }
   
    /* update the status for TCP conn */
    if (po->L4.flags & TH_SYN)
@@ -237,20 +330,19 @@ static void conntrack_update(struct conn_object *co, struct packet_object *po)
 
 
 /*
- * create a new entry in the tail 
+ * create a new entry in the tail.
+ * the stripe of the hash must be locked.
  */
-static void conntrack_add(struct packet_object *po)
+static struct conn_tail *conntrack_add(u_int32 h, struct packet_object *po)
 {
    struct conn_tail *cl;
-   struct conn_hash_search *cs;
 
    DEBUG_MSG("conntrack_add: NEW CONNECTION");
    
-   /* alloc the list element */
+   /* alloc the list element and the conn object in it */
    SAFE_CALLOC(cl, 1, sizeof(struct conn_tail));
-
-   /* alloc the conn object in the element */
-   SAFE_CALLOC(cl->co, 1, sizeof(struct conn_object));
+   cl->co = &cl->obj;
+   cl->hash = h;
 
    /* 
     * here we create the connection.
@@ -273,26 +365,19 @@ static void conntrack_add(struct packet_object *po)
    /* initialize the connection buffer */
    connbuf_init(&cl->co->data, EC_GBL_CONF->connection_buffer);
    
+   /* insert the new connection in the hash table and in its stripe */
+   LIST_INSERT_HEAD(&conntrack_table->bucket[h & conntrack_table->mask], cl, bucket);
+   TAILQ_INSERT_TAIL(&conntrack_stripes[h & STRIPEMASK].lru, cl, lru);
+
+   /* conntrack_merge() will insert it in the tail */
+   TAILQ_INSERT_TAIL(&conntrack_stripes[h & STRIPEMASK].pending, cl, next);
+
+   __atomic_add_fetch(&conntrack_count, 1, __ATOMIC_RELAXED);
+
    /* update the connection entry */
-   conntrack_update(cl->co, po);
+   conntrack_update(cl, po);
 
-   /* alloc the hash table element */
-   SAFE_CALLOC(cs, 1, sizeof(struct conn_hash_search));
-   
-   /* set the pointer to the list */
-   cs->cl = cl;
-  
-   /* 
-    * set the pointer to the element in the hash table 
-    * it is used when a connection is deleted because
-    * even the element in the hash table must be deleted
-    */
-   cl->cs = cs;
-   
-   /* insert the new connection in the tail */
-   TAILQ_INSERT_TAIL(&conntrack_tail_head, cl, next);
-   /* insert the new connection in the tail */
-   LIST_INSERT_HEAD(&conntrack_search_head[conntrack_hash(po)], cs, next);
+   return cl;
 }
 
 /*
@@ -322,22 +407,138 @@ static int conntrack_match(struct conn_object *co, struct packet_object *po)
 }
 
 /* 
- * erase a connection object
+ * erase a connection object.
+ * the stripe of the hash must be locked.
+ */
+static void conntrack_del(struct conn_tail *cl)
+{
+   struct conntrack_stripe *st = &conntrack_stripes[cl->hash & STRIPEMASK];
+
+   /* remove the element in the hash table and in the stripe */
+   LIST_REMOVE(cl, bucket);
+   TAILQ_REMOVE(&st->lru, cl, lru);
+
+   __atomic_sub_fetch(&conntrack_count, 1, __ATOMIC_RELAXED);
+
+   /* the UIs have never seen it */
+   if (!cl->listed) {
+      TAILQ_REMOVE(&st->pending, cl, next);
+      conntrack_free(cl);
+      return;
+   }
+
+   /* the UIs may be using it, conntrack_merge() will free it */
+   __atomic_store_n(&cl->dead, 1, __ATOMIC_RELAXED);
+   TAILQ_INSERT_TAIL(&st->dead, cl, lru);
+}
+
+/*
+ * free a connection no longer reachable from the table nor the list
  */
-static void conntrack_del(struct conn_object *co)
+static void conntrack_free(struct conn_tail *cl)
 {
    struct ct_hook_list *h, *tmp;
 
    /* remove the hooks */
-   SLIST_FOREACH_SAFE(h, &co->hook_head, next, tmp) {
-      SLIST_REMOVE(&co->hook_head, h, ct_hook_list, next);
+   SLIST_FOREACH_SAFE(h, &cl->co->hook_head, next, tmp) {
+      SLIST_REMOVE(&cl->co->hook_head, h, ct_hook_list, next);
       SAFE_FREE(h);
    }
 
    /* wipe the associated buffer */
-   connbuf_wipe(&co->data);
+   connbuf_wipe(&cl->co->data);
+
+   SAFE_FREE(cl->co->DISSECTOR.user);
+   SAFE_FREE(cl->co->DISSECTOR.pass);
+   SAFE_FREE(cl->co->DISSECTOR.info);
    
-   SAFE_FREE(co);
+   SAFE_FREE(cl);
+}
+
+/*
+ * move the new connections of the stripes at the end of the list and
+ * free the deleted ones. the list lock must be held, the stripes are
+ * taken one at a time and only to unlink the two queues.
+ */
+static void conntrack_merge(void)
+{
+   struct conntrack_stripe *st;
+   struct conn_tail *cl, *dead;
+   u_int i;
+
+   for (i = 0; i < STRIPES; i++) {
+      st = &conntrack_stripes[i];
+
+      /* nothing to do, don't bother the packets of the stripe */
+      if (__atomic_load_n(&TAILQ_FIRST(&st->pending), __ATOMIC_RELAXED) == NULL &&
+          __atomic_load_n(&TAILQ_FIRST(&st->dead), __ATOMIC_RELAXED) == NULL)
+         continue;
+
+      CONNTRACK_LOCK(i);
+
+      while ((cl = TAILQ_FIRST(&st->pending)) != NULL) {
+         TAILQ_REMOVE(&st->pending, cl, next);
+         TAILQ_INSERT_TAIL(&conntrack_tail_head, cl, next);
+         cl->listed = 1;
+      }
+
+      /* unlinked from the table, only the list can still reach them */
+      dead = TAILQ_FIRST(&st->dead);
+      TAILQ_INIT(&st->dead);
+
+      CONNTRACK_UNLOCK(i);
+
+      while ((cl = dead) != NULL) {
+         dead = TAILQ_NEXT(cl, lru);
+         if (conntrack_cursor == cl)
+            conntrack_cursor = NULL;
+         TAILQ_REMOVE(&conntrack_tail_head, cl, next);
+         conntrack_free(cl);
+      }
+   }
+}
+
+/*
+ * double the buckets of the hash table, holding all the stripes
+ */
+static void conntrack_grow(void)
+{
+   struct conntrack_table *old, *new;
+   struct conn_tail *cl;
+   u_int32 i, size;
+
+   size = __atomic_load_n(&conntrack_buckets, __ATOMIC_RELAXED);
+
+   if (__atomic_load_n(&conntrack_count, __ATOMIC_RELAXED) <= size * 2 || size >= (1 << TABBIT_MAX))
+      return;
+
+   for (i = 0; i < STRIPES; i++)
+      pthread_mutex_lock(&conntrack_stripes[i].mutex);
+
+   old = conntrack_table;
+   size = (old->mask + 1) * 2;
+
+   /* someone else may have done it in the meantime */
+   if (__atomic_load_n(&conntrack_count, __ATOMIC_RELAXED) > (old->mask + 1) * 2) {
+
+      SAFE_CALLOC(new, 1, sizeof(struct conntrack_table) + size * sizeof(struct conn_bucket));
+      new->mask = size - 1;
+
+      for (i = 0; i <= old->mask; i++)
+         while ((cl = LIST_FIRST(&old->bucket[i])) != NULL) {
+            LIST_REMOVE(cl, bucket);
+            LIST_INSERT_HEAD(&new->bucket[cl->hash & new->mask], cl, bucket);
+         }
+
+      conntrack_table = new;
+      __atomic_store_n(&conntrack_buckets, size, __ATOMIC_RELAXED);
+      SAFE_FREE(old);
+
+      DEBUG_MSG("conntrack_grow: %u buckets", size);
+   }
+
+   for (i = STRIPES; i-- > 0; )
+      pthread_mutex_unlock(&conntrack_stripes[i].mutex);
 }
 
 /*
@@ -346,28 +547,30 @@ static void conntrack_del(struct conn_object *co)
 void conntrack_purge(void)
 {
    struct conn_tail *cl, *tmp;
+   u_int i;
 
    DEBUG_MSG("conntrack_purge");
    
-   TAILQ_FOREACH_SAFE(cl, &conntrack_tail_head, next, tmp) {
-      /* don't erase the connection if it is viewed */
-      if (cl->co->flags & CONN_VIEWING)
-         continue;
-      
-      CONNTRACK_LOCK;
+   for (i = 0; i < STRIPES; i++) {
+
+      CONNTRACK_LOCK(i);
+
+      TAILQ_FOREACH_SAFE(cl, &conntrack_stripes[i].lru, lru, tmp) {
+         /* don't erase the connection if it is viewed */
+         if (cl->co->flags & CONN_VIEWING)
+            continue;
       
-      /* wipe the connection */
-      conntrack_del(cl->co);
-      /* remove the element in the hash table */
-      LIST_REMOVE(cl->cs, next);
-      SAFE_FREE(cl->cs);
-      /* remove the element in the tailq */
-      TAILQ_REMOVE(&conntrack_tail_head, cl, next);
-      SAFE_FREE(cl);
-
-      CONNTRACK_UNLOCK;
+         /* wipe the connection */
+         conntrack_del(cl);
+      }
+
+      CONNTRACK_UNLOCK(i);
    }
-   
+
+   /* free the listed ones */
+   CONNTRACK_LIST_LOCK;
+   conntrack_merge();
+   CONNTRACK_LIST_UNLOCK;
 }
 
 
@@ -378,6 +581,7 @@ EC_THREAD_FUNC(conntrack_timeouter)
    struct conn_tail *cl;
    struct conn_tail *tmp = NULL;
    size_t sec;
+   u_int i;
    
    /* variable not used */
    (void) EC_THREAD_PARAM;
@@ -405,50 +609,51 @@ EC_THREAD_FUNC(conntrack_timeouter)
       DEBUG_MSG("conntrack_timeouter: woke up");
       
       /* get current time */
-      gettimeofday(&ts, NULL);
+      conntrack_clock(&ts);
      
       /*
-       * the timeouter is the only thread that erase a connection
-       * so we are sure that the list will be consistent till the
-       * end.
-       * we can lock and unlock every time we handle an element of 
-       * the list to permit the conntrack functions to operate on the
-       * list even when timeouter goes thru the list
+       * the stripes are handled one at a time, so the packets
+       * of the other ones are processed in the meantime.
+       * the connections are ordered by the last update: stop at
+       * the first one which is neither idle nor timeouted.
        */
-      TAILQ_FOREACH_SAFE(cl, &conntrack_tail_head, next, tmp) {
+      for (i = 0; i < STRIPES; i++) {
 
-         /* don't erase the connection if it is viewed */
-         if (cl->co->flags & CONN_VIEWING)
-            continue;
-         
-         CONNTRACK_LOCK;
+         CONNTRACK_LOCK(i);
          
-         /* calculate the difference */
-         time_sub(&ts, &cl->co->ts, &diff);
+         TAILQ_FOREACH_SAFE(cl, &conntrack_stripes[i].lru, lru, tmp) {
+
+            /* calculate the difference */
+            time_sub(&ts, &cl->co->ts, &diff);
+
+            if (diff.tv_sec < (time_t)sec)
+               break;
+
+            /* don't erase the connection if it is viewed */
+            if (cl->co->flags & CONN_VIEWING)
+               continue;
          
-         /* 
-          * update it only if the staus is active,
-          * all the other status must be left as they are
-          */
-         if (cl->co->status == CONN_ACTIVE && diff.tv_sec >= EC_GBL_CONF->connection_idle)
-            cl->co->status = CONN_IDLE;
+            /* 
+             * update it only if the staus is active,
+             * all the other status must be left as they are
+             */
+            if (cl->co->status == CONN_ACTIVE && diff.tv_sec >= EC_GBL_CONF->connection_idle)
+               cl->co->status = CONN_IDLE;
          
-         /* delete the timeouted connections */
-         if (diff.tv_sec >= EC_GBL_CONF->connection_timeout) {
-            /* wipe the connection */
-            conntrack_del(cl->co);
-            /* remove the element in the hash table */
-            LIST_REMOVE(cl->cs, next);
-            SAFE_FREE(cl->cs);
-            /* remove the element in the tailq */
-            TAILQ_REMOVE(&conntrack_tail_head, cl, next);
-            SAFE_FREE(cl);
+            /* delete the timeouted connections */
+            if (diff.tv_sec >= EC_GBL_CONF->connection_timeout)
+               conntrack_del(cl);
          }
 
-         CONNTRACK_UNLOCK;
+         CONNTRACK_UNLOCK(i);
    
          CANCELLATION_POINT();
       }
+
+      /* free the deleted connections, even if no UI is showing them */
+      CONNTRACK_LIST_LOCK;
+      conntrack_merge();
+      CONNTRACK_LIST_UNLOCK;
    }
    
    return NULL;
@@ -461,12 +666,13 @@ EC_THREAD_FUNC(conntrack_timeouter)
  */
 int conntrack_hook_packet_add(struct packet_object *po, void (*func)(struct packet_object *po))
 {
-   struct conn_object *conn;
+   struct conn_tail *conn;
+   u_int32 hash = CONNTRACK_HASH_PO(po);
 
-   CONNTRACK_LOCK;
+   CONNTRACK_LOCK(hash);
    
    /* search the connection already exists */
-   conn = conntrack_search(po);
+   conn = conntrack_search(hash, po);
 
    /* 
     * if the connection already exist, add the hook function 
@@ -478,8 +684,7 @@ int conntrack_hook_packet_add(struct packet_object *po, void (*func)(struct pack
    if (!conn) {
       
       DEBUG_MSG("conntrack_hook_packet_add: ephemeral connection");
-      conntrack_add(po);
-      conn = conntrack_search(po);
+      conn = conntrack_add(hash, po);
    }
   
    /* add the hook point */
@@ -492,14 +697,17 @@ int conntrack_hook_packet_add(struct packet_object *po, void (*func)(struct pack
       
       /* set the hook function */
       h->func = func;
+      h->acct = metrics_acct_add(func);
       
-      SLIST_INSERT_HEAD(&conn->hook_head, h, next);
+      SLIST_INSERT_HEAD(&conn->co->hook_head, h, next);
       
-      CONNTRACK_UNLOCK;
+      CONNTRACK_UNLOCK(hash);
+
+      conntrack_grow();
       return E_SUCCESS;
    } 
    
-   CONNTRACK_UNLOCK;
+   CONNTRACK_UNLOCK(hash);
 
    return -E_NOTFOUND;
 }
@@ -510,32 +718,33 @@ int conntrack_hook_packet_add(struct packet_object *po, void (*func)(struct pack
  */
 int conntrack_hook_packet_del(struct packet_object *po, void (*func)(struct packet_object *po))
 {
-   struct conn_object *conn;
+   struct conn_tail *conn;
+   u_int32 hash = CONNTRACK_HASH_PO(po);
 
    DEBUG_MSG("conntrack_hook_packet_del");
    
-   CONNTRACK_LOCK;
+   CONNTRACK_LOCK(hash);
    
    /* search the connection already exists */
-   conn = conntrack_search(po);
+   conn = conntrack_search(hash, po);
 
    /* remove the hook function only if the connection exists */
    if (conn) {
       struct ct_hook_list *h;
       
-      SLIST_FOREACH(h, &conn->hook_head, next) {
+      SLIST_FOREACH(h, &conn->co->hook_head, next) {
          if (h->func == func) {
-            SLIST_REMOVE(&conn->hook_head, h, ct_hook_list, next);
+            SLIST_REMOVE(&conn->co->hook_head, h, ct_hook_list, next);
             SAFE_FREE(h);
             break;
          }
       }
       
-      CONNTRACK_UNLOCK;
+      CONNTRACK_UNLOCK(hash);
       return E_SUCCESS;
    }
    
-   CONNTRACK_UNLOCK;
+   CONNTRACK_UNLOCK(hash);
 
    return -E_NOTFOUND;
 }
@@ -547,8 +756,9 @@ int conntrack_hook_packet_del(struct packet_object *po, void (*func)(struct pack
 int conntrack_hook_conn_add(struct conn_object *co, void (*func)(struct packet_object *po))
 {
    struct ct_hook_list *h;
+   u_int32 hash = CONNTRACK_HASH_CO(co);
 
-   CONNTRACK_LOCK;
+   CONNTRACK_LOCK(hash);
    
    /* add the hook point */
    
@@ -558,10 +768,11 @@ int conntrack_hook_conn_add(struct conn_object *co, void (*func)(struct packet_o
    
    /* set the hook function */
    h->func = func;
+   h->acct = metrics_acct_add(func);
    
    SLIST_INSERT_HEAD(&co->hook_head, h, next);
       
-   CONNTRACK_UNLOCK;
+   CONNTRACK_UNLOCK(hash);
 
    return E_SUCCESS;
 }
@@ -573,10 +784,11 @@ int conntrack_hook_conn_add(struct conn_object *co, void (*func)(struct packet_o
 int conntrack_hook_conn_del(struct conn_object *co, void (*func)(struct packet_object *po))
 {
    struct ct_hook_list *h;
+   u_int32 hash = CONNTRACK_HASH_CO(co);
 
    DEBUG_MSG("conntrack_hook_conn_del");
    
-   CONNTRACK_LOCK;
+   CONNTRACK_LOCK(hash);
    
    SLIST_FOREACH(h, &co->hook_head, next) {
       if (h->func == func) {
@@ -586,7 +798,7 @@ int conntrack_hook_conn_del(struct conn_object *co, void (*func)(struct packet_o
       }
    }
    
-   CONNTRACK_UNLOCK;
+   CONNTRACK_UNLOCK(hash);
    return E_SUCCESS;
 }
 
@@ -597,21 +809,93 @@ int conntrack_hook_conn_del(struct conn_object *co, void (*func)(struct packet_o
 void conntrack_hook(struct conn_object *co, struct packet_object *po)
 {
    struct ct_hook_list *h;
+   uint64_t t0;
 
    /* pass the po to all the hooked functions */
    SLIST_FOREACH(h, &co->hook_head, next) {
-      h->func(po);
+      if (EC_GBL_CONF->hook_accounting) {
+         t0 = metrics_clock();
+         h->func(po);
+         metrics_acct(h->acct, metrics_clock() - t0);
+      } else
+         h->func(po);
    }
    
 }
 
 /*
- * fill the desc and return the next/prev element
+ * the UIs keep the elements of the list between the calls: it is
+ * held while they use them, so none of them can be freed.
+ * the packets are not stopped meanwhile, the connections
+ * they delete are only marked as dead.
  */
-void * conntrack_print(int mode, void *list, char **desc, size_t len)
+void conntrack_lock(void)
+{
+   CONNTRACK_LIST_LOCK;
+   conntrack_merge();
+}
+
+void conntrack_unlock(void)
+{
+   CONNTRACK_LIST_UNLOCK;
+}
+
+/*
+ * return the element if it is still in the list (it may have been
+ * deleted since it was given to the UI), NULL otherwise.
+ * the elements are usually walked in order, so the last one returned
+ * and the following are checked before searching the whole list.
+ * the list lock must be held.
+ */
+static struct conn_tail *conntrack_listed(struct conn_tail *c)
 {
-   struct conn_tail *c = (struct conn_tail *)list;
    struct conn_tail *cl;
+
+   if (conntrack_cursor != NULL && 
+       (c == conntrack_cursor || c == TAILQ_NEXT(conntrack_cursor, next)))
+      cl = c;
+   else
+      TAILQ_FOREACH(cl, &conntrack_tail_head, next) {
+         if (cl == c)
+            break;
+      }
+
+   /* deleted, but not freed yet */
+   if (cl != NULL && __atomic_load_n(&cl->dead, __ATOMIC_RELAXED))
+      return NULL;
+
+   return cl;
+}
+
+/*
+ * the element following/preceding c (c itself with mode 0),
+ * skipping the deleted ones. the list lock must be held.
+ */
+static struct conn_tail *conntrack_step(int mode, struct conn_tail *c)
+{
+   do {
+      switch (mode) {
+         case -1:
+            c = TAILQ_PREV(c, conn_head, next);
+            break;
+         case +1:
+            c = TAILQ_NEXT(c, next);
+            break;
+         default:
+            return c;
+      }
+   } while (c != NULL && __atomic_load_n(&c->dead, __ATOMIC_RELAXED));
+
+   return c;
+}
+
+/*
+ * fill the desc and return the next/prev element.
+ * NULL if the element is no longer in the list
+ */
+void * conntrack_print(int mode, void *list, char **desc, size_t len)
+{
+   struct conn_tail *c;
    char src[MAX_ASCII_ADDR_LEN];
    char dst[MAX_ASCII_ADDR_LEN];
    char proto[2], status[8], flags[2];
@@ -619,9 +903,19 @@ void * conntrack_print(int mode, void *list, char **desc, size_t len)
    size_t slen;
 #endif
 
-   /* NULL is used to retrieve the first element */
-   if (list == NULL)
-      return TAILQ_FIRST(&conntrack_tail_head);
+   CONNTRACK_LIST_LOCK;
+
+   /* NULL is used to retrieve the first element, of an up to date list */
+   if (list == NULL) {
+      conntrack_merge();
+      c = TAILQ_FIRST(&conntrack_tail_head);
+      if (c != NULL && __atomic_load_n(&c->dead, __ATOMIC_RELAXED))
+         c = conntrack_step(+1, c);
+      goto out;
+   }
+
+   if ((c = conntrack_listed(list)) == NULL)
+      goto out;
 
    /* the caller wants the description */
    if (desc != NULL) {
@@ -657,67 +951,50 @@ void * conntrack_print(int mode, void *list, char **desc, size_t len)
    }
   
    /* return the next/prev/current to the caller */
-   switch (mode) {
-      case -1:
-         return TAILQ_PREV(c, conn_head, next);
-         break;
-      case +1:
-         return TAILQ_NEXT(c, next);
-         break;
-      case 0:
-         /* if exists in the list, return it */
-         TAILQ_FOREACH(cl, &conntrack_tail_head, next) {
-            if (cl == c)
-               return c;
-         }
-         /* else, return NULL */
-         return NULL;
-      default:
-         return list;
-         break;
-   }
-         
-   return NULL;
+   c = conntrack_step(mode, c);
+
+out:
+   conntrack_cursor = c;
+   CONNTRACK_LIST_UNLOCK;
+
+   return c;
 }
 
 /* 
- * copy the connection object pointer to conn and return the next/prev element
+ * copy the connection object pointer to conn and return the next/prev element.
+ * NULL if the element is no longer in the list (conn is not set).
+ * the object can be used only while holding conntrack_lock()
  */
 void * conntrack_get(int mode, void *list, struct conn_object **conn)
 {
-   struct conn_tail *c = (struct conn_tail *)list;
-   struct conn_tail *cl;
+   struct conn_tail *c;
+
+   CONNTRACK_LIST_LOCK;
 
-   /* NULL is used to retrieve the first element */
-   if (list == NULL)
-      return TAILQ_FIRST(&conntrack_tail_head);
+   /* NULL is used to retrieve the first element, of an up to date list */
+   if (list == NULL) {
+      conntrack_merge();
+      c = TAILQ_FIRST(&conntrack_tail_head);
+      if (c != NULL && __atomic_load_n(&c->dead, __ATOMIC_RELAXED))
+         c = conntrack_step(+1, c);
+      goto out;
+   }
+
+   if ((c = conntrack_listed(list)) == NULL)
+      goto out;
 
    /* the caller wants the connection object */
    if (conn != NULL) 
        *conn = c->co;
   
    /* return the next/prev/current to the caller */
-   switch (mode) {
-      case -1:
-         return TAILQ_PREV(c, conn_head, next);
-         break;
-      case +1:
-         return TAILQ_NEXT(c, next);
-         break;
-      case 0:
-         /* if exists in the list, return it */
-         TAILQ_FOREACH(cl, &conntrack_tail_head, next) {
-            if (cl == c)
-               return c;
-         }
-         /* else, return NULL */
-         return NULL;
-      default:
-         return list;
-         break;
-   }
-         
-   return NULL;
+   c = conntrack_step(mode, c);
+
+out:
+   conntrack_cursor = c;
+   CONNTRACK_LIST_UNLOCK;
+
+   return c;
 }
 
 
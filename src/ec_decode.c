@@ -29,6 +29,10 @@
 #include <ec_hook.h>
 #include <ec_filter.h>
 #include <ec_inject.h>
+#include <ec_metrics.h>
+#include <ec_detect.h>
+#include <ec_flow_cache.h>
+#include <ec_rcu.h>
 
 #include <pcap.h>
 #include <libnet.h>
@@ -50,15 +54,56 @@ struct dec_entry {
    FUNC_DECODER_PTR(decoder);
 };
 
+/*
+ * the lookup used by get_decoder() on every packet: for each level an
+ * array of decoders directly indexed by the type, so it is a single
+ * load without any lock.
+ * it is built from protocols_table at the first lookup, when all the
+ * __init registrations are done. then add_decoder() and del_decoder()
+ * update a slot with an atomic store, or publish a new copy if the
+ * type does not fit in the arrays (a new level or a bigger type).
+ * the replaced copies can still be in use, they are freed after a
+ * grace period of the RCU_DECODERS domain: the decoding of a packet
+ * is a read section.
+ */
+#define DEC_INDEX_MAX   65536
+
+/* more than one decoder for the same type (e.g. dissectors on a port) */
+struct dec_chain {
+   u_int32 type;
+   u_int8 level;
+   void **decoders;     /* NULL terminated */
+};
+
+struct dec_lookup {
+   u_int32 size[UINT8_MAX + 1];
+   void **slot[UINT8_MAX + 1];
+   /* the types too big to be indexed, sorted */
+   struct dec_entry *sparse;
+   unsigned sparse_num;
+   /* the types with more than one decoder, sorted */
+   struct dec_chain *chain;
+   unsigned chain_num;
+};
+
+static struct dec_lookup *dec_lookup;
+
 /* protos */
 
 void __init data_init(void);
 FUNC_DECODER(decode_data);
 
+static void decode_frame(struct iface_env *iface, const struct pcap_pkthdr *pkthdr, u_char *pkt, bool in_place);
+
 static void sort_decoders(void);
 static int cmp_decoders(const void *va, const void *vb);
 static struct dec_entry* find_entry(u_int8 level, u_int32 type);
-void **get_decoders(u_int8 level, u_int32 type);
+static unsigned count_entries(struct dec_entry *e);
+static int cmp_chain(const void *va, const void *vb);
+static struct dec_lookup * dec_lookup_build(void);
+static struct dec_lookup * dec_lookup_freeze(void);
+static struct dec_lookup * dec_lookup_update(u_int8 level, u_int32 type);
+static void dec_lookup_free(void *arg);
 
 /* mutexes */
 
@@ -74,20 +119,44 @@ static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 void ec_decode(u_char *param, const struct pcap_pkthdr *pkthdr, const u_char *pkt)
+{
+   decode_frame((struct iface_env *)param, pkthdr, (u_char *)pkt, false);
+}
+
+/*
+ * decode a frame where it was captured (e.g. in a block of the
+ * mmap ring) without copying it in iface->pbuf.
+ * the caller owns the buffer and it must be writable up to
+ * the byte following the frame (used for the NULL termination)
+ */
+void ec_decode_in_place(struct iface_env *iface, const struct pcap_pkthdr *pkthdr, u_char *pkt)
+{
+   decode_frame(iface, pkthdr, pkt, true);
+}
+
+static void decode_frame(struct iface_env *iface, const struct pcap_pkthdr *pkthdr, u_char *pkt, bool in_place)
 {
    FUNC_DECODER_PTR(packet_decoder);
    struct packet_object po;
    u_int len;
    u_char *data;
    int datalen;
-   struct iface_env *iface;
-
-   iface = (struct iface_env *)param;
+   struct timeval now;
+   uint64_t t0 = 0;
 
    CANCELLATION_POINT();
 
    /* start the timer for the stats */
    stats_half_start(&EC_GBL_STATS->bh);
+
+   /* the latency from the kernel timestamp, for the sampled packets */
+   if (metrics_sample() && !EC_GBL_OPTIONS->read) {
+      gettimeofday(&now, NULL);
+      if (timercmp(&now, &pkthdr->ts, >)) {
+         time_sub(&now, &pkthdr->ts, &now);
+         metrics_stage(METRICS_CAPTURE, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_usec * 1000);
+      }
+   }
   
    /* XXX -- remove this */
 #if 0
@@ -95,13 +164,12 @@ void ec_decode(u_char *param, const struct pcap_pkthdr *pkthdr, const u_char *pk
       USER_MSG("CAPTURED: 0x%04x bytes form %s\n", pkthdr->caplen, iface->name );
 #endif
    
+   /* 
+    * update the offset pointer.
+    * the kernel statistics are sampled by the stats timer
+    */
    if (EC_GBL_OPTIONS->read)
-      /* update the offset pointer */
       EC_GBL_PCAP->dump_off = ftell(pcap_file(EC_GBL_IFACE->pcap));
-   else {
-      /* update the statistics */
-      stats_update();
-   }
    
    /* 
     * dump packet to file if specified on command line 
@@ -127,17 +195,22 @@ void ec_decode(u_char *param, const struct pcap_pkthdr *pkthdr, const u_char *pk
       return;
    }
    
-   /* 
-    * copy the packet in a "dedicated" buffer
-    * we don't want other packets after the end of the packet (as in BPF)
-    *
-    * also keep the buffer aligned !
-    * the alignment is set by the media decoder.
-    */
-   memcpy(iface->pbuf + EC_GBL_PCAP->align, pkt, pkthdr->caplen);
+   if (in_place) {
+      /* the ring already keeps the network header aligned */
+      data = pkt;
+   } else {
+      /* 
+       * copy the packet in a "dedicated" buffer
+       * we don't want other packets after the end of the packet (as in BPF)
+       *
+       * also keep the buffer aligned !
+       * the alignment is set by the media decoder.
+       */
+      memcpy(iface->pbuf + EC_GBL_PCAP->align, pkt, pkthdr->caplen);
+      data = (u_char *)iface->pbuf + EC_GBL_PCAP->align;
+   }
    
-   /* extract data and datalen from pcap packet */
-   data = (u_char *)iface->pbuf + EC_GBL_PCAP->align;
+   /* extract datalen from pcap packet */
    datalen = pkthdr->caplen;
 
    /* 
@@ -182,9 +255,20 @@ void ec_decode(u_char *param, const struct pcap_pkthdr *pkthdr, const u_char *pk
     *
     * after this fuction the packet is completed (all flags set)
     */
+   rcu_read_begin(RCU_DECODERS);
+
    packet_decoder = get_decoder(LINK_LAYER, EC_GBL_PCAP->dlt);
    BUG_IF(packet_decoder == NULL);
+
+   if (metrics_on)
+      t0 = metrics_clock();
+
    packet_decoder(data, datalen, &len, &po);
+
+   if (metrics_on)
+      metrics_stage(METRICS_DECODE, metrics_clock() - t0);
+
+   rcu_read_end(RCU_DECODERS);
   
    /* special case for bridged sniffing */
    if (EC_GBL_SNIFF->type == SM_BRIDGED) {
@@ -248,6 +332,62 @@ void __init data_init(void)
    add_decoder(APP_LAYER, PL_DEFAULT, decode_data);
 }
 
+/* the dissectors remembered on a single packet */
+#define DISSECT_ONCE_MAX   16
+
+/* 
+ * run a dissector, measuring it if the packet is sampled
+ */
+#define EXECUTE_DISSECTOR(x) do{ \
+   if (x && metrics_on) { \
+      t1 = metrics_clock(); \
+      EXECUTE_DECODER(x); \
+      metrics_func(x, metrics_clock() - t1); \
+   } else \
+      EXECUTE_DECODER(x); \
+}while(0)
+
+/*
+ * run all the dissectors registered on a port (there can be more
+ * than one), but not the ones already run on this packet.
+ * the chain belongs to the lookup, it is walked in a read section
+ */
+#define EXECUTE_DISSECTORS(level, port) do{ \
+   rcu_read_begin(RCU_DECODERS); \
+   if ((chain = get_decoders(level, port)) == NULL) { \
+      app_decoder = get_decoder(level, port); \
+      if (dissector_once(app_decoder, done, &ndone)) \
+         EXECUTE_DISSECTOR(app_decoder); \
+   } else \
+      for (; *chain != NULL; chain++) { \
+         app_decoder = *chain; \
+         if (dissector_once(app_decoder, done, &ndone)) \
+            EXECUTE_DISSECTOR(app_decoder); \
+      } \
+   rcu_read_end(RCU_DECODERS); \
+}while(0)
+
+/*
+ * remember the dissectors run on a packet.
+ * returns 0 if the dissector was already run (or there is none)
+ */
+static inline int dissector_once(void *decoder, void **done, u_int *n)
+{
+   u_int i;
+
+   if (decoder == NULL)
+      return 0;
+
+   for (i = 0; i < *n; i++)
+      if (done[i] == decoder)
+         return 0;
+
+   if (*n < DISSECT_ONCE_MAX)
+      done[(*n)++] = decoder;
+
+   return 1;
+}
+
 /* 
  * if the packet reach the top of the stack (it can be handled),
  * this decoder is invoked
@@ -257,9 +397,17 @@ FUNC_DECODER(decode_data)
 {
    int proto = 0;
    FUNC_DECODER_PTR(app_decoder);
+   void **chain, *done[DISSECT_ONCE_MAX];
+   u_int ndone = 0;
+   int i, n, settled = 1;
+   uint64_t t0 = 0, t1 = 0;
+   u_int32 gen = flow_cache_generation();
       
    CANCELLATION_POINT();
 
+   if (metrics_on)
+      t0 = metrics_clock();
+
    /* this packet must not be passet to dissectors */
    if ( po->flags & PO_DONT_DISSECT)
       return NULL;
@@ -293,17 +441,33 @@ FUNC_DECODER(decode_data)
          break;
    }
 
-   if(proto) {
-      app_decoder = get_decoder(proto, ntohs(po->L4.src));
-      EXECUTE_DECODER(app_decoder);
+   /* the dissectors of the flow were already looked up */
+   if (proto && (n = flow_cache_dissectors(po, done)) >= 0) {
+      for (i = 0; i < n; i++) {
+         app_decoder = done[i];
+         EXECUTE_DISSECTOR(app_decoder);
+      }
+   } else if(proto) {
+      /* the protocol of the flow, whatever its ports are */
+      if (EC_GBL_CONF->protocol_detection)
+         settled = (detect_proto(po) == E_SUCCESS);
+
+      EXECUTE_DISSECTORS(proto, ntohs(po->L4.src));
 
    /*
     * This check prevents from running a decoder twice
     */
-      if(po->L4.src != po->L4.dst) {
-         app_decoder = get_decoder(proto, ntohs(po->L4.dst));
-         EXECUTE_DECODER(app_decoder);
+      if(po->L4.src != po->L4.dst)
+         EXECUTE_DISSECTORS(proto, ntohs(po->L4.dst));
+
+      if (po->DETECT.decoder != NULL && dissector_once(po->DETECT.decoder, done, &ndone)) {
+         app_decoder = po->DETECT.decoder;
+         EXECUTE_DISSECTOR(app_decoder);
       }
+
+      /* they won't change for the next packets */
+      if (settled)
+         flow_cache_resolve(po, gen, done, ndone);
    }
 
    /* HOOK POINT: DECODED (the po structure is filled) */ 
@@ -313,8 +477,14 @@ FUNC_DECODER(decode_data)
     * here we can filter the content of the packet.
     * the injection is done elsewhere.
     */
+   if (metrics_on)
+      t1 = metrics_clock();
+
    filter_packet(po);
 
+   if (metrics_on)
+      metrics_stage(METRICS_FILTER, metrics_clock() - t1);
+
    /* If the modified packet exceeds the MTU split it into inject buffer */
    inject_split_data(po);
    
@@ -327,6 +497,9 @@ FUNC_DECODER(decode_data)
     */
    top_half_queue_add(po);     
 
+   if (metrics_on)
+      metrics_stage(METRICS_DATA, metrics_clock() - t0);
+
    CANCELLATION_POINT();
   
    return NULL;
@@ -339,6 +512,7 @@ FUNC_DECODER(decode_data)
 void add_decoder(u_int8 level, u_int32 type, FUNC_DECODER_PTR(decoder))
 {
    struct dec_entry *e;
+   struct dec_lookup *old;
    bool found = false;
 
    DECODERS_LOCK;
@@ -376,7 +550,15 @@ void add_decoder(u_int8 level, u_int32 type, FUNC_DECODER_PTR(decoder))
 
    table_sorted = false;
 
+   old = dec_lookup_update(level, type);
+
+   /* the flows may be handled by the new decoder */
+   flow_cache_invalidate();
+
    DECODERS_UNLOCK;
+
+   /* not under the lock, the packets being decoded may need it */
+   rcu_retire(RCU_DECODERS, old, &dec_lookup_free);
    
    return;
 }
@@ -404,9 +586,16 @@ static int cmp_decoders(const void *va, const void *vb)
       return da->level - db->level;
    }
 
-   return da->type - db->type;
+   if (da->type != db->type)
+      return (da->type < db->type) ? -1 : 1;
+
+   return 0;
 }
 
+/*
+ * search the table of the writers, returns the first
+ * entry of the type. must be called with DECODERS_LOCK held
+ */
 static struct dec_entry* find_entry(u_int8 level, u_int32 type)
 {
    struct dec_entry *e, fake;
@@ -414,18 +603,198 @@ static struct dec_entry* find_entry(u_int8 level, u_int32 type)
    fake.level = level;
    fake.type = type;
 
-   DECODERS_LOCK;
-
    if(!table_sorted) 
       sort_decoders();
 
    e = bsearch(&fake, protocols_table, protocols_num, sizeof(struct dec_entry), cmp_decoders);
 
-   DECODERS_UNLOCK;
-   
+   while (e != NULL && e > protocols_table && e[-1].level == level && e[-1].type == type)
+      e--;
+
    return e;
 }
 
+/*
+ * build the lookup arrays from protocols_table.
+ * must be called with DECODERS_LOCK held
+ */
+static struct dec_lookup * dec_lookup_build(void)
+{
+   struct dec_lookup *l;
+   struct dec_entry *e;
+   struct dec_chain *c;
+   u_int32 max[UINT8_MAX + 1];
+   unsigned i, j, n;
+
+   SAFE_CALLOC(l, 1, sizeof(struct dec_lookup));
+
+   if (!table_sorted)
+      sort_decoders();
+
+   memset(max, 0, sizeof(max));
+
+   /* the size of the arrays */
+   for (i = 0; i < protocols_num; i++) {
+      e = &protocols_table[i];
+      if (e->decoder == NULL || !e->active)
+         continue;
+      if (e->type >= DEC_INDEX_MAX) {
+         l->sparse_num++;
+         continue;
+      }
+      if (e->type >= max[e->level])
+         max[e->level] = e->type + 1;
+   }
+
+   for (i = 0; i <= UINT8_MAX; i++) {
+      if (max[i] == 0)
+         continue;
+
+      /* the ports are all indexed, the other types are few and small */
+      if (i == APP_LAYER_TCP || i == APP_LAYER_UDP)
+         l->size[i] = DEC_INDEX_MAX;
+      else
+         for (l->size[i] = 16; l->size[i] < max[i]; l->size[i] <<= 1);
+
+      SAFE_CALLOC(l->slot[i], l->size[i], sizeof(void *));
+   }
+
+   if (l->sparse_num)
+      SAFE_CALLOC(l->sparse, l->sparse_num, sizeof(struct dec_entry));
+
+   /* the table is sorted, so are the sparse and the chain arrays */
+   l->sparse_num = 0;
+   for (i = 0; i < protocols_num; i += n) {
+      e = &protocols_table[i];
+      n = count_entries(e);
+      if (e->decoder == NULL || !e->active)
+         continue;
+
+      if (e->type >= DEC_INDEX_MAX)
+         memcpy(&l->sparse[l->sparse_num++], e, sizeof(struct dec_entry));
+      else
+         l->slot[e->level][e->type] = e->decoder;
+
+      if (n == 1)
+         continue;
+
+      SAFE_REALLOC(l->chain, (l->chain_num + 1) * sizeof(struct dec_chain));
+      c = &l->chain[l->chain_num++];
+      c->level = e->level;
+      c->type = e->type;
+      SAFE_CALLOC(c->decoders, n + 1, sizeof(void *));
+      for (j = 0; j < n; j++)
+         c->decoders[j] = e[j].decoder;
+   }
+
+   return l;
+}
+
+/*
+ * the number of consecutive entries with the same level
+ * and type of 'e' in the sorted table (at least 1)
+ */
+static unsigned count_entries(struct dec_entry *e)
+{
+   struct dec_entry *end = protocols_table + protocols_num;
+   unsigned n = 1;
+
+   while (e + n < end && e[n].level == e->level && e[n].type == e->type)
+      n++;
+
+   return n;
+}
+
+static int cmp_chain(const void *va, const void *vb)
+{
+   const struct dec_chain *ca = va, *cb = vb;
+
+   if (ca->level != cb->level)
+      return ca->level - cb->level;
+
+   if (ca->type != cb->type)
+      return (ca->type < cb->type) ? -1 : 1;
+
+   return 0;
+}
+
+/*
+ * build the lookup at the first call, the registrations
+ * of the decoders and of the dissectors are done by now
+ */
+static struct dec_lookup * dec_lookup_freeze(void)
+{
+   struct dec_lookup *l;
+
+   DECODERS_LOCK;
+
+   if ((l = dec_lookup) == NULL) {
+      l = dec_lookup_build();
+      __atomic_store_n(&dec_lookup, l, __ATOMIC_RELEASE);
+   }
+
+   DECODERS_UNLOCK;
+
+   return l;
+}
+
+/*
+ * propagate a change of protocols_table to the lookup.
+ * must be called with DECODERS_LOCK held.
+ * returns the lookup it has replaced (to be retired by
+ * the caller), NULL if it was updated in place
+ */
+static struct dec_lookup * dec_lookup_update(u_int8 level, u_int32 type)
+{
+   struct dec_lookup *l = dec_lookup, *n;
+   struct dec_entry *e;
+   struct dec_chain fake;
+
+   /* still registering, it will be built later */
+   if (l == NULL)
+      return NULL;
+
+   e = find_entry(level, type);
+
+   fake.level = level;
+   fake.type = type;
+
+   /* a single decoder, neither before nor after */
+   if (type < l->size[level] && (e == NULL || count_entries(e) == 1) &&
+       (l->chain_num == 0 || bsearch(&fake, l->chain, l->chain_num, sizeof(struct dec_chain), cmp_chain) == NULL)) {
+      __atomic_store_n(&l->slot[level][type], (e && e->active) ? e->decoder : NULL, __ATOMIC_RELEASE);
+      return NULL;
+   }
+
+   /* removing something which is not there */
+   if (type >= l->size[level] && type < DEC_INDEX_MAX && e == NULL)
+      return NULL;
+
+   n = dec_lookup_build();
+   __atomic_store_n(&dec_lookup, n, __ATOMIC_RELEASE);
+
+   return l;
+}
+
+/*
+ * free a replaced lookup, no thread can be using it anymore
+ */
+static void dec_lookup_free(void *arg)
+{
+   struct dec_lookup *l = arg;
+   unsigned i;
+
+   for (i = 0; i <= UINT8_MAX; i++)
+      SAFE_FREE(l->slot[i]);
+
+   for (i = 0; i < l->chain_num; i++)
+      SAFE_FREE(l->chain[i].decoders);
+
+   SAFE_FREE(l->chain);
+   SAFE_FREE(l->sparse);
+   SAFE_FREE(l);
+}
+
 
 /*
  * get a decoder from the decoders table 
@@ -433,25 +802,86 @@ static struct dec_entry* find_entry(u_int8 level, u_int32 type)
 
 void * get_decoder(u_int8 level, u_int32 type)
 {
-   struct dec_entry *e;
+   struct dec_lookup *l;
+   struct dec_entry *e, fake;
+   void *decoder = NULL;
+
+   /* just a counter while decoding a packet */
+   rcu_read_begin(RCU_DECODERS);
+
+   if ((l = __atomic_load_n(&dec_lookup, __ATOMIC_ACQUIRE)) == NULL)
+      l = dec_lookup_freeze();
 
-   if((e = find_entry(level, type)))
-      if(e->active)
-         return e->decoder;
+   if (type < l->size[level])
+      decoder = __atomic_load_n(&l->slot[level][type], __ATOMIC_ACQUIRE);
+   else if (type >= DEC_INDEX_MAX && l->sparse_num != 0) {
+      fake.level = level;
+      fake.type = type;
+
+      if ((e = bsearch(&fake, l->sparse, l->sparse_num, sizeof(struct dec_entry), cmp_decoders)))
+         decoder = e->decoder;
+   }
+
+   rcu_read_end(RCU_DECODERS);
    
+   return decoder;
+}
+
+/*
+ * get all the decoders of a type, NULL terminated.
+ * it returns NULL if there is only one (or none),
+ * get_decoder() has to be used then.
+ * the array can be used only until the end of the
+ * RCU_DECODERS read section of the caller
+ */
+
+void ** get_decoders(u_int8 level, u_int32 type)
+{
+   struct dec_lookup *l = __atomic_load_n(&dec_lookup, __ATOMIC_ACQUIRE);
+   struct dec_chain *c, fake;
+
+   BUG_IF(!rcu_reading(RCU_DECODERS));
+
+   if (l == NULL)
+      l = dec_lookup_freeze();
+
+   if (l->chain_num == 0)
+      return NULL;
+
+   fake.level = level;
+   fake.type = type;
+
+   if ((c = bsearch(&fake, l->chain, l->chain_num, sizeof(struct dec_chain), cmp_chain)))
+      return c->decoders;
+
    return NULL;
 }
 
 /*
- * remove a decoder(s) from the decoders table
+ * remove a decoder from the decoders table.
+ * if more than one is registered for the type,
+ * 'decoder' selects it (NULL removes any of them)
  */
 
-void del_decoder(u_int8 level, u_int32 type)
+void del_decoder(u_int8 level, u_int32 type, FUNC_DECODER_PTR(decoder))
 {
    struct dec_entry *e;
+   struct dec_lookup *old = NULL;
+   unsigned i, n;
+
+   DECODERS_LOCK;
 
    if((e = find_entry(level, type))) {
-      DECODERS_LOCK;
+      n = count_entries(e);
+      for (i = 0; decoder != NULL && i < n; i++)
+         if (e[i].decoder == decoder)
+            break;
+      if (i == n) {
+         DECODERS_UNLOCK;
+         return;
+      }
+      e += (decoder != NULL) ? i : 0;
+
       if (e != &protocols_table[protocols_num-1])
       {
           /* Replace this entry with the last one */
@@ -462,8 +892,14 @@ void del_decoder(u_int8 level, u_int32 type)
       /* And mark as unsorted */
       table_sorted = false;
 
-      DECODERS_UNLOCK;
+      old = dec_lookup_update(level, type);
+
+      flow_cache_invalidate();
    }
+
+   DECODERS_UNLOCK;
+
+   rcu_retire(RCU_DECODERS, old, &dec_lookup_free);
    
    return;
 }
@@ -0,0 +1,184 @@
+/*
+    ettercap -- application protocol detection
+
+    Copyright (C) ALoR & NaGA
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <ec.h>
+#include <ec_decode.h>
+#include <ec_dissect.h>
+#include <ec_session.h>
+#include <ec_detect.h>
+
+/*
+ * the signatures are matched against the beginning of the first
+ * payloads of a flow. they are indexed by their first byte, so a
+ * payload is compared only with the few signatures starting with
+ * the same byte.
+ */
+
+struct detect_sig {
+   const char *name;          /* the dissector handling the protocol */
+   u_int8 proto;              /* NL_TYPE_TCP or NL_TYPE_UDP */
+   u_int8 side;               /* who sends the matching payload */
+      #define DETECT_CLIENT   1
+      #define DETECT_SERVER   2
+   const char *pattern;
+   size_t len;
+};
+
+#define SIG(name, proto, side, pattern) { name, proto, side, pattern, sizeof(pattern) - 1 }
+
+static struct detect_sig detect_sigs[] = {
+   SIG("http", NL_TYPE_TCP, DETECT_CLIENT, "GET /"),
+   SIG("http", NL_TYPE_TCP, DETECT_CLIENT, "POST /"),
+   SIG("http", NL_TYPE_TCP, DETECT_CLIENT, "HEAD /"),
+   SIG("http", NL_TYPE_TCP, DETECT_CLIENT, "PUT /"),
+   SIG("http", NL_TYPE_TCP, DETECT_CLIENT, "DELETE /"),
+   SIG("http", NL_TYPE_TCP, DETECT_CLIENT, "OPTIONS "),
+   SIG("ssh", NL_TYPE_TCP, DETECT_SERVER, "SSH-"),
+   SIG("ssh", NL_TYPE_TCP, DETECT_CLIENT, "SSH-"),
+   SIG("smtp", NL_TYPE_TCP, DETECT_CLIENT, "EHLO "),
+   SIG("smtp", NL_TYPE_TCP, DETECT_CLIENT, "HELO "),
+   SIG("pop3", NL_TYPE_TCP, DETECT_SERVER, "+OK"),
+   SIG("imap", NL_TYPE_TCP, DETECT_SERVER, "* OK"),
+   SIG("irc", NL_TYPE_TCP, DETECT_CLIENT, "NICK "),
+   SIG("vnc", NL_TYPE_TCP, DETECT_SERVER, "RFB 0"),
+   SIG("x11", NL_TYPE_TCP, DETECT_CLIENT, "l\x00\x0b\x00"),
+   SIG("x11", NL_TYPE_TCP, DETECT_CLIENT, "B\x00\x00\x0b"),
+};
+
+#define DETECT_SIGS  (sizeof(detect_sigs) / sizeof(struct detect_sig))
+
+/* the signatures starting with each byte, -1 terminated */
+static int8_t detect_index[UINT8_MAX + 1][DETECT_SIGS + 1];
+
+/* the payloads inspected before giving up on a flow */
+#define DETECT_TRIES    4
+
+/* kept in a dissector session for every flow with a payload */
+struct detect_state {
+   const struct detect_sig *sig;    /* NULL if not recognized */
+   void *decoder;
+   u_int16 port;                    /* the server port */
+   u_int8 tries;
+   u_int8 done;
+};
+
+/* protos */
+
+void __init detect_init(void);
+static const struct detect_sig * detect_match(struct packet_object *po);
+
+/************************************************/
+
+void __init detect_init(void)
+{
+   u_int i, n[UINT8_MAX + 1];
+   u_char c;
+
+   memset(n, 0, sizeof(n));
+   memset(detect_index, -1, sizeof(detect_index));
+
+   for (i = 0; i < DETECT_SIGS; i++) {
+      c = detect_sigs[i].pattern[0];
+      detect_index[c][n[c]++] = i;
+   }
+}
+
+/*
+ * the first signature matching the payload of the packet
+ */
+static const struct detect_sig * detect_match(struct packet_object *po)
+{
+   const struct detect_sig *sig;
+   int8_t *idx = detect_index[po->DATA.data[0]];
+
+   for (; *idx != -1; idx++) {
+      sig = &detect_sigs[*idx];
+      if (sig->proto == po->L4.proto && po->DATA.len >= sig->len &&
+          !memcmp(po->DATA.data, sig->pattern, sig->len))
+         return sig;
+   }
+
+   return NULL;
+}
+
+/*
+ * look up the protocol of the flow, inspecting the payload
+ * if it is not known yet, and report it in po->DETECT.
+ * returns E_SUCCESS when the inspection of the flow is over,
+ * -E_NOTHANDLED if the next payloads may change the result.
+ */
+int detect_proto(struct packet_object *po)
+{
+   struct ec_session *s = NULL;
+   struct detect_state *ds;
+   const struct detect_sig *sig;
+   struct dissect_ident ident;
+
+   /* the same key used by dissect_create_ident(), without the allocation */
+   memset(&ident, 0, sizeof(ident));
+   ident.fptr = DISSECT_CODE(detect_proto);
+   memcpy(&ident.L3_src, &po->L3.src, sizeof(struct ip_addr));
+   memcpy(&ident.L3_dst, &po->L3.dst, sizeof(struct ip_addr));
+   ident.L4_proto = po->L4.proto;
+   ident.L4_src = po->L4.src;
+   ident.L4_dst = po->L4.dst;
+
+   if (session_get(&s, &ident, DISSECT_IDENT_LEN) == -E_NOTFOUND) {
+      /* nothing to inspect, don't keep a state for empty packets */
+      if (po->DATA.len == 0)
+         return -E_NOTHANDLED;
+
+      dissect_create_session(&s, po, DISSECT_CODE(detect_proto));
+      SAFE_CALLOC(s->data, 1, sizeof(struct detect_state));
+      s->data_len = sizeof(struct detect_state);
+      session_put(s);
+   }
+
+   ds = s->data;
+
+   if (!ds->done && po->DATA.len > 0) {
+
+      if ((sig = detect_match(po)) != NULL) {
+         ds->decoder = dissect_decoder((char *)sig->name,
+                                       sig->proto == NL_TYPE_TCP ? APP_LAYER_TCP : APP_LAYER_UDP);
+         ds->port = (sig->side == DETECT_SERVER) ? po->L4.src : po->L4.dst;
+         ds->sig = sig;
+         ds->done = 1;
+
+         DEBUG_MSG("detect_proto: %s on port %u", sig->name, ntohs(ds->port));
+      } else if (++ds->tries == DETECT_TRIES)
+         ds->done = 1;
+   }
+
+   /* the dissector may have been disabled */
+   if (ds->sig != NULL && ds->decoder != NULL) {
+      po->DETECT.proto = ds->sig->name;
+      po->DETECT.decoder = ds->decoder;
+      po->DETECT.port = ds->port;
+   }
+
+   return ds->done ? E_SUCCESS : -E_NOTHANDLED;
+}
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
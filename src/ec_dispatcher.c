@@ -24,27 +24,84 @@
 #include <ec_hook.h>
 #include <ec_stats.h>
 #include <ec_sleep.h>
+#include <ec_hash.h>
+#include <ec_metrics.h>
 
+#include <poll.h>
+#include <fcntl.h>
+#ifdef OS_LINUX
+   #include <sys/eventfd.h>
+#endif
 
-/* this is the PO queue from bottom to top half */
-struct po_queue_entry {
+/* 
+ * this is the PO queue from bottom to top half.
+ *
+ * a bounded ring of preallocated slots: many producers (the capture 
+ * threads) and a single consumer (the top half), without locks.
+ * every slot has a sequence number telling whose turn it is:
+ *   seq == pos       the slot is free for the producer at pos
+ *   seq == pos + 1   the slot is filled and the consumer can take it
+ */
+#define PO_QUEUE_SIZE   65536    /* must be a power of 2 */
+#define PO_QUEUE_MASK   (PO_QUEUE_SIZE - 1)
+
+struct po_slot {
+   unsigned long seq;
    struct packet_object *po;
-   STAILQ_ENTRY(po_queue_entry) next;
+   uint64_t ts;            /* enqueue time of a sampled packet, else 0 */
+};
+
+/*
+ * the top half is split in dispatcher_threads shards, each one
+ * with its own queue. packets are assigned to a shard by a 
+ * symmetric hash of the flow, so the packets of a connection
+ * (in both directions) are always dispatched in order by the
+ * same thread.
+ *
+ * wakeup of an idle shard: it raises 'sleeping' before blocking 
+ * on the fd and the producer who clears it pays the write(). 
+ * on linux an eventfd is used, elsewhere a pipe.
+ */
+struct po_shard {
+   u_int id;
+   struct po_slot *slots;
+   /* producers and consumer on different cache lines */
+   char pad0[64];
+   unsigned long tail;     /* next position for the producers */
+   char pad1[64];
+   unsigned long head;     /* next position for the consumer */
+   int sleeping;
+   int wake[2];
 };
 
-static STAILQ_HEAD(, po_queue_entry) po_queue = STAILQ_HEAD_INITIALIZER(po_queue);
+static struct po_shard *po_shards;
+static u_int po_shards_nr;
 
-/* global mutex on interface */
+static pthread_once_t po_once = PTHREAD_ONCE_INIT;
 
-static pthread_mutex_t po_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define PO_QUEUE_LOCK     do{ pthread_mutex_lock(&po_mutex); }while(0)
-#define PO_QUEUE_UNLOCK   do{ pthread_mutex_unlock(&po_mutex); }while(0)
+/* 
+ * at the end of a dump file the shard which got the EOF waits 
+ * for the others to empty their queues. it raises po_draining 
+ * and the shard bringing queue_curr to zero signals it.
+ */
+static pthread_mutex_t po_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t po_drain_cond = PTHREAD_COND_INITIALIZER;
+static int po_draining;
 
 /* proto */
 
 void top_half_queue_add(struct packet_object *po);
 EC_THREAD_FUNC(top_half);
 
+static void po_queue_init(void);
+static u_int32 po_shard_hash(struct packet_object *po);
+static int po_queue_push(struct po_shard *sh, struct packet_object *po, uint64_t ts);
+static struct packet_object *po_queue_pop(struct po_shard *sh, uint64_t *ts);
+static void po_queue_wait(struct po_shard *sh);
+static void po_queue_wakeup(struct po_shard *sh);
+static void po_queue_drain(void);
+static void po_queue_drained(void);
+
 /*******************************************/
 
 /*
@@ -54,92 +111,105 @@ EC_THREAD_FUNC(top_half);
  * created by the bottom_half (capture).
  * it read the queue created by top_half_queue_add()
  * and deliver the po to all the registered functions
+ *
+ * the thread started by main() is the shard 0 and it
+ * spawns the others.
  */
 
 EC_THREAD_FUNC(top_half)
 {
-   struct po_queue_entry *e;
-   u_int pck_len;
+   struct po_shard *sh;
+   struct packet_object *po;
+   char thread_name[32];
+   u_int pck_len, i;
+   uint64_t ts, t0 = 0;
  
-   /* variable not used */
-   (void) EC_THREAD_PARAM;
-
    /* initialize the thread */
    ec_thread_init();
    
-   DEBUG_MSG("top_half activated !");
+   pthread_once(&po_once, po_queue_init);
 
-   /* 
-    * we don't want profiles in memory.
-    * remove the hooks and return
-    */
-   if (!EC_GBL_CONF->store_profiles) {
-      DEBUG_MSG("top_half: profile collection disabled");
-      hook_del(HOOK_PACKET_ARP, &profile_parse);
-      hook_del(HOOK_PACKET_ICMP, &profile_parse);
-      hook_del(HOOK_PROTO_DHCP_PROFILE, &profile_parse);
-      hook_del(HOOK_DISPATCHER, &profile_parse);
+   sh = (EC_THREAD_PARAM != NULL) ? EC_THREAD_PARAM : &po_shards[0];
+
+   DEBUG_MSG("top_half activated ! (shard %u)", sh->id);
+
+   if (sh->id == 0) {
+      /* 
+       * we don't want profiles in memory.
+       * remove the hooks and return
+       */
+      if (!EC_GBL_CONF->store_profiles) {
+         DEBUG_MSG("top_half: profile collection disabled");
+         hook_del(HOOK_PACKET_ARP, &profile_parse);
+         hook_del(HOOK_PACKET_ICMP, &profile_parse);
+         hook_del(HOOK_PROTO_DHCP_PROFILE, &profile_parse);
+         hook_del(HOOK_DISPATCHER, &profile_parse);
+      }
+
+      for (i = 1; i < po_shards_nr; i++) {
+         snprintf(thread_name, sizeof(thread_name), "top_half[%u]", i);
+         ec_thread_new(thread_name, "dispatching module shard", &top_half, &po_shards[i]);
+      }
    }
    
    LOOP { 
      
       CANCELLATION_POINT();
       
-      /* the queue is updated by other thread, lock it */
-      PO_QUEUE_LOCK;
-      
       /* get the first element */
-      e = STAILQ_FIRST(&po_queue);
+      po = po_queue_pop(sh, &ts);
 
-      /* the queue is empty, nothing to do... */
-      if (e == NULL) {
-         PO_QUEUE_UNLOCK;
-         ec_usleep(1); // 1µs
+      /* the queue is empty, sleep until a producer wakes us up */
+      if (po == NULL) {
+         po_queue_wait(sh);
          continue;
       }
   
       /* start the counter for the TopHalf */
       stats_half_start(&EC_GBL_STATS->th);
        
-      /* remove the packet form the queue */
-      STAILQ_REMOVE_HEAD(&po_queue, e, next);
-     
       /* update the queue stats */
-      stats_queue_del();
-      
-      /* 
-       * we have extracted the element, unlock the queue 
-       *
-       * the bottom half MUST be very fast and it cannot
-       * wait on the top half lock.
-       */
-      PO_QUEUE_UNLOCK;
+      if (stats_queue_del() == 0)
+         po_queue_drained();
+
+      /* the packet was sampled by the bottom half, follow it */
+      metrics_on = (ts != 0);
+      if (metrics_on) {
+         t0 = metrics_clock();
+         metrics_stage(METRICS_QUEUE, t0 - ts);
+      }
       
       /* 
        * check if it is the last packet of a file...
        * and exit if we are in text only or demonize mode
        */
-      if (e->po->flags & PO_EOF) {
+      if (po->flags & PO_EOF) {
+         /* the other shards may still have packets of the file */
+         po_queue_drain();
+
          DEBUG_MSG("End of dump file...");
          USER_MSG("\nEnd of dump file...\n");
          if ((EC_GBL_UI->type == UI_TEXT || EC_GBL_UI->type == UI_DAEMONIZE) && EC_GBL_CONF->close_on_eof)
             clean_exit(0);
          else {
-            SAFE_FREE(e);
+            packet_destroy_object(po);
+            packet_release_object(po);
             continue;
          }
       }
       
       /* HOOK_POINT: DISPATCHER */
-      hook_point(HOOK_DISPATCHER, e->po);
+      hook_point(HOOK_DISPATCHER, po);
+
+      if (metrics_on)
+         metrics_stage(METRICS_DISPATCH, metrics_clock() - t0);
 
       /* save the len before the free() */
-      pck_len = e->po->DATA.disp_len;
+      pck_len = po->DATA.disp_len;
       
       /* destroy the duplicate packet object */
-      packet_destroy_object(e->po);
-      SAFE_FREE(e->po);
-      SAFE_FREE(e);
+      packet_destroy_object(po);
+      packet_release_object(po);
       
       /* start the counter for the TopHalf */
       stats_half_end(&EC_GBL_STATS->th, pck_len);
@@ -150,28 +220,248 @@ EC_THREAD_FUNC(top_half)
 
 /* 
  * add a packet to the top half queue.
- * this fuction is called by the bottom half thread
+ * this fuction is called by the bottom half thread(s)
+ * and it never blocks on the top half: if the queue is
+ * full the packet is dropped (and accounted).
+ * while reading from a file we wait instead, there is
+ * no reason to lose packets there.
  */
 
 void top_half_queue_add(struct packet_object *po)
 {
-   struct po_queue_entry *e;
+   struct packet_object *dup;
+   struct po_shard *sh;
+   uint64_t ts = 0;
 
-   SAFE_CALLOC(e, 1, sizeof(struct po_queue_entry));
-   
-   e->po = packet_dup(po, PO_DUP_NONE);
-   
-   PO_QUEUE_LOCK;
-   
-   /* add the message to the queue */
-   STAILQ_INSERT_TAIL(&po_queue, e, next);
-   
-   /* update the stats */
+   pthread_once(&po_once, po_queue_init);
+
+   sh = &po_shards[0];
+   if (po_shards_nr > 1)
+      sh = &po_shards[po_shard_hash(po) % po_shards_nr];
+
+   dup = packet_dup(po, PO_DUP_NONE);
+
+   if (metrics_on)
+      ts = metrics_clock();
+
+   /* 
+    * update the stats before the push: once in the ring the
+    * packet can be taken (and uncounted) by the shard at once
+    */
    stats_queue_add();
    
-   PO_QUEUE_UNLOCK;
+   while (po_queue_push(sh, dup, ts) != E_SUCCESS) {
+      if (EC_GBL_OPTIONS->read || (dup->flags & PO_EOF)) {
+         po_queue_wakeup(sh);
+         ec_usleep(MILLI2MICRO(1));
+         continue;
+      }
+
+      /* a shard may be waiting for the count to reach zero */
+      if (stats_queue_del() == 0)
+         po_queue_drained();
+      stats_queue_drop();
+      packet_destroy_object(dup);
+      packet_release_object(dup);
+      return;
+   }
+
+   po_queue_wakeup(sh);
+}
+
+/*******************************************/
+
+static void po_queue_init(void)
+{
+   struct po_shard *sh;
+   unsigned long j;
+   u_int i;
+
+   po_shards_nr = EC_GBL_CONF->dispatcher_threads;
+   if (po_shards_nr == 0)
+      po_shards_nr = 1;
+
+   SAFE_CALLOC(po_shards, po_shards_nr, sizeof(struct po_shard));
+
+   for (i = 0; i < po_shards_nr; i++) {
+      sh = &po_shards[i];
+      sh->id = i;
+
+      SAFE_CALLOC(sh->slots, PO_QUEUE_SIZE, sizeof(struct po_slot));
+      for (j = 0; j < PO_QUEUE_SIZE; j++)
+         sh->slots[j].seq = j;
+
+#ifdef OS_LINUX
+      sh->wake[0] = sh->wake[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (sh->wake[0] != -1)
+         continue;
+#endif
+      if (pipe(sh->wake) == -1)
+         FATAL_ERROR("Cannot create the top half wakeup channel: %s", strerror(errno));
+
+      fcntl(sh->wake[0], F_SETFL, fcntl(sh->wake[0], F_GETFL) | O_NONBLOCK);
+      fcntl(sh->wake[1], F_SETFL, fcntl(sh->wake[1], F_GETFL) | O_NONBLOCK);
+   }
+
+   DEBUG_MSG("po_queue_init: %u shard(s)", po_shards_nr);
 }
 
+/*
+ * the hash must be equal for packets from dst to src
+ * and viceversa, so the addresses and the ports are XORed
+ */
+static u_int32 po_shard_hash(struct packet_object *po)
+{
+   u_int32 hash_array[3];
+
+   hash_array[0] = fnv_32((u_char *)&po->L3.src, sizeof(struct ip_addr)) ^
+                   fnv_32((u_char *)&po->L3.dst, sizeof(struct ip_addr));
+   hash_array[1] = po->L4.src ^ po->L4.dst;
+   hash_array[2] = po->L4.proto;
+   
+   return fnv_32((u_char *)&hash_array, sizeof(hash_array));
+}
+
+/*
+ * reserve a position with a CAS on the tail, fill the slot
+ * and publish it by advancing its sequence
+ */
+static int po_queue_push(struct po_shard *sh, struct packet_object *po, uint64_t ts)
+{
+   struct po_slot *slot;
+   unsigned long pos, seq;
+   long dif;
+
+   pos = __atomic_load_n(&sh->tail, __ATOMIC_RELAXED);
+
+   for (;;) {
+      slot = &sh->slots[pos & PO_QUEUE_MASK];
+      seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      dif = (long)seq - (long)pos;
+
+      if (dif == 0) {
+         if (__atomic_compare_exchange_n(&sh->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      } else if (dif < 0) {
+         /* the consumer did not free it yet: full */
+         return -E_NOTHANDLED;
+      } else {
+         pos = __atomic_load_n(&sh->tail, __ATOMIC_RELAXED);
+      }
+   }
+
+   slot->po = po;
+   slot->ts = ts;
+   __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+   return E_SUCCESS;
+}
+
+/*
+ * only the thread of the shard calls it, so the head needs no atomics
+ */
+static struct packet_object *po_queue_pop(struct po_shard *sh, uint64_t *ts)
+{
+   struct po_slot *slot = &sh->slots[sh->head & PO_QUEUE_MASK];
+   struct packet_object *po;
+
+   if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != sh->head + 1)
+      return NULL;
+
+   po = slot->po;
+   *ts = slot->ts;
+   /* hand it back to the producers of the next lap */
+   __atomic_store_n(&slot->seq, sh->head + PO_QUEUE_SIZE, __ATOMIC_RELEASE);
+   sh->head++;
+
+   return po;
+}
+
+/*
+ * block the shard until something is queued.
+ * the flag is raised before checking the queue again, so a producer
+ * publishing in between either sees it or is seen by us.
+ * the timeout only bounds the wait for the cancellation.
+ */
+static void po_queue_wait(struct po_shard *sh)
+{
+   struct pollfd pfd;
+   struct po_slot *slot = &sh->slots[sh->head & PO_QUEUE_MASK];
+   uint64_t junk;
+
+   __atomic_store_n(&sh->sleeping, 1, __ATOMIC_SEQ_CST);
+
+   if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == sh->head + 1) {
+      __atomic_store_n(&sh->sleeping, 0, __ATOMIC_RELAXED);
+      return;
+   }
+
+   pfd.fd = sh->wake[0];
+   pfd.events = POLLIN;
+   pfd.revents = 0;
+
+   poll(&pfd, 1, 100);
+
+   /* drain it, both the eventfd counter and the pipe */
+   while (read(sh->wake[0], &junk, sizeof(junk)) > 0);
+
+   __atomic_store_n(&sh->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * the cheap path is a single load: the syscall is done
+ * only if the shard is sleeping, and only by one producer
+ */
+static void po_queue_wakeup(struct po_shard *sh)
+{
+   uint64_t one = 1;
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   if (__atomic_load_n(&sh->sleeping, __ATOMIC_RELAXED) == 0)
+      return;
+
+   if (__atomic_exchange_n(&sh->sleeping, 0, __ATOMIC_ACQ_REL) == 0)
+      return;
+
+   if (write(sh->wake[1], &one, sizeof(one)) == -1)
+      DEBUG_MSG("po_queue_wakeup: %s", strerror(errno));
+}
+
+/*
+ * sleep until all the shards have taken their packets.
+ * the flag is raised before checking the counter under the mutex,
+ * so the shard emptying the queue either is seen here or sees us.
+ * the producers count a packet before it can be taken, so the
+ * counter never goes below zero and only the decrements wake us up.
+ */
+static void po_queue_drain(void)
+{
+   __atomic_store_n(&po_draining, 1, __ATOMIC_SEQ_CST);
+
+   pthread_mutex_lock(&po_drain_mutex);
+   while (__atomic_load_n(&EC_GBL_STATS->queue_curr, __ATOMIC_SEQ_CST) > 0)
+      pthread_cond_wait(&po_drain_cond, &po_drain_mutex);
+   pthread_mutex_unlock(&po_drain_mutex);
+
+   __atomic_store_n(&po_draining, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * the queues are empty: wake up the shard waiting in po_queue_drain().
+ * nobody waits outside the end of a file, so it is a single load.
+ */
+static void po_queue_drained(void)
+{
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   if (__atomic_load_n(&po_draining, __ATOMIC_RELAXED) == 0)
+      return;
+
+   pthread_mutex_lock(&po_drain_mutex);
+   pthread_cond_broadcast(&po_drain_cond);
+   pthread_mutex_unlock(&po_drain_mutex);
+}
 
 /* EOF */
 
@@ -23,6 +23,7 @@
 #include <ec_dissect.h>
 #include <ec_packet.h>
 #include <ec_sslwrap.h>
+#include <ec_metrics.h>
 
 /* globals */
 
@@ -181,6 +182,9 @@ void dissect_add(char *name, u_int8 level, u_int32 port, FUNC_DECODER_PTR(decode
 
    /* add the default decoder */
    add_decoder(level, port, decoder);
+
+   /* and measure its latency */
+   metrics_func_add(decoder, "dissector", name);
       
    return;
 }
@@ -194,7 +198,7 @@ void dissect_del(char *name)
 
    SLIST_FOREACH_SAFE(e, &dissect_list, next, tmp) {
       if (!strcasecmp(e->name, name)) {
-         del_decoder(e->level, e->type);
+         del_decoder(e->level, e->type, e->decoder);
          SLIST_REMOVE(&dissect_list, e, dissect_entry, next);
          SAFE_FREE(e);
       }
@@ -255,6 +259,22 @@ int dissect_modify(int mode, char *name, u_int32 port)
    return -E_NOTFOUND;
 }
 
+/*
+ * the decoder of a dissector, NULL if it is not registered
+ * (or it was disabled) on that level
+ */
+void * dissect_decoder(char *name, u_int8 level)
+{
+   struct dissect_entry *e;
+
+   SLIST_FOREACH (e, &dissect_list, next) {
+      if (!strcasecmp(e->name, name) && e->level == level)
+         return e->decoder;
+   }
+
+   return NULL;
+}
+
 /*
  * return E_SUCCESS if the dissector is on
  * the specified port 
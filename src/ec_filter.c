@@ -21,13 +21,16 @@
 
 #include <ec.h>
 #include <ec_filter.h>
+#include <ec_filter_engine.h>
 #include <ec_version.h>
 #include <ec_threads.h>
 #include <ec_send.h>
+#include <ec_rcu.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <ctype.h>
 
 #include <regex.h>
 #ifdef HAVE_PCRE
@@ -37,17 +40,116 @@
 
 #define JIT_FAULT(x, ...) do { USER_MSG("JIT FILTER FAULT: " x "\n", ## __VA_ARGS__); return -E_FATAL; } while(0)
 
+/*
+ * a loaded filter is never modified (except for its enabled flag) and
+ * filter_packet() walks the list without any lock, so the filters run
+ * concurrently on all the decoding threads.
+ * the writers (load, unload and the walk of the UIs) are serialized by
+ * the filters_mutex; they link a filter only when it is ready, and free
+ * an unlinked one when no thread can be executing it anymore (the
+ * RCU_FILTERS domain of ec_rcu).
+ */
+
 /* since we need a recursive mutex, we cannot initialize it here statically */
 static pthread_mutex_t filters_mutex;
 #define FILTERS_LOCK     do{ pthread_mutex_lock(&filters_mutex); }while(0)
 #define FILTERS_UNLOCK   do{ pthread_mutex_unlock(&filters_mutex); }while(0)
 
+/*
+ * the chain is decoded when the file is loaded: every filter_op gets
+ * the handler for its exact kind (a test on a 16 bit field with ==,
+ * a jump if false, ...), the pointers to the targets of the jumps and
+ * the operands already converted. a test followed by a conditional
+ * jump is executed as a single instruction.
+ * the handlers return the next instruction, NULL after the exit.
+ * if something can't be decoded the chain is interpreted as before.
+ */
+struct filter_insn {
+   struct filter_insn * (*exec)(struct filter_insn *ins, struct packet_object *po, u_int32 *flags);
+   int (*test)(struct filter_insn *ins, struct packet_object *po);
+   int (*cmp)(u_int32 a, u_int32 b);
+   struct filter_insn *jmp;
+   struct filter_op *fop;
+   size_t base;               /* offset of the base pointer in the packet_object */
+   u_int16 offset;
+   u_int32 value;
+   int literal;               /* the id of its literal in the automaton, -1 if none */
+};
+
+/*
+ * the literals of search(), replace() and of the regex requiring one,
+ * from all the loaded filters, are matched by a single automaton
+ * (aho-corasick). the first time one of them is needed, the payload
+ * is scanned once for all of them, and the instructions just look at
+ * the result. the scan is done again only if the packet is modified.
+ * the input is folded to lower case, so the literals of the case
+ * insensitive regex are found too; the others are compared where
+ * they are found.
+ * the ids don't change while a filter using them is loaded. the
+ * automaton is replaced (with the same read-copy-update of the list)
+ * when a filter is loaded or unloaded; the filters loaded after the
+ * one a packet is using search their literals as before.
+ */
+struct filter_literal {
+   u_char *str;
+   size_t len;
+   u_int8 icase;
+   u_int32 refs;
+};
+
+struct filter_ac {
+   u_int32 gen;
+   /* copies of the literals, indexed by id */
+   struct filter_literal *lits;
+   int *same;                 /* the next literal ending on the same node */
+   size_t nlits;
+   /* the nodes */
+   u_int16 *delta;            /* the transitions, 256 for each node */
+   int *out;                  /* the first literal ending on the node, -1 if none */
+   u_int16 *dict;             /* the next node with literals on the suffix links */
+   u_int16 *report;           /* the same, starting from the node itself */
+   size_t nodes;
+};
+
+/* it must fit in the u_int16 of the transitions */
+#define FILTER_AC_NODES_MAX   8192
+/* the shortest literal worth a prefilter for a regex */
+#define FILTER_LITERAL_MIN    3
+
+#define AC_FOLD(c)   (((c) >= 'A' && (c) <= 'Z') ? (c) + ('a' - 'A') : (c))
+
+/* the registry of the literals, protected by the filters_mutex */
+static struct filter_literal *filter_literals;
+static size_t filter_nliterals;
+
+static struct filter_ac *filter_ac;
+static u_int32 filter_ac_gen;
+
+/* the result of the scans of the packet being filtered */
+struct filter_scan {
+   struct filter_ac *ac;
+   int usable;                /* the ac contains the literals of the running filter */
+   u_int8 done[2];            /* DATA.data and DATA.disp_data were scanned */
+   u_int8 *hit[2];            /* indexed by id */
+   size_t size;
+};
+
+static __thread struct filter_scan filter_scan;
+
 /* protos */
 
 static void reconstruct_strings(struct filter_env *fenv, struct filter_header *fh);
-static int compile_regex(struct filter_env *fenv);
+
+static void filter_scan_exit(void);
    
-static int filter_engine(struct filter_op *fop, struct packet_object *po);
+static size_t regex_escape_len(const char *p);
+static int filter_literal_get(u_char *str, size_t len, u_int8 icase);
+static void filter_literal_put(int id);
+static struct filter_ac * filter_ac_build(void);
+static void filter_ac_free(struct filter_ac *ac);
+static void filter_ac_rebuild(void);
+static void filter_ac_scan(struct filter_ac *ac, const u_char *data, size_t len, u_int8 *hit);
+static int filter_literal_hit(struct filter_insn *ins, struct packet_object *po);
 static int execute_test(struct filter_op *fop, struct packet_object *po);
 static int execute_assign(struct filter_op *fop, struct packet_object *po);
 static int execute_incdec(struct filter_op *fop, struct packet_object *po);
@@ -79,6 +181,18 @@ void filter_init_mutex(void) {
    /* we want an recursive mutex, so we can re-aquire it in the same thread */
    pthread_mutexattr_settype(&at, PTHREAD_MUTEX_RECURSIVE_NP);
    pthread_mutex_init(&filters_mutex, &at);
+
+   rcu_thread_exit(RCU_FILTERS, &filter_scan_exit);
+}
+
+/*
+ * called by the exiting threads that have filtered some packet.
+ * the results of the scans are in a single block
+ */
+static void filter_scan_exit(void)
+{
+   SAFE_FREE(filter_scan.hit[0]);
+   filter_scan.size = 0;
 }
 
 /*
@@ -86,7 +200,7 @@ void filter_init_mutex(void) {
  * it process the filter_ops and apply the instructions
  * on the given packet object
  */
-static int filter_engine(struct filter_op *fop, struct packet_object *po)
+int filter_engine(struct filter_op *fop, struct packet_object *po)
 {
    u_int32 eip = 0;
    u_int32 flags = 0;
@@ -96,8 +210,6 @@ static int filter_engine(struct filter_op *fop, struct packet_object *po)
    /* sanity check */
    BUG_IF(fop == NULL);
 
-   FILTERS_LOCK;
-
    /* loop until EXIT */
    while (fop[eip].opcode != FOP_EXIT) {
 
@@ -157,7 +269,6 @@ static int filter_engine(struct filter_op *fop, struct packet_object *po)
             break;
             
          default:
-            FILTERS_UNLOCK;
             JIT_FAULT("unsupported opcode [%d] (execution interrupted)", fop[eip].opcode);
             break;
       }
@@ -166,24 +277,871 @@ static int filter_engine(struct filter_op *fop, struct packet_object *po)
       eip++;
    }
    
-   FILTERS_UNLOCK;
+   return 0;
+}
+
+/*
+ * the longest literal every match of the regex must contain.
+ * returns its length (0 if there is none), the literal is
+ * stored in lit, to be freed by the caller.
+ * it is conservative: what is not understood ends the literal.
+ */
+size_t filter_regex_literal(const char *re, int icase, u_char **lit)
+{
+   size_t n = strlen(re), cur = 0, best = 0, esc;
+   const char *p;
+   int depth = 0;
+   u_char *run, c;
+
+   *lit = NULL;
+
+   /* the alternatives and the options (caseless, extended...) */
+   if (strchr(re, '|') || strstr(re, "(?"))
+      return 0;
+
+   SAFE_CALLOC(run, n + 1, sizeof(u_char));
+   SAFE_CALLOC(*lit, n + 1, sizeof(u_char));
+
+#define END_RUN do {                      \
+   if (cur > best) {                      \
+      best = cur;                         \
+      memcpy(*lit, run, cur);             \
+   }                                      \
+   cur = 0;                               \
+} while (0)
+
+   for (p = re; *p != '\0'; p++) {
+      switch (*p) {
+         case '\\':
+            /* the escaped letters and digits are classes, references or codes */
+            if (p[1] == '\0' || (p[1] & 0x80) || isalnum((u_char)p[1])) {
+               END_RUN;
+               if (p[1] == '\0')
+                  continue;
+               /* their arguments are not part of the literal */
+               if ((esc = regex_escape_len(p + 1)) == 0)
+                  goto bail;
+               p += esc;
+               continue;
+            }
+            c = *++p;
+            break;
+
+         case '[':
+            END_RUN;
+            /* a ] just after the [ (or [^) is part of the bracket */
+            if (*++p == '^')
+               p++;
+            if (*p == ']')
+               p++;
+            while (*p != '\0' && *p != ']') {
+               /* it depends on the flavour of the regex */
+               if (*p == '\\')
+                  goto bail;
+               p++;
+            }
+            if (*p == '\0')
+               goto bail;
+            continue;
+
+         case '(':
+            depth++;
+            END_RUN;
+            continue;
+
+         case ')':
+            depth--;
+            END_RUN;
+            continue;
+
+         case '*':
+         case '?':
+         case '{':
+            /* the previous character may be missing */
+            if (cur > 0)
+               cur--;
+            END_RUN;
+            if (*p == '{') {
+               while (*p != '\0' && *p != '}')
+                  p++;
+               if (*p == '\0')
+                  goto bail;
+            }
+            continue;
+
+         case '+':
+         case '.':
+         case '^':
+         case '$':
+         case ']':
+         case '}':
+            END_RUN;
+            continue;
+
+         default:
+            c = *p;
+            break;
+      }
+
+      /* the groups may be optional, the locale may fold the other characters */
+      if (depth != 0 || (icase && (c & 0x80))) {
+         END_RUN;
+         continue;
+      }
+
+      run[cur++] = c;
+   }
+
+   END_RUN;
+
+#undef END_RUN
 
+   SAFE_FREE(run);
+
+   if (best < FILTER_LITERAL_MIN) {
+      SAFE_FREE(*lit);
+      return 0;
+   }
+
+   return best;
+
+bail:
+   SAFE_FREE(run);
+   SAFE_FREE(*lit);
    return 0;
 }
 
+/*
+ * the length of an escape sequence (without the backslash) starting
+ * with a letter or a digit, its arguments included. it may be longer
+ * than the real one, only the literal is shortened.
+ * returns 0 if the rest of the regex can't be understood.
+ */
+static size_t regex_escape_len(const char *p)
+{
+   const char *q = p + 1;
+   char end;
+
+   switch (*p) {
+      /* the backreferences and the octal codes: \1, \12, \101 */
+      case '0': case '1': case '2': case '3': case '4':
+      case '5': case '6': case '7': case '8': case '9':
+         while (isdigit((u_char)*q))
+            q++;
+         return q - p;
+
+      /* \x41 or \x{263a} */
+      case 'x':
+         if (*q != '{') {
+            while (q - p < 3 && isxdigit((u_char)*q))
+               q++;
+            return q - p;
+         }
+         break;
+
+      /* a control character: \cA */
+      case 'c':
+         return (*q != '\0') ? 2 : 1;
+
+      /* \g1, \g-1, \g{name}, \k<name>, \p{L}, \N{U+263a}, \o{101} */
+      case 'g':
+         if (*q == '-' || *q == '+')
+            q++;
+         if (isdigit((u_char)*q)) {
+            while (isdigit((u_char)*q))
+               q++;
+            return q - p;
+         }
+         break;
+      case 'k':
+      case 'p':
+      case 'P':
+      case 'N':
+      case 'o':
+         break;
+
+      /* everything up to \E is quoted */
+      case 'Q':
+         return 0;
+
+      default:
+         return 1;
+   }
+
+   switch (*q) {
+      case '{':  end = '}';  break;
+      case '<':  end = '>';  break;
+      case '\'': end = '\''; break;
+      default:
+         /* \p and \P take a single letter too */
+         return (*p == 'p' || *p == 'P') && isalpha((u_char)*q) ? 2 : 1;
+   }
+
+   if ((q = strchr(q + 1, end)) == NULL)
+      return 0;
+
+   return q - p + 1;
+}
+
+/*
+ * the id of a literal, added to the registry if it is new
+ */
+static int filter_literal_get(u_char *str, size_t len, u_int8 icase)
+{
+   size_t i, slot = filter_nliterals;
+
+   for (i = 0; i < filter_nliterals; i++) {
+      if (filter_literals[i].refs == 0) {
+         if (slot == filter_nliterals)
+            slot = i;
+         continue;
+      }
+      if (filter_literals[i].icase == icase && filter_literals[i].len == len &&
+          !memcmp(filter_literals[i].str, str, len)) {
+         filter_literals[i].refs++;
+         return i;
+      }
+   }
+
+   if (slot == filter_nliterals) {
+      SAFE_REALLOC(filter_literals, (filter_nliterals + 1) * sizeof(struct filter_literal));
+      filter_nliterals++;
+   }
+
+   SAFE_CALLOC(filter_literals[slot].str, len, sizeof(u_char));
+   memcpy(filter_literals[slot].str, str, len);
+   filter_literals[slot].len = len;
+   filter_literals[slot].icase = icase;
+   filter_literals[slot].refs = 1;
+
+   return slot;
+}
+
+static void filter_literal_put(int id)
+{
+   if (--filter_literals[id].refs == 0)
+      SAFE_FREE(filter_literals[id].str);
+}
+
+/*
+ * add the literals of a decoded filter to the automaton.
+ * the filter must not be visible to the packets yet.
+ */
+void filter_literals_add(struct filter_env *fenv)
+{
+   struct filter_insn *ins;
+   struct filter_op *fop;
+   u_char *lit;
+   size_t i, len, n = 0;
+
+   if (fenv->code == NULL)
+      return;
+
+   for (i = 0; i < fenv->len / sizeof(struct filter_op); i++) {
+      ins = &fenv->code[i];
+      fop = ins->fop;
+
+      if (fop->opcode != FOP_FUNC || fop->op.func.slen == 0)
+         continue;
+
+      switch (fop->op.func.op) {
+         case FFUNC_SEARCH:
+            if (fop->op.func.level != 5 && fop->op.func.level != 6)
+               break;
+            /* fall through */
+         case FFUNC_REPLACE:
+            ins->literal = filter_literal_get(fop->op.func.string, fop->op.func.slen, 0);
+            n++;
+            break;
+
+         case FFUNC_REGEX:
+#ifdef HAVE_PCRE
+         case FFUNC_PCRE:
+#endif
+            if (fop->op.func.level != 5 && fop->op.func.level != 6)
+               break;
+            /* regcomp() is called with REG_ICASE */
+            if ((len = filter_regex_literal((const char *)fop->op.func.string, fop->op.func.op == FFUNC_REGEX, &lit)) > 0) {
+               ins->literal = filter_literal_get(lit, len, fop->op.func.op == FFUNC_REGEX);
+               SAFE_FREE(lit);
+               n++;
+            }
+            break;
+      }
+   }
+
+   if (n > 0)
+      filter_ac_rebuild();
+
+   fenv->ac_gen = filter_ac_gen;
+}
+
+/*
+ * remove the literals of a filter no packet can be using anymore
+ */
+void filter_literals_del(struct filter_env *fenv)
+{
+   size_t i, n = 0;
+
+   if (fenv->code == NULL)
+      return;
+
+   for (i = 0; i < fenv->len / sizeof(struct filter_op); i++) {
+      if (fenv->code[i].literal >= 0) {
+         filter_literal_put(fenv->code[i].literal);
+         n++;
+      }
+   }
+
+   if (n > 0)
+      filter_ac_rebuild();
+}
+
+/*
+ * whether the literals of the filter are in the current automaton
+ * (the instructions look at its scans instead of searching them)
+ */
+int filter_literals_ready(struct filter_env *fenv)
+{
+   struct filter_ac *ac = __atomic_load_n(&filter_ac, __ATOMIC_ACQUIRE);
+
+   return ac != NULL && ac->gen >= fenv->ac_gen;
+}
+
+/*
+ * the references to the literals of the registry,
+ * 0 when no loaded filter is using them
+ */
+u_int32 filter_literals_refs(void)
+{
+   u_int32 refs = 0;
+   size_t i;
+
+   FILTERS_LOCK;
+
+   for (i = 0; i < filter_nliterals; i++)
+      refs += filter_literals[i].refs;
+
+   FILTERS_UNLOCK;
+
+   return refs;
+}
+
+/*
+ * build the automaton of all the literals in the registry.
+ * returns NULL if there are none, or too many
+ */
+static struct filter_ac * filter_ac_build(void)
+{
+   struct filter_ac *ac;
+   u_int16 *fail, *queue;
+   u_int32 s, u, v;
+   size_t i, j, nodes = 1, head = 0, tail = 0;
+
+   for (i = 0; i < filter_nliterals; i++)
+      if (filter_literals[i].refs > 0)
+         nodes += filter_literals[i].len;
+
+   if (nodes == 1 || nodes > FILTER_AC_NODES_MAX) {
+      DEBUG_MSG("filter_ac_build: %lu nodes, no automaton", (unsigned long)nodes);
+      return NULL;
+   }
+
+   SAFE_CALLOC(ac, 1, sizeof(struct filter_ac));
+   SAFE_CALLOC(ac->lits, filter_nliterals, sizeof(struct filter_literal));
+   SAFE_CALLOC(ac->same, filter_nliterals, sizeof(int));
+   SAFE_CALLOC(ac->delta, nodes * 256, sizeof(u_int16));
+   SAFE_CALLOC(ac->out, nodes, sizeof(int));
+   SAFE_CALLOC(ac->dict, nodes, sizeof(u_int16));
+   SAFE_CALLOC(ac->report, nodes, sizeof(u_int16));
+   SAFE_CALLOC(fail, nodes, sizeof(u_int16));
+   SAFE_CALLOC(queue, nodes, sizeof(u_int16));
+
+   ac->gen = filter_ac_gen;
+   ac->nlits = filter_nliterals;
+
+   for (i = 0; i < nodes; i++)
+      ac->out[i] = -1;
+
+   /* the trie of the folded literals, 0 is the root */
+   ac->nodes = 1;
+   for (i = 0; i < filter_nliterals; i++) {
+      if (filter_literals[i].refs == 0)
+         continue;
+
+      /* the packets may use it after the literal is removed from the registry */
+      SAFE_CALLOC(ac->lits[i].str, filter_literals[i].len, sizeof(u_char));
+      memcpy(ac->lits[i].str, filter_literals[i].str, filter_literals[i].len);
+      ac->lits[i].len = filter_literals[i].len;
+      ac->lits[i].icase = filter_literals[i].icase;
+
+      for (s = 0, j = 0; j < filter_literals[i].len; j++) {
+         v = AC_FOLD(filter_literals[i].str[j]);
+         if (ac->delta[s * 256 + v] == 0)
+            ac->delta[s * 256 + v] = ac->nodes++;
+         s = ac->delta[s * 256 + v];
+      }
+
+      ac->same[i] = ac->out[s];
+      ac->out[s] = i;
+   }
+
+   /* the failure links, in breadth first order */
+   for (v = 0; v < 256; v++)
+      if ((s = ac->delta[v]) != 0)
+         queue[tail++] = s;
+
+   while (head < tail) {
+      u = queue[head++];
+
+      ac->dict[u] = (ac->out[fail[u]] >= 0) ? fail[u] : ac->dict[fail[u]];
+      ac->report[u] = (ac->out[u] >= 0) ? u : ac->dict[u];
+
+      for (v = 0; v < 256; v++) {
+         s = ac->delta[u * 256 + v];
+         if (s != 0) {
+            /* a node of the trie */
+            fail[s] = ac->delta[fail[u] * 256 + v];
+            queue[tail++] = s;
+         } else {
+            /* the transitions of the failure node (already complete) */
+            ac->delta[u * 256 + v] = ac->delta[fail[u] * 256 + v];
+         }
+      }
+   }
+
+   SAFE_FREE(fail);
+   SAFE_FREE(queue);
+
+   return ac;
+}
+
+static void filter_ac_free(struct filter_ac *ac)
+{
+   size_t i;
+
+   for (i = 0; i < ac->nlits; i++)
+      SAFE_FREE(ac->lits[i].str);
+
+   SAFE_FREE(ac->lits);
+   SAFE_FREE(ac->same);
+   SAFE_FREE(ac->delta);
+   SAFE_FREE(ac->out);
+   SAFE_FREE(ac->dict);
+   SAFE_FREE(ac->report);
+   SAFE_FREE(ac);
+}
+
+/*
+ * replace the automaton after a change of the registry.
+ * called with the filters_mutex held
+ */
+static void filter_ac_rebuild(void)
+{
+   struct filter_ac *old = filter_ac;
+
+   filter_ac_gen++;
+
+   __atomic_store_n(&filter_ac, filter_ac_build(), __ATOMIC_RELEASE);
+
+   if (old != NULL) {
+      /* some packet may still be using it */
+      rcu_synchronize(RCU_FILTERS);
+      filter_ac_free(old);
+   }
+}
+
+/*
+ * mark in hit the literals found in the data
+ */
+static void filter_ac_scan(struct filter_ac *ac, const u_char *data, size_t len, u_int8 *hit)
+{
+   struct filter_literal *lit;
+   u_int32 s = 0, n;
+   size_t i;
+   int id;
+
+   memset(hit, 0, ac->nlits);
+
+   if (data == NULL)
+      return;
+
+   for (i = 0; i < len; i++) {
+      s = ac->delta[s * 256 + AC_FOLD(data[i])];
+
+      for (n = ac->report[s]; n != 0; n = ac->dict[n]) {
+         for (id = ac->out[n]; id >= 0; id = ac->same[id]) {
+            lit = &ac->lits[id];
+            if (!hit[id] && (lit->icase || !memcmp(data + i + 1 - lit->len, lit->str, lit->len)))
+               hit[id] = 1;
+         }
+      }
+   }
+}
+
+/*
+ * whether the literal of the instruction is in the payload.
+ * returns -1 if it has to be searched as before
+ */
+static int filter_literal_hit(struct filter_insn *ins, struct packet_object *po)
+{
+   struct filter_scan *sc = &filter_scan;
+   int l;
+
+   if (ins->literal < 0 || !sc->usable)
+      return -1;
+
+   /* replace() always works on DATA.data */
+   l = (ins->fop->op.func.level == 6 && ins->fop->op.func.op != FFUNC_REPLACE) ? 1 : 0;
+
+   if (!sc->done[l]) {
+      if (sc->size < sc->ac->nlits) {
+         sc->size = sc->ac->nlits;
+         SAFE_REALLOC(sc->hit[0], 2 * sc->size);
+         sc->hit[1] = sc->hit[0] + sc->size;
+      }
+
+      if (l == 0)
+         filter_ac_scan(sc->ac, po->DATA.data, po->DATA.len, sc->hit[0]);
+      else
+         filter_ac_scan(sc->ac, po->DATA.disp_data, po->DATA.disp_len, sc->hit[1]);
+
+      sc->done[l] = 1;
+   }
+
+   return sc->hit[l][ins->literal];
+}
+
+/*
+ * the comparisons of the tests, one for each size and operation
+ */
+#define INSN_TEST(name, type, conv, op) \
+static int name(struct filter_insn *ins, struct packet_object *po) \
+{ \
+   u_char *base = *(u_char **)((u_char *)po + ins->base); \
+   return conv(*(type *)(base + ins->offset)) op ins->value; \
+}
+
+#define INSN_TESTS(size, type, conv) \
+   INSN_TEST(test_##size##_eq, type, conv, ==) \
+   INSN_TEST(test_##size##_neq, type, conv, !=) \
+   INSN_TEST(test_##size##_lt, type, conv, <) \
+   INSN_TEST(test_##size##_gt, type, conv, >) \
+   INSN_TEST(test_##size##_leq, type, conv, <=) \
+   INSN_TEST(test_##size##_geq, type, conv, >=)
+
+INSN_TESTS(8, u_int8, )
+INSN_TESTS(16, u_int16, ntohs)
+INSN_TESTS(32, u_int32, ntohl)
+
+/* indexed by size and FTEST_* */
+static int (*insn_tests[3][6])(struct filter_insn *, struct packet_object *) = {
+   { test_8_eq, test_8_neq, test_8_lt, test_8_gt, test_8_leq, test_8_geq },
+   { test_16_eq, test_16_neq, test_16_lt, test_16_gt, test_16_leq, test_16_geq },
+   { test_32_eq, test_32_neq, test_32_lt, test_32_gt, test_32_leq, test_32_geq },
+};
+
+static int (*insn_cmps[6])(u_int32, u_int32) = {
+   cmp_eq, cmp_neq, cmp_lt, cmp_gt, cmp_leq, cmp_geq,
+};
+
+static int test_string(struct filter_insn *ins, struct packet_object *po)
+{
+   u_char *base = *(u_char **)((u_char *)po + ins->base);
+   return ins->cmp(memcmp(base + ins->offset, ins->fop->op.test.string, ins->fop->op.test.slen), 0);
+}
+
+static int test_ipaddr(struct filter_insn *ins, struct packet_object *po)
+{
+   u_char *base = *(u_char **)((u_char *)po + ins->base);
+   return ins->cmp(memcmp(base + ins->offset, ins->fop->op.test.ipaddr, 16), 0);
+}
+
+/*
+ * the handlers of the instructions
+ */
+static struct filter_insn * insn_test(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   *flags = ins->test(ins, po) ? FLAG_TRUE : FLAG_FALSE;
+   return ins + 1;
+}
+
+static struct filter_insn * insn_test_jtrue(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   *flags = ins->test(ins, po) ? FLAG_TRUE : FLAG_FALSE;
+   return (*flags & FLAG_TRUE) ? ins[1].jmp : ins + 2;
+}
+
+static struct filter_insn * insn_test_jfalse(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   *flags = ins->test(ins, po) ? FLAG_TRUE : FLAG_FALSE;
+   return (*flags & FLAG_TRUE) ? ins + 2 : ins[1].jmp;
+}
+
+static struct filter_insn * insn_assign(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   execute_assign(ins->fop, po);
+   *flags = FLAG_TRUE;
+   /* the payload has to be scanned again */
+   filter_scan.done[0] = filter_scan.done[1] = 0;
+   return ins + 1;
+}
+
+static struct filter_insn * insn_incdec(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   execute_incdec(ins->fop, po);
+   *flags = FLAG_TRUE;
+   filter_scan.done[0] = filter_scan.done[1] = 0;
+   return ins + 1;
+}
+
+static struct filter_insn * insn_func(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   *flags = (execute_func(ins->fop, po) == FLAG_TRUE) ? FLAG_TRUE : FLAG_FALSE;
+
+   /* the functions that may have modified the payload */
+   switch (ins->fop->op.func.op) {
+      case FFUNC_PCRE:
+         if (ins->fop->op.func.rlen == 0)
+            break;
+         /* fall through */
+      case FFUNC_REPLACE:
+      case FFUNC_INJECT:
+      case FFUNC_EXECINJECT:
+         filter_scan.done[0] = filter_scan.done[1] = 0;
+         break;
+   }
+
+   return ins + 1;
+}
+
+static struct filter_insn * insn_search(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   int hit = filter_literal_hit(ins, po);
+
+   if (hit < 0)
+      return insn_func(ins, po, flags);
+
+   *flags = hit ? FLAG_TRUE : FLAG_FALSE;
+   return ins + 1;
+}
+
+static struct filter_insn * insn_replace(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   /* nothing to replace (in unoffensive mode it complains anyway) */
+   if (filter_literal_hit(ins, po) == 0 && !EC_GBL_OPTIONS->unoffensive) {
+      *flags = FLAG_FALSE;
+      return ins + 1;
+   }
+
+   return insn_func(ins, po, flags);
+}
+
+static struct filter_insn * insn_regex(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   /* it can't match without its literal */
+   if (filter_literal_hit(ins, po) == 0) {
+      *flags = FLAG_FALSE;
+      return ins + 1;
+   }
+
+   return insn_func(ins, po, flags);
+}
+
+static struct filter_insn * insn_jmp(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   (void) po;
+   (void) flags;
+
+   return ins->jmp;
+}
+
+static struct filter_insn * insn_jtrue(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   (void) po;
+
+   return (*flags & FLAG_TRUE) ? ins->jmp : ins + 1;
+}
+
+static struct filter_insn * insn_jfalse(struct filter_insn *ins, struct packet_object *po, u_int32 *flags)
+{
+   (void) po;
+
+   return (*flags & FLAG_TRUE) ? ins + 1 : ins->jmp;
+}
+
+/*
+ * decode the chain of a filter in fenv->code.
+ * the exit has a NULL handler, one more is appended in case
+ * the chain doesn't end with it.
+ */
+int filter_decode(struct filter_env *fenv)
+{
+   struct filter_op *fop = fenv->chain;
+   struct filter_insn *code, *ins;
+   size_t i, n = fenv->len / sizeof(struct filter_op);
+
+   SAFE_CALLOC(code, n + 1, sizeof(struct filter_insn));
+
+   for (i = 0; i < n; i++) {
+      ins = &code[i];
+      ins->fop = &fop[i];
+      /* the literals are added when the filter is linked */
+      ins->literal = -1;
+
+      switch (fop[i].opcode) {
+         case FOP_EXIT:
+            break;
+
+         case FOP_TEST:
+            switch (fop[i].op.test.level) {
+               case 2: ins->base = offsetof(struct packet_object, L2.header); break;
+               case 3: ins->base = offsetof(struct packet_object, L3.header); break;
+               case 4: ins->base = offsetof(struct packet_object, L4.header); break;
+               case 5: ins->base = offsetof(struct packet_object, DATA.data); break;
+               case 6: ins->base = offsetof(struct packet_object, DATA.disp_data); break;
+               default: goto fallback;
+            }
+
+            if (fop[i].op.test.op > FTEST_GEQ)
+               goto fallback;
+
+            ins->offset = fop[i].op.test.offset;
+            ins->cmp = insn_cmps[fop[i].op.test.op];
+
+            switch (fop[i].op.test.size) {
+               case 0:
+                  ins->test = test_string;
+                  break;
+               case 1:
+                  ins->test = insn_tests[0][fop[i].op.test.op];
+                  ins->value = fop[i].op.test.value & 0xff;
+                  break;
+               case 2:
+                  ins->test = insn_tests[1][fop[i].op.test.op];
+                  ins->value = fop[i].op.test.value & 0xffff;
+                  break;
+               case 4:
+                  ins->test = insn_tests[2][fop[i].op.test.op];
+                  ins->value = fop[i].op.test.value;
+                  break;
+               case 16:
+                  ins->test = test_ipaddr;
+                  break;
+               default:
+                  goto fallback;
+            }
+
+            /* the jump is kept too, other jumps may land on it */
+            if (i + 1 < n && fop[i + 1].opcode == FOP_JTRUE)
+               ins->exec = insn_test_jtrue;
+            else if (i + 1 < n && fop[i + 1].opcode == FOP_JFALSE)
+               ins->exec = insn_test_jfalse;
+            else
+               ins->exec = insn_test;
+            break;
+
+         case FOP_ASSIGN:
+            ins->exec = insn_assign;
+            break;
+
+         case FOP_INC:
+         case FOP_DEC:
+            ins->exec = insn_incdec;
+            break;
+
+         case FOP_FUNC:
+            switch (fop[i].op.func.op) {
+               case FFUNC_SEARCH:
+                  ins->exec = insn_search;
+                  break;
+               case FFUNC_REPLACE:
+                  ins->exec = insn_replace;
+                  break;
+               case FFUNC_REGEX:
+               case FFUNC_PCRE:
+                  ins->exec = insn_regex;
+                  break;
+               default:
+                  ins->exec = insn_func;
+                  break;
+            }
+            break;
+
+         case FOP_JMP:
+         case FOP_JTRUE:
+         case FOP_JFALSE:
+            if (fop[i].op.jmp >= n)
+               goto fallback;
+            ins->jmp = &code[fop[i].op.jmp];
+            ins->exec = (fop[i].opcode == FOP_JMP) ? insn_jmp :
+                        (fop[i].opcode == FOP_JTRUE) ? insn_jtrue : insn_jfalse;
+            break;
+
+         default:
+            goto fallback;
+      }
+   }
+
+   fenv->code = code;
+
+   return E_SUCCESS;
+
+fallback:
+   DEBUG_MSG("filter_decode: cannot decode instruction %lu, the filter will be interpreted", (unsigned long)i);
+   SAFE_FREE(code);
+   return -E_INVALID;
+}
+
+/*
+ * execute a decoded chain on the packet
+ */
+void filter_run(struct filter_insn *ins, struct packet_object *po)
+{
+   u_int32 flags = FLAG_FALSE;
+
+   while (ins->exec != NULL)
+      ins = ins->exec(ins, po, &flags);
+}
+
 /*
  * pass a packet through every (enabled) filter loaded
  */
 void filter_packet(struct packet_object *po) {
-   struct filter_list **l;
-   for (l = EC_GBL_FILTERS; *l != NULL; l = &(*l)->next) {
+   struct filter_list *l;
+   /* a filter may inject a packet, filtered by a nested call */
+   struct filter_ac *ac = filter_scan.ac;
+   int usable = filter_scan.usable;
+
+   rcu_read_begin(RCU_FILTERS);
+
+   filter_scan.ac = __atomic_load_n(&filter_ac, __ATOMIC_ACQUIRE);
+   filter_scan.done[0] = filter_scan.done[1] = 0;
+
+   for (l = __atomic_load_n(EC_GBL_FILTERS, __ATOMIC_ACQUIRE); l != NULL; 
+        l = __atomic_load_n(&l->next, __ATOMIC_ACQUIRE)) {
       /* if a script drops the packet, do not present it to following scripts */
       if ( po->flags & PO_DROPPED )
          break;
       /* check whether the filter script is enabled */
-      if ((*l)->enabled)
-         filter_engine((*l)->env.chain, po);
+      if (!__atomic_load_n(&l->enabled, __ATOMIC_RELAXED))
+         continue;
+      /* the interpreter is used for what the decoder doesn't know */
+      if (l->env.code != NULL) {
+         filter_scan.usable = (filter_scan.ac != NULL && filter_scan.ac->gen >= l->env.ac_gen);
+         filter_run(l->env.code, po);
+      } else {
+         filter_engine(l->env.chain, po);
+         filter_scan.done[0] = filter_scan.done[1] = 0;
+      }
    }
+
+   rcu_read_end(RCU_FILTERS);
+
+   /* the scans of the caller are out of date */
+   filter_scan.ac = ac;
+   filter_scan.usable = usable;
+   filter_scan.done[0] = filter_scan.done[1] = 0;
 }
 
 /* 
@@ -796,8 +1754,10 @@ static int func_inject(struct filter_op *fop, struct packet_object *po)
    
    close(fd);
 
-   if (ret != size)
+   if (ret != size) {
+      SAFE_FREE(file);
       FATAL_MSG("Cannot read the file into memory");
+   }
  
    /* check if we are overflowing pcap buffer */
    if(EC_GBL_PCAP->snaplen - (po->L4.header - (po->packet + po->L2.len) + po->L4.len) <= po->DATA.len + (unsigned)size)
@@ -1072,6 +2032,7 @@ int filter_load_file(const char *filename, struct filter_list **list, uint8_t en
    size_t size, ret;
    struct filter_env *fenv;
    struct filter_header fh;
+   struct filter_list *f;
 
    DEBUG_MSG("filter_load_file (%s)", filename);
 
@@ -1080,22 +2041,30 @@ int filter_load_file(const char *filename, struct filter_list **list, uint8_t en
       FATAL_MSG("File not found or permission denied");
 
    /* read the header */
-   if (read(fd, &fh, sizeof(struct filter_header)) != sizeof(struct filter_header))
+   if (read(fd, &fh, sizeof(struct filter_header)) != sizeof(struct filter_header)) {
+      close(fd);
       FATAL_MSG("The file is corrupted");
+   }
 
    /* sanity checks */
-   if (fh.magic != htons(EC_FILTER_MAGIC))
+   if (fh.magic != htons(EC_FILTER_MAGIC)) {
+      close(fd);
       FATAL_MSG("Bad magic in filter file\n"
             "Make sure to compile the filter with a current version of etterfilter");
+   }
 
    /* check pointer alignment */
-   if (fh.code % 8)
+   if (fh.code % 8) {
+      close(fd);
       FATAL_MSG("Bad instruction pointer alignment\n"
             "Make sure to compile the filter with a current version of etterfilter");
+   }
   
    /* which version has compiled the filter ? */
-   if (strcmp(fh.version, EC_VERSION))
+   if (strcmp(fh.version, EC_VERSION)) {
+      close(fd);
       FATAL_MSG("Filter compiled for a different version");
+   }
    
    /* get the size */
    size = lseek(fd, 0, SEEK_END);
@@ -1110,17 +2079,14 @@ int filter_load_file(const char *filename, struct filter_list **list, uint8_t en
    
    close(fd);
    
-   if (ret != size)
+   if (ret != size) {
+      SAFE_FREE(file);
       FATAL_MSG("Cannot read the file into memory");
-
-   FILTERS_LOCK;
-
-   /* advance to the end of the filter list */
-   while (*list) list = &(*list)->next;
+   }
 
    /* allocate memory for the list entry */
-   SAFE_CALLOC(*list, 1, sizeof(struct filter_list));
-   fenv = &(*list)->env;
+   SAFE_CALLOC(f, 1, sizeof(struct filter_list));
+   fenv = &f->env;
    
    /* set the global variables */
    fenv->map = file;
@@ -1133,17 +2099,36 @@ int filter_load_file(const char *filename, struct filter_list **list, uint8_t en
     */
    reconstruct_strings(fenv, &fh);
 
+   /* compile the regex to speed up the matching */
+   if (filter_compile_regex(fenv) != E_SUCCESS) {
+      /* the ones compiled before the failure */
+      filter_free_regex(fenv);
+      SAFE_FREE(fenv->map);
+      SAFE_FREE(f);
+      return -E_FATAL;
+   }
+
+   /* decode the instructions, or leave them to the interpreter */
+   filter_decode(fenv);
+
    /* save the name of the loaded filter */
-   (*list)->name = strdup(filename);
+   f->name = strdup(filename);
 
    /* enable the filter if requested */
-   (*list)->enabled = enabled;
+   f->enabled = enabled;
 
-   FILTERS_UNLOCK;
+   FILTERS_LOCK;
 
-   /* compile the regex to speed up the matching */
-   if (compile_regex(fenv) != E_SUCCESS)
-      return -E_FATAL;
+   /* the automaton must know its literals before the packets see it */
+   filter_literals_add(fenv);
+
+   /* advance to the end of the filter list */
+   while (*list) list = &(*list)->next;
+
+   /* it is complete, the packets can see it now */
+   __atomic_store_n(list, f, __ATOMIC_RELEASE);
+
+   FILTERS_UNLOCK;
    
    USER_MSG("Content filters loaded from %s...\n", filename);
    
@@ -1155,53 +2140,34 @@ int filter_load_file(const char *filename, struct filter_list **list, uint8_t en
  */
 void filter_unload(struct filter_list **list)
 {
-   if (*list == NULL) return;
+   struct filter_list *f;
 
    FILTERS_LOCK;
 
-   struct filter_env *fenv= &(*list)->env;
-   size_t i = 0;
-   struct filter_op *fop = fenv->chain;
-   
+   if ((f = *list) == NULL) {
+      FILTERS_UNLOCK;
+      return;
+   }
+
    DEBUG_MSG("filter_unload");
 
+   /* reclose the filter list */
+   __atomic_store_n(list, f->next, __ATOMIC_RELEASE);
+
+   /* some packet may still be passing through it */
+   rcu_synchronize(RCU_FILTERS);
+
    /* free the memory alloc'd for regex */
-   while (fop != NULL && i < (fenv->len / sizeof(struct filter_op)) ) {
-      /* search for func regex and pcre */
-      if(fop[i].opcode == FOP_FUNC) {
-         switch(fop[i].op.func.op) {
-            case FFUNC_REGEX:
-               regfree(fop[i].op.func.ropt->regex);
-               SAFE_FREE(fop[i].op.func.ropt);
-               break;
-               
-            case FFUNC_PCRE:
-               #ifdef HAVE_PCRE
-               pcre_free(fop[i].op.func.ropt->pregex);
-               pcre_free(fop[i].op.func.ropt->preg_extra);
-               SAFE_FREE(fop[i].op.func.ropt);
-               #endif               
-               break;
-         }
-      }
-      i++;
-   }
+   filter_free_regex(&f->env);
+
+   filter_literals_del(&f->env);
+   SAFE_FREE(f->env.code);
    
    /* free the memory region containing the file */
-   SAFE_FREE(fenv->map);
+   SAFE_FREE(f->env.map);
 
-   /* wipe the pointer */
-   fenv->map = NULL;
-   fenv->chain = NULL;
-   fenv->len = 0;
-
-   SAFE_FREE((*list)->name);
-
-   /* reclose the filter list */
-   struct filter_list **ptr = list;
-   struct filter_list *succ = (*list)->next;
-   *ptr = succ;
-   SAFE_FREE(*list);
+   SAFE_FREE(f->name);
+   SAFE_FREE(f);
 
    FILTERS_UNLOCK;
 }
@@ -1233,6 +2199,8 @@ static void reconstruct_strings(struct filter_env *fenv, struct filter_header *f
        */
       switch(fop[i].opcode) {
          case FOP_FUNC:
+            /* the pointer in the file is meaningless, filter_compile_regex() sets it */
+            fop[i].op.func.ropt = NULL;
             if (fop[i].op.func.slen)
                fop[i].op.func.string = (fenv->map + fh->data + (size_t)fop[i].op.func.string);
             if (fop[i].op.func.rlen)
@@ -1258,7 +2226,7 @@ static void reconstruct_strings(struct filter_env *fenv, struct filter_header *f
 /*
  * compile the regex of a filter_op
  */
-static int compile_regex(struct filter_env *fenv)
+int filter_compile_regex(struct filter_env *fenv)
 {
    size_t i = 0;
    struct filter_op *fop = fenv->chain;
@@ -1284,6 +2252,9 @@ static int compile_regex(struct filter_env *fenv)
                err = regcomp(fop[i].op.func.ropt->regex, (const char*)fop[i].op.func.string, REG_EXTENDED | REG_NOSUB | REG_ICASE );
                if (err) {
                   regerror(err, fop[i].op.func.ropt->regex, errbuf, sizeof(errbuf));
+                  /* filter_free_regex() skips the ones not compiled */
+                  SAFE_FREE(fop[i].op.func.ropt->regex);
+                  SAFE_FREE(fop[i].op.func.ropt);
                   FATAL_MSG("filter engine: %s", errbuf);
                } 
                break;
@@ -1296,13 +2267,18 @@ static int compile_regex(struct filter_env *fenv)
 
                /* prepare the regex (with default option) */
                fop[i].op.func.ropt->pregex = pcre_compile(fop[i].op.func.string, 0, &perrbuf, &err, NULL );
-               if (fop[i].op.func.ropt->pregex == NULL)
+               if (fop[i].op.func.ropt->pregex == NULL) {
+                  SAFE_FREE(fop[i].op.func.ropt);
                   FATAL_MSG("filter engine: %s\n", perrbuf);
+               }
   
                /* optimize the pcre */
                fop[i].op.func.ropt->preg_extra = pcre_study(fop[i].op.func.ropt->pregex, 0, &perrbuf);
-               if (perrbuf != NULL)
+               if (perrbuf != NULL) {
+                  pcre_free(fop[i].op.func.ropt->pregex);
+                  SAFE_FREE(fop[i].op.func.ropt);
                   FATAL_MSG("filter engine: %s\n", perrbuf);
+               }
                
                #endif               
                break;
@@ -1314,6 +2290,37 @@ static int compile_regex(struct filter_env *fenv)
    return E_SUCCESS;
 }
 
+/*
+ * free the regex compiled by filter_compile_regex()
+ */
+void filter_free_regex(struct filter_env *fenv)
+{
+   size_t i = 0;
+   struct filter_op *fop = fenv->chain;
+
+   while (fop != NULL && i < (fenv->len / sizeof(struct filter_op)) ) {
+      /* search for func regex and pcre (a failed load stops compiling them) */
+      if(fop[i].opcode == FOP_FUNC && fop[i].op.func.ropt != NULL) {
+         switch(fop[i].op.func.op) {
+            case FFUNC_REGEX:
+               regfree(fop[i].op.func.ropt->regex);
+               SAFE_FREE(fop[i].op.func.ropt->regex);
+               SAFE_FREE(fop[i].op.func.ropt);
+               break;
+               
+            case FFUNC_PCRE:
+               #ifdef HAVE_PCRE
+               pcre_free(fop[i].op.func.ropt->pregex);
+               pcre_free(fop[i].op.func.ropt->preg_extra);
+               SAFE_FREE(fop[i].op.func.ropt);
+               #endif               
+               break;
+         }
+      }
+      i++;
+   }
+}
+
 /*
  * Walk the list of loaded filters and call the callback function
  * for every single list item along with the argument passed.
@@ -0,0 +1,201 @@
+/*
+    ettercap -- per flow cache of the packet processing decisions
+
+    Copyright (C) ALoR & NaGA
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <ec.h>
+#include <ec_inet.h>
+#include <ec_flow_cache.h>
+
+#include <pthread.h>
+
+/*
+ * a direct mapped table for each thread: a flow colliding with
+ * another one simply takes its slot.
+ */
+#define FLOW_CACHE_SIZE    1024     /* must be a power of 2 */
+
+static __thread struct flow_cache *flow_table;
+
+/* the key is used only for its destructor, to free the table of an exiting thread */
+static pthread_key_t flow_table_key;
+static pthread_once_t flow_table_once = PTHREAD_ONCE_INIT;
+
+/*
+ * incremented every time the cached decisions may have become wrong.
+ * it never wraps to 0, which marks the empty entries.
+ */
+static u_int32 flow_cache_gen = 1;
+
+/* protos */
+
+static void flow_table_key_init(void);
+static void flow_table_alloc(void);
+static inline u_int32 flow_hash(struct packet_object *po);
+static inline int flow_match(struct flow_cache *fc, struct packet_object *po);
+
+/************************************************/
+
+static void flow_table_key_init(void)
+{
+   pthread_key_create(&flow_table_key, &free);
+}
+
+static void flow_table_alloc(void)
+{
+   pthread_once(&flow_table_once, &flow_table_key_init);
+
+   SAFE_CALLOC(flow_table, FLOW_CACHE_SIZE, sizeof(struct flow_cache));
+   pthread_setspecific(flow_table_key, flow_table);
+}
+
+static inline u_int32 flow_hash(struct packet_object *po)
+{
+   u_int32 h, w;
+   size_t i, len;
+
+   h = ((u_int32)po->L4.src << 16 | po->L4.dst) ^ po->L4.proto;
+
+   len = MIN(ntohs(po->L3.src.addr_len), MAX_IP_ADDR_LEN);
+   for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+      memcpy(&w, po->L3.src.addr + i, sizeof(w));
+      h = (h ^ w) * 0x9e3779b1;
+   }
+
+   len = MIN(ntohs(po->L3.dst.addr_len), MAX_IP_ADDR_LEN);
+   for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+      memcpy(&w, po->L3.dst.addr + i, sizeof(w));
+      h = (h ^ w) * 0x9e3779b1;
+   }
+
+   h ^= po->L2.src[MEDIA_ADDR_LEN - 1] | po->L2.dst[MEDIA_ADDR_LEN - 1] << 8;
+
+   return h ^ (h >> 16);
+}
+
+static inline int flow_match(struct flow_cache *fc, struct packet_object *po)
+{
+   return fc->L4_src == po->L4.src && fc->L4_dst == po->L4.dst &&
+          fc->L4_proto == po->L4.proto &&
+          !ip_addr_cmp(&fc->L3_src, &po->L3.src) &&
+          !ip_addr_cmp(&fc->L3_dst, &po->L3.dst) &&
+          !memcmp(fc->L2_src, po->L2.src, MEDIA_ADDR_LEN) &&
+          !memcmp(fc->L2_dst, po->L2.dst, MEDIA_ADDR_LEN);
+}
+
+/*
+ * the entry of the flow the packet belongs to.
+ * if it is not in the cache (or it is stale) a new empty
+ * one is returned, for the caller to fill it.
+ */
+struct flow_cache * flow_cache_get(struct packet_object *po)
+{
+   struct flow_cache *fc;
+   u_int32 gen = __atomic_load_n(&flow_cache_gen, __ATOMIC_ACQUIRE);
+
+   if (flow_table == NULL)
+      flow_table_alloc();
+
+   fc = &flow_table[flow_hash(po) & (FLOW_CACHE_SIZE - 1)];
+
+   if (fc->gen == gen && flow_match(fc, po))
+      return fc;
+
+   memset(fc, 0, sizeof(struct flow_cache));
+   memcpy(fc->L2_src, po->L2.src, MEDIA_ADDR_LEN);
+   memcpy(fc->L2_dst, po->L2.dst, MEDIA_ADDR_LEN);
+   memcpy(&fc->L3_src, &po->L3.src, sizeof(struct ip_addr));
+   memcpy(&fc->L3_dst, &po->L3.dst, sizeof(struct ip_addr));
+   fc->L4_src = po->L4.src;
+   fc->L4_dst = po->L4.dst;
+   fc->L4_proto = po->L4.proto;
+   fc->gen = gen;
+
+   return fc;
+}
+
+u_int32 flow_cache_generation(void)
+{
+   return __atomic_load_n(&flow_cache_gen, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * discard the content of all the caches.
+ * it must be called after the change (TARGETS, options or decoders),
+ * so a decision taken in the meantime is discarded too.
+ */
+void flow_cache_invalidate(void)
+{
+   /* skip the 0 */
+   if (__atomic_add_fetch(&flow_cache_gen, 1, __ATOMIC_ACQ_REL) == 0)
+      __atomic_add_fetch(&flow_cache_gen, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * copy the dissectors of the flow in 'dissectors' and set po->DETECT.
+ * returns their number, or -E_NOTFOUND if they are not known yet
+ */
+int flow_cache_dissectors(struct packet_object *po, void **dissectors)
+{
+   struct flow_cache *fc = flow_cache_get(po);
+
+   if (!(fc->flags & FLOW_RESOLVED))
+      return -E_NOTFOUND;
+
+   /* a dissector may use the cache, don't run them from the entry */
+   memcpy(dissectors, fc->dissectors, fc->ndissectors * sizeof(void *));
+
+   po->DETECT.proto = fc->detect_proto;
+   po->DETECT.decoder = fc->detect_decoder;
+   po->DETECT.port = fc->detect_port;
+
+   return fc->ndissectors;
+}
+
+/*
+ * remember the dissectors run on the packet, once they are settled
+ * for the whole flow. 'gen' is the generation when their lookup
+ * started: if it has changed since, they may be out of date.
+ */
+void flow_cache_resolve(struct packet_object *po, u_int32 gen, void **dissectors, u_int n)
+{
+   struct flow_cache *fc;
+
+   if (n > FLOW_DISSECTORS_MAX)
+      return;
+
+   fc = flow_cache_get(po);
+
+   if (fc->gen != gen)
+      return;
+
+   memcpy(fc->dissectors, dissectors, n * sizeof(void *));
+   fc->ndissectors = n;
+
+   fc->detect_proto = po->DETECT.proto;
+   fc->detect_decoder = po->DETECT.decoder;
+   fc->detect_port = po->DETECT.port;
+
+   fc->flags |= FLOW_RESOLVED;
+}
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
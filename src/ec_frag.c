@@ -0,0 +1,411 @@
+/*
+    ettercap -- IP fragments reassembly
+
+    Copyright (C) ALoR & NaGA
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <ec.h>
+#include <ec_frag.h>
+#include <ec_hash.h>
+#include <ec_stats.h>
+
+#include <pthread.h>
+
+/*
+ * the fragments are kept as they arrive, the datagram is
+ * built only when all its bytes have been received.
+ * the pending datagrams are in a hash table and in a list
+ * ordered by their first fragment: the head of the list
+ * is the first to expire and the first to be evicted when
+ * the memory reserved to the reassembly is exhausted.
+ */
+
+#define FRAG_HASH_BITS  10
+#define FRAG_HASH_SIZE  (1 << FRAG_HASH_BITS)
+#define FRAG_HASH_MASK  (FRAG_HASH_SIZE - 1)
+
+/* no legitimate datagram needs more than this */
+#define FRAG_MAX_FRAGS  64
+
+struct frag {
+   u_int32 off;
+   u_int32 len;
+   struct frag *next;
+   u_char data[];
+};
+
+struct frag_dgram {
+   struct frag_key key;
+   struct timeval ts;         /* arrival of the first fragment */
+   u_int32 total;             /* payload length, known at the last fragment */
+   u_int nfrags;
+   size_t mem;
+   /* 
+    * link layer and network header of the fragment at offset 0.
+    * the later fragments may have shorter headers (RFC 791 
+    * options not copied), the datagram is built on this one
+    */
+   u_char *hdr;
+   size_t hdr_len;
+   size_t l3_off;
+   size_t max;                /* the biggest payload its header can describe */
+   /* in arrival order */
+   struct frag *frags;
+   struct frag **frags_tail;
+   LIST_ENTRY(frag_dgram) next;
+   TAILQ_ENTRY(frag_dgram) age;
+};
+
+static LIST_HEAD(, frag_dgram) frag_table[FRAG_HASH_SIZE];
+static TAILQ_HEAD(, frag_dgram) frag_age = TAILQ_HEAD_INITIALIZER(frag_age);
+
+/* fanout capture threads may receive fragments concurrently */
+static pthread_mutex_t frag_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define FRAG_LOCK     do{ pthread_mutex_lock(&frag_mutex); }while(0)
+#define FRAG_UNLOCK   do{ pthread_mutex_unlock(&frag_mutex); }while(0)
+
+/* protos */
+
+static u_int32 frag_hash(struct frag_key *key);
+static struct frag_dgram * frag_find(struct frag_key *key, u_int32 h);
+static void frag_free(struct frag_dgram *d);
+static void frag_expire(struct timeval *ts);
+static void frag_evict(size_t len);
+static int frag_overlaps(struct frag_dgram *d, u_int32 off, size_t len);
+static int frag_complete(struct frag_dgram *d);
+static void frag_build(struct frag_dgram *d, u_char **dgram, size_t *dgram_len);
+static int frag_discard(struct frag_dgram *d);
+static int frag_add(struct frag_key *key, struct timeval *ts,
+                    u_int32 offset, u_char *data, size_t len, int more, size_t max,
+                    struct frag_hdr *hdr, u_char **dgram, size_t *dgram_len);
+
+/************************************************/
+
+static u_int32 frag_hash(struct frag_key *key)
+{
+   return fnv_32((u_char *)key, sizeof(struct frag_key)) & FRAG_HASH_MASK;
+}
+
+static struct frag_dgram * frag_find(struct frag_key *key, u_int32 h)
+{
+   struct frag_dgram *d;
+
+   LIST_FOREACH(d, &frag_table[h], next)
+      if (!memcmp(&d->key, key, sizeof(struct frag_key)))
+         return d;
+
+   return NULL;
+}
+
+/*
+ * unlink a datagram and release its memory
+ */
+static void frag_free(struct frag_dgram *d)
+{
+   struct frag *f, *tmp;
+
+   LIST_REMOVE(d, next);
+   TAILQ_REMOVE(&frag_age, d, age);
+
+   for (f = d->frags; f != NULL; f = tmp) {
+      tmp = f->next;
+      SAFE_FREE(f);
+   }
+
+   EC_GBL_STATS->frag_mem -= d->mem;
+   EC_GBL_STATS->frag_pending--;
+
+   SAFE_FREE(d->hdr);
+   SAFE_FREE(d);
+}
+
+/*
+ * the time is the one of the packets, so the
+ * timeout works even when reading from a file
+ */
+static void frag_expire(struct timeval *ts)
+{
+   struct frag_dgram *d;
+   struct timeval diff;
+
+   while ((d = TAILQ_FIRST(&frag_age)) != NULL) {
+      time_sub(ts, &d->ts, &diff);
+      if (diff.tv_sec < EC_GBL_CONF->frag_timeout)
+         break;
+
+      EC_GBL_STATS->frag_expired++;
+      frag_free(d);
+   }
+}
+
+/*
+ * make room for len bytes, throwing away the oldest datagrams
+ */
+static void frag_evict(size_t len)
+{
+   struct frag_dgram *d;
+
+   while (EC_GBL_STATS->frag_mem + len > (size_t)EC_GBL_CONF->frag_memory &&
+          (d = TAILQ_FIRST(&frag_age)) != NULL) {
+      EC_GBL_STATS->frag_evicted++;
+      frag_free(d);
+   }
+}
+
+/*
+ * returns 1 if the range overlaps a fragment already received,
+ * 2 if it is the exact copy of one of them (retransmission)
+ */
+static int frag_overlaps(struct frag_dgram *d, u_int32 off, size_t len)
+{
+   struct frag *f;
+   int ret = 0;
+
+   for (f = d->frags; f != NULL; f = f->next) {
+      if (off < f->off + f->len && f->off < off + len) {
+         if (f->off == off && f->len == len && ret == 0)
+            ret = 2;
+         else
+            return 1;
+      }
+   }
+
+   return ret;
+}
+
+/*
+ * all the bytes from 0 to total have been received ?
+ */
+static int frag_complete(struct frag_dgram *d)
+{
+   struct frag *f, *sorted[FRAG_MAX_FRAGS];
+   u_int32 covered = 0;
+   u_int n = 0, i, j;
+
+   if (d->total == 0 || d->hdr == NULL)
+      return 0;
+
+   /* insertion sort by offset, there are only a few of them */
+   for (f = d->frags; f != NULL; f = f->next) {
+      for (i = n; i > 0 && sorted[i - 1]->off > f->off; i--)
+         sorted[i] = sorted[i - 1];
+      sorted[i] = f;
+      n++;
+   }
+
+   for (j = 0; j < n; j++) {
+      if (sorted[j]->off > covered)
+         return 0;
+      if (sorted[j]->off + sorted[j]->len > covered)
+         covered = sorted[j]->off + sorted[j]->len;
+   }
+
+   return covered >= d->total;
+}
+
+/*
+ * copy the fragments in a new buffer, after the headers of the first one.
+ * the buffer is as big as a captured packet can be, so
+ * the filters are free to enlarge the payload
+ */
+static void frag_build(struct frag_dgram *d, u_char **dgram, size_t *dgram_len)
+{
+   struct frag *f, *order[FRAG_MAX_FRAGS];
+   u_int n = 0, i;
+   u_char *buf;
+
+   SAFE_CALLOC(buf, d->hdr_len + FRAG_MAX_LEN + 1, sizeof(u_char));
+   memcpy(buf, d->hdr, d->hdr_len);
+
+   for (f = d->frags; f != NULL; f = f->next)
+      order[n++] = f;
+
+   /* the later copies win, so reverse the order to keep the first data */
+   for (i = 0; i < n; i++) {
+      f = (EC_GBL_CONF->frag_policy == FRAG_POLICY_FIRST) ? order[n - 1 - i] : order[i];
+      memcpy(buf + d->hdr_len + f->off, f->data, f->len);
+   }
+
+   *dgram = buf;
+   *dgram_len = d->hdr_len + d->total;
+}
+
+/*
+ * the fragment and its datagram are thrown away
+ */
+static int frag_discard(struct frag_dgram *d)
+{
+   EC_GBL_STATS->frag_dropped++;
+
+   if (d != NULL)
+      frag_free(d);
+
+   return -E_INVALID;
+}
+
+/*
+ * add a fragment to its datagram.
+ *
+ * offset and len are relative to the fragmentable part of the datagram,
+ * "more" is false for the last fragment and max is the biggest payload
+ * the network header can describe (at most FRAG_MAX_LEN). hdr is what precedes the data
+ * in the packet (link layer and network headers) and it is kept from the
+ * fragment at offset 0 only.
+ *
+ * returns E_SUCCESS when the datagram is complete: dgram is a new buffer
+ * with the headers of the first fragment followed by the whole payload 
+ * (the caller has to fix the lengths in the headers and free it).
+ * hdr->len and hdr->l3_off are set to the ones of those headers, which
+ * may differ from the fragment completing the datagram.
+ * -E_NOTHANDLED if more fragments are needed, -E_INVALID if the fragment
+ * (or the whole datagram) was discarded.
+ */
+int frag_insert(struct frag_key *key, struct timeval *ts,
+                u_int32 offset, u_char *data, size_t len, int more, size_t max,
+                struct frag_hdr *hdr, u_char **dgram, size_t *dgram_len)
+{
+   int ret;
+
+   FRAG_LOCK;
+   ret = frag_add(key, ts, offset, data, len, more, max, hdr, dgram, dgram_len);
+   FRAG_UNLOCK;
+
+   return ret;
+}
+
+/*
+ * called with the lock held
+ */
+static int frag_add(struct frag_key *key, struct timeval *ts,
+                    u_int32 offset, u_char *data, size_t len, int more, size_t max,
+                    struct frag_hdr *hdr, u_char **dgram, size_t *dgram_len)
+{
+   struct frag_dgram *d;
+   struct frag *f;
+   u_int32 h;
+   size_t need;
+
+   frag_expire(ts);
+
+   /* only the last fragment can have a length which is not a multiple of 8 */
+   if (len == 0 || offset + len > max || (more && (len & 7)))
+      return frag_discard(NULL);
+
+   need = sizeof(struct frag) + len + (offset == 0 ? hdr->len : 0);
+
+   h = frag_hash(key);
+   d = frag_find(key, h);
+
+   if (d == NULL)
+      need += sizeof(struct frag_dgram);
+
+   if (need > (size_t)EC_GBL_CONF->frag_memory)
+      return frag_discard(NULL);
+
+   /* the eviction may throw away this datagram as well */
+   if (EC_GBL_STATS->frag_mem + need > (size_t)EC_GBL_CONF->frag_memory) {
+      frag_evict(need);
+      if (d != NULL && frag_find(key, h) == NULL) {
+         d = NULL;
+         need += sizeof(struct frag_dgram);
+         frag_evict(need);
+      }
+   }
+
+   if (d == NULL) {
+      SAFE_CALLOC(d, 1, sizeof(struct frag_dgram));
+      memcpy(&d->key, key, sizeof(struct frag_key));
+      memcpy(&d->ts, ts, sizeof(struct timeval));
+      d->frags_tail = &d->frags;
+      d->mem = sizeof(struct frag_dgram);
+      EC_GBL_STATS->frag_mem += d->mem;
+      EC_GBL_STATS->frag_pending++;
+      LIST_INSERT_HEAD(&frag_table[h], d, next);
+      TAILQ_INSERT_TAIL(&frag_age, d, age);
+   }
+
+   switch (frag_overlaps(d, offset, len)) {
+      case 2:
+         /* a retransmission, nothing new */
+         return -E_NOTHANDLED;
+      case 1:
+         EC_GBL_STATS->frag_overlap++;
+         if (EC_GBL_CONF->frag_policy == FRAG_POLICY_DROP)
+            return frag_discard(d);
+         break;
+   }
+
+   if (d->nfrags == FRAG_MAX_FRAGS)
+      return frag_discard(d);
+
+   /* the last fragment fixes the length, nothing may go beyond it */
+   if (d->total != 0 && (offset + len > d->total || (!more && offset + len != d->total)))
+      return frag_discard(d);
+
+   if (!more) {
+      d->total = offset + len;
+      for (f = d->frags; f != NULL; f = f->next)
+         if (f->off + f->len > d->total)
+            return frag_discard(d);
+   }
+
+   if (offset == 0 && d->hdr == NULL) {
+      /* the data seen so far must fit this header */
+      for (f = d->frags; f != NULL; f = f->next)
+         if (f->off + f->len > max)
+            return frag_discard(d);
+
+      SAFE_CALLOC(d->hdr, hdr->len, sizeof(u_char));
+      memcpy(d->hdr, hdr->buf, hdr->len);
+      d->hdr_len = hdr->len;
+      d->l3_off = hdr->l3_off;
+      d->max = max;
+      d->mem += hdr->len;
+      EC_GBL_STATS->frag_mem += hdr->len;
+   }
+
+   /* the datagram is described by the header of the first fragment */
+   if (d->hdr != NULL && offset + len > d->max)
+      return frag_discard(d);
+
+   SAFE_CALLOC(f, 1, sizeof(struct frag) + len);
+   f->off = offset;
+   f->len = len;
+   memcpy(f->data, data, len);
+   *d->frags_tail = f;
+   d->frags_tail = &f->next;
+   d->nfrags++;
+   d->mem += sizeof(struct frag) + len;
+   EC_GBL_STATS->frag_mem += sizeof(struct frag) + len;
+
+   if (!frag_complete(d))
+      return -E_NOTHANDLED;
+
+   frag_build(d, dgram, dgram_len);
+   hdr->len = d->hdr_len;
+   hdr->l3_off = d->l3_off;
+   EC_GBL_STATS->frag_reassembled++;
+   frag_free(d);
+
+   return E_SUCCESS;
+}
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
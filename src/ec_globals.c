@@ -74,8 +74,10 @@ void ec_globals_free(void)
    EC_GBL_FREE(ec_gbls->filters);
 
    free_ip_list(ec_gbls->t1);
+   free_ip_ranges(ec_gbls->t1);
    EC_GBL_FREE(ec_gbls->t1);
    free_ip_list(ec_gbls->t2);
+   free_ip_ranges(ec_gbls->t2);
    EC_GBL_FREE(ec_gbls->t2);
    
    EC_GBL_FREE(ec_gbls->env->name);
@@ -22,32 +22,62 @@
 #include <ec.h>
 #include <ec_hook.h>
 #include <ec_packet.h>
+#include <ec_metrics.h>
 #ifdef HAVE_EC_LUA
   #include <ec_lua.h>
 #endif
 
+#include <ec_rcu.h>
+
 #include <pthread.h>
 
-struct hook_list {
-   int point;
+/*
+ * every hook point has its own array of functions.
+ *
+ * hook_point() runs on the capture threads and on the dispatcher
+ * shards for every packet, so it takes no lock: the arrays are never
+ * modified, hook_add() and hook_del() publish a modified copy
+ * (read-copy-update) and free the old one when no thread can be
+ * reading it anymore.
+ */
+
+#define HOOK_POINTS  128
+
+/* fails to compile if a hook point is beyond the tables */
+typedef char hook_points_check[(HOOK_POINTS_MAX <= HOOK_POINTS) ? 1 : -1];
+
+struct hook_entry {
    void (*func)(struct packet_object *po);
-   LIST_ENTRY (hook_list) next;
+   int flags;
+   struct metrics_acct *acct;
+};
+
+struct hook_table {
+   size_t nr;
+   struct hook_entry entry[];
 };
 
 /* global data */
 
-/* the list for the HOOK_* */
-static LIST_HEAD(, hook_list) hook_list_head;
-/* the list for the PACKET_* */
-static LIST_HEAD(, hook_list) hook_pck_list_head;
+static struct hook_table *hook_tables[HOOK_POINTS];
 
-pthread_mutex_t hook_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* serializes the writers */
+static pthread_mutex_t hook_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define HOOK_LOCK     do{ pthread_mutex_lock(&hook_mutex); } while(0)
 #define HOOK_UNLOCK   do{ pthread_mutex_unlock(&hook_mutex); } while(0)
-   
-pthread_mutex_t hook_pck_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define HOOK_PCK_LOCK     do{ pthread_mutex_lock(&hook_pck_mutex); } while(0)
-#define HOOK_PCK_UNLOCK   do{ pthread_mutex_unlock(&hook_pck_mutex); } while(0)
+
+/* 
+ * with more than one dispatcher thread, the HOOK_DISPATCHER 
+ * functions not flagged as HOOK_FL_SHARD_SAFE are serialized
+ */
+static pthread_mutex_t hook_serial_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define HOOK_SERIAL_LOCK     do{ pthread_mutex_lock(&hook_serial_mutex); } while(0)
+#define HOOK_SERIAL_UNLOCK   do{ pthread_mutex_unlock(&hook_serial_mutex); } while(0)
+
+/* protos */
+
+static void hook_call(struct hook_entry *h, struct packet_object *po);
+static void hook_dispatch(struct hook_entry *h, struct packet_object *po, int acct);
 
 /*******************************************/
 
@@ -55,28 +85,29 @@ pthread_mutex_t hook_pck_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void hook_point(int point, struct packet_object *po)
 {
-   struct hook_list *current;
+   struct hook_table *t;
+   size_t i;
+   int acct;
 
-   /* the hook is for a HOOK_PACKET_* type */
-   if (point > HOOK_PACKET_BASE) {
-      
-      HOOK_PCK_LOCK;
-   
-      LIST_FOREACH(current, &hook_pck_list_head, next) 
-         if (current->point == point)
-            current->func(po);
-   
-      HOOK_PCK_UNLOCK;
-   
-   } else {
-   
-      HOOK_LOCK;
-   
-      LIST_FOREACH(current, &hook_list_head, next) 
-         if (current->point == point)
-            current->func(po);
-   
-      HOOK_UNLOCK;
+   /* nothing is hooked here, the common case */
+   if ((u_int)point < HOOK_POINTS && __atomic_load_n(&hook_tables[point], __ATOMIC_RELAXED) != NULL) {
+
+      acct = EC_GBL_CONF->hook_accounting;
+
+      rcu_read_begin(RCU_HOOKS);
+
+      t = __atomic_load_n(&hook_tables[point], __ATOMIC_ACQUIRE);
+
+      for (i = 0; t != NULL && i < t->nr; i++) {
+         if (point == HOOK_DISPATCHER)
+            hook_dispatch(&t->entry[i], po, acct);
+         else if (acct)
+            hook_call(&t->entry[i], po);
+         else
+            t->entry[i].func(po);
+      }
+
+      rcu_read_end(RCU_HOOKS);
    }
 #ifdef HAVE_EC_LUA
    ec_lua_dispatch_hooked_packet(point, po);
@@ -86,69 +117,143 @@ void hook_point(int point, struct packet_object *po)
 }
 
 
+/*
+ * call a function accounting its cpu time
+ */
+
+static void hook_call(struct hook_entry *h, struct packet_object *po)
+{
+   uint64_t t0 = metrics_clock();
+
+   h->func(po);
+
+   metrics_acct(h->acct, metrics_clock() - t0);
+}
+
+/* 
+ * call a HOOK_DISPATCHER function, serialized if not shard-safe, 
+ * and measure it if the packet is sampled or the accounting is on
+ */
+
+static void hook_dispatch(struct hook_entry *h, struct packet_object *po, int acct)
+{
+   uint64_t t0 = 0, ns;
+   int serial;
+
+   serial = !(h->flags & HOOK_FL_SHARD_SAFE) && EC_GBL_CONF->dispatcher_threads > 1;
+
+   if (serial)
+      HOOK_SERIAL_LOCK;
+
+   if (metrics_on || acct)
+      t0 = metrics_clock();
+
+   h->func(po);
+
+   if (metrics_on || acct) {
+      ns = metrics_clock() - t0;
+      if (metrics_on)
+         metrics_func(h->func, ns);
+      if (acct)
+         metrics_acct(h->acct, ns);
+   }
+
+   if (serial)
+      HOOK_SERIAL_UNLOCK;
+}
+
 /* add a function to an hook point */
 
 void hook_add(int point, void (*func)(struct packet_object *po) )
 {
-   struct hook_list *newelem;
-
-   SAFE_CALLOC(newelem, 1, sizeof(struct hook_list));
-              
-   newelem->point = point;
-   newelem->func = func;
-
-   /* the hook is for a HOOK_PACKET_* type */
-   if (point > HOOK_PACKET_BASE) {
-      HOOK_PCK_LOCK;
-      LIST_INSERT_HEAD(&hook_pck_list_head, newelem, next);
-      HOOK_PCK_UNLOCK;
-   } else {
-      HOOK_LOCK;
-      LIST_INSERT_HEAD(&hook_list_head, newelem, next);
-      HOOK_UNLOCK;
-   }
-   
+   hook_add_flags(point, func, 0);
+}
+
+/* 
+ * add a function to an hook point, declaring how it can be called.
+ * HOOK_FL_SHARD_SAFE: the function does its own locking and can
+ * run concurrently on all the dispatcher threads.
+ */
+
+void hook_add_flags(int point, void (*func)(struct packet_object *po), int flags)
+{
+   struct hook_table *old, *t;
+   struct metrics_acct *acct;
+   size_t nr;
+
+   BUG_IF((u_int)point >= HOOK_POINTS);
+
+   if (point == HOOK_DISPATCHER)
+      metrics_func_add(func, "hook", NULL);
+
+   acct = metrics_acct_add(func);
+
+   HOOK_LOCK;
+
+   old = hook_tables[point];
+   nr = (old != NULL) ? old->nr : 0;
+
+   SAFE_CALLOC(t, 1, sizeof(struct hook_table) + (nr + 1) * sizeof(struct hook_entry));
+
+   /* the last added is the first called */
+   t->entry[0].func = func;
+   t->entry[0].flags = flags;
+   t->entry[0].acct = acct;
+   if (nr > 0)
+      memcpy(&t->entry[1], old->entry, nr * sizeof(struct hook_entry));
+   t->nr = nr + 1;
+
+   __atomic_store_n(&hook_tables[point], t, __ATOMIC_RELEASE);
+
+   HOOK_UNLOCK;
+
+   /*
+    * without the writers lock: a hook function may add or remove hooks
+    * while we wait for it. from inside a hook it is only queued.
+    */
+   rcu_retire(RCU_HOOKS, old, &free);
 }
 
 /* remove a function from an hook point */
 
 int hook_del(int point, void (*func)(struct packet_object *po) )
 {
-   struct hook_list *current;
+   struct hook_table *old, *t = NULL;
+   size_t i;
 
+   if ((u_int)point >= HOOK_POINTS)
+      return -E_NOTFOUND;
 
-   /* the hook is for a HOOK_PACKET_* type */
-   if (point > HOOK_PACKET_BASE) {
-      HOOK_PCK_LOCK;
-   
-      LIST_FOREACH(current, &hook_pck_list_head, next) {
-         if (current->point == point && current->func == func) {
-            LIST_REMOVE(current, next);
-            SAFE_FREE(current);
-            HOOK_PCK_UNLOCK;
-            DEBUG_MSG("hook_del -- %d [%p]", point, func);
-            return E_SUCCESS;
-         }
-      }
- 
-      HOOK_PCK_UNLOCK;
-   } else {
-      HOOK_LOCK;
-   
-      LIST_FOREACH(current, &hook_list_head, next) {
-         if (current->point == point && current->func == func) {
-            LIST_REMOVE(current, next);
-            SAFE_FREE(current);
-            HOOK_UNLOCK;
-            DEBUG_MSG("hook_del -- %d [%p]", point, func);
-            return E_SUCCESS;
-         }
-      }
- 
+   HOOK_LOCK;
+
+   old = hook_tables[point];
+
+   for (i = 0; old != NULL && i < old->nr; i++)
+      if (old->entry[i].func == func)
+         break;
+
+   if (old == NULL || i == old->nr) {
       HOOK_UNLOCK;
+      return -E_NOTFOUND;
    }
-   
-   return -E_NOTFOUND;
+
+   /* the last one leaves the point empty */
+   if (old->nr > 1) {
+      SAFE_CALLOC(t, 1, sizeof(struct hook_table) + (old->nr - 1) * sizeof(struct hook_entry));
+      memcpy(&t->entry[0], &old->entry[0], i * sizeof(struct hook_entry));
+      memcpy(&t->entry[i], &old->entry[i + 1], (old->nr - i - 1) * sizeof(struct hook_entry));
+      t->nr = old->nr - 1;
+   }
+
+   __atomic_store_n(&hook_tables[point], t, __ATOMIC_RELEASE);
+
+   HOOK_UNLOCK;
+
+   DEBUG_MSG("hook_del -- %d [%p]", point, func);
+
+   rcu_retire(RCU_HOOKS, old, &free);
+
+   return E_SUCCESS;
 }
 
 
@@ -159,7 +159,7 @@ int inject_buffer(struct packet_object *po)
     */ 
    SAFE_FREE(pck_buf);
    SAFE_FREE(pd->DATA.disp_data);
-   SAFE_FREE(pd);
+   packet_release_object(pd);
    
    return ret;
 }
@@ -111,8 +111,11 @@ int set_loglevel(int level, char *filename)
          /* initialize the log file */
          log_write_header(&fdp, LOG_PACKET);
          
-         /* add the hook point to DISPATCHER */
-         hook_add(HOOK_DISPATCHER, &log_packet);
+         /* 
+          * add the hook point to DISPATCHER.
+          * shard-safe: every record is written under the LOG_LOCK
+          */
+         hook_add_flags(HOOK_DISPATCHER, &log_packet, HOOK_FL_SHARD_SAFE);
 
          /* no break here, loglevel is incremental */
          /* fall through */
@@ -131,8 +134,12 @@ int set_loglevel(int level, char *filename)
          /* initialize the log file */
          log_write_header(&fdi, LOG_INFO);
 
-         /* add the hook point to DISPATCHER */
-         hook_add(HOOK_DISPATCHER, &log_info);
+         /* 
+          * add the hook point to DISPATCHER.
+          * shard-safe: the records are written under the LOG_LOCK, 
+          * the source and the destination ones together
+          */
+         hook_add_flags(HOOK_DISPATCHER, &log_info, HOOK_FL_SHARD_SAFE);
         
          /* add the hook for the ARP packets */
          hook_add(HOOK_PACKET_ARP, &log_info);
@@ -30,6 +30,8 @@
 #include <ec_threads.h>
 #include <ec_capture.h>
 #include <ec_dispatcher.h>
+#include <ec_stats.h>
+#include <ec_metrics.h>
 #include <ec_send.h>
 #include <ec_plugins.h>
 #include <ec_format.h>
@@ -194,6 +196,13 @@ int main(int argc, char *argv[])
    /* create the dispatcher thread */
    ec_thread_new("top_half", "dispatching module", &top_half, NULL);
 
+   /* and the one sampling the statistics */
+   ec_thread_new("stats", "statistics timer", &stats_timer, NULL);
+
+   /* export the statistics to the outside world */
+   if (EC_GBL_CONF->metrics_socket && *EC_GBL_CONF->metrics_socket)
+      ec_thread_new("metrics", "metrics exporter", &metrics_server, NULL);
+
    /* this thread becomes the UI then displays it */
    ec_thread_register(EC_PTHREAD_SELF, EC_GBL_PROGRAM, "the user interface");
 
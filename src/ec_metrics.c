@@ -0,0 +1,581 @@
+/*
+    ettercap -- pipeline latency histograms and metrics export
+
+    Copyright (C) ALoR & NaGA
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+/* for dladdr() */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+
+#include <ec.h>
+#include <ec_metrics.h>
+#include <ec_stats.h>
+#include <ec_threads.h>
+#include <ec_plugins.h>
+
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+#ifdef HAVE_DLFCN_H
+   #include <dlfcn.h>
+#endif
+
+/*
+ * only one packet every METRICS_SAMPLE (per thread) is timed,
+ * the others pay just a counter increment
+ */
+#define METRICS_SAMPLE     64
+
+/* the functions (dissectors and hooks) which can be measured */
+#define METRICS_FUNC_MAX   256
+
+/* globals */
+
+__thread int metrics_on;
+static __thread u_int metrics_tick;
+
+static struct metrics_hist metrics_stages[METRICS_STAGES] = {
+   [METRICS_CAPTURE]  = { "stage", "capture" },
+   [METRICS_DECODE]   = { "stage", "decode" },
+   [METRICS_DATA]     = { "stage", "decode_data" },
+   [METRICS_FILTER]   = { "stage", "filter" },
+   [METRICS_QUEUE]    = { "stage", "queue" },
+   [METRICS_DISPATCH] = { "stage", "dispatch" },
+};
+
+/*
+ * append only, published by the counter.
+ * the readers are lock free, the writers are serialized
+ */
+static struct metrics_hist metrics_funcs[METRICS_FUNC_MAX];
+static u_int metrics_funcs_nr;
+
+/* same publication scheme, pointed by the hook tables */
+static struct metrics_acct metrics_accts[METRICS_FUNC_MAX];
+static u_int metrics_accts_nr;
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define METRICS_LOCK     do{ pthread_mutex_lock(&metrics_mutex); }while(0)
+#define METRICS_UNLOCK   do{ pthread_mutex_unlock(&metrics_mutex); }while(0)
+
+/* protos */
+
+static void metrics_observe(struct metrics_hist *h, uint64_t ns);
+static void metrics_label(void *func, char *label, size_t len);
+static int metrics_acct_cmp(const void *a, const void *b);
+static void metrics_print(char **buf, size_t *len, size_t *size, const char *fmt, ...);
+static void metrics_print_hist(char **buf, size_t *len, size_t *size, struct metrics_hist *h);
+static char *metrics_dump(size_t *len);
+
+/************************************************/
+
+/*
+ * monotonic time in nanoseconds
+ */
+uint64_t metrics_clock(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * decide if the packet entering the pipeline of this
+ * thread has to be timed and remember it in metrics_on
+ */
+int metrics_sample(void)
+{
+   metrics_on = (metrics_tick++ % METRICS_SAMPLE) == 0;
+
+   return metrics_on;
+}
+
+static void metrics_observe(struct metrics_hist *h, uint64_t ns)
+{
+   int b = 0;
+
+   /* log2 of the value */
+   if (ns > 1)
+      b = 63 - __builtin_clzll(ns);
+   if (b >= METRICS_BUCKETS)
+      b = METRICS_BUCKETS - 1;
+
+   __atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_stage(int stage, uint64_t ns)
+{
+   metrics_observe(&metrics_stages[stage], ns);
+}
+
+/*
+ * register a function to be measured.
+ * a dissector is registered once for every port,
+ * only the first call counts
+ */
+void metrics_func_add(void *func, const char *family, const char *label)
+{
+   struct metrics_hist *h;
+   u_int i;
+
+   METRICS_LOCK;
+
+   for (i = 0; i < metrics_funcs_nr; i++) {
+      if (metrics_funcs[i].func == func) {
+         METRICS_UNLOCK;
+         return;
+      }
+   }
+
+   if (metrics_funcs_nr == METRICS_FUNC_MAX) {
+      METRICS_UNLOCK;
+      DEBUG_MSG("metrics_func_add: table full, %s not measured", label ? label : "?");
+      return;
+   }
+
+   h = &metrics_funcs[metrics_funcs_nr];
+   h->family = family;
+   h->func = func;
+
+   /* the hooks have no name, ask the dynamic linker */
+   if (label != NULL)
+      strlcpy(h->label, label, sizeof(h->label));
+   else
+      metrics_label(func, h->label, sizeof(h->label));
+
+   __atomic_store_n(&metrics_funcs_nr, metrics_funcs_nr + 1, __ATOMIC_RELEASE);
+
+   METRICS_UNLOCK;
+}
+
+/*
+ * account the time spent in a registered function
+ */
+void metrics_func(void *func, uint64_t ns)
+{
+   u_int i, n = __atomic_load_n(&metrics_funcs_nr, __ATOMIC_ACQUIRE);
+
+   for (i = 0; i < n; i++) {
+      if (metrics_funcs[i].func == func) {
+         metrics_observe(&metrics_funcs[i], ns);
+         return;
+      }
+   }
+}
+
+/*
+ * the name of a function, if the dynamic linker knows it.
+ * the static functions are not exported, dladdr() would
+ * return the nearest symbol before them
+ */
+static void metrics_label(void *func, char *label, size_t len)
+{
+#ifdef HAVE_DLFCN_H
+   Dl_info info;
+
+   if (dladdr(func, &info) && info.dli_sname != NULL && info.dli_saddr == func) {
+      strlcpy(label, info.dli_sname, len);
+      return;
+   }
+#endif
+   snprintf(label, len, "%p", func);
+}
+
+/*
+ * get the accounting record of a hooked function.
+ * it is called when the function is hooked, so the
+ * plugin registering it is already known.
+ * NULL if the table is full
+ */
+struct metrics_acct * metrics_acct_add(void *func)
+{
+   return metrics_acct_add_owned(func, NULL, NULL);
+}
+
+/*
+ * the record of a function which is not native code (a lua hook):
+ * 'key' identifies it, 'label' and 'owner' are shown in the report.
+ * with a NULL label the record is named after 'key' as a native function
+ */
+struct metrics_acct * metrics_acct_add_owned(void *key, const char *label, const char *owner)
+{
+   struct metrics_acct *a;
+   u_int i;
+
+   METRICS_LOCK;
+
+   for (i = 0; i < metrics_accts_nr; i++) {
+      if (metrics_accts[i].func == key) {
+         METRICS_UNLOCK;
+         return &metrics_accts[i];
+      }
+   }
+
+   if (metrics_accts_nr == METRICS_FUNC_MAX) {
+      METRICS_UNLOCK;
+      DEBUG_MSG("metrics_acct_add: table full, %p not accounted", key);
+      return NULL;
+   }
+
+   a = &metrics_accts[metrics_accts_nr];
+   a->func = key;
+   if (label == NULL) {
+      metrics_label(key, a->label, sizeof(a->label));
+      plugin_owner(key, a->plugin, sizeof(a->plugin));
+   } else {
+      strlcpy(a->label, label, sizeof(a->label));
+      if (owner != NULL)
+         strlcpy(a->plugin, owner, sizeof(a->plugin));
+   }
+
+   __atomic_store_n(&metrics_accts_nr, metrics_accts_nr + 1, __ATOMIC_RELEASE);
+
+   METRICS_UNLOCK;
+
+   return a;
+}
+
+/*
+ * account a call of a hooked function
+ */
+void metrics_acct(struct metrics_acct *a, uint64_t ns)
+{
+   uint64_t max;
+
+   if (a == NULL)
+      return;
+
+   __atomic_fetch_add(&a->calls, 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&a->time, ns, __ATOMIC_RELAXED);
+
+   max = __atomic_load_n(&a->max, __ATOMIC_RELAXED);
+   while (ns > max && !__atomic_compare_exchange_n(&a->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* the most expensive first */
+static int metrics_acct_cmp(const void *a, const void *b)
+{
+   const struct metrics_acct *x = a, *y = b;
+
+   if (x->time != y->time)
+      return (x->time < y->time) ? 1 : -1;
+
+   return 0;
+}
+
+/*
+ * a table of the 'max' most expensive functions (all if 0)
+ * followed by the totals of every plugin, for the user interfaces.
+ * the string must be freed by the caller
+ */
+char * metrics_acct_report(size_t max)
+{
+   struct metrics_acct *snap, *tot;
+   size_t len = 0, size = 4096;
+   u_int i, j, n, ntot = 0;
+   char *buf;
+
+   SAFE_CALLOC(buf, size, sizeof(char));
+
+   if (!EC_GBL_CONF->hook_accounting) {
+      metrics_print(&buf, &len, &size, "Hook accounting is disabled (hook_accounting in etter.conf)\n");
+      return buf;
+   }
+
+   n = __atomic_load_n(&metrics_accts_nr, __ATOMIC_ACQUIRE);
+
+   /* a consistent copy to be sorted */
+   SAFE_CALLOC(snap, n + 1, sizeof(struct metrics_acct));
+   SAFE_CALLOC(tot, n + 1, sizeof(struct metrics_acct));
+
+   for (i = 0; i < n; i++) {
+      memcpy(snap[i].label, metrics_accts[i].label, sizeof(snap[i].label));
+      memcpy(snap[i].plugin, metrics_accts[i].plugin, sizeof(snap[i].plugin));
+      snap[i].calls = __atomic_load_n(&metrics_accts[i].calls, __ATOMIC_RELAXED);
+      snap[i].time = __atomic_load_n(&metrics_accts[i].time, __ATOMIC_RELAXED);
+      snap[i].max = __atomic_load_n(&metrics_accts[i].max, __ATOMIC_RELAXED);
+
+      /* sum it to the owner */
+      for (j = 0; j < ntot; j++)
+         if (!strcmp(tot[j].plugin, snap[i].plugin))
+            break;
+      if (j == ntot)
+         memcpy(tot[ntot++].plugin, snap[i].plugin, sizeof(tot[j].plugin));
+      tot[j].calls += snap[i].calls;
+      tot[j].time += snap[i].time;
+      if (snap[i].max > tot[j].max)
+         tot[j].max = snap[i].max;
+   }
+
+   qsort(snap, n, sizeof(struct metrics_acct), metrics_acct_cmp);
+   qsort(tot, ntot, sizeof(struct metrics_acct), metrics_acct_cmp);
+
+   metrics_print(&buf, &len, &size, "%-24s %-12s %10s %10s %8s %8s\n",
+         "Function", "Plugin", "Calls", "Total ms", "Avg us", "Max us");
+   for (i = 0; i < n && (max == 0 || i < max); i++) {
+      if (snap[i].calls == 0)
+         break;
+      metrics_print(&buf, &len, &size, "%-24.24s %-12.12s %10" PRIu64 " %10.1f %8.2f %8.1f\n",
+            snap[i].label, *snap[i].plugin ? snap[i].plugin : "-", snap[i].calls,
+            snap[i].time / 1.0e6, snap[i].time / 1.0e3 / snap[i].calls, snap[i].max / 1.0e3);
+   }
+
+   metrics_print(&buf, &len, &size, "\n%-24s %-12s %10s %10s %8s %8s\n",
+         "Plugin", "", "Calls", "Total ms", "Avg us", "Max us");
+   for (i = 0; i < ntot; i++) {
+      if (tot[i].calls == 0)
+         break;
+      metrics_print(&buf, &len, &size, "%-24.24s %-12s %10" PRIu64 " %10.1f %8.2f %8.1f\n",
+            *tot[i].plugin ? tot[i].plugin : "(ettercap)", "", tot[i].calls,
+            tot[i].time / 1.0e6, tot[i].time / 1.0e3 / tot[i].calls, tot[i].max / 1.0e3);
+   }
+
+   SAFE_FREE(snap);
+   SAFE_FREE(tot);
+
+   return buf;
+}
+
+/************************************************/
+
+static void metrics_print(char **buf, size_t *len, size_t *size, const char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   for (;;) {
+      va_start(ap, fmt);
+      n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+      va_end(ap);
+
+      if (n < 0)
+         return;
+
+      if (*len + n < *size) {
+         *len += n;
+         return;
+      }
+
+      *size *= 2;
+      SAFE_REALLOC(*buf, *size);
+   }
+}
+
+/*
+ * a histogram in the prometheus text format,
+ * the buckets are cumulative and in seconds
+ */
+static void metrics_print_hist(char **buf, size_t *len, size_t *size, struct metrics_hist *h)
+{
+   uint64_t cum = 0;
+   int b;
+
+   for (b = 0; b < METRICS_BUCKETS; b++) {
+      cum += __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+      metrics_print(buf, len, size, "ettercap_%s_latency_seconds_bucket{%s=\"%s\",le=\"%.9g\"} %" PRIu64 "\n",
+            h->family, h->family, h->label, (double)(2ULL << b) / 1.0e9, cum);
+   }
+   metrics_print(buf, len, size, "ettercap_%s_latency_seconds_bucket{%s=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+         h->family, h->family, h->label, cum);
+   metrics_print(buf, len, size, "ettercap_%s_latency_seconds_sum{%s=\"%s\"} %.9f\n",
+         h->family, h->family, h->label, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1.0e9);
+   metrics_print(buf, len, size, "ettercap_%s_latency_seconds_count{%s=\"%s\"} %" PRIu64 "\n",
+         h->family, h->family, h->label, __atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+/*
+ * the counters of EC_GBL_STATS and all the histograms
+ */
+static char *metrics_dump(size_t *len)
+{
+   struct gbl_stats *st = EC_GBL_STATS;
+   size_t size = 16384;
+   char *buf;
+   u_int i, n;
+   int s;
+
+   SAFE_CALLOC(buf, size, sizeof(char));
+   *len = 0;
+
+#define METRIC(name, type, fmt, value) do {                                   \
+   metrics_print(&buf, len, &size, "# TYPE ettercap_" name " " type "\n");    \
+   metrics_print(&buf, len, &size, "ettercap_" name " " fmt "\n", value);     \
+} while(0)
+
+   METRIC("packets_received_total", "counter", "%" PRIu64, st->ps_recv);
+   METRIC("packets_dropped_total", "counter", "%" PRIu64, st->ps_drop);
+   METRIC("packets_forwarded_total", "counter", "%" PRIu64, st->ps_sent);
+   METRIC("bytes_forwarded_total", "counter", "%" PRIu64, st->bs_sent);
+   METRIC("bottom_half_packets_total", "counter", "%" PRIu64, st->bh.pck_recv);
+   METRIC("bottom_half_bytes_total", "counter", "%" PRIu64, st->bh.pck_size);
+   METRIC("top_half_packets_total", "counter", "%" PRIu64, st->th.pck_recv);
+   METRIC("top_half_bytes_total", "counter", "%" PRIu64, st->th.pck_size);
+   METRIC("queue_length", "gauge", "%lu", st->queue_curr);
+   METRIC("queue_length_max", "gauge", "%lu", st->queue_max);
+   METRIC("queue_dropped_total", "counter", "%lu", st->queue_drop);
+   METRIC("ring_blocks_total", "counter", "%" PRIu64, st->ring_blocks);
+   METRIC("ring_blocks_losing_total", "counter", "%" PRIu64, st->ring_lost);
+   METRIC("ring_freeze_total", "counter", "%" PRIu64, st->ring_freeze);
+   METRIC("pool_heap_alloc_total", "counter", "%" PRIu64, st->pool_heap_alloc);
+   METRIC("pool_heap_free_total", "counter", "%" PRIu64, st->pool_heap_free);
+   METRIC("frag_memory_bytes", "gauge", "%" PRIu64, st->frag_mem);
+   METRIC("frag_pending", "gauge", "%" PRIu64, st->frag_pending);
+   METRIC("frag_reassembled_total", "counter", "%" PRIu64, st->frag_reassembled);
+   METRIC("frag_expired_total", "counter", "%" PRIu64, st->frag_expired);
+   METRIC("frag_evicted_total", "counter", "%" PRIu64, st->frag_evicted);
+   METRIC("frag_overlap_total", "counter", "%" PRIu64, st->frag_overlap);
+   METRIC("frag_dropped_total", "counter", "%" PRIu64, st->frag_dropped);
+   METRIC("stream_memory_bytes", "gauge", "%" PRIu64, st->stream_mem);
+   METRIC("stream_out_of_order_total", "counter", "%" PRIu64, st->stream_ooo);
+   METRIC("stream_gaps_total", "counter", "%" PRIu64, st->stream_gaps);
+   METRIC("stream_dropped_total", "counter", "%" PRIu64, st->stream_dropped);
+   METRIC("stream_overflow_total", "counter", "%" PRIu64, st->stream_overflow);
+
+#undef METRIC
+
+   metrics_print(&buf, len, &size, "# TYPE ettercap_stage_latency_seconds histogram\n");
+   for (s = 0; s < METRICS_STAGES; s++)
+      metrics_print_hist(&buf, len, &size, &metrics_stages[s]);
+
+   n = __atomic_load_n(&metrics_funcs_nr, __ATOMIC_ACQUIRE);
+
+   metrics_print(&buf, len, &size, "# TYPE ettercap_dissector_latency_seconds histogram\n");
+   for (i = 0; i < n; i++)
+      if (!strcmp(metrics_funcs[i].family, "dissector"))
+         metrics_print_hist(&buf, len, &size, &metrics_funcs[i]);
+
+   metrics_print(&buf, len, &size, "# TYPE ettercap_hook_latency_seconds histogram\n");
+   for (i = 0; i < n; i++)
+      if (!strcmp(metrics_funcs[i].family, "hook"))
+         metrics_print_hist(&buf, len, &size, &metrics_funcs[i]);
+
+   if (EC_GBL_CONF->hook_accounting) {
+      n = __atomic_load_n(&metrics_accts_nr, __ATOMIC_ACQUIRE);
+
+#define METRIC_ACCT(name, type, fmt, field, scale) do {                                         \
+   metrics_print(&buf, len, &size, "# TYPE ettercap_hook_" name " " type "\n");                 \
+   for (i = 0; i < n; i++)                                                                      \
+      metrics_print(&buf, len, &size, "ettercap_hook_" name "{hook=\"%s\",plugin=\"%s\"} " fmt "\n", \
+            metrics_accts[i].label, metrics_accts[i].plugin,                                    \
+            __atomic_load_n(&metrics_accts[i].field, __ATOMIC_RELAXED) scale);                  \
+} while(0)
+
+      METRIC_ACCT("calls_total", "counter", "%" PRIu64, calls, );
+      METRIC_ACCT("cpu_seconds_total", "counter", "%.9f", time, / 1.0e9);
+      METRIC_ACCT("cpu_seconds_max", "gauge", "%.9f", max, / 1.0e9);
+
+#undef METRIC_ACCT
+   }
+
+   return buf;
+}
+
+/*
+ * serve the metrics on the unix socket metrics_socket.
+ * every connection gets a plain HTTP/1.0 response and is closed,
+ * so it can be read with a simple "nc -U" or with
+ * "curl --unix-socket <path> http://localhost/metrics"
+ */
+EC_THREAD_FUNC(metrics_server)
+{
+   struct sockaddr_un sun;
+   struct stat st;
+   struct pollfd pfd;
+   char req[512], hdr[128];
+   char *body;
+   size_t len;
+   int sd, cd, n;
+
+   /* variable not used */
+   (void) EC_THREAD_PARAM;
+
+   ec_thread_init();
+
+   DEBUG_MSG("metrics_server: %s", EC_GBL_CONF->metrics_socket);
+
+   memset(&sun, 0, sizeof(sun));
+   sun.sun_family = AF_UNIX;
+   strlcpy(sun.sun_path, EC_GBL_CONF->metrics_socket, sizeof(sun.sun_path));
+
+   /* 
+    * we are still root here: remove only a stale socket of a 
+    * previous run, never a file which happens to be there
+    */
+   if (lstat(sun.sun_path, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+         USER_MSG("Cannot export the metrics on %s: it exists and it is not a socket\n", sun.sun_path);
+         return NULL;
+      }
+      unlink(sun.sun_path);
+   }
+
+   /* 
+    * only the owner can connect. the mode is set before listen(),
+    * until then nobody can connect to it
+    */
+   sd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (sd == -1 || bind(sd, (struct sockaddr *)&sun, sizeof(sun)) == -1 || 
+       chmod(sun.sun_path, S_IRUSR | S_IWUSR) == -1 || listen(sd, 8) == -1) {
+      USER_MSG("Cannot export the metrics on %s: %s\n", sun.sun_path, strerror(errno));
+      if (sd != -1)
+         close(sd);
+      return NULL;
+   }
+
+   LOOP {
+      CANCELLATION_POINT();
+
+      if ((cd = accept(sd, NULL, NULL)) == -1)
+         continue;
+
+      /* consume the request (if any), we serve only one resource */
+      pfd.fd = cd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, 100) > 0 && read(cd, req, sizeof(req)) == -1) {
+         close(cd);
+         continue;
+      }
+
+      body = metrics_dump(&len);
+
+      n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                                     "Content-Type: text/plain; version=0.0.4\r\n"
+                                     "Content-Length: %zu\r\n\r\n", len);
+      if (write(cd, hdr, n) != n || write(cd, body, len) != (ssize_t)len)
+         DEBUG_MSG("metrics_server: short write: %s", strerror(errno));
+
+      SAFE_FREE(body);
+      close(cd);
+   }
+
+   return NULL;
+}
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
@@ -24,6 +24,7 @@
 #include <ec_poll.h>
 #include <ec_scan.h>
 #include <ec_sleep.h>
+#include <ec_sniff.h>
 
 /* globals */
 
@@ -144,6 +145,9 @@ int mitm_start(void)
       }
    }
 
+   /* the methods may have changed the matching options (remote) */
+   sniff_targets_changed();
+
    return E_SUCCESS;
 }
 
@@ -166,7 +170,8 @@ void mitm_stop(void)
          e->selected = 0;
       }
    }
-   
+
+   sniff_targets_changed();
 }
 
 
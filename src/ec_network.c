@@ -4,6 +4,7 @@
 #include <ec_queue.h>
 #include <ec_network.h>
 #include <ec_threads.h>
+#include <ec_sniff_bpf.h>
 
 #include <pcap.h>
 #include <libnet.h>
@@ -35,11 +36,18 @@ static pthread_mutex_t sl_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define SOURCES_LIST_LOCK     do{ pthread_mutex_lock(&sl_mutex); }while(0)
 #define SOURCES_LIST_UNLOCK   do{ pthread_mutex_unlock(&sl_mutex); }while(0)
 
+/* pcap_compile() is not reentrant */
+static pthread_mutex_t filter_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define FILTER_LOCK     do{ pthread_mutex_lock(&filter_mutex); }while(0)
+#define FILTER_UNLOCK   do{ pthread_mutex_unlock(&filter_mutex); }while(0)
+
 /* protos */
 static void close_network();
 static void pcap_winit(pcap_t *pcap);
 static void source_print(struct iface_env *source);
 static int source_init(char *name, struct iface_env *source, bool primary, bool live);
+static int source_filter(struct iface_env *source, struct bpf_program *bpf);
+static void source_filter_update(struct iface_env *source);
 static void source_close(struct iface_env *iface);
 static int secondary_sources_init(char **sources);
 static void close_secondary_sources(void);
@@ -103,9 +111,11 @@ void network_init()
 
 static void close_network()
 {
+   capture_ring_close(EC_GBL_IFACE);
    pcap_close(EC_GBL_IFACE->pcap);
    SAFE_FREE(EC_GBL_IFACE->pbuf);
    if(EC_GBL_SNIFF->type == SM_BRIDGED) {
+      capture_ring_close(EC_GBL_BRIDGE);
       pcap_close(EC_GBL_BRIDGE->pcap);
       SAFE_FREE(EC_GBL_BRIDGE->pbuf);
    }
@@ -158,7 +168,7 @@ static int source_init(char *name, struct iface_env *source, bool primary, bool
    int ret;
    pcap_t *pcap = NULL;
    libnet_t *lnet = NULL;
-   struct bpf_program bpf;
+   struct bpf_program bpf, *filter = NULL;
    char pcap_errbuf[PCAP_ERRBUF_SIZE];
    char lnet_errbuf[LIBNET_ERRBUF_SIZE];
    int snaplen;
@@ -221,16 +231,6 @@ static int source_init(char *name, struct iface_env *source, bool primary, bool
          EC_GBL_OPTIONS->unoffensive = 1;
    }
 
-   if(EC_GBL_PCAP->filter && strcmp(EC_GBL_PCAP->filter, "") && live) {
-      u_int net, mask;
-      if(pcap_lookupnet(name, &net, &mask, pcap_errbuf) == -1)
-         ERROR_MSG("%s - %s", name, pcap_errbuf);
-      if(pcap_compile(pcap, &bpf, EC_GBL_PCAP->filter, 1, mask) < 0)
-         ERROR_MSG("Wrong pcap filter: %s - %s", name, pcap_geterr(pcap));
-      if(pcap_setfilter(pcap, &bpf) == 1)
-         ERROR_MSG("Cannot set pcap filter: %s - %s", name, pcap_geterr(pcap));
-   }
-
    snaplen = pcap_snapshot(pcap);
    DEBUG_MSG("requested snaplen for %s: %d, assigned snaplen: %d", name, EC_GBL_PCAP->snaplen, snaplen);
    if(primary)
@@ -330,11 +330,149 @@ static int source_init(char *name, struct iface_env *source, bool primary, bool
    freeifaddrs(ifaddrs);
 #endif  /* OS_WINDOWS */
 
+   /* the filter generated from the TARGETS needs the addresses of the interface */
+   if(source_filter(source, &bpf) == E_SUCCESS) {
+      if(pcap_setfilter(pcap, &bpf) == -1)
+         ERROR_MSG("Cannot set pcap filter: %s - %s", name, pcap_geterr(pcap));
+      filter = &bpf;
+   }
+
+   /* the ring socket needs privileges, open it now */
+   if(EC_GBL_CONF->capture_ring)
+      capture_ring_open(source, filter);
+   else if(EC_GBL_CONF->capture_threads > 1)
+      USER_MSG("capture_threads needs capture_ring, using a single capture thread on %s\n", name);
+
+   if(filter != NULL)
+      pcap_freecode(filter);
+
    source->is_ready = 1;
 
    return E_SUCCESS;
 }
 
+/*
+ * compile the capture filter of a live source: the one given by
+ * the user, restricted to the TARGETS if target_filter is set.
+ * returns -E_NOTFOUND if there is no filter at all.
+ *
+ * the capture thread may be using the handle of the source, the
+ * program is compiled with a dead one of the same link type
+ */
+static int source_filter(struct iface_env *source, struct bpf_program *bpf)
+{
+   char pcap_errbuf[PCAP_ERRBUF_SIZE];
+   char *user = EC_GBL_PCAP->filter, *targets = NULL, *expr;
+   pcap_t *dead;
+   u_int net, mask;
+   size_t len;
+
+   if(user != NULL && !strcmp(user, ""))
+      user = NULL;
+
+   if(EC_GBL_CONF->target_filter)
+      targets = sniff_bpf_filter(source);
+
+   if(user == NULL && targets == NULL)
+      return -E_NOTFOUND;
+
+   if(pcap_lookupnet(source->name, &net, &mask, pcap_errbuf) == -1) {
+      if(user != NULL)
+         ERROR_MSG("%s - %s", source->name, pcap_errbuf);
+      mask = 0;
+   }
+
+   dead = pcap_open_dead(pcap_datalink(source->pcap), pcap_snapshot(source->pcap));
+   if(dead == NULL) {
+      SAFE_FREE(targets);
+      return -E_NOTFOUND;
+   }
+
+   FILTER_LOCK;
+
+   if(targets != NULL) {
+      len = strlen(targets) + (user ? strlen(user) : 0) + 16;
+      SAFE_CALLOC(expr, len, sizeof(char));
+      if(user != NULL)
+         snprintf(expr, len, "(%s) and (%s)", user, targets);
+      else
+         snprintf(expr, len, "%s", targets);
+
+      DEBUG_MSG("source_filter: %s: %s", source->name, expr);
+
+      if(pcap_compile(dead, bpf, expr, 1, mask) == 0) {
+         FILTER_UNLOCK;
+         pcap_close(dead);
+         SAFE_FREE(expr);
+         SAFE_FREE(targets);
+         return E_SUCCESS;
+      }
+
+      /* the TARGETS only restrict the capture, it works without them */
+      USER_MSG("Cannot filter the TARGETS on %s (%s), capturing everything\n", source->name, 
+            pcap_geterr(dead));
+      SAFE_FREE(expr);
+      SAFE_FREE(targets);
+   }
+
+   /* an empty expression accepts everything */
+   if(pcap_compile(dead, bpf, user ? user : "", 1, mask) < 0)
+      ERROR_MSG("Wrong pcap filter: %s - %s", source->name, pcap_geterr(dead));
+
+   FILTER_UNLOCK;
+
+   pcap_close(dead);
+
+   return E_SUCCESS;
+}
+
+/*
+ * replace the filter of a running source
+ */
+static void source_filter_update(struct iface_env *source)
+{
+   struct bpf_program *bpf;
+   pcap_t *dead;
+   int ret;
+
+   if(!source->is_ready || !source->is_live || source->pcap == NULL)
+      return;
+
+   SAFE_CALLOC(bpf, 1, sizeof(struct bpf_program));
+
+   /* there was one, accept everything now */
+   if(source_filter(source, bpf) != E_SUCCESS) {
+      ret = -1;
+      if((dead = pcap_open_dead(pcap_datalink(source->pcap), pcap_snapshot(source->pcap))) != NULL) {
+         FILTER_LOCK;
+         ret = pcap_compile(dead, bpf, "", 1, 0);
+         FILTER_UNLOCK;
+         pcap_close(dead);
+      }
+      if(ret < 0) {
+         SAFE_FREE(bpf);
+         return;
+      }
+   }
+
+   /* the capture thread sets it and frees it */
+   capture_setfilter(source, bpf);
+}
+
+/*
+ * the TARGETS were changed, regenerate the filter of all the interfaces
+ */
+void network_filter_update(void)
+{
+   if(EC_GBL_IFACE->is_live)
+      source_filter_update(EC_GBL_IFACE);
+
+   if(EC_GBL_BRIDGE->is_live)
+      source_filter_update(EC_GBL_BRIDGE);
+
+   secondary_sources_foreach(&source_filter_update);
+}
+
 static void source_close(struct iface_env *iface)
 {
 #ifdef WITH_IPV6
@@ -343,9 +481,17 @@ static void source_close(struct iface_env *iface)
 
    iface->is_ready = 0;
 
+   capture_ring_close(iface);
+
    if(iface->pcap != NULL)
       pcap_close(iface->pcap);
 
+   /* a filter never set by the capture thread */
+   if(iface->filter != NULL) {
+      pcap_freecode(iface->filter);
+      SAFE_FREE(iface->filter);
+   }
+
    if(iface->lnet != NULL)
       libnet_destroy(iface->lnet);
   
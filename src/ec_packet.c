@@ -24,6 +24,77 @@
 #include <ec_inet.h>
 #include <ec_ui.h>
 #include <ec_format.h>
+#include <ec_stats.h>
+
+#include <pthread.h>
+
+/*
+ * memory pool for the duplicates sent to the top half.
+ *
+ * every thread keeps a cache of free elements for each size class
+ * (the packet_object itself and some sizes for the packet buffer).
+ * since the duplicates are created by the capture threads and
+ * destroyed by the dispatcher ones, the caches exchange batches
+ * of POOL_BATCH elements through a depot, so the lock is taken
+ * once every POOL_BATCH packets. the heap is used only to grow
+ * the pool (or for a packet larger than the biggest class).
+ * the cache of a thread is given back when it exits.
+ */
+
+#define POOL_BATCH      64
+#define POOL_DEPOT_MAX  64    /* batches kept in the depot, the others go back to the heap */
+
+enum {
+   POOL_PO = 0,
+   POOL_BUF_SMALL,
+   POOL_BUF_MEDIUM,
+   POOL_BUF_LARGE,
+   POOL_CLASSES,
+   POOL_HEAP = POOL_CLASSES,  /* not pooled, too big */
+};
+
+static const size_t pool_size[POOL_CLASSES] = {
+   sizeof(struct packet_object),
+   2048,
+   16384,
+   UINT16_MAX + 1,
+};
+
+/* placed before every element, keeps the payload aligned */
+union pool_hdr {
+   struct {
+      union pool_hdr *next;      /* in the cache and in the batch */
+      union pool_hdr *next_batch;   /* in the depot */
+      u_int cls;
+   } h;
+   u_char align[32];
+};
+
+struct pool_depot {
+   union pool_hdr *batches;
+   u_int count;
+   pthread_mutex_t mutex;
+};
+
+static struct pool_depot pool_depot[POOL_CLASSES] = {
+   [0 ... POOL_CLASSES - 1] = { NULL, 0, PTHREAD_MUTEX_INITIALIZER },
+};
+
+static __thread union pool_hdr *pool_cache[POOL_CLASSES];
+static __thread u_int pool_cache_count[POOL_CLASSES];
+static __thread int pool_cache_used;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* protos */
+
+static void *pool_get(u_int cls);
+static void *pool_get_buf(size_t len);
+static void pool_put(void *ptr);
+static void pool_key_init(void);
+static void pool_cache_spill(u_int cls);
+static void pool_cache_drain(void *unused);
 
 /* --------------------------- */
 
@@ -81,7 +152,9 @@ int packet_disp_data(struct packet_object *po, u_char *buf, u_int len)
 }
 
 /*
- * free the packet object memory
+ * free the packet object memory.
+ * a duplicate is only emptied: its buffers go back to the pool,
+ * the object itself is released by packet_release_object()
  */
 
 int packet_destroy_object(struct packet_object *po)
@@ -94,7 +167,9 @@ int packet_destroy_object(struct packet_object *po)
     */
    if (po->flags & PO_DUP) {
      
-      SAFE_FREE(po->packet);
+      if (po->packet != NULL)
+         pool_put(po->packet);
+      po->packet = NULL;
       
       /* 
        * free the dissector info 
@@ -120,8 +195,12 @@ int packet_destroy_object(struct packet_object *po)
     */
    SAFE_FREE(po->DATA.disp_data);
 
-   /* if it is alloced entirely by ourselves */
-   if(po->flags & PO_FORGED) {
+   /* 
+    * if it is alloced entirely by ourselves.
+    * the duplicate of a forged packet keeps the flag, 
+    * but it comes from the pool
+    */
+   if((po->flags & PO_FORGED) && !(po->flags & PO_DUP)) {
       SAFE_FREE(po->packet);
       SAFE_FREE(po);
    }
@@ -129,16 +208,33 @@ int packet_destroy_object(struct packet_object *po)
    return 0;
 }
 
+/*
+ * give back to the pool a duplicate created by packet_dup().
+ * it takes the place of the free() after packet_destroy_object(),
+ * the duplicates must not be freed by hand.
+ * the buffers are not touched, see inject_buffer()
+ */
+
+void packet_release_object(struct packet_object *po)
+{
+   BUG_IF(!(po->flags & PO_DUP));
+
+   pool_put(po);
+}
+
 
 /*
  * duplicate a po and return
- * the new allocated one
+ * the new allocated one.
+ * the duplicate comes from the pool: destroy it with
+ * packet_destroy_object() and release it with
+ * packet_release_object(), don't free() it.
  */
 struct packet_object * packet_dup(struct packet_object *po, u_char flag)
 {
    struct packet_object *dup_po;
 
-   SAFE_CALLOC(dup_po, 1, sizeof(struct packet_object));
+   dup_po = pool_get(POOL_PO);
 
    /* 
     * copy the po over the dup_po 
@@ -162,7 +258,7 @@ struct packet_object * packet_dup(struct packet_object *po, u_char flag)
    /* copy only if the buffer exists */
    if ( (flag & PO_DUP_PACKET) && po->packet != NULL) {  
       /* duplicate the po buffer */
-      SAFE_CALLOC(dup_po->packet, po->len, sizeof(u_char));
+      dup_po->packet = pool_get_buf(po->len);
   
       /* copy the buffer */
       memcpy(dup_po->packet, po->packet, po->len);
@@ -206,6 +302,154 @@ struct packet_object * packet_dup(struct packet_object *po, u_char flag)
    return dup_po;
 }
 
+/*
+ * get an element from the cache of this thread,
+ * refill it from the depot or the heap if empty
+ */
+static void *pool_get(u_int cls)
+{
+   struct pool_depot *d = &pool_depot[cls];
+   union pool_hdr *e;
+
+   /* the first time, arrange to give the cache back on exit */
+   if (!pool_cache_used) {
+      pthread_once(&pool_once, pool_key_init);
+      pthread_setspecific(pool_key, &pool_cache_used);
+      pool_cache_used = 1;
+   }
+
+   if (pool_cache[cls] == NULL) {
+      pthread_mutex_lock(&d->mutex);
+      if (d->batches != NULL) {
+         pool_cache[cls] = d->batches;
+         pool_cache_count[cls] = POOL_BATCH;
+         d->batches = d->batches->h.next_batch;
+         d->count--;
+      }
+      pthread_mutex_unlock(&d->mutex);
+   }
+
+   if ((e = pool_cache[cls]) != NULL) {
+      pool_cache[cls] = e->h.next;
+      pool_cache_count[cls]--;
+   } else {
+      SAFE_CALLOC(e, 1, sizeof(union pool_hdr) + pool_size[cls]);
+      e->h.cls = cls;
+      __atomic_fetch_add(&EC_GBL_STATS->pool_heap_alloc, 1, __ATOMIC_RELAXED);
+   }
+
+   return e + 1;
+}
+
+/*
+ * the packet buffers go in the smallest class which fits
+ */
+static void *pool_get_buf(size_t len)
+{
+   union pool_hdr *e;
+   u_int cls;
+
+   for (cls = POOL_BUF_SMALL; cls < POOL_CLASSES; cls++)
+      if (len <= pool_size[cls])
+         return pool_get(cls);
+
+   SAFE_CALLOC(e, 1, sizeof(union pool_hdr) + len);
+   e->h.cls = POOL_HEAP;
+   __atomic_fetch_add(&EC_GBL_STATS->pool_heap_alloc, 1, __ATOMIC_RELAXED);
+
+   return e + 1;
+}
+
+/*
+ * put the element in the cache of this thread.
+ * when it holds two batches, one is moved to the depot
+ */
+static void pool_put(void *ptr)
+{
+   union pool_hdr *e = (union pool_hdr *)ptr - 1;
+   u_int cls = e->h.cls;
+
+   if (cls == POOL_HEAP) {
+      SAFE_FREE(e);
+      __atomic_fetch_add(&EC_GBL_STATS->pool_heap_free, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   e->h.next = pool_cache[cls];
+   pool_cache[cls] = e;
+
+   if (++pool_cache_count[cls] >= POOL_BATCH * 2)
+      pool_cache_spill(cls);
+}
+
+/*
+ * move the first batch of the cache to the depot
+ */
+static void pool_cache_spill(u_int cls)
+{
+   union pool_hdr *e, *batch, *last;
+   struct pool_depot *d;
+   u_int i;
+
+   /* detach the first batch */
+   batch = pool_cache[cls];
+   for (last = batch, i = 1; i < POOL_BATCH; i++)
+      last = last->h.next;
+   pool_cache[cls] = last->h.next;
+   pool_cache_count[cls] -= POOL_BATCH;
+   last->h.next = NULL;
+
+   d = &pool_depot[cls];
+   pthread_mutex_lock(&d->mutex);
+   if (d->count < POOL_DEPOT_MAX) {
+      batch->h.next_batch = d->batches;
+      d->batches = batch;
+      d->count++;
+      batch = NULL;
+   }
+   pthread_mutex_unlock(&d->mutex);
+
+   /* the depot is full, release the memory */
+   while (batch != NULL) {
+      e = batch;
+      batch = batch->h.next;
+      SAFE_FREE(e);
+      __atomic_fetch_add(&EC_GBL_STATS->pool_heap_free, 1, __ATOMIC_RELAXED);
+   }
+}
+
+static void pool_key_init(void)
+{
+   pthread_key_create(&pool_key, pool_cache_drain);
+}
+
+/*
+ * called when a thread using the pool exits: the full batches
+ * of its cache go to the depot, the rest back to the heap
+ */
+static void pool_cache_drain(void *unused)
+{
+   union pool_hdr *e;
+   u_int cls;
+
+   (void) unused;
+
+   for (cls = 0; cls < POOL_CLASSES; cls++) {
+
+      while (pool_cache_count[cls] >= POOL_BATCH)
+         pool_cache_spill(cls);
+
+      while ((e = pool_cache[cls]) != NULL) {
+         pool_cache[cls] = e->h.next;
+         SAFE_FREE(e);
+         __atomic_fetch_add(&EC_GBL_STATS->pool_heap_free, 1, __ATOMIC_RELAXED);
+      }
+      pool_cache_count[cls] = 0;
+   }
+
+   pool_cache_used = 0;
+}
+
    
 /* EOF */
 
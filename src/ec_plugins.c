@@ -19,6 +19,11 @@
 
 */
 
+/* for dladdr() */
+#ifndef _GNU_SOURCE
+   #define _GNU_SOURCE
+#endif
+
 #include <ec.h>
 #include <ec_plugins.h>
 
@@ -67,6 +72,11 @@ static pthread_mutex_t plugin_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define PLUGIN_LIST_UNLOCK do { pthread_mutex_unlock(&plugin_list_mutex); } \
                            while (0)
 
+/* plugin_head is walked by plugin_owner() from other threads */
+static pthread_mutex_t plugin_head_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define PLUGIN_HEAD_LOCK do { pthread_mutex_lock(&plugin_head_mutex); } while (0)
+#define PLUGIN_HEAD_UNLOCK do { pthread_mutex_unlock(&plugin_head_mutex); } while (0)
+
 /* protos... */
 
 void plugin_unload_all(void);
@@ -218,8 +228,10 @@ void plugin_unload_all(void)
       p = SLIST_FIRST(&plugin_head);
       if(plugin_is_activated(p->ops->name) == 1)
 		plugin_fini(p->ops->name);
-      dlclose(p->handle);
+      PLUGIN_HEAD_LOCK;
       SLIST_REMOVE_HEAD(&plugin_head, next);
+      PLUGIN_HEAD_UNLOCK;
+      dlclose(p->handle);
       SAFE_FREE(p);
    }
 #endif
@@ -254,7 +266,9 @@ int plugin_register(void *handle, struct plugin_ops *ops)
    p->handle = handle;
    p->ops = ops;
 
+   PLUGIN_HEAD_LOCK;
    SLIST_INSERT_HEAD(&plugin_head, p, next);
+   PLUGIN_HEAD_UNLOCK;
 
    return E_SUCCESS;
 #else
@@ -427,6 +441,41 @@ int search_plugin(char *name)
    return -E_NOTFOUND;
 }
 
+/*
+ * copy in 'name' the name of the plugin whose code contains 'func',
+ * -E_NOTFOUND if it belongs to ettercap itself.
+ * a plugin is recognized by the object its ops are defined in.
+ * the name is copied under the lock since the plugin may be unloaded
+ */
+int plugin_owner(void *func, char *name, size_t len)
+{
+#if defined(HAVE_PLUGINS) && defined(HAVE_DLFCN_H)
+   struct plugin_entry *p;
+   Dl_info fi, pi;
+
+   if (func == NULL || !dladdr(func, &fi))
+      return -E_NOTFOUND;
+
+   PLUGIN_HEAD_LOCK;
+
+   SLIST_FOREACH(p, &plugin_head, next) {
+      if (dladdr(p->ops, &pi) && pi.dli_fbase == fi.dli_fbase) {
+         strlcpy(name, p->ops->name, len);
+         PLUGIN_HEAD_UNLOCK;
+         return E_SUCCESS;
+      }
+   }
+
+   PLUGIN_HEAD_UNLOCK;
+#else
+   (void) func;
+   (void) name;
+   (void) len;
+#endif
+
+   return -E_NOTFOUND;
+}
+
 /*
  * print the list of available plugins
  */
@@ -28,6 +28,7 @@
 #include <ec_scan.h>
 #include <ec_log.h>
 #include <ec_geoip.h>
+#include <ec_hash.h>
 
 #define ONLY_REMOTE_PROFILES  3
 #define ONLY_LOCAL_PROFILES   2
@@ -39,18 +40,52 @@ void __init profiles_init(void);
 static void profile_purge(int flag);
 
 static int profile_add_host(struct packet_object *po);
+static int profile_update_host(struct packet_object *po);
 static int profile_add_user(struct packet_object *po);
 static void update_info(struct host_profile *h, struct packet_object *po);
 static void update_port_list(struct host_profile *h, struct packet_object *po);
 static void update_port_list_with_advertised(struct host_profile *h, uint8_t L4_proto, uint16_t L4_src);
 static void set_gateway(u_char *L2_addr);
 
+static int profile_cmp(struct ip_addr *a, struct ip_addr *b);
+static void profile_hash_grow(void);
+static void profile_index(struct host_profile *h);
+static void profile_unindex(struct host_profile *h);
+static void profile_rehash_mac(struct host_profile *h, u_int8 *old);
+static struct host_profile * profile_skip_pred(struct ip_addr *ip, struct host_profile **update);
+static void profile_skip_rebuild(void);
+static struct open_port * port_search(struct host_profile *h, u_int8 proto, u_int16 port, u_int32 *idx);
+static struct open_port * port_add(struct host_profile *h, u_int8 proto, u_int16 port, u_int32 idx);
+static struct active_user * user_search(struct open_port *o, struct packet_object *po, u_int32 *idx);
+
 /* global mutex on interface */
 
 static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define PROFILE_LOCK     do { pthread_mutex_lock(&profile_mutex); } while(0)
 #define PROFILE_UNLOCK   do { pthread_mutex_unlock(&profile_mutex); } while(0)
 
+/*
+ * the profiles are indexed (under the PROFILE_LOCK) by:
+ *    - two hash tables, on the ip and on the mac address, doubled
+ *      when the hosts are more than twice their buckets
+ *    - a skip list sorted by ip address, to find where a new host
+ *      goes in the EC_GBL_PROFILES list shown by the UIs
+ */
+
+#define PROFILE_HASH_INIT  256
+#define PROFILE_SKIP_MAX   16
+
+static LIST_HEAD(profile_bucket, host_profile) *profile_ip_hash, *profile_mac_hash;
+static u_int32 profile_hash_size;
+static u_int32 profile_count;
+
+static struct host_profile *profile_skip_head[PROFILE_SKIP_MAX];
+static u_int8 profile_skip_levels = 1;
+static u_int32 profile_skip_seed = 0x2545f491;
+
+#define PROFILE_IP_HASH(ip)   (fnv_32((ip)->addr, ntohs((ip)->addr_len)) & (profile_hash_size - 1))
+#define PROFILE_MAC_HASH(mac) (fnv_32((mac), MEDIA_ADDR_LEN) & (profile_hash_size - 1))
+
 /************************************************/
   
 /*
@@ -58,6 +93,10 @@ static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
  */
 void __init profiles_init(void)
 {
+   profile_hash_size = PROFILE_HASH_INIT;
+   SAFE_CALLOC(profile_ip_hash, profile_hash_size, sizeof(struct profile_bucket));
+   SAFE_CALLOC(profile_mac_hash, profile_hash_size, sizeof(struct profile_bucket));
+
    /* add the hook for the ARP packets */
    hook_add(HOOK_PACKET_ARP, &profile_parse);
    
@@ -70,11 +109,262 @@ void __init profiles_init(void)
    /* add the hook for DHCP packets */
    hook_add(HOOK_PROTO_DHCP_PROFILE, &profile_parse);
          
-   /* receive all the top half packets */
-   hook_add(HOOK_DISPATCHER, &profile_parse);
+   /* 
+    * receive all the top half packets.
+    * shard-safe: the hosts, their ports and users are looked up 
+    * and modified only under the PROFILE_LOCK
+    */
+   hook_add_flags(HOOK_DISPATCHER, &profile_parse, HOOK_FL_SHARD_SAFE);
 }
 
 
+/*
+ * the order of the profile list: by family, then by address
+ */
+static int profile_cmp(struct ip_addr *a, struct ip_addr *b)
+{
+   if (a->addr_type != b->addr_type)
+      return ntohs(a->addr_type) < ntohs(b->addr_type) ? -1 : 1;
+
+   return memcmp(a->addr, b->addr, ntohs(a->addr_len));
+}
+
+/*
+ * double the hash tables
+ */
+static void profile_hash_grow(void)
+{
+   struct profile_bucket *ip_hash, *mac_hash;
+   struct host_profile *h;
+   u_int32 i, old = profile_hash_size;
+
+   ip_hash = profile_ip_hash;
+   mac_hash = profile_mac_hash;
+
+   profile_hash_size *= 2;
+   SAFE_CALLOC(profile_ip_hash, profile_hash_size, sizeof(struct profile_bucket));
+   SAFE_CALLOC(profile_mac_hash, profile_hash_size, sizeof(struct profile_bucket));
+
+   for (i = 0; i < old; i++) {
+      while ((h = LIST_FIRST(&ip_hash[i])) != NULL) {
+         LIST_REMOVE(h, ip_next);
+         LIST_INSERT_HEAD(&profile_ip_hash[PROFILE_IP_HASH(&h->L3_addr)], h, ip_next);
+      }
+      while ((h = LIST_FIRST(&mac_hash[i])) != NULL) {
+         LIST_REMOVE(h, mac_next);
+         LIST_INSERT_HEAD(&profile_mac_hash[PROFILE_MAC_HASH(h->L2_addr)], h, mac_next);
+      }
+   }
+
+   SAFE_FREE(ip_hash);
+   SAFE_FREE(mac_hash);
+
+   DEBUG_MSG("profile_hash_grow: %u buckets", profile_hash_size);
+}
+
+/*
+ * insert a new host in the profile list and in the indexes
+ */
+static void profile_index(struct host_profile *h)
+{
+   struct host_profile *update[PROFILE_SKIP_MAX];
+   struct host_profile *pred;
+   u_int8 l;
+
+   if (++profile_count > profile_hash_size * 2)
+      profile_hash_grow();
+
+   LIST_INSERT_HEAD(&profile_ip_hash[PROFILE_IP_HASH(&h->L3_addr)], h, ip_next);
+   LIST_INSERT_HEAD(&profile_mac_hash[PROFILE_MAC_HASH(h->L2_addr)], h, mac_next);
+
+   /* the last host not greater than this one (ordered ascending) */
+   pred = profile_skip_pred(&h->L3_addr, update);
+
+   /* every level has half of the hosts of the one below */
+   for (h->skip_level = 1; h->skip_level < PROFILE_SKIP_MAX; h->skip_level++) {
+      profile_skip_seed ^= profile_skip_seed << 13;
+      profile_skip_seed ^= profile_skip_seed >> 17;
+      profile_skip_seed ^= profile_skip_seed << 5;
+      if (profile_skip_seed & 1)
+         break;
+   }
+
+   for (; profile_skip_levels < h->skip_level; profile_skip_levels++)
+      update[profile_skip_levels] = NULL;
+
+   SAFE_CALLOC(h->skip, h->skip_level, sizeof(struct host_profile *));
+
+   for (l = 0; l < h->skip_level; l++) {
+      if (update[l] == NULL) {
+         h->skip[l] = profile_skip_head[l];
+         profile_skip_head[l] = h;
+      } else {
+         h->skip[l] = update[l]->skip[l];
+         update[l]->skip[l] = h;
+      }
+   }
+
+   if (pred == NULL)
+      TAILQ_INSERT_HEAD(&EC_GBL_PROFILES, h, next);
+   else
+      TAILQ_INSERT_AFTER(&EC_GBL_PROFILES, pred, h, next);
+}
+
+/*
+ * remove a host from the profile list and from the hashes.
+ * the skip list must be rebuilt after the removals
+ */
+static void profile_unindex(struct host_profile *h)
+{
+   LIST_REMOVE(h, ip_next);
+   LIST_REMOVE(h, mac_next);
+   TAILQ_REMOVE(&EC_GBL_PROFILES, h, next);
+   SAFE_FREE(h->skip);
+   profile_count--;
+}
+
+/*
+ * the mac address of a host has changed
+ */
+static void profile_rehash_mac(struct host_profile *h, u_int8 *old)
+{
+   if (!memcmp(old, h->L2_addr, MEDIA_ADDR_LEN))
+      return;
+
+   LIST_REMOVE(h, mac_next);
+   LIST_INSERT_HEAD(&profile_mac_hash[PROFILE_MAC_HASH(h->L2_addr)], h, mac_next);
+}
+
+/*
+ * search the last host not greater than 'ip' in the skip list.
+ * 'update' is filled with the last one on every level
+ */
+static struct host_profile * profile_skip_pred(struct ip_addr *ip, struct host_profile **update)
+{
+   struct host_profile *x = NULL, *n;
+   int l;
+
+   for (l = profile_skip_levels - 1; l >= 0; l--) {
+      for (n = x ? x->skip[l] : profile_skip_head[l]; n && profile_cmp(&n->L3_addr, ip) <= 0; n = n->skip[l])
+         x = n;
+      update[l] = x;
+   }
+
+   return x;
+}
+
+/*
+ * link again the skip list following the (sorted) profile list
+ */
+static void profile_skip_rebuild(void)
+{
+   struct host_profile *last[PROFILE_SKIP_MAX];
+   struct host_profile *h;
+   u_int8 l;
+
+   memset(last, 0, sizeof(last));
+   memset(profile_skip_head, 0, sizeof(profile_skip_head));
+
+   TAILQ_FOREACH(h, &EC_GBL_PROFILES, next) {
+      for (l = 0; l < h->skip_level; l++) {
+         h->skip[l] = NULL;
+         if (last[l] == NULL)
+            profile_skip_head[l] = h;
+         else
+            last[l]->skip[l] = h;
+         last[l] = h;
+      }
+   }
+}
+
+/*
+ * binary search of a port of a host.
+ * 'idx' is set to its position, or to the one where it goes
+ */
+static struct open_port * port_search(struct host_profile *h, u_int8 proto, u_int16 port, u_int32 *idx)
+{
+   struct open_port *o;
+   u_int32 lo = 0, hi = h->nports, mid;
+
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      o = h->ports[mid];
+      if (ntohs(o->L4_addr) < ntohs(port) || 
+          (o->L4_addr == port && o->L4_proto < proto))
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   *idx = lo;
+
+   if (lo < h->nports && h->ports[lo]->L4_addr == port && h->ports[lo]->L4_proto == proto)
+      return h->ports[lo];
+
+   return NULL;
+}
+
+/*
+ * create a new port at the position found by port_search()
+ */
+static struct open_port * port_add(struct host_profile *h, u_int8 proto, u_int16 port, u_int32 idx)
+{
+   struct open_port *o;
+
+   SAFE_CALLOC(o, 1, sizeof(struct open_port));
+   
+   o->L4_proto = proto;
+   o->L4_addr = port;
+
+   if (h->nports == h->ports_size) {
+      h->ports_size = h->ports_size ? h->ports_size * 2 : 4;
+      SAFE_REALLOC(h->ports, h->ports_size * sizeof(struct open_port *));
+   }
+
+   /* insert in the right position (ordered ascending) */
+   if (idx == 0)
+      LIST_INSERT_HEAD(&(h->open_ports_head), o, next);
+   else
+      LIST_INSERT_AFTER(h->ports[idx - 1], o, next);
+
+   memmove(&h->ports[idx + 1], &h->ports[idx], (h->nports - idx) * sizeof(struct open_port *));
+   h->ports[idx] = o;
+   h->nports++;
+
+   return o;
+}
+
+/*
+ * binary search of the user of a packet on a port.
+ * 'idx' is set to the position where a new one goes
+ */
+static struct active_user * user_search(struct open_port *o, struct packet_object *po, u_int32 *idx)
+{
+   struct active_user *u;
+   u_int32 lo = 0, hi = o->nusers, mid, i;
+
+   /* the first one with the same name */
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (strcmp(o->users[mid]->user, po->DISSECTOR.user) < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   for (i = lo; i < o->nusers && !strcmp(o->users[i]->user, po->DISSECTOR.user); i++) {
+      u = o->users[i];
+      if (!strcmp(u->pass, po->DISSECTOR.pass) &&
+          !ip_addr_cmp(&u->client, &po->L3.src))
+         return u;
+   }
+
+   /* after the ones with the same name (ordered alphabetically) */
+   *idx = i;
+
+   return NULL;
+}
+
 /*
  * decides if the packet has to be added
  * to the profiles
@@ -159,8 +449,6 @@ void profile_parse(struct packet_object *po)
 static int profile_add_host(struct packet_object *po)
 {
    struct host_profile *h;
-   struct host_profile *c;
-   struct host_profile *last = NULL;
    char tmp[MAX_ASCII_ADDR_LEN];
    
    /* 
@@ -189,22 +477,10 @@ static int profile_add_host(struct packet_object *po)
 
    PROFILE_LOCK;
 
-   /* search if it already exists */
-   TAILQ_FOREACH(h, &EC_GBL_PROFILES, next) {
-      /* an host is identified by the mac and the ip address */
-      /* if the mac address is null also update it since it could
-       * be captured as a DHCP packet specifying the GW 
-       */
-      if ((!memcmp(h->L2_addr, po->L2.src, MEDIA_ADDR_LEN) ||
-           !memcmp(po->L2.src, "\x00\x00\x00\x00\x00\x00", MEDIA_ADDR_LEN) ) &&
-          !ip_addr_cmp(&h->L3_addr, &po->L3.src) ) {
-
-         update_info(h, po);
-         /* the host was already in the list
-          * return 0 host added */
-         PROFILE_UNLOCK;
-         return 0;
-      }
+   /* the host was already in the list, return 0 host added */
+   if (profile_update_host(po)) {
+      PROFILE_UNLOCK;
+      return 0;
    }
   
    PROFILE_UNLOCK;
@@ -228,23 +504,22 @@ static int profile_add_host(struct packet_object *po)
    SAFE_CALLOC(h, 1, sizeof(struct host_profile));
    
    PROFILE_LOCK;
+
+   /* 
+    * another shard may have added it in the meantime
+    * (the packets of the host are in many flows)
+    */
+   if (profile_update_host(po)) {
+      PROFILE_UNLOCK;
+      SAFE_FREE(h);
+      return 0;
+   }
    
    /* fill the structure with the collected infos */
    update_info(h, po);
    
-   /* search the right point to inser it (ordered ascending) */
-   TAILQ_FOREACH(c, &EC_GBL_PROFILES, next) {
-      if ( ip_addr_cmp(&c->L3_addr, &h->L3_addr) > 0 )
-         break;
-      last = c;
-   }
-   
-   if (TAILQ_FIRST(&EC_GBL_PROFILES) == NULL) 
-      TAILQ_INSERT_HEAD(&EC_GBL_PROFILES, h, next);
-   else if (c != NULL) 
-      TAILQ_INSERT_BEFORE(c, h, next);
-   else 
-      TAILQ_INSERT_AFTER(&EC_GBL_PROFILES, last, h, next);
+   /* insert it in the list and in the indexes */
+   profile_index(h);
 
    PROFILE_UNLOCK;
    
@@ -253,6 +528,35 @@ static int profile_add_host(struct packet_object *po)
    return 1;   
 }
 
+/*
+ * update the profile of the host, if it exists.
+ * must be called with the PROFILE_LOCK held.
+ * returns 1 if it was found
+ */
+static int profile_update_host(struct packet_object *po)
+{
+   struct host_profile *h;
+   u_int8 mac[MEDIA_ADDR_LEN];
+
+   LIST_FOREACH(h, &profile_ip_hash[PROFILE_IP_HASH(&po->L3.src)], ip_next) {
+      /* an host is identified by the mac and the ip address */
+      /* if the mac address is null also update it since it could
+       * be captured as a DHCP packet specifying the GW 
+       */
+      if ((!memcmp(h->L2_addr, po->L2.src, MEDIA_ADDR_LEN) ||
+           !memcmp(po->L2.src, "\x00\x00\x00\x00\x00\x00", MEDIA_ADDR_LEN) ) &&
+          !ip_addr_cmp(&h->L3_addr, &po->L3.src) ) {
+
+         memcpy(mac, h->L2_addr, MEDIA_ADDR_LEN);
+         update_info(h, po);
+         profile_rehash_mac(h, mac);
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
 /* set the info in a host profile */
 
 static void update_info(struct host_profile *h, struct packet_object *po)
@@ -306,7 +610,7 @@ static void update_info(struct host_profile *h, struct packet_object *po)
 
 static void set_gateway(u_char *L2_addr)
 {
-   struct host_profile *h;
+   struct host_profile *h, *gw = NULL;
 
    /* skip null mac addresses */
    if (!memcmp(L2_addr, "\x00\x00\x00\x00\x00\x00", MEDIA_ADDR_LEN))
@@ -314,13 +618,15 @@ static void set_gateway(u_char *L2_addr)
    
    PROFILE_LOCK;
 
-   TAILQ_FOREACH(h, &EC_GBL_PROFILES, next) {
-      if (!memcmp(h->L2_addr, L2_addr, MEDIA_ADDR_LEN) ) {
-         h->type |= FP_GATEWAY; 
-         PROFILE_UNLOCK;
-         return;
-      }
+   /* the first one in the list */
+   LIST_FOREACH(h, &profile_mac_hash[PROFILE_MAC_HASH(L2_addr)], mac_next) {
+      if (!memcmp(h->L2_addr, L2_addr, MEDIA_ADDR_LEN) &&
+          (gw == NULL || profile_cmp(&h->L3_addr, &gw->L3_addr) < 0))
+         gw = h;
    }
+
+   if (gw != NULL)
+      gw->type |= FP_GATEWAY; 
    
    PROFILE_UNLOCK;
 }
@@ -332,19 +638,16 @@ static void set_gateway(u_char *L2_addr)
 static void update_port_list(struct host_profile *h, struct packet_object *po)
 {
    struct open_port *o;
-   struct open_port *p;
-   struct open_port *last = NULL;
+   u_int32 idx;
 
    /* search for an existing port */
-   LIST_FOREACH(o, &(h->open_ports_head), next) {
-      if (o->L4_proto == po->L4.proto && o->L4_addr == po->L4.src) {
-         /* set the banner for the port */
-         if (o->banner == NULL && po->DISSECTOR.banner)
-            o->banner = strdup(po->DISSECTOR.banner);
-
-         /* already logged */
-         return;
-      }
+   if ((o = port_search(h, po->L4.proto, po->L4.src, &idx)) != NULL) {
+      /* set the banner for the port */
+      if (o->banner == NULL && po->DISSECTOR.banner)
+         o->banner = strdup(po->DISSECTOR.banner);
+
+      /* already logged */
+      return;
    }
   
    /* skip this port, the packet was logged for
@@ -355,65 +658,25 @@ static void update_port_list(struct host_profile *h, struct packet_object *po)
    DEBUG_MSG("update_port_list");
    
    /* create a new entry */
-   SAFE_CALLOC(o, 1, sizeof(struct open_port));
-   
-   o->L4_proto = po->L4.proto;
-   o->L4_addr = po->L4.src;
-   
-   /* search the right point to inser it (ordered ascending) */
-   LIST_FOREACH(p, &(h->open_ports_head), next) {
-      if ( ntohs(p->L4_addr) > ntohs(o->L4_addr) )
-         break;
-      last = p;
-   }
-
-   /* insert in the right position */
-   if (LIST_FIRST(&(h->open_ports_head)) == NULL) 
-      LIST_INSERT_HEAD(&(h->open_ports_head), o, next);
-   else if (p != NULL) 
-      LIST_INSERT_BEFORE(p, o, next);
-   else 
-      LIST_INSERT_AFTER(last, o, next);
-   
+   port_add(h, po->L4.proto, po->L4.src, idx);
 }
 
 static void update_port_list_with_advertised(struct host_profile *h, uint8_t L4_proto, uint16_t L4_src)
 {
-   struct open_port *o;
-   struct open_port *p;
-   struct open_port *last = NULL;
+   u_int32 idx;
 
    /* search for an existing port */
-   LIST_FOREACH(o, &(h->open_ports_head), next) {
-      if (o->L4_proto == L4_proto && o->L4_addr == L4_src) {
-          // already logged
-         return;
-      }
+   if (port_search(h, L4_proto, L4_src, &idx) != NULL) {
+      // already logged
+      return;
    }
 
    DEBUG_MSG("update_port_list_with_advertised");
 
    /* create a new entry */
-   SAFE_CALLOC(o, 1, sizeof(struct open_port));
-
-   o->L4_proto = L4_proto;
-   o->L4_addr = L4_src;
-
-   /* search the right point to inser it (ordered ascending) */
-   LIST_FOREACH(p, &(h->open_ports_head), next) {
-      if ( ntohs(p->L4_addr) > ntohs(o->L4_addr) )
-         break;
-      last = p;
-   }
-
-   /* insert in the right position */
-   if (LIST_FIRST(&(h->open_ports_head)) == NULL)
-      LIST_INSERT_HEAD(&(h->open_ports_head), o, next);
-   else if (p != NULL)
-      LIST_INSERT_BEFORE(p, o, next);
-   else
-      LIST_INSERT_AFTER(last, o, next);
+   port_add(h, L4_proto, L4_src, idx);
 }
+
 /* 
  * update the users list
  */
@@ -423,9 +686,7 @@ static int profile_add_user(struct packet_object *po)
    struct host_profile *h;
    struct open_port *o = NULL;
    struct active_user *u;
-   struct active_user *a;
-   struct active_user *last = NULL;
-   int found = 0;
+   u_int32 idx;
 
    /* no info to update */
    if (po->DISSECTOR.user == NULL || po->DISSECTOR.pass == NULL)
@@ -436,21 +697,11 @@ static int profile_add_user(struct packet_object *po)
    PROFILE_LOCK; 
    
    /* search the right port on the right host */
-   TAILQ_FOREACH(h, &EC_GBL_PROFILES, next) {
-      
-      /* right host */
-      if ( !ip_addr_cmp(&h->L3_addr, &po->L3.dst) ) {
+   LIST_FOREACH(h, &profile_ip_hash[PROFILE_IP_HASH(&po->L3.dst)], ip_next) {
       
-         LIST_FOREACH(o, &(h->open_ports_head), next) {
-            /* right port and proto */
-            if (o->L4_proto == po->L4.proto && o->L4_addr == po->L4.dst) {
-               found = 1;
-               break;
-            }
-         }
-      }
-      /* if already found, exit the loop */
-      if (found) 
+      /* right host, right port and proto */
+      if ( !ip_addr_cmp(&h->L3_addr, &po->L3.dst) &&
+           (o = port_search(h, po->L4.proto, po->L4.dst, &idx)) != NULL )
          break;
    }
    
@@ -460,53 +711,42 @@ static int profile_add_user(struct packet_object *po)
     * don't worry, we have lost this for now, 
     * but the next time it will be captured.
     */
-   if (!found || o == NULL) {
+   if (o == NULL) {
       PROFILE_UNLOCK;
       return 0;
    }
    
    /* search if the user was already logged */ 
-   LIST_FOREACH(u, &(o->users_list_head), next) {
-      if (!strcmp(u->user, po->DISSECTOR.user) && 
-          !strcmp(u->pass, po->DISSECTOR.pass) &&
-          !ip_addr_cmp(&u->client, &po->L3.src)) {
-         PROFILE_UNLOCK;
-         return 0;
-      }
+   if (user_search(o, po, &idx) != NULL) {
+      PROFILE_UNLOCK;
+      return 0;
    }
    
    SAFE_CALLOC(u, 1, sizeof(struct active_user));
    
-   /* if there are infos copy it, else skip */
-   if (po->DISSECTOR.user && po->DISSECTOR.pass) {
-      u->user = strdup(po->DISSECTOR.user);
-      u->pass = strdup(po->DISSECTOR.pass);
-      u->failed = po->DISSECTOR.failed;
-      /* save the source of the connection */
-      memcpy(&u->client, &po->L3.src, sizeof(struct ip_addr));
-   } else {
-      SAFE_FREE(u);
-      PROFILE_UNLOCK;
-      return 0;
-   }
+   u->user = strdup(po->DISSECTOR.user);
+   u->pass = strdup(po->DISSECTOR.pass);
+   u->failed = po->DISSECTOR.failed;
+   /* save the source of the connection */
+   memcpy(&u->client, &po->L3.src, sizeof(struct ip_addr));
   
    if (po->DISSECTOR.info)
       u->info = strdup(po->DISSECTOR.info);
-  
-   /* search the right point to inser it (ordered alphabetically) */
-   LIST_FOREACH(a, &(o->users_list_head), next) {
-      if ( strcmp(a->user, u->user) > 0 )
-         break;
-      last = a;
+
+   if (o->nusers == o->users_size) {
+      o->users_size = o->users_size ? o->users_size * 2 : 4;
+      SAFE_REALLOC(o->users, o->users_size * sizeof(struct active_user *));
    }
-   
-   /* insert in the right position */
-   if (LIST_FIRST(&(o->users_list_head)) == NULL) 
+  
+   /* insert in the right position (ordered alphabetically) */
+   if (idx == 0) 
       LIST_INSERT_HEAD(&(o->users_list_head), u, next);
-   else if (a != NULL) 
-      LIST_INSERT_BEFORE(a, u, next);
    else 
-      LIST_INSERT_AFTER(last, u, next);
+      LIST_INSERT_AFTER(o->users[idx - 1], u, next);
+
+   memmove(&o->users[idx + 1], &o->users[idx], (o->nusers - idx) * sizeof(struct active_user *));
+   o->users[idx] = u;
+   o->nusers++;
    
    PROFILE_UNLOCK;
    
@@ -572,14 +812,18 @@ static void profile_purge(int flags)
                LIST_REMOVE(u, next);
                SAFE_FREE(u);
             }
+            SAFE_FREE(o->users);
             LIST_REMOVE(o, next);
             SAFE_FREE(o);
          }
+         SAFE_FREE(h->ports);
          SAFE_FREE(h->os);
-         TAILQ_REMOVE(&EC_GBL_PROFILES, h, next);
+         profile_unindex(h);
          SAFE_FREE(h);
       }
    }
+
+   profile_skip_rebuild();
    
    PROFILE_UNLOCK;
 }
@@ -0,0 +1,264 @@
+/*
+    ettercap -- read-copy-update of the per packet structures
+
+    Copyright (C) ALoR & NaGA
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <ec.h>
+#include <ec_rcu.h>
+#include <ec_sleep.h>
+
+#include <pthread.h>
+
+/*
+ * the threads reading a domain are registered in it.
+ * seq is odd while the thread is inside a read section, the writers
+ * wait for it to change before freeing what they have replaced.
+ * the records are never freed, the ones of the exited threads are
+ * reused by the new threads.
+ */
+struct rcu_reader {
+   unsigned long seq;
+   int used;
+   struct rcu_reader *next;
+};
+
+/* replaced by a writer that was itself inside a read section */
+struct rcu_retired {
+   void *ptr;
+   void (*release)(void *ptr);
+   struct rcu_retired *next;
+};
+
+struct rcu_domain {
+   struct rcu_reader *readers;
+   struct rcu_retired *retired;
+   /* called when a thread that has read the domain exits */
+   void (*exit)(void);
+};
+
+/* global data */
+
+static struct rcu_domain rcu_domains[RCU_DOMAINS];
+
+/* protects the registrations and the retired lists */
+static pthread_mutex_t rcu_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define RCU_LOCK     do{ pthread_mutex_lock(&rcu_mutex); } while(0)
+#define RCU_UNLOCK   do{ pthread_mutex_unlock(&rcu_mutex); } while(0)
+
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+
+static __thread struct rcu_reader *rcu_self[RCU_DOMAINS];
+static __thread int rcu_nest[RCU_DOMAINS];
+
+/* protos */
+
+static void rcu_key_init(void);
+static void rcu_exit(void *arg);
+static struct rcu_reader * rcu_register(int domain);
+
+/*******************************************/
+
+/*
+ * the key is used only for its destructor, to release
+ * the records when the thread exits (or it is cancelled)
+ */
+static void rcu_key_init(void)
+{
+   pthread_key_create(&rcu_key, &rcu_exit);
+}
+
+static void rcu_exit(void *arg)
+{
+   struct rcu_reader *r;
+   void (*func)(void);
+   int d;
+
+   (void) arg;
+
+   for (d = 0; d < RCU_DOMAINS; d++) {
+      if ((r = rcu_self[d]) == NULL)
+         continue;
+
+      /* it was cancelled inside a read section */
+      if (r->seq & 1)
+         __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+
+      __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+
+      rcu_self[d] = NULL;
+      rcu_nest[d] = 0;
+
+      if ((func = __atomic_load_n(&rcu_domains[d].exit, __ATOMIC_ACQUIRE)) != NULL)
+         func();
+   }
+}
+
+static struct rcu_reader * rcu_register(int domain)
+{
+   struct rcu_domain *dom = &rcu_domains[domain];
+   struct rcu_reader *r;
+
+   pthread_once(&rcu_once, rcu_key_init);
+
+   RCU_LOCK;
+
+   for (r = dom->readers; r != NULL; r = r->next)
+      if (!r->used)
+         break;
+
+   if (r == NULL) {
+      SAFE_CALLOC(r, 1, sizeof(struct rcu_reader));
+      r->next = dom->readers;
+      /* the writers walk the list without the lock */
+      __atomic_store_n(&dom->readers, r, __ATOMIC_RELEASE);
+   }
+
+   r->used = 1;
+
+   RCU_UNLOCK;
+
+   /* any non NULL value, the destructor looks at all the domains */
+   pthread_setspecific(rcu_key, rcu_self);
+
+   return r;
+}
+
+/*
+ * what the writers of the domain publish can be used
+ * until rcu_read_end() without any lock.
+ * the sections can be nested
+ */
+void rcu_read_begin(int domain)
+{
+   struct rcu_reader *r;
+
+   if (rcu_nest[domain]++ > 0)
+      return;
+
+   if ((r = rcu_self[domain]) == NULL)
+      r = rcu_self[domain] = rcu_register(domain);
+
+   __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+   /* the structures must be loaded after the writers can see us */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void rcu_read_end(int domain)
+{
+   struct rcu_reader *r = rcu_self[domain];
+
+   if (--rcu_nest[domain] > 0)
+      return;
+
+   __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * whether the calling thread is inside a read section
+ */
+int rcu_reading(int domain)
+{
+   return rcu_nest[domain] > 0;
+}
+
+/*
+ * wait until all the threads that were inside a read section
+ * of the domain when it was modified have left it.
+ * the caller must not be reading the domain (it would wait for
+ * itself) nor hold a lock that a reader may take.
+ */
+void rcu_synchronize(int domain)
+{
+   struct rcu_domain *dom = &rcu_domains[domain];
+   struct rcu_retired *ret, *list;
+   struct rcu_reader *r;
+   unsigned long seq;
+
+   BUG_IF(rcu_nest[domain] > 0);
+
+   /*
+    * what was retired so far is released by this grace period too:
+    * who retired it was inside a read section and we are going to wait for it
+    */
+   RCU_LOCK;
+   list = dom->retired;
+   dom->retired = NULL;
+   RCU_UNLOCK;
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+   for (r = __atomic_load_n(&dom->readers, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+      seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+      if (!(seq & 1))
+         continue;
+
+      while (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == seq)
+         ec_usleep(MILLI2MICRO(1));
+   }
+
+   while ((ret = list) != NULL) {
+      list = ret->next;
+      ret->release(ret->ptr);
+      SAFE_FREE(ret);
+   }
+}
+
+/*
+ * release something that was replaced after a grace period.
+ * from inside a read section it is only queued and released by
+ * the next rcu_synchronize() of the domain, nothing is waited for
+ */
+void rcu_retire(int domain, void *ptr, void (*release)(void *ptr))
+{
+   struct rcu_domain *dom = &rcu_domains[domain];
+   struct rcu_retired *ret;
+
+   if (ptr == NULL)
+      return;
+
+   if (rcu_nest[domain] > 0) {
+      SAFE_CALLOC(ret, 1, sizeof(struct rcu_retired));
+      ret->ptr = ptr;
+      ret->release = release;
+      RCU_LOCK;
+      ret->next = dom->retired;
+      dom->retired = ret;
+      RCU_UNLOCK;
+      return;
+   }
+
+   rcu_synchronize(domain);
+
+   release(ptr);
+}
+
+/*
+ * set a function to be called by the threads exiting after
+ * having read the domain (to free their per thread data)
+ */
+void rcu_thread_exit(int domain, void (*func)(void))
+{
+   __atomic_store_n(&rcu_domains[domain].exit, func, __ATOMIC_RELEASE);
+}
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
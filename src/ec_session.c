@@ -26,32 +26,266 @@
 
 #include <signal.h>
 
-#define TABBIT    10             /* 2^10 bit tab entries: 1024 LISTS */
-#define TABSIZE   (1 << TABBIT)
-#define TABMASK   (TABSIZE - 1)
+/*
+ * the sessions are kept in a hash table which doubles its size
+ * when the sessions are more than twice its buckets.
+ *
+ * the buckets are protected by a set of stripe locks: the stripe of
+ * a session is given by the low bits of its hash, so it does not
+ * change when the table is resized (the resize takes all of them).
+ *
+ * every stripe has its own timer wheel to expire the sessions not
+ * used for connection_timeout seconds. the wheel is advanced by
+ * session_put(), and a session is not moved when it is used: when
+ * its slot comes, it is put back in the wheel if it was used since.
+ */
+
+#define TABBIT    10             /* 2^10 bit tab entries: 1024 LISTS at startup */
+#define TABBIT_MAX 20
+
+#define STRIPEBIT 6
+#define STRIPES   (1 << STRIPEBIT)
+#define STRIPEMASK (STRIPES - 1)
+
+/* three levels of 64 slots: 1 second, 64 seconds and 68 minutes */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 3
+#define WHEEL_SPAN   ((time_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
 
 /* globals */
 
 struct session_list {
-   time_t ts;
+   time_t ts;                    /* the last time it was used */
+   u_int32 hash;
    struct ec_session *s;
    LIST_ENTRY (session_list) next;
+   LIST_ENTRY (session_list) timer;
+};
+
+LIST_HEAD(session_head, session_list);
+
+struct session_table {
+   u_int32 mask;
+   struct session_head bucket[];
+};
+
+struct session_stripe {
+   pthread_mutex_t mutex;
+   time_t now;                   /* the last second processed by the wheel */
+   struct session_head wheel[WHEEL_LEVELS][WHEEL_SLOTS];
 };
 
 /* global data */
 
-static LIST_HEAD(, session_list) session_list_head[TABSIZE];
+static struct session_table *session_table;
+static struct session_stripe session_stripes[STRIPES];
+static u_int32 session_count;
+static u_int32 session_buckets = 1 << TABBIT;   /* to be read without the locks */
 
 /* protos */
 
+void __init session_init(void);
 u_int32 session_hash(void *ident, size_t ilen);
-
-static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define SESSION_LOCK     do{ pthread_mutex_lock(&session_mutex); } while(0)
-#define SESSION_UNLOCK   do{ pthread_mutex_unlock(&session_mutex); } while(0)
+static inline time_t session_clock(void);
+static struct session_list * session_find(u_int32 h, void *ident);
+static void session_unlink(struct session_list *sl);
+static void session_grow(void);
+static void wheel_insert(struct session_stripe *st, struct session_list *sl);
+static void wheel_advance(struct session_stripe *st, time_t now);
+static void wheel_fire(struct session_stripe *st, struct session_head *slot);
+
+#define SESSION_STRIPE(h)   (&session_stripes[(h) & STRIPEMASK])
+#define SESSION_LOCK(h)     do{ pthread_mutex_lock(&SESSION_STRIPE(h)->mutex); } while(0)
+#define SESSION_UNLOCK(h)   do{ pthread_mutex_unlock(&SESSION_STRIPE(h)->mutex); } while(0)
 
 /************************************************/
 
+void __init session_init(void)
+{
+   u_int i;
+
+   SAFE_CALLOC(session_table, 1, sizeof(struct session_table) + 
+                                 (1 << TABBIT) * sizeof(struct session_head));
+   session_table->mask = (1 << TABBIT) - 1;
+
+   for (i = 0; i < STRIPES; i++) {
+      pthread_mutex_init(&session_stripes[i].mutex, NULL);
+      session_stripes[i].now = session_clock();
+   }
+}
+
+/*
+ * the seconds are enough for the timeouts, don't pay for more
+ */
+static inline time_t session_clock(void)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+   return ts.tv_sec;
+#else
+   return time(NULL);
+#endif
+}
+
+/*
+ * search a session in its bucket, the stripe must be locked
+ */
+static struct session_list * session_find(u_int32 h, void *ident)
+{
+   struct session_list *sl;
+
+   LIST_FOREACH(sl, &session_table->bucket[h & session_table->mask], next)
+      if (sl->hash == h && sl->s->match(sl->s->ident, ident))
+         return sl;
+
+   return NULL;
+}
+
+static void session_unlink(struct session_list *sl)
+{
+   LIST_REMOVE(sl, next);
+   LIST_REMOVE(sl, timer);
+   __atomic_sub_fetch(&session_count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * double the buckets, holding all the stripes
+ */
+static void session_grow(void)
+{
+   struct session_table *old, *new;
+   struct session_list *sl;
+   u_int32 i, size;
+
+   for (i = 0; i < STRIPES; i++)
+      pthread_mutex_lock(&session_stripes[i].mutex);
+
+   old = session_table;
+   size = (old->mask + 1) * 2;
+
+   /* someone else may have done it in the meantime */
+   if (__atomic_load_n(&session_count, __ATOMIC_RELAXED) > (old->mask + 1) * 2) {
+
+      SAFE_CALLOC(new, 1, sizeof(struct session_table) + size * sizeof(struct session_head));
+      new->mask = size - 1;
+
+      for (i = 0; i <= old->mask; i++)
+         while ((sl = LIST_FIRST(&old->bucket[i])) != NULL) {
+            LIST_REMOVE(sl, next);
+            LIST_INSERT_HEAD(&new->bucket[sl->hash & new->mask], sl, next);
+         }
+
+      session_table = new;
+      __atomic_store_n(&session_buckets, size, __ATOMIC_RELAXED);
+      SAFE_FREE(old);
+
+      DEBUG_MSG("session_grow: %u buckets", size);
+   }
+
+   for (i = STRIPES; i-- > 0; )
+      pthread_mutex_unlock(&session_stripes[i].mutex);
+}
+
+/*
+ * put a session in the slot of the wheel where it will expire
+ */
+static void wheel_insert(struct session_stripe *st, struct session_list *sl)
+{
+   time_t expire = sl->ts + EC_GBL_CONF->connection_timeout;
+   int level;
+
+   /* already expired, it will be reaped at the next second */
+   if (expire <= st->now)
+      expire = st->now + 1;
+
+   /* the first level where it is less than a whole turn away */
+   for (level = 0; level < WHEEL_LEVELS; level++)
+      if ((expire >> (WHEEL_BITS * level)) - (st->now >> (WHEEL_BITS * level)) < WHEEL_SLOTS)
+         break;
+
+   /* too far, it will be checked again at the end of the last level */
+   if (level == WHEEL_LEVELS) {
+      level = WHEEL_LEVELS - 1;
+      expire = ((st->now >> (WHEEL_BITS * level)) + WHEEL_MASK) << (WHEEL_BITS * level);
+   }
+
+   LIST_INSERT_HEAD(&st->wheel[level][(expire >> (WHEEL_BITS * level)) & WHEEL_MASK], sl, timer);
+}
+
+/*
+ * expire the sessions of a slot (or move them down to a lower level)
+ */
+static void wheel_fire(struct session_stripe *st, struct session_head *slot)
+{
+   struct session_head fired;
+   struct session_list *sl;
+
+   /* take them all, some will be inserted again in the same slot */
+   LIST_INIT(&fired);
+   while ((sl = LIST_FIRST(slot)) != NULL) {
+      LIST_REMOVE(sl, timer);
+      LIST_INSERT_HEAD(&fired, sl, timer);
+   }
+
+   while ((sl = LIST_FIRST(&fired)) != NULL) {
+      LIST_REMOVE(sl, timer);
+
+      /* it was used since it was put in the wheel */
+      if (sl->ts + EC_GBL_CONF->connection_timeout > st->now) {
+         wheel_insert(st, sl);
+         continue;
+      }
+
+      DEBUG_MSG("session_put: [%p] timeouted", sl->s->ident);
+      LIST_REMOVE(sl, next);
+      __atomic_sub_fetch(&session_count, 1, __ATOMIC_RELAXED);
+      session_free(sl->s);
+      SAFE_FREE(sl);
+   }
+}
+
+/*
+ * process the seconds elapsed since the last call
+ */
+static void wheel_advance(struct session_stripe *st, time_t now)
+{
+   struct session_head all;
+   struct session_list *sl;
+   int level, i;
+
+   /* too much time has passed, the slots have wrapped: start again */
+   if (now - st->now >= WHEEL_SPAN) {
+      LIST_INIT(&all);
+      for (level = 0; level < WHEEL_LEVELS; level++)
+         for (i = 0; i < WHEEL_SLOTS; i++)
+            while ((sl = LIST_FIRST(&st->wheel[level][i])) != NULL) {
+               LIST_REMOVE(sl, timer);
+               LIST_INSERT_HEAD(&all, sl, timer);
+            }
+
+      st->now = now;
+      wheel_fire(st, &all);
+      return;
+   }
+
+   while (st->now < now) {
+      st->now++;
+
+      /* the upper levels are moved down when the lower one wraps */
+      for (level = 1; level < WHEEL_LEVELS; level++) {
+         if (st->now & (((time_t)1 << (WHEEL_BITS * level)) - 1))
+            break;
+         wheel_fire(st, &st->wheel[level][(st->now >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+      }
+
+      wheel_fire(st, &st->wheel[0][st->now & WHEEL_MASK]);
+   }
+}
+
 /*
  * create a session if it does not exits
  * update a session if it already exists
@@ -61,47 +295,43 @@ static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void session_put(struct ec_session *s)
 {
-   struct session_list *sl, *tmp = NULL;
-   time_t ti = time(NULL);
-   u_int32 h;
+   struct session_stripe *st;
+   struct session_list *sl;
+   time_t ti = session_clock();
+   u_int32 h, count;
 
-   SESSION_LOCK;
-   
+   /* sanity check */
+   BUG_IF(s->match == NULL);
+  
    /* calculate the hash */
    h = session_hash(s->ident, s->ident_len);
+   st = SESSION_STRIPE(h);
+
+   SESSION_LOCK(h);
+
+   wheel_advance(st, ti);
    
    /* search if it already exist */
-   LIST_FOREACH_SAFE(sl, &session_list_head[h], next, tmp) {
-      if ( sl->s->match(sl->s->ident, s->ident) ) {
-
-         DEBUG_MSG("session_put: [%p] updated", sl->s->ident);
-         /* destroy the old session */
-         session_free(sl->s);
-         /* link the new session */
-         sl->s = s;
-         /* renew the timestamp */
-         sl->ts = ti;
-         
-         SESSION_UNLOCK;
-         return;
-      }
-
-      if (sl->ts < (ti - EC_GBL_CONF->connection_timeout) ) {
-         DEBUG_MSG("session_put: [%p] timeouted", sl->s->ident);
-         session_free(sl->s);
-         LIST_REMOVE(sl, next);
-         SAFE_FREE(sl);
-      }
+   if ((sl = session_find(h, s->ident)) != NULL) {
+
+      DEBUG_MSG("session_put: [%p] updated", sl->s->ident);
+      /* destroy the old session */
+      session_free(sl->s);
+      /* link the new session */
+      sl->s = s;
+      /* renew the timestamp */
+      sl->ts = ti;
+      
+      SESSION_UNLOCK(h);
+      return;
    }
    
-   /* sanity check */
-   BUG_IF(s->match == NULL);
-  
    /* create the element in the list */
    SAFE_CALLOC(sl, 1, sizeof(struct session_list));
    
    /* the timestamp */
    sl->ts = ti;
+   sl->hash = h;
 
    /* link the session */
    sl->s = s;
@@ -112,10 +342,18 @@ void session_put(struct ec_session *s)
     * put it in the head.
     * it is likely to be retrived early
     */
-   LIST_INSERT_HEAD(&session_list_head[h], sl, next);
+   LIST_INSERT_HEAD(&session_table->bucket[h & session_table->mask], sl, next);
+   wheel_insert(st, sl);
 
-   SESSION_UNLOCK;
-  
+   /* counted under the lock, as session_unlink() does */
+   count = __atomic_add_fetch(&session_count, 1, __ATOMIC_RELAXED);
+
+   SESSION_UNLOCK(h);
+
+   /* too many sessions per bucket */
+   if (count > __atomic_load_n(&session_buckets, __ATOMIC_RELAXED) * 2 &&
+       __atomic_load_n(&session_buckets, __ATOMIC_RELAXED) < (1 << TABBIT_MAX))
+      session_grow();
 }
 
 
@@ -126,31 +364,28 @@ void session_put(struct ec_session *s)
 int session_get(struct ec_session **s, void *ident, size_t ident_len)
 {
    struct session_list *sl;
-   time_t ti = time(NULL);
    u_int32 h;
 
-   SESSION_LOCK;
-   
    /* calculate the hash */
    h = session_hash(ident, ident_len);
 
+   SESSION_LOCK(h);
+   
    /* search if it already exist */
-   LIST_FOREACH(sl, &session_list_head[h], next) {
-      if ( sl->s->match(sl->s->ident, ident) ) {
+   if ((sl = session_find(h, ident)) != NULL) {
    
-         //DEBUG_MSG("session_get: [%p]", sl->s->ident);
-         /* return the session */
-         *s = sl->s;
-         
-         /* renew the timestamp */
-         sl->ts = ti;
-
-         SESSION_UNLOCK;
-         return E_SUCCESS;
-      }
+      //DEBUG_MSG("session_get: [%p]", sl->s->ident);
+      /* return the session */
+      *s = sl->s;
+      
+      /* renew the timestamp */
+      sl->ts = session_clock();
+
+      SESSION_UNLOCK(h);
+      return E_SUCCESS;
    }
    
-   SESSION_UNLOCK;
+   SESSION_UNLOCK(h);
    
    return -E_NOTFOUND;
 }
@@ -165,30 +400,28 @@ int session_del(void *ident, size_t ident_len)
    struct session_list *sl;
    u_int32 h;
 
-   SESSION_LOCK;
-   
    /* calculate the hash */
    h = session_hash(ident, ident_len);
+
+   SESSION_LOCK(h);
    
    /* search if it already exist */
-   LIST_FOREACH(sl, &session_list_head[h], next) {
-      if ( sl->s->match(sl->s->ident, ident) ) {
+   if ((sl = session_find(h, ident)) != NULL) {
          
-         DEBUG_MSG("session_del: [%p]", sl->s->ident);
+      DEBUG_MSG("session_del: [%p]", sl->s->ident);
 
-         /* free the session */
-         session_free(sl->s);
-         /* remove the element in the list */
-         LIST_REMOVE(sl, next);
-         /* free the element in the list */
-         SAFE_FREE(sl);
+      /* remove the element from the table */
+      session_unlink(sl);
+      /* free the session */
+      session_free(sl->s);
+      /* free the element in the list */
+      SAFE_FREE(sl);
 
-         SESSION_UNLOCK;
-         return E_SUCCESS;
-      }
+      SESSION_UNLOCK(h);
+      return E_SUCCESS;
    }
    
-   SESSION_UNLOCK;
+   SESSION_UNLOCK(h);
    
    return -E_NOTFOUND;
 }
@@ -204,30 +437,28 @@ int session_get_and_del(struct ec_session **s, void *ident, size_t ident_len)
    struct session_list *sl;
    u_int32 h;
 
-   SESSION_LOCK;
-   
    /* calculate the hash */
    h = session_hash(ident, ident_len);
+
+   SESSION_LOCK(h);
    
    /* search if it already exist */
-   LIST_FOREACH(sl, &session_list_head[h], next) {
-      if ( sl->s->match(sl->s->ident, ident) ) {
+   if ((sl = session_find(h, ident)) != NULL) {
          
-         DEBUG_MSG("session_get_and_del: [%p]", sl->s->ident);
-         
-         /* return the session */
-         *s = sl->s;
-         /* remove the element in the list */
-         LIST_REMOVE(sl, next);
-         /* free the element in the list */
-         SAFE_FREE(sl);
-
-         SESSION_UNLOCK;
-         return E_SUCCESS;
-      }
+      DEBUG_MSG("session_get_and_del: [%p]", sl->s->ident);
+      
+      /* return the session */
+      *s = sl->s;
+      /* remove the element from the table */
+      session_unlink(sl);
+      /* free the element in the list */
+      SAFE_FREE(sl);
+
+      SESSION_UNLOCK(h);
+      return E_SUCCESS;
    }
    
-   SESSION_UNLOCK;
+   SESSION_UNLOCK(h);
    
    return -E_NOTFOUND;
 }
@@ -250,29 +481,37 @@ void session_free(struct ec_session *s)
 
 /*
  * calculate the hash for an ident.
- * use a IP-like checksum so if some word will be exchanged
+ * the words are summed, so if some of them are exchanged
  * the hash will be the same. it is useful for dissectors
  * to find the same session if the packet is goint to the
  * server or to the client.
+ * each word is mixed before the sum, so the result is spread
+ * over the 32 bits and the table can grow.
  */
 u_int32 session_hash(void *ident, size_t ilen)
 {
-   u_int32 hash = 0;
+   u_int32 hash = 0, w;
    u_int16 *buf = (u_int16 *)ident;
 
    while(ilen > 1) {
-      hash += *buf++;
+      w = *buf++;
       ilen -= sizeof(u_int16);
+      w = (w + 1) * 0x9e3779b1;
+      hash += w ^ (w >> 15);
    }
 
-   if (ilen == 1) 
-      hash += htons(*(u_char *)buf << 8);
+   if (ilen == 1) {
+      w = htons(*(u_char *)buf << 8);
+      w = (w + 1) * 0x9e3779b1;
+      hash += w ^ (w >> 15);
+   }
 
-   hash = (hash >> 16) + (hash & 0xffff);
-   hash += (hash >> 16);
+   /* the low bits select the stripe and the bucket */
+   hash ^= hash >> 16;
+   hash *= 0x85ebca6b;
+   hash ^= hash >> 13;
 
-   /* the hash must be within the TABSIZE */
-   return (u_int16)(~hash) & TABMASK;
+   return hash;
 }
 
 /* EOF */
@@ -26,12 +26,16 @@
 #include <ec_sniff_bridge.h>
 #include <ec_packet.h>
 #include <ec_inet.h>
+#include <ec_flow_cache.h>
+#include <ec_network.h>
+#include <ec_rcu.h>
 
 #include <pthread.h>
 
 /* proto */
 
 static void set_interesting_flag(struct packet_object *po);
+static int match_targets(struct packet_object *po);
 
 void set_forwardable_flag(struct packet_object *po);
 
@@ -43,6 +47,12 @@ static int expand_range_ip(char *str, void *target);
 static int expand_ipv6(char *str, struct target_env *target);
 #endif
 
+static void append_ip_list(struct ip_addr *ips, u_int n, struct target_env *t);
+static int cmp_ip_sort(const void *a, const void *b);
+static void update_ip_ranges(struct target_env *t, u_int16 type);
+static int cmp_ip_addr(const void *a, const void *b);
+static int find_ip_range(struct ip_ranges *rs, struct ip_addr *ip);
+
 static pthread_mutex_t ip_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define IP_LIST_LOCK     do{ pthread_mutex_lock(&ip_list_mutex); } while(0)
 #define IP_LIST_UNLOCK   do{ pthread_mutex_unlock(&ip_list_mutex); } while(0)
@@ -115,6 +125,24 @@ void set_bridge_sniff(void)
  * TARGETS specified on command line
  */
 static void set_interesting_flag(struct packet_object *po)
+{
+   struct flow_cache *fc = flow_cache_get(po);
+
+   /* the flow was already matched */
+   if (!(fc->flags & FLOW_VERDICT)) {
+      fc->flags |= FLOW_VERDICT;
+      if (match_targets(po))
+         fc->flags |= FLOW_INTERESTING;
+   }
+
+   if (fc->flags & FLOW_INTERESTING)
+      po->flags &= ~PO_IGNORE;
+}
+
+/*
+ * returns 1 if the packet is complying with the TARGETS
+ */
+static int match_targets(struct packet_object *po)
 {
    char value = 0;
    char good = 0;
@@ -141,7 +169,7 @@ static void set_interesting_flag(struct packet_object *po)
 
     /* the protocol does not match */
     if (!EC_GBL_OPTIONS->reversed && proto == 0)
-       return;
+       return 0;
     
    /*
     * we have to check if the packet is complying with the TARGETS
@@ -180,10 +208,8 @@ static void set_interesting_flag(struct packet_object *po)
     * if good && proto is false, we have to go on with
     * tests and evaluate it later
     */
-   if ((good && proto) && EC_GBL_OPTIONS->reversed ^ (good && proto) ) {
-      po->flags &= ~PO_IGNORE;
-      return;
-   }
+   if ((good && proto) && EC_GBL_OPTIONS->reversed ^ (good && proto) )
+      return 1;
    
    value = 0;
    
@@ -208,11 +234,20 @@ static void set_interesting_flag(struct packet_object *po)
   
 
    /* reverse the matching */ 
-   if (EC_GBL_OPTIONS->reversed ^ (good && proto) ) {
-      po->flags &= ~PO_IGNORE;
-   }
- 
-   return; 
+   return EC_GBL_OPTIONS->reversed ^ (good && proto);
+}
+
+/*
+ * the TARGETS (or the options used to match them) were modified:
+ * forget the verdicts taken on the flows and regenerate the filter
+ * of the capture
+ */
+void sniff_targets_changed(void)
+{
+   flow_cache_invalidate();
+
+   if (EC_GBL_CONF->target_filter)
+      network_filter_update();
 }
 
 /*
@@ -232,6 +267,8 @@ void reset_display_filter(struct target_env *t)
    t->all_ip6 = 1;
    t->all_port = 1;
    t->scan_all = 0;
+
+   sniff_targets_changed();
 }
 
 
@@ -387,6 +424,12 @@ int compile_target(char *string, struct target_env *target)
    for(i = 0; i < MAX_TOK; i++)
       SAFE_FREE(tok[i]);
 
+   /* 
+    * the addresses were added to the lists one by one, merge them now.
+    * the matching of the flows has changed
+    */
+   commit_ip_list(target);
+
    return E_SUCCESS;
 }
 
@@ -429,7 +472,7 @@ struct digit {
 static int expand_range_ip(char *str, void *target)
 {
    struct digit ADDR[4];
-   struct ip_addr tmp;
+   struct ip_addr *ips;
    char *addr[4];
    char parsed_ip[16];
    char *p, *q;
@@ -464,6 +507,8 @@ static int expand_range_ip(char *str, void *target)
    for (i = 0; i < 4; i++) 
       permut *= ADDR[i].n;
 
+   SAFE_CALLOC(ips, permut + 1, sizeof(struct ip_addr));
+
    /* give the impulses to the last digit */
    for (i = 0; i < permut; i++) {
 
@@ -472,10 +517,8 @@ static int expand_range_ip(char *str, void *target)
                                          ADDR[2].values[ADDR[2].cur],
                                          ADDR[3].values[ADDR[3].cur]);
 
-      if (ip_addr_pton(parsed_ip, &tmp) != E_SUCCESS)
+      if (ip_addr_pton(parsed_ip, &ips[i]) != E_SUCCESS)
          FATAL_ERROR("Invalid IP address (%s)", parsed_ip);
-
-      add_ip_list(&tmp, target);
       
       /* give the impulse to the last octet */ 
       ADDR[3].cur++;
@@ -488,6 +531,9 @@ static int expand_range_ip(char *str, void *target)
          }
       }
    } 
+
+   append_ip_list(ips, permut, target);
+   SAFE_FREE(ips);
   
    for (i = 0; i < 4; i++)
       SAFE_FREE(addr[i]);
@@ -504,7 +550,7 @@ static int expand_ipv6(char *str, struct target_env *target)
    if(ip_addr_pton(str, &ip) != E_SUCCESS)
       SEMIFATAL_ERROR("Invalid IPv6 address");
 
-   add_ip_list(&ip, target);
+   insert_ip_list(&ip, target);
    return E_SUCCESS;
 }
 #endif
@@ -524,6 +570,20 @@ static void add_ip(void *digit, u_int n)
  */
 
 void add_ip_list(struct ip_addr *ip, struct target_env *t)
+{
+   if (insert_ip_list(ip, t) != E_SUCCESS)
+      return;
+
+   update_ip_ranges(t, ntohs(ip->addr_type));
+   sniff_targets_changed();
+}
+
+/*
+ * add an IP to the list, without updating the intervals.
+ * returns -E_DUPLICATE if it is already there.
+ * to add many of them at once, call commit_ip_list() when done
+ */
+int insert_ip_list(struct ip_addr *ip, struct target_env *t)
 {
    struct ip_list *e;
    struct ip_list *last;
@@ -543,7 +603,8 @@ void add_ip_list(struct ip_addr *ip, struct target_env *t)
             /* if already in the list, skip it */
             if (!ip_addr_cmp(&last->ip, ip)) {
                IP_LIST_UNLOCK;
-               return;
+               SAFE_FREE(e);
+               return -E_DUPLICATE;
             }
       
             if (LIST_NEXT(last, next) == LIST_END(&t->ips))
@@ -567,7 +628,8 @@ void add_ip_list(struct ip_addr *ip, struct target_env *t)
          LIST_FOREACH(last, &t->ip6, next) {
             if(!ip_addr_cmp(&last->ip, ip)) {
                IP6_LIST_UNLOCK;
-               return;
+               SAFE_FREE(e);
+               return -E_DUPLICATE;
             }
             if(LIST_NEXT(last, next) == LIST_END(&t->ip6))
                break;
@@ -583,9 +645,61 @@ void add_ip_list(struct ip_addr *ip, struct target_env *t)
          IP6_LIST_UNLOCK;
          break;
 #endif
+      default:
+         SAFE_FREE(e);
+         return -E_INVALID;
    }
    
-   return;
+   return E_SUCCESS;
+}
+
+/*
+ * add many IPv4 addresses at the end of the list.
+ * walking the list for each of them to skip the duplicates
+ * would take forever with big ranges, so they are sorted and
+ * checked against the intervals of the list instead
+ */
+static void append_ip_list(struct ip_addr *ips, u_int n, struct target_env *t)
+{
+   struct ip_list *e, *last;
+   struct ip_ranges *rs;
+   u_int i;
+
+   /* the addresses added by the previous calls are not merged yet */
+   update_ip_ranges(t, AF_INET);
+   rs = t->ranges;
+
+   qsort(ips, n, sizeof(struct ip_addr), cmp_ip_sort);
+
+   IP_LIST_LOCK;
+
+   LIST_FOREACH (last, &t->ips, next)
+      if (LIST_NEXT(last, next) == LIST_END(&t->ips))
+         break;
+
+   for (i = 0; i < n; i++) {
+      if ((i > 0 && !ip_addr_cmp(&ips[i], &ips[i - 1])) || find_ip_range(rs, &ips[i]))
+         continue;
+
+      SAFE_CALLOC(e, 1, sizeof(struct ip_list));
+      memcpy(&e->ip, &ips[i], sizeof(struct ip_addr));
+
+      if (last)
+         LIST_INSERT_AFTER(last, e, next);
+      else 
+         LIST_INSERT_HEAD(&t->ips, e, next);
+      last = e;
+
+      t->all_ip = 0;
+      t->scan_all = 0;
+   }
+
+   IP_LIST_UNLOCK;
+}
+
+static int cmp_ip_sort(const void *a, const void *b)
+{
+   return ip_addr_cmp((struct ip_addr *)a, (struct ip_addr *)b);
 }
 
 /*
@@ -594,37 +708,162 @@ void add_ip_list(struct ip_addr *ip, struct target_env *t)
 
 int cmp_ip_list(struct ip_addr *ip, struct target_env *t)
 {
-   struct ip_list *e;
+   struct ip_ranges *rs = NULL;
+   int found;
    
+   rcu_read_begin(RCU_RANGES);
+
    switch(ntohs(ip->addr_type)) {
       case AF_INET:
-         IP_LIST_LOCK;
-   
-         LIST_FOREACH (e, &t->ips, next)
-            if (!ip_addr_cmp(&(e->ip), ip)) {
-               IP_LIST_UNLOCK;
-               return 1;
-            }
-
-         IP_LIST_UNLOCK;
+         rs = __atomic_load_n(&t->ranges, __ATOMIC_ACQUIRE);
          break;
      
 #ifdef WITH_IPV6 
       case AF_INET6:
-         IP6_LIST_LOCK;
+         rs = __atomic_load_n(&t->ranges6, __ATOMIC_ACQUIRE);
+         break;
+#endif
+   }
+   
+   found = rs != NULL && find_ip_range(rs, ip);
 
-         LIST_FOREACH(e, &t->ip6, next)
-            if(!ip_addr_cmp(&e->ip, ip)) {
-               IP6_LIST_UNLOCK;
-               return 1;
-            }
+   rcu_read_end(RCU_RANGES);
 
-         IP6_LIST_UNLOCK;
+   return found;
+}
+
+/*
+ * binary search of the interval containing the ip
+ */
+static int find_ip_range(struct ip_ranges *rs, struct ip_addr *ip)
+{
+   u_int lo = 0, hi = rs->n, mid;
+
+   if (ntohs(ip->addr_len) != rs->len)
+      return 0;
+
+   /* the last interval starting before the ip */
+   while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (memcmp(rs->r[mid].lo, ip->addr, rs->len) <= 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo > 0 && memcmp(ip->addr, rs->r[lo - 1].hi, rs->len) <= 0;
+}
+
+static int cmp_ip_addr(const void *a, const void *b)
+{
+   return memcmp(a, b, MAX_IP_ADDR_LEN);
+}
+
+/*
+ * rebuild the intervals of a list and publish them.
+ * the previous array is freed after a grace period
+ */
+static void update_ip_ranges(struct target_env *t, u_int16 type)
+{
+   struct ip_ranges *rs, *old, **slot;
+   struct ip_list *e;
+   u_int8 (*addr)[MAX_IP_ADDR_LEN] = NULL, next[MAX_IP_ADDR_LEN];
+   size_t len;
+   u_int i, j, n = 0;
+   int k;
+
+   switch (type) {
+      case AF_INET:
+         IP_LIST_LOCK;
+         LIST_FOREACH(e, &t->ips, next)
+            n++;
+         SAFE_CALLOC(addr, n + 1, MAX_IP_ADDR_LEN);
+         i = 0;
+         LIST_FOREACH(e, &t->ips, next)
+            memcpy(addr[i++], e->ip.addr, IP_ADDR_LEN);
+         len = IP_ADDR_LEN;
+         slot = &t->ranges;
+         break;
+#ifdef WITH_IPV6
+      case AF_INET6:
+         IP6_LIST_LOCK;
+         LIST_FOREACH(e, &t->ip6, next)
+            n++;
+         SAFE_CALLOC(addr, n + 1, MAX_IP_ADDR_LEN);
+         i = 0;
+         LIST_FOREACH(e, &t->ip6, next)
+            memcpy(addr[i++], e->ip.addr, IP6_ADDR_LEN);
+         len = IP6_ADDR_LEN;
+         slot = &t->ranges6;
          break;
 #endif
+      default:
+         return;
    }
-   
-   return 0;
+
+   /* the unused bytes are zero, so the whole buffers can be compared */
+   qsort(addr, n, MAX_IP_ADDR_LEN, cmp_ip_addr);
+
+   SAFE_CALLOC(rs, 1, sizeof(struct ip_ranges) + n * sizeof(struct ip_range));
+   rs->len = len;
+
+   /* merge the consecutive addresses */
+   for (i = 0; i < n; i = j) {
+      memcpy(rs->r[rs->n].lo, addr[i], len);
+
+      for (j = i + 1; j < n; j++) {
+         /* the address following addr[j - 1] */
+         memcpy(next, addr[j - 1], len);
+         for (k = len - 1; k >= 0 && ++next[k] == 0; k--);
+
+         if (k < 0 || memcmp(addr[j], next, len))
+            break;
+      }
+
+      memcpy(rs->r[rs->n].hi, addr[j - 1], len);
+      rs->n++;
+   }
+
+   SAFE_FREE(addr);
+
+   old = *slot;
+   __atomic_store_n(slot, rs, __ATOMIC_RELEASE);
+
+   if (type == AF_INET)
+      IP_LIST_UNLOCK;
+#ifdef WITH_IPV6
+   else
+      IP6_LIST_UNLOCK;
+#endif
+
+   DEBUG_MSG("update_ip_ranges: %u addresses in %u intervals", n, rs->n);
+
+   /* every writer frees the array it has replaced */
+   rcu_retire(RCU_RANGES, old, &free);
+}
+
+/*
+ * rebuild the intervals after a batch of insert_ip_list() 
+ * or remove_ip_list(), once for the whole batch
+ */
+void commit_ip_list(struct target_env *t)
+{
+   update_ip_ranges(t, AF_INET);
+#ifdef WITH_IPV6
+   update_ip_ranges(t, AF_INET6);
+#endif
+
+   sniff_targets_changed();
+}
+
+/*
+ * free the intervals.
+ * no one must be matching the packets anymore.
+ */
+void free_ip_ranges(struct target_env *t)
+{
+   SAFE_FREE(t->ranges);
+   SAFE_FREE(t->ranges6);
 }
 
 /*
@@ -632,6 +871,23 @@ int cmp_ip_list(struct ip_addr *ip, struct target_env *t)
  */
 
 void del_ip_list(struct ip_addr *ip, struct target_env *t)
+{
+   /* 'ip' may be the one in the list, it is freed */
+   u_int16 type = ntohs(ip->addr_type);
+
+   if (remove_ip_list(ip, t) != E_SUCCESS)
+      return;
+
+   update_ip_ranges(t, type);
+   sniff_targets_changed();
+}
+
+/*
+ * remove an IP from the list, without updating the intervals.
+ * returns -E_NOTFOUND if it was not there.
+ * to remove many of them at once, call commit_ip_list() when done
+ */
+int remove_ip_list(struct ip_addr *ip, struct target_env *t)
 {
    struct ip_list *e;
 
@@ -650,7 +906,7 @@ void del_ip_list(struct ip_addr *ip, struct target_env *t)
                }
          
                IP_LIST_UNLOCK;
-               return;
+               return E_SUCCESS;
             }
          }
    
@@ -670,7 +926,7 @@ void del_ip_list(struct ip_addr *ip, struct target_env *t)
                   t->all_ip6 = 1;
                
                IP6_LIST_UNLOCK;
-               return;
+               return E_SUCCESS;
             }
          }
 
@@ -679,7 +935,7 @@ void del_ip_list(struct ip_addr *ip, struct target_env *t)
 #endif
    }
    
-   return;
+   return -E_NOTFOUND;
 }
 
 /*
@@ -710,6 +966,8 @@ void free_ip_list(struct target_env *t)
 
    IP6_LIST_UNLOCK;
 #endif
+
+   commit_ip_list(t);
 }
 
 
@@ -0,0 +1,308 @@
+/*
+    ettercap -- translation of the TARGETS into a capture filter
+
+    Copyright (C) ALoR & NaGA
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <ec.h>
+#include <ec_inet.h>
+#include <ec_network.h>
+#include <ec_sniff.h>
+#include <ec_sniff_bpf.h>
+#include <ec_mitm.h>
+#include <ec_rcu.h>
+
+#include <stdarg.h>
+
+/*
+ * the expression only has to drop what set_interesting_flag() would
+ * ignore anyway, the exact matching is still done on every packet.
+ * so whatever is hard to express (or would make the program too
+ * big) is simply let through:
+ *
+ *  - the frames ettercap needs whatever the TARGETS are: ARP, the
+ *    broadcasts and multicasts (ND, DHCP, ...) and the frames sent
+ *    to our mac address (the ones forwarded during the mitm attacks)
+ *  - the IPv4 fragments, which are matched once reassembled
+ *  - the IPv6 packets not directly carrying TCP or UDP (extension
+ *    headers, ICMPv6)
+ *  - the lists with too many intervals or port ranges
+ */
+
+#define BPF_PREFIXES_MAX   64    /* per list */
+#define BPF_PORTS_MAX      32
+
+struct bpf_str {
+   char *s;
+   size_t len;
+   size_t size;
+};
+
+/* protos */
+
+static void bpf_cat(struct bpf_str *b, const char *fmt, ...);
+static int bpf_prefixes(struct bpf_str *b, struct ip_ranges *rs, const char *dir);
+static int bpf_ports(struct bpf_str *b, u_int8 *ports, const char *dir);
+static void bpf_side(struct bpf_str *b, struct target_env *t, struct iface_env *iface, const char *dir);
+static void bpf_and(struct bpf_str *b, struct bpf_str *x, struct bpf_str *y);
+
+/************************************************/
+
+static void bpf_cat(struct bpf_str *b, const char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   for (;;) {
+      va_start(ap, fmt);
+      n = vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+      va_end(ap);
+
+      if (b->len + n < b->size)
+         break;
+
+      b->size = (b->size + n + 1) * 2;
+      SAFE_REALLOC(b->s, b->size);
+   }
+
+   b->len += n;
+}
+
+/*
+ * the intervals of a target as "dir net a/n" terms, joined by "or".
+ * returns the number of terms, -E_INVALID if they are too many
+ */
+static int bpf_prefixes(struct bpf_str *b, struct ip_ranges *rs, const char *dir)
+{
+   u_int8 lo[MAX_IP_ADDR_LEN], last[MAX_IP_ADDR_LEN];
+   char tmp[MAX_ASCII_ADDR_LEN];
+   struct ip_addr ip;
+   size_t bits = rs->len * 8;
+   u_int i, k, j, n = 0;
+   int c;
+
+   for (i = 0; i < rs->n; i++) {
+      memcpy(lo, rs->r[i].lo, rs->len);
+
+      for (;;) {
+         /* the biggest aligned block starting at lo... */
+         for (k = 0; k < bits && !(lo[rs->len - 1 - k / 8] & (1 << (k % 8))); k++);
+
+         /* ...not going beyond the end of the interval */
+         for (;; k--) {
+            memcpy(last, lo, rs->len);
+            for (j = 0; j < k; j++)
+               last[rs->len - 1 - j / 8] |= 1 << (j % 8);
+            if (k == 0 || memcmp(last, rs->r[i].hi, rs->len) <= 0)
+               break;
+         }
+
+         if (++n > BPF_PREFIXES_MAX)
+            return -E_INVALID;
+
+         ip_addr_init(&ip, (rs->len == IP_ADDR_LEN) ? AF_INET : AF_INET6, lo);
+         bpf_cat(b, "%s%s net %s/%u", (n > 1) ? " or " : "", dir, ip_addr_ntoa(&ip, tmp), bits - k);
+
+         if (!memcmp(last, rs->r[i].hi, rs->len))
+            break;
+
+         /* the next block */
+         memcpy(lo, last, rs->len);
+         for (c = rs->len - 1; c >= 0 && ++lo[c] == 0; c--);
+      }
+   }
+
+   return n;
+}
+
+/*
+ * the port bitmap as "dir port" and "dir portrange" terms.
+ * returns the number of terms, -E_INVALID if they are too many
+ */
+static int bpf_ports(struct bpf_str *b, u_int8 *ports, const char *dir)
+{
+   u_int p, q, n = 0;
+
+   for (p = 1; p < (1 << 16); p = q) {
+      if (!BIT_TEST(ports, p)) {
+         q = p + 1;
+         continue;
+      }
+
+      for (q = p + 1; q < (1 << 16) && BIT_TEST(ports, q); q++);
+
+      if (++n > BPF_PORTS_MAX)
+         return -E_INVALID;
+
+      if (q - 1 == p)
+         bpf_cat(b, "%s%s port %u", (n > 1) ? " or " : "", dir, p);
+      else
+         bpf_cat(b, "%s%s portrange %u-%u", (n > 1) ? " or " : "", dir, p, q - 1);
+   }
+
+   /* the packets without ports are matched as port 0 */
+   if (BIT_TEST(ports, 0))
+      bpf_cat(b, "%snot (tcp or udp)", n++ ? " or " : "");
+
+   return n;
+}
+
+/*
+ * the conditions on one end of the packet (dir is "src" or "dst").
+ * nothing is added if they match any packet
+ */
+static void bpf_side(struct bpf_str *b, struct target_env *t, struct iface_env *iface, const char *dir)
+{
+   struct bpf_str ips = { NULL, 0, 0 }, ports = { NULL, 0, 0 };
+   struct ip_ranges *rs;
+   char tmp[MAX_ASCII_ADDR_LEN];
+   int all = 0;
+
+   if (!t->all_mac)
+      bpf_cat(b, "ether %s %s", dir, mac_addr_ntoa(t->mac, tmp));
+
+   /* all_ip is used for both the families by set_interesting_flag() */
+   if (!t->all_ip) {
+      rcu_read_begin(RCU_RANGES);
+
+      bpf_cat(&ips, "(ip and (");
+      rs = __atomic_load_n(&t->ranges, __ATOMIC_ACQUIRE);
+      if (rs == NULL || rs->n == 0)
+         bpf_cat(&ips, "ip[0] = 0");   /* false */
+      else if (bpf_prefixes(&ips, rs, dir) < 0)
+         all = 1;
+      bpf_cat(&ips, "))");
+
+      rs = __atomic_load_n(&t->ranges6, __ATOMIC_ACQUIRE);
+      if (rs != NULL && rs->n > 0) {
+         bpf_cat(&ips, " or (ip6 and (");
+         if (bpf_prefixes(&ips, rs, dir) < 0)
+            all = 1;
+         bpf_cat(&ips, "))");
+      }
+
+      rcu_read_end(RCU_RANGES);
+
+      /* with -M arp:remote the hosts outside the lan match too */
+      if (EC_GBL_OPTIONS->remote) {
+         if (iface->has_ipv4)
+            bpf_cat(&ips, " or (ip and not %s net %s/%d)", dir, ip_addr_ntoa(&iface->network, tmp),
+                  ip_addr_get_prefix(&iface->netmask));
+         else
+            bpf_cat(&ips, " or ip");
+         bpf_cat(&ips, " or ip6");
+      }
+
+      if (!all)
+         bpf_cat(b, "%s(%s)", b->len ? " and " : "", ips.s);
+   }
+
+   if (!t->all_port && bpf_ports(&ports, t->ports, dir) > 0)
+      bpf_cat(b, "%s(%s)", b->len ? " and " : "", ports.s);
+
+   SAFE_FREE(ips.s);
+   SAFE_FREE(ports.s);
+}
+
+static void bpf_and(struct bpf_str *b, struct bpf_str *x, struct bpf_str *y)
+{
+   if (x->len && y->len)
+      bpf_cat(b, "(%s and %s)", x->s, y->s);
+   else
+      bpf_cat(b, "(%s)", x->len ? x->s : y->s);
+}
+
+/*
+ * the capture filter equivalent to the TARGETS on an interface.
+ * returns NULL if they can't restrict the capture.
+ * the string must be freed by the caller.
+ */
+char * sniff_bpf_filter(struct iface_env *iface)
+{
+   struct bpf_str b = { NULL, 0, 0 }, t1s = b, t2d = b, t1d = b, t2s = b;
+   char tmp[ETH_ASCII_ADDR_LEN];
+   char *proto = NULL;
+
+   /* everything is forwarded between the two interfaces */
+   if (EC_GBL_SNIFF->type == SM_BRIDGED)
+      return NULL;
+
+   /* the expression is only for ethernet */
+   if (iface->dlt != DLT_EN10MB)
+      return NULL;
+
+   /* the reversed matching selects almost everything */
+   if (EC_GBL_OPTIONS->reversed)
+      return NULL;
+
+   /* the stolen frames must all be forwarded to their owners */
+   if (is_mitm_active("port"))
+      return NULL;
+
+   /* the only ones known by set_interesting_flag() */
+   if (EC_GBL_OPTIONS->proto != NULL && (!strcasecmp(EC_GBL_OPTIONS->proto, "tcp") || 
+                                         !strcasecmp(EC_GBL_OPTIONS->proto, "udp")))
+      proto = EC_GBL_OPTIONS->proto;
+
+   bpf_side(&t1s, EC_GBL_TARGET1, iface, "src");
+   bpf_side(&t2d, EC_GBL_TARGET2, iface, "dst");
+   bpf_side(&t1d, EC_GBL_TARGET1, iface, "dst");
+   bpf_side(&t2s, EC_GBL_TARGET2, iface, "src");
+
+   /* one of the directions matches anything */
+   if ((!t1s.len && !t2d.len) || (!t1d.len && !t2s.len)) {
+      if (proto == NULL)
+         goto out;
+      bpf_cat(&b, "(%s)", proto);
+   } else {
+      bpf_cat(&b, "(");
+      if (proto != NULL)
+         bpf_cat(&b, "%s and ", proto);
+      bpf_cat(&b, "(");
+      bpf_and(&b, &t1s, &t2d);
+      bpf_cat(&b, " or ");
+      bpf_and(&b, &t1d, &t2s);
+      bpf_cat(&b, "))");
+   }
+
+   bpf_cat(&b, " or arp or rarp or ether broadcast or ether multicast");
+   /* 
+    * match_targets() accepts what is sent to us even with -u,
+    * and it looks at the mac of the main interface
+    */
+   bpf_cat(&b, " or ether dst %s", mac_addr_ntoa(iface->mac, tmp));
+   if (memcmp(iface->mac, EC_GBL_IFACE->mac, MEDIA_ADDR_LEN))
+      bpf_cat(&b, " or ether dst %s", mac_addr_ntoa(EC_GBL_IFACE->mac, tmp));
+   bpf_cat(&b, " or (ip and ip[6:2] & 0x3fff != 0)");
+   bpf_cat(&b, " or (ip6 and not (tcp or udp))");
+   /* it changes the offsets of what follows, keep it the last */
+   bpf_cat(&b, " or vlan");
+
+out:
+   SAFE_FREE(t1s.s);
+   SAFE_FREE(t2d.s);
+   SAFE_FREE(t1d.s);
+   SAFE_FREE(t2s.s);
+
+   return b.s;
+}
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
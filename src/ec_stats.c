@@ -21,94 +21,212 @@
 
 #include <ec.h>
 #include <ec_stats.h>
+#include <ec_threads.h>
+#include <ec_sleep.h>
 
 #include <pcap.h>
 #include <libnet.h>
 #include <sys/time.h>
+#include <time.h>
+
+#define STATS_INTERVAL     500   /* milliseconds */
 
 /************************************************/
 
+/*
+ * the queue has many producers (the capture threads)
+ * and one consumer (the top half), so the counters
+ * are updated without locks
+ */
+
 unsigned long stats_queue_add(void)
 {
+   unsigned long curr, max;
+
    /* increment the counter */
-   EC_GBL_STATS->queue_curr++;
+   curr = __atomic_add_fetch(&EC_GBL_STATS->queue_curr, 1, __ATOMIC_RELAXED);
    
-   /* check if the max has to be updated */
-   if (EC_GBL_STATS->queue_curr > EC_GBL_STATS->queue_max)
-      EC_GBL_STATS->queue_max = EC_GBL_STATS->queue_curr;
+   /* check if the high water mark has to be updated */
+   max = __atomic_load_n(&EC_GBL_STATS->queue_max, __ATOMIC_RELAXED);
+   while (curr > max)
+      if (__atomic_compare_exchange_n(&EC_GBL_STATS->queue_max, &max, curr, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         break;
 
-   return EC_GBL_STATS->queue_curr;
+   return curr;
 }
 
 unsigned long stats_queue_del(void)
 {
    /* decrement the current counter */
-   EC_GBL_STATS->queue_curr--;
+   return __atomic_sub_fetch(&EC_GBL_STATS->queue_curr, 1, __ATOMIC_RELAXED);
+}
+
+/* 
+ * a packet was dropped because the queue was full 
+ */
+unsigned long stats_queue_drop(void)
+{
+   return __atomic_add_fetch(&EC_GBL_STATS->queue_drop, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * per thread counters of the bottom and top half.
+ *
+ * each capture/dispatcher thread owns a slot and it is the only 
+ * writer, so the counters are updated with relaxed stores and no 
+ * lock. the stats timer sums them up in the struct half_stats
+ * read by the UIs.
+ *
+ * the processing time is measured only on one packet every
+ * STATS_TIME_SAMPLE (a power of 2) and scaled up.
+ */
+
+#define STATS_TIME_SHIFT   4
+#define STATS_TIME_SAMPLE  (1 << STATS_TIME_SHIFT)
+
+struct stats_slot {
+   uint64_t pck_recv;
+   uint64_t pck_size;
+   uint64_t busy;          /* estimated processing time (ns) */
+   uint64_t ts;            /* start of the sampled packet, 0 if not sampled */
+   u_int tick;
+   struct stats_slot *next;
+};
+
+/* the slots of the bottom [0] and top [1] half */
+static struct stats_slot *stats_slots[2];
+static __thread struct stats_slot *stats_self[2];
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define STATS_LOCK     do{ pthread_mutex_lock(&stats_mutex); }while(0)
+#define STATS_UNLOCK   do{ pthread_mutex_unlock(&stats_mutex); }while(0)
+
+/* protos */
+
+static struct stats_slot *stats_slot_get(struct half_stats *hs);
+static void stats_half_sum(struct stats_slot *list, uint64_t *recv, uint64_t *size, uint64_t *busy);
+static void stats_half_update(struct half_stats *hs, struct stats_slot *list);
+
+/*
+ * monotonic time in nanoseconds
+ */
+static inline uint64_t stats_clock(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * the slot of the calling thread, 
+ * created and linked at the first packet
+ */
+static struct stats_slot *stats_slot_get(struct half_stats *hs)
+{
+   int i = (hs == &EC_GBL_STATS->th);
 
-   return EC_GBL_STATS->queue_curr;
+   if (stats_self[i] == NULL) {
+      SAFE_CALLOC(stats_self[i], 1, sizeof(struct stats_slot));
+
+      STATS_LOCK;
+      stats_self[i]->next = stats_slots[i];
+      stats_slots[i] = stats_self[i];
+      STATS_UNLOCK;
+   }
+
+   return stats_self[i];
 }
 
 /*
- * gets the timeval initial value
- * to calculate the processing time
+ * start the processing time of a sampled packet
  */
 
 void stats_half_start(struct half_stats *hs)
 {
-   /* get the time */
-   gettimeofday(&hs->ts, 0);
+   struct stats_slot *s = stats_slot_get(hs);
+
+   s->ts = ((s->tick++ & (STATS_TIME_SAMPLE - 1)) == 0) ? stats_clock() : 0;
 }
 
 /*
  * update the packet (num and size) counters
- * and get the time diff to calculate the 
- * rate
+ * and the processing time if the packet is sampled
  */
 void stats_half_end(struct half_stats *hs, u_int len)
 {
-   struct timeval diff;
-   float ttime;
-   float ptime;
+   struct stats_slot *s = stats_slot_get(hs);
 
-   /* get the time */
-   gettimeofday(&hs->te, 0);
+   if (s->ts != 0)
+      __atomic_store_n(&s->busy, s->busy + ((stats_clock() - s->ts) << STATS_TIME_SHIFT), __ATOMIC_RELAXED);
 
-   time_sub(&hs->te, &hs->ts, &diff);
-   time_add(&hs->ttot, &diff, &hs->ttot);
-   time_add(&hs->tpar, &diff, &hs->tpar);
+   __atomic_store_n(&s->pck_recv, s->pck_recv + 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&s->pck_size, s->pck_size + len, __ATOMIC_RELAXED);
+}
 
-   /* calculate the rate (packet/time) */
-   ttime = hs->ttot.tv_sec + hs->ttot.tv_usec/1.0e6;
-   ptime = hs->tpar.tv_sec + hs->tpar.tv_usec/1.0e6;
+/*
+ * the absolute counters of all the threads of a half
+ */
+static void stats_half_sum(struct stats_slot *list, uint64_t *recv, uint64_t *size, uint64_t *busy)
+{
+   struct stats_slot *s;
 
-   /* update the packet count */
-   hs->pck_recv++;
-   hs->pck_size += len;
-   hs->tmp_size += len;
-   
-   if ( (hs->pck_recv % EC_GBL_CONF->sampling_rate) == 0 ) {
-      /* save the average and the worst sampling */
-      hs->rate_adv = hs->pck_recv/ttime;
-      if (hs->rate_worst > EC_GBL_CONF->sampling_rate/ptime || hs->rate_worst == 0)
-         hs->rate_worst = EC_GBL_CONF->sampling_rate/ptime;
-      
-      hs->thru_adv = hs->pck_size/ttime;
-      if (hs->thru_worst > hs->tmp_size/ptime || hs->thru_worst == 0)
-         hs->thru_worst = hs->tmp_size/ptime;
-
-#if 0
-      DEBUG_MSG("PACKET RATE: %llu [%d] [%d] -- [%d] [%d]\n", hs->pck_recv,
-         hs->rate_worst, hs->rate_adv,
-         hs->thru_worst, hs->thru_adv);
-#endif
-            
-      /* reset the partial */
-      memset(&hs->tpar, 0, sizeof(struct timeval));
-      hs->tmp_size = 0;
+   *recv = *size = *busy = 0;
+
+   for (s = list; s != NULL; s = s->next) {
+      *recv += __atomic_load_n(&s->pck_recv, __ATOMIC_RELAXED);
+      *size += __atomic_load_n(&s->pck_size, __ATOMIC_RELAXED);
+      *busy += __atomic_load_n(&s->busy, __ATOMIC_RELAXED);
    }
 
 }
 
+/*
+ * sum the slots and calculate the rates (packet/time).
+ * the worst values are taken on the intervals between two 
+ * calls with at least sampling_rate packets.
+ */
+static void stats_half_update(struct half_stats *hs, struct stats_slot *list)
+{
+   uint64_t recv, size, busy;
+   double ttime, ptime;
+
+   stats_half_sum(list, &recv, &size, &busy);
+
+   /* relative to the last stats_wipe() */
+   recv -= hs->base_recv;
+   size -= hs->base_size;
+   busy -= hs->base_busy;
+
+   hs->pck_recv = recv;
+   hs->pck_size = size;
+   hs->busy = busy;
+
+   if (busy == 0)
+      return;
+
+   ttime = busy / 1.0e9;
+   hs->rate_adv = recv / ttime;
+   hs->thru_adv = size / ttime;
+
+   if (recv - hs->last_recv < (uint64_t)EC_GBL_CONF->sampling_rate || busy == hs->last_busy)
+      return;
+
+   ptime = (busy - hs->last_busy) / 1.0e9;
+
+   if (hs->rate_worst > (recv - hs->last_recv) / ptime || hs->rate_worst == 0)
+      hs->rate_worst = (recv - hs->last_recv) / ptime;
+      
+   if (hs->thru_worst > (size - hs->last_size) / ptime || hs->thru_worst == 0)
+      hs->thru_worst = (size - hs->last_size) / ptime;
+
+   /* reset the partial */
+   hs->last_recv = recv;
+   hs->last_size = size;
+   hs->last_busy = busy;
+}
+
 /*
  * zero the statistics.
  * since the stats from the kernel are not modifiable
@@ -118,12 +236,26 @@ void stats_half_end(struct half_stats *hs, u_int len)
 void stats_wipe(void)
 {
    struct pcap_stat ps;
+   uint64_t recv, size, busy;
    
    DEBUG_MSG("stats_wipe");
 
+   STATS_LOCK;
+
    /* wipe top and botto half statistics */
+   stats_half_sum(stats_slots[0], &recv, &size, &busy);
    memset(&EC_GBL_STATS->bh, 0, sizeof(struct half_stats));
+   EC_GBL_STATS->bh.base_recv = recv;
+   EC_GBL_STATS->bh.base_size = size;
+   EC_GBL_STATS->bh.base_busy = busy;
+
+   stats_half_sum(stats_slots[1], &recv, &size, &busy);
    memset(&EC_GBL_STATS->th, 0, sizeof(struct half_stats));
+   EC_GBL_STATS->th.base_recv = recv;
+   EC_GBL_STATS->th.base_size = size;
+   EC_GBL_STATS->th.base_busy = busy;
+
+   STATS_UNLOCK;
 
    /* now the global stats */
    pcap_stats(EC_GBL_IFACE->pcap, &ps);
@@ -143,34 +275,77 @@ void stats_wipe(void)
    EC_GBL_STATS->bs_sent = 0;
    EC_GBL_STATS->queue_max = 0;
    EC_GBL_STATS->queue_curr = 0;
+   EC_GBL_STATS->queue_drop = 0;
+   EC_GBL_STATS->ring_blocks = 0;
+   EC_GBL_STATS->ring_lost = 0;
+   EC_GBL_STATS->ring_freeze = 0;
 }
 
 /*
- * update the statistics
+ * update the statistics.
+ * called by the stats timer, never in the packet path
  */
 void stats_update(void)
 {
    struct pcap_stat ps;
    struct libnet_stats ls;
+
+   STATS_LOCK;
+   stats_half_update(&EC_GBL_STATS->bh, stats_slots[0]);
+   stats_half_update(&EC_GBL_STATS->th, stats_slots[1]);
+   STATS_UNLOCK;
    
    /* update the statistics 
     *
     * statistics are available only in live capture
     * no statistics are stored in savefiles
     */
-   pcap_stats(EC_GBL_IFACE->pcap, &ps);
+   if (EC_GBL_OPTIONS->read || EC_GBL_IFACE->pcap == NULL)
+      return;
+
+   if (EC_GBL_IFACE->ring == NULL) {
+      pcap_stats(EC_GBL_IFACE->pcap, &ps);
+
+      /* on systems other than linux, the counter is not reset */ 
+      EC_GBL_STATS->ps_recv = ps.ps_recv - EC_GBL_STATS->ps_recv_delta;
+      EC_GBL_STATS->ps_drop = ps.ps_drop - EC_GBL_STATS->ps_drop_delta;
+   }
+   /* 
+    * else the pcap handle is muted, the counters are 
+    * accumulated block by block by the ring walker
+    */
+
    /* get the statistics for Layer 3 since we forward packets here */
    libnet_stats(EC_GBL_LNET->lnet_IP4, &ls);
-      
-   /* on systems other than linux, the counter is not reset */ 
-   EC_GBL_STATS->ps_recv = ps.ps_recv - EC_GBL_STATS->ps_recv_delta;
-   EC_GBL_STATS->ps_drop = ps.ps_drop - EC_GBL_STATS->ps_drop_delta;
 
    /* from libnet */
    EC_GBL_STATS->ps_sent = ls.packets_sent - EC_GBL_STATS->ps_sent_delta;
    EC_GBL_STATS->bs_sent = ls.bytes_written - EC_GBL_STATS->bs_sent_delta;
 }
 
+/*
+ * sample the counters every STATS_INTERVAL milliseconds
+ */
+EC_THREAD_FUNC(stats_timer)
+{
+   /* variable not used */
+   (void) EC_THREAD_PARAM;
+
+   ec_thread_init();
+
+   DEBUG_MSG("stats_timer: activated");
+
+   LOOP {
+      CANCELLATION_POINT();
+
+      ec_usleep(MILLI2MICRO(STATS_INTERVAL));
+
+      stats_update();
+   }
+
+   return NULL;
+}
+
 /* EOF */
 
 // vim:ts=3:expandtab
@@ -0,0 +1,406 @@
+/*
+    ettercap -- TCP stream reassembly for the dissectors
+
+    Copyright (C) ALoR & NaGA
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <ec.h>
+#include <ec_decode.h>
+#include <ec_dissect.h>
+#include <ec_session.h>
+#include <ec_stats.h>
+#include <ec_tcp_stream.h>
+
+/*
+ * the stream is kept in a dissector session whose ident is made
+ * with the callback, so it expires with the other sessions if the
+ * connection is not closed.
+ *
+ * the packets of a connection are always decoded by the same thread
+ * (see capture_threads), so the stream itself is not locked.
+ * the memory used by all the streams is accounted in the stats.
+ */
+
+/* sequence numbers comparison (they wrap around) */
+#define SEQ_LT(a, b)    ((int32)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b)   ((int32)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)    ((int32)((a) - (b)) > 0)
+
+/* a smaller buffer is kept across the invocations */
+#define TCP_STREAM_KEEP    2048
+
+/* protos */
+
+static void tcp_stream_free(void *data, size_t data_len);
+static void tcp_stream_mem(ssize_t delta);
+static int tcp_stream_fits(struct tcp_stream_half *h, size_t len);
+static int tcp_stream_budget(size_t len);
+static void tcp_stream_append(struct tcp_stream_half *h, u_char *data, size_t len);
+static void tcp_stream_queue(struct tcp_stream_half *h, u_int32 seq, u_char *data, size_t len);
+static void tcp_stream_pull(struct tcp_stream_half *h);
+static void tcp_stream_skip(struct tcp_stream_half *h);
+static void tcp_stream_wipe(struct tcp_stream_half *h);
+static void tcp_stream_deliver(struct tcp_stream *ts, struct tcp_stream_half *h, struct packet_object *po,
+                               TCP_STREAM_FUNC_PTR(func), int flags);
+
+/************************************************/
+
+/*
+ * called when the session is destroyed
+ */
+static void tcp_stream_free(void *data, size_t data_len)
+{
+   struct tcp_stream *ts = data;
+
+   (void) data_len;
+
+   tcp_stream_wipe(&ts->way[0]);
+   tcp_stream_wipe(&ts->way[1]);
+
+   SAFE_FREE(ts->data);
+}
+
+static void tcp_stream_mem(ssize_t delta)
+{
+   __atomic_add_fetch(&EC_GBL_STATS->stream_mem, delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * can len more bytes be buffered for this half ?
+ * the per connection and the global limits are both checked
+ */
+static int tcp_stream_fits(struct tcp_stream_half *h, size_t len)
+{
+   if (h->len + h->ooo_len + len > (size_t)EC_GBL_CONF->stream_buffer)
+      return 0;
+
+   return tcp_stream_budget(len);
+}
+
+/*
+ * can the streams take len more bytes of the global budget ?
+ */
+static int tcp_stream_budget(size_t len)
+{
+   return __atomic_load_n(&EC_GBL_STATS->stream_mem, __ATOMIC_RELAXED) + len <= (size_t)EC_GBL_CONF->stream_memory;
+}
+
+/*
+ * add in order data to the buffer.
+ * if the buffer can't grow within the global budget, the data is
+ * lost together with what was not parsed yet: it becomes a gap
+ */
+static void tcp_stream_append(struct tcp_stream_half *h, u_char *data, size_t len)
+{
+   size_t size;
+
+   if (h->len + len + 1 > h->size) {
+      size = h->len + len + 1;
+
+      if (!tcp_stream_budget(size - h->size)) {
+         __atomic_add_fetch(&EC_GBL_STATS->stream_dropped, 1, __ATOMIC_RELAXED);
+         h->next_seq += len;
+         h->len = 0;
+         h->gap = 1;
+         if (h->size > 0)
+            h->buf[0] = 0;
+         return;
+      }
+
+      SAFE_REALLOC(h->buf, size);
+      tcp_stream_mem(size - h->size);
+      h->size = size;
+   }
+
+   memcpy(h->buf + h->len, data, len);
+   h->len += len;
+   h->next_seq += len;
+
+   /* the dissectors expect null terminated strings */
+   h->buf[h->len] = 0;
+}
+
+/*
+ * keep a segment received after a hole
+ */
+static void tcp_stream_queue(struct tcp_stream_half *h, u_int32 seq, u_char *data, size_t len)
+{
+   struct tcp_stream_seg *seg, *s;
+
+   /* a retransmission of a queued segment */
+   TAILQ_FOREACH(s, &h->ooo, next)
+      if (s->seq == seq && s->len >= len)
+         return;
+
+   SAFE_CALLOC(seg, 1, sizeof(struct tcp_stream_seg) + len);
+   seg->seq = seq;
+   seg->len = len;
+   memcpy(seg->data, data, len);
+
+   TAILQ_FOREACH(s, &h->ooo, next)
+      if (SEQ_LT(seq, s->seq))
+         break;
+
+   if (s != NULL)
+      TAILQ_INSERT_BEFORE(s, seg, next);
+   else
+      TAILQ_INSERT_TAIL(&h->ooo, seg, next);
+
+   h->ooo_len += len;
+   tcp_stream_mem(sizeof(struct tcp_stream_seg) + len);
+
+   __atomic_add_fetch(&EC_GBL_STATS->stream_ooo, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * move to the buffer the queued segments that are now in order
+ */
+static void tcp_stream_pull(struct tcp_stream_half *h)
+{
+   struct tcp_stream_seg *seg;
+   u_int32 skip;
+
+   while ((seg = TAILQ_FIRST(&h->ooo)) != NULL && SEQ_LEQ(seg->seq, h->next_seq)) {
+
+      /* release it before, the buffer takes its place in the budget */
+      TAILQ_REMOVE(&h->ooo, seg, next);
+      h->ooo_len -= seg->len;
+      tcp_stream_mem(-(ssize_t)(sizeof(struct tcp_stream_seg) + seg->len));
+
+      skip = h->next_seq - seg->seq;
+      if (skip < seg->len)
+         tcp_stream_append(h, seg->data + skip, seg->len - skip);
+
+      SAFE_FREE(seg);
+   }
+}
+
+/*
+ * the hole will not be filled (the packet was lost or there
+ * is no more room to wait for it): jump to the next data.
+ * what was not parsed yet can't be completed anymore.
+ */
+static void tcp_stream_skip(struct tcp_stream_half *h)
+{
+   struct tcp_stream_seg *seg;
+
+   if ((seg = TAILQ_FIRST(&h->ooo)) == NULL)
+      return;
+
+   __atomic_add_fetch(&EC_GBL_STATS->stream_gaps, 1, __ATOMIC_RELAXED);
+
+   h->len = 0;
+   h->gap = 1;
+   h->next_seq = seg->seq;
+
+   tcp_stream_pull(h);
+}
+
+/*
+ * release the buffers of one direction
+ */
+static void tcp_stream_wipe(struct tcp_stream_half *h)
+{
+   struct tcp_stream_seg *seg;
+
+   while ((seg = TAILQ_FIRST(&h->ooo)) != NULL) {
+      TAILQ_REMOVE(&h->ooo, seg, next);
+      tcp_stream_mem(-(ssize_t)(sizeof(struct tcp_stream_seg) + seg->len));
+      SAFE_FREE(seg);
+   }
+   h->ooo_len = 0;
+
+   tcp_stream_mem(-(ssize_t)h->size);
+   SAFE_FREE(h->buf);
+   h->size = 0;
+   h->len = 0;
+}
+
+/*
+ * pass the buffer to the callback and keep what it did not parse
+ */
+static void tcp_stream_deliver(struct tcp_stream *ts, struct tcp_stream_half *h, struct packet_object *po,
+                               TCP_STREAM_FUNC_PTR(func), int flags)
+{
+   size_t used;
+
+   if (h->len == 0 && flags == 0)
+      return;
+
+   if (h->gap)
+      flags |= TCP_STREAM_GAP;
+   h->gap = 0;
+
+   used = func(ts, po, h->buf, h->len, flags);
+
+   if (used < h->len) {
+      memmove(h->buf, h->buf + used, h->len - used);
+      h->len -= used;
+      h->buf[h->len] = 0;
+   } else {
+      h->len = 0;
+   }
+
+   /* the parser is waiting for something that does not fit */
+   if (h->len >= (size_t)EC_GBL_CONF->stream_buffer) {
+      __atomic_add_fetch(&EC_GBL_STATS->stream_overflow, 1, __ATOMIC_RELAXED);
+      h->len = 0;
+      h->gap = 1;
+   }
+
+   if (h->len == 0 && h->size > TCP_STREAM_KEEP) {
+      tcp_stream_mem(-(ssize_t)h->size);
+      SAFE_FREE(h->buf);
+      h->size = 0;
+   }
+}
+
+/*
+ * add the payload of a packet to its stream and call 'func'
+ * with the in order data of that direction.
+ *
+ * the stream is created by the first packet with payload (or
+ * by the SYN) and destroyed when both directions are closed.
+ */
+int tcp_stream_add(struct packet_object *po, TCP_STREAM_FUNC_PTR(func))
+{
+   struct ec_session *s = NULL;
+   struct tcp_stream *ts;
+   struct tcp_stream_half *h;
+   void *ident = NULL;
+   u_char *data = po->DATA.data;
+   size_t len = po->DATA.len;
+   u_int32 seq, skip, start;
+   int flags = 0;
+
+   if (po->L4.proto != NL_TYPE_TCP)
+      return -E_INVALID;
+
+   /* a pure ACK changes nothing, don't pay for the session lookup */
+   if (len == 0 && !(po->L4.flags & (TH_SYN | TH_FIN | TH_RST)))
+      return -E_NOTHANDLED;
+
+   dissect_create_ident(&ident, po, DISSECT_CODE(func));
+
+   if (session_get(&s, ident, DISSECT_IDENT_LEN) == -E_NOTFOUND) {
+      /* nothing to reassemble */
+      if (len == 0 && !(po->L4.flags & TH_SYN)) {
+         SAFE_FREE(ident);
+         return -E_NOTHANDLED;
+      }
+
+      dissect_create_session(&s, po, DISSECT_CODE(func));
+      SAFE_CALLOC(s->data, 1, sizeof(struct tcp_stream));
+      s->data_len = sizeof(struct tcp_stream);
+      s->free = &tcp_stream_free;
+
+      ts = s->data;
+      memcpy(&ts->L3_src, &po->L3.src, sizeof(struct ip_addr));
+      ts->L4_src = po->L4.src;
+      TAILQ_INIT(&ts->way[0].ooo);
+      TAILQ_INIT(&ts->way[1].ooo);
+
+      session_put(s);
+   }
+
+   ts = s->data;
+
+   if (po->L4.src == ts->L4_src && !ip_addr_cmp(&po->L3.src, &ts->L3_src))
+      h = &ts->way[0];
+   else
+      h = &ts->way[1];
+
+   if (h->closed) {
+      SAFE_FREE(ident);
+      return E_SUCCESS;
+   }
+
+   seq = ntohl(po->L4.seq);
+   if (po->L4.flags & TH_SYN)
+      seq++;
+
+   /*
+    * the first packet seen sets the sequence.
+    * the decrypted packets of the ssl wrapper are already in order
+    */
+   if (!h->synced || (po->flags & PO_FROMSSL)) {
+      h->next_seq = seq;
+      h->synced = 1;
+   }
+
+   /* the part already delivered is a retransmission */
+   if (SEQ_LT(seq, h->next_seq)) {
+      skip = h->next_seq - seq;
+      if (skip >= len)
+         len = 0;
+      else {
+         data += skip;
+         len -= skip;
+         seq = h->next_seq;
+      }
+   }
+
+   start = h->next_seq;
+
+   if (len > 0) {
+      if (seq == h->next_seq) {
+         tcp_stream_append(h, data, len);
+         tcp_stream_pull(h);
+      } else {
+         /* no room to wait for the hole, give it up */
+         if (!tcp_stream_fits(h, len + sizeof(struct tcp_stream_seg)))
+            tcp_stream_skip(h);
+
+         if (seq == h->next_seq) {
+            tcp_stream_append(h, data, len);
+            tcp_stream_pull(h);
+         } else if (SEQ_GT(seq, h->next_seq) && tcp_stream_fits(h, len + sizeof(struct tcp_stream_seg))) {
+            tcp_stream_queue(h, seq, data, len);
+         } else {
+            __atomic_add_fetch(&EC_GBL_STATS->stream_dropped, 1, __ATOMIC_RELAXED);
+         }
+      }
+   }
+
+   /* the end of the stream, even if some data is missing */
+   if (po->L4.flags & (TH_FIN | TH_RST)) {
+      h->closed = 1;
+      flags |= TCP_STREAM_END;
+   }
+
+   /* call the parser only if there is something new */
+   if (h->next_seq != start || flags)
+      tcp_stream_deliver(ts, h, po, func, flags);
+
+   if (h->closed)
+      tcp_stream_wipe(h);
+
+   /* the connection is over (or the dissector follows only this direction) */
+   if ((ts->way[0].closed && ts->way[1].closed) || (po->L4.flags & TH_RST) ||
+       (h->closed && !ts->way[h == &ts->way[0]].synced))
+      session_del(ident, DISSECT_IDENT_LEN);
+
+   SAFE_FREE(ident);
+
+   return E_SUCCESS;
+}
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
@@ -73,6 +73,8 @@ static void toggle_reverse(void)
       tag_reverse[0] = '*';
       EC_GBL_OPTIONS->reversed = 1;
    }
+
+   sniff_targets_changed();
 }
 
 /*
@@ -25,6 +25,7 @@
 #include <ec_format.h>
 #include <ec_utils.h>
 #include <ec_encryption.h>
+#include <ec_metrics.h>
 
 /* proto */
 
@@ -32,6 +33,9 @@ static void toggle_resolve(void);
 static void curses_show_stats(void);
 static void curses_stop_stats(void);
 static void refresh_stats(void);
+static void curses_show_acct(void);
+static void curses_stop_acct(void);
+static void refresh_acct(void);
 static void curses_vis_method(void);
 static void curses_set_method(void);
 static void curses_vis_regex(void);
@@ -45,6 +49,7 @@ extern void curses_show_connections(void);
 
 static char tag_resolve[] = " ";
 static wdg_t *wdg_stats;
+static wdg_t *wdg_acct;
 #define VLEN 8
 static char vmethod[VLEN];
 #define RLEN 50
@@ -56,6 +61,7 @@ struct wdg_menu menu_view[] = { {"View",                 'V', "",  NULL},
                                 {"Connections",          'C', "C", curses_show_connections},
                                 {"Profiles",             'O', "O", curses_show_profiles},
                                 {"Statistics",           's', "s", curses_show_stats},
+                                {"Hook accounting",      'a', "a", curses_show_acct},
                                 {"-",                     0,  "",  NULL},
                                 {"Resolve IP addresses",  0, tag_resolve,   toggle_resolve},
                                 {"Visualization method...", 'v', "v", curses_vis_method},
@@ -158,8 +164,12 @@ static void refresh_stats(void)
    wdg_window_print(wdg_stats, 1, 2, "Dropped packets     : %8lld  %.2f %% ", EC_GBL_STATS->ps_drop, 
           (EC_GBL_STATS->ps_recv) ? (float)EC_GBL_STATS->ps_drop * 100 / EC_GBL_STATS->ps_recv : 0 );
    wdg_window_print(wdg_stats, 1, 3, "Forwarded packets   : %8lld  bytes: %8lld ", EC_GBL_STATS->ps_sent, EC_GBL_STATS->bs_sent);
+   if (EC_GBL_IFACE->ring != NULL)
+      wdg_window_print(wdg_stats, 1, 4, "Ring blocks         : %8" PRIu64 "  losing: %8" PRIu64 "  freeze: %8" PRIu64 " ", 
+            EC_GBL_STATS->ring_blocks, EC_GBL_STATS->ring_lost, EC_GBL_STATS->ring_freeze);
   
-   wdg_window_print(wdg_stats, 1, 5, "Current queue len   : %d/%d ", EC_GBL_STATS->queue_curr, EC_GBL_STATS->queue_max);
+   wdg_window_print(wdg_stats, 1, 5, "Current queue len   : %lu/%lu  drops: %lu ", EC_GBL_STATS->queue_curr, EC_GBL_STATS->queue_max,
+         EC_GBL_STATS->queue_drop);
    wdg_window_print(wdg_stats, 1, 6, "Sampling rate       : %d ", EC_GBL_CONF->sampling_rate);
    
    wdg_window_print(wdg_stats, 1, 8, "Bottom Half received packet : pck: %8lld  bytes: %8lld", 
@@ -180,6 +190,73 @@ static void refresh_stats(void)
          EC_GBL_STATS->th.thru_worst, EC_GBL_STATS->th.thru_adv);
 }
 
+/*
+ * display the cpu time spent in the hooked functions
+ */
+static void curses_show_acct(void)
+{
+   DEBUG_MSG("curses_show_acct");
+
+   /* if the object already exist, set the focus to it */
+   if (wdg_acct) {
+      wdg_set_focus(wdg_acct);
+      return;
+   }
+   
+   wdg_create_object(&wdg_acct, WDG_WINDOW, WDG_OBJ_WANT_FOCUS);
+   
+   wdg_set_title(wdg_acct, "Hook accounting:", WDG_ALIGN_LEFT);
+   wdg_set_size(wdg_acct, 1, 2, 81, SYSMSG_WIN_SIZE - 1);
+   wdg_set_color(wdg_acct, WDG_COLOR_SCREEN, EC_COLOR);
+   wdg_set_color(wdg_acct, WDG_COLOR_WINDOW, EC_COLOR);
+   wdg_set_color(wdg_acct, WDG_COLOR_BORDER, EC_COLOR_BORDER);
+   wdg_set_color(wdg_acct, WDG_COLOR_FOCUS, EC_COLOR_FOCUS);
+   wdg_set_color(wdg_acct, WDG_COLOR_TITLE, EC_COLOR_TITLE);
+   wdg_draw_object(wdg_acct);
+ 
+   wdg_set_focus(wdg_acct);
+  
+   refresh_acct(); 
+
+   /* add the callback on idle to refresh the table */
+   wdg_add_idle_callback(refresh_acct);
+
+   /* add the destroy callback */
+   wdg_add_destroy_key(wdg_acct, CTRL('Q'), curses_stop_acct);
+}
+
+static void curses_stop_acct(void)
+{
+   DEBUG_MSG("curses_stop_acct");
+   wdg_del_idle_callback(refresh_acct);
+
+   /* the object does not exist anymore */
+   wdg_acct = NULL;
+}
+
+static void refresh_acct(void)
+{
+   char *report, *line, *next;
+   size_t y = 1, rows;
+
+   /* if not focused don't refresh it */
+   if (!(wdg_acct->flags & WDG_OBJ_FOCUSED))
+      return;
+
+   /* the border and the title */
+   rows = wdg_get_nlines(wdg_acct) - 2;
+
+   report = metrics_acct_report(0);
+
+   for (line = report; line != NULL && y < rows; line = next) {
+      if ((next = strchr(line, '\n')) != NULL)
+         *next++ = '\0';
+      wdg_window_print(wdg_acct, 1, y++, "%s", line);
+   }
+
+   SAFE_FREE(report);
+}
+
 /*
  * change the visualization method 
  */
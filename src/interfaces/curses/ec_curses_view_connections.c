@@ -48,6 +48,7 @@ static void split_print_po(struct packet_object *po);
 static void join_print(u_char *text, size_t len, struct ip_addr *L3_src);
 static void join_print_po(struct packet_object *po);
 static void curses_connection_kill(void *conn);
+static void curses_connection_kill_co(struct conn_object *co);
 static void curses_connection_purge(void *conn);
 static void curses_connection_kill_wrapper(void);
 static void curses_connection_inject(void);
@@ -159,6 +160,13 @@ static void curses_connection_detail(void *conn)
    
    DEBUG_MSG("curses_connection_detail");
 
+   /* it may have been deleted since the list was drawn */
+   conntrack_lock();
+   if (conntrack_get(0, c, NULL) == NULL) {
+      conntrack_unlock();
+      return;
+   }
+
    /* if the object already exist, set the focus to it */
    if (wdg_conn_detail) {
       wdg_destroy_object(&wdg_conn_detail);
@@ -235,12 +243,25 @@ static void curses_connection_detail(void *conn)
       if (c->co->DISSECTOR.info)
          wdg_window_print(wdg_conn_detail, 1, ++row, "Additional Info         :  %s", c->co->DISSECTOR.info);
    }
+
+   conntrack_unlock();
 }
 
 static void curses_connection_data(void *conn)
 {
    struct conn_tail *c = (struct conn_tail *)conn;
    DEBUG_MSG("curses_connection_data");
+
+   /* it may have been deleted since the list was drawn */
+   conntrack_lock();
+   if (conntrack_get(0, c, NULL) == NULL) {
+      conntrack_unlock();
+      return;
+   }
+
+   /* once it is viewed the timeouter leaves it alone */
+   c->co->flags |= CONN_VIEWING;
+   conntrack_unlock();
   
    /* 
     * remove any hook on the open connection.
@@ -537,12 +558,21 @@ static void curses_connection_kill(void *conn)
    struct conn_tail *c = (struct conn_tail *)conn;
    
    DEBUG_MSG("curses_connection_kill");
-  
+
+   /* it may have been deleted since the list was drawn */
+   conntrack_lock();
+   if (conntrack_get(0, c, NULL) != NULL)
+      curses_connection_kill_co(c->co);
+   conntrack_unlock();
+}
+
+static void curses_connection_kill_co(struct conn_object *co)
+{
    /* kill it */
-   switch (user_kill(c->co)) {
+   switch (user_kill(co)) {
       case E_SUCCESS:
          /* set the status */
-         c->co->status = CONN_KILLED;
+         co->status = CONN_KILLED;
          curses_message("The connection was killed !!");
          break;
       case -E_FATAL:
@@ -573,14 +603,10 @@ static void curses_connection_purge(void *conn)
  */
 static void curses_connection_kill_wrapper(void)
 {
-   struct conn_tail c;
-
    DEBUG_MSG("curses_connection_kill_wrapper");
    
-   /* create the fake conn_tail object */
-   c.co = curr_conn;
-   
-   curses_connection_kill(&c);
+   /* it is being viewed, it can't be deleted */
+   curses_connection_kill_co(curr_conn);
 }
 
 /*
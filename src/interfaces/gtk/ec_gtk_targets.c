@@ -54,6 +54,8 @@ void toggle_reverse(void)
    } else {
       EC_GBL_OPTIONS->reversed = 1;
    }
+
+   sniff_targets_changed();
 }
 
 /*
@@ -640,10 +642,13 @@ static void gtkui_delete_targets(GtkWidget *widget, gpointer data) {
                gtk_tree_model_get (model, &iter, 1, &il, -1);
 
                /* remove the host from the list */
-               del_ip_list(&il->ip, EC_GBL_TARGET1);
+               remove_ip_list(&il->ip, EC_GBL_TARGET1);
 
                gtk_list_store_remove(GTK_LIST_STORE (liststore1), &iter);
             }
+
+            /* once for all the selected hosts */
+            commit_ip_list(EC_GBL_TARGET1);
          }
          break;
       case 2:
@@ -657,10 +662,13 @@ static void gtkui_delete_targets(GtkWidget *widget, gpointer data) {
                gtk_tree_model_get (model, &iter, 1, &il, -1);
 
                /* remove the host from the list */
-               del_ip_list(&il->ip, EC_GBL_TARGET2);
+               remove_ip_list(&il->ip, EC_GBL_TARGET2);
 
                gtk_list_store_remove(GTK_LIST_STORE (liststore2), &iter);
             }
+
+            /* once for all the selected hosts */
+            commit_ip_list(EC_GBL_TARGET2);
          }
          break;
    }
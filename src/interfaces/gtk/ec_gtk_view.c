@@ -24,6 +24,7 @@
 #include <ec_format.h>
 #include <ec_utils.h>
 #include <ec_encryption.h>
+#include <ec_metrics.h>
 
 /* proto */
 
@@ -47,7 +48,8 @@ static guint stats_idle; /* for removing the idle call */
 /* for stats window */
 static GtkWidget *stats_window, *packets_recv, *packets_drop, *packets_forw, 
                  *queue_len, *sample_rate, *recv_bottom, *recv_top, *interesting, 
-                 *rate_bottom, *rate_top, *through_bottom, *through_top;
+                 *rate_bottom, *rate_top, *through_bottom, *through_top,
+                 *hook_acct;
 
 /*******************************************/
 
@@ -110,7 +112,7 @@ void gtkui_show_stats(void)
 
    /* alright, this is a lot of code but it'll keep everything lined up nicely */
    /* if you need to add a row, don't forget to increase the number in gtk_table_new */
-   table = gtk_table_new(12, 2, FALSE); /* rows, cols, size */
+   table = gtk_table_new(13, 2, FALSE); /* rows, cols, size */
    gtk_table_set_col_spacings(GTK_TABLE (table), 10);
    gtk_container_add(GTK_CONTAINER (stats_window), table);
 
@@ -222,6 +224,12 @@ void gtkui_show_stats(void)
    gtk_misc_set_alignment(GTK_MISC (label), 0, 0.5);
    gtk_table_attach_defaults(GTK_TABLE(table), label, 0, 1, 11, 12);
 
+   hook_acct    = gtk_label_new("");
+   gtk_label_set_selectable(GTK_LABEL (hook_acct), TRUE);
+   gtk_misc_set_alignment(GTK_MISC (hook_acct), 0, 0.5);
+   gtk_misc_set_padding(GTK_MISC (hook_acct), 0, 10);
+   gtk_table_attach_defaults(GTK_TABLE(table), hook_acct, 0, 2, 12, 13);
+
    gtk_widget_show_all(table);
    gtk_widget_show(stats_window);
   
@@ -266,6 +274,7 @@ static void gtkui_stop_stats(void)
 static gboolean refresh_stats(gpointer data)
 {
    char line[50];
+   char *report, *markup;
 
    /* variable not used */
    (void) data;
@@ -309,6 +318,13 @@ static gboolean refresh_stats(gpointer data)
          EC_GBL_STATS->th.thru_worst, EC_GBL_STATS->th.thru_adv);
    gtk_label_set_text(GTK_LABEL (through_top), line);
 
+   /* the most expensive hooked functions */
+   report = metrics_acct_report(10);
+   markup = g_markup_printf_escaped("<tt>%s</tt>", report);
+   gtk_label_set_markup(GTK_LABEL (hook_acct), markup);
+   g_free(markup);
+   SAFE_FREE(report);
+
    return(TRUE);
 }
 
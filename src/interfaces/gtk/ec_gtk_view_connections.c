@@ -93,9 +93,6 @@ static void set_connfilter(GtkWidget *widget, gpointer *data);
 static void set_connfilter_host(GtkWidget *widget, gpointer *data);
 static gboolean connfilter(GtkTreeModel *model, GtkTreeIter *iter, gpointer *data);
 
-extern void conntrack_lock(void);
-extern void conntrack_unlock(void);
-
 /*** globals ***/
 
 /* connection list */
@@ -433,6 +430,9 @@ static gboolean refresh_connections(gpointer data)
       connections = NULL;
    }
 
+   /* the rows point to the connections, none can be freed while they are used */
+   conntrack_lock();
+
    /* remove old connections */
    for(row = connections; row; row = nextrow) {
        nextrow = row->next;
@@ -457,8 +457,10 @@ static gboolean refresh_connections(gpointer data)
    /* make sure we have a place to start searching for new rows */
    if(!lastconn) {
       listend = conntrack_get(0, NULL, NULL);
-      if(listend == NULL)
+      if(listend == NULL) {
+         conntrack_unlock();
          return(TRUE);
+      }
    } else {
       listend = lastconn->conn;
    }
@@ -475,8 +477,10 @@ static gboolean refresh_connections(gpointer data)
    gtkui_connection_list_row(1, &top);
    gtkui_connection_list_row(0, &bottom);
 
-   if(top.conn == NULL) 
+   if(top.conn == NULL) {
+      conntrack_unlock();
       return(TRUE);
+   }
 
    iter = top.iter; /* copy iter by value */
 
@@ -484,7 +488,8 @@ static gboolean refresh_connections(gpointer data)
    do {
       /* get the conntrack pointer for this row */
       gtk_tree_model_get (model, &iter, 11, &list, -1);
-      conntrack_get(0, list, &conn);
+      if(conntrack_get(0, list, &conn) == NULL)
+         continue;
 
       /* extract changing values from conntrack_print string */
       conntrack_flagstr(conn, flags, sizeof(flags));
@@ -501,6 +506,8 @@ static gboolean refresh_connections(gpointer data)
 
    /* finnaly apply the filter */
    gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(filter.model));
+
+   conntrack_unlock();
   
    return(TRUE);
 }
@@ -640,8 +647,12 @@ static void gtkui_connection_detail(void)
    } else
       return; /* nothing is selected */
 
-   if(!c || !c->co)
+   /* it may have been deleted since the last refresh */
+   conntrack_lock();
+   if(!c || conntrack_get(0, c, NULL) == NULL) {
+      conntrack_unlock();
       return;
+   }
 
    dwindow = gtk_window_new(GTK_WINDOW_TOPLEVEL);
    gtk_window_set_title(GTK_WINDOW(dwindow), "Connection Details");
@@ -910,6 +921,8 @@ static void gtkui_connection_detail(void)
       }
    }
 
+   conntrack_unlock();
+
    /* resize table to the acutal size */
    gtk_table_resize(GTK_TABLE(table), row, ncols);
 
@@ -956,8 +969,16 @@ static void gtkui_connection_data(void)
    } else
       return; /* nothing is selected */
 
-   if(c == NULL || c->co == NULL)
-      return; /* just to be safe */
+   /* it may have been deleted since the last refresh */
+   conntrack_lock();
+   if(c == NULL || conntrack_get(0, c, NULL) == NULL) {
+      conntrack_unlock();
+      return;
+   }
+
+   /* once it is viewed the timeouter leaves it alone */
+   c->co->flags |= CONN_VIEWING;
+   conntrack_unlock();
   
    /* 
     * remove any hook on the open connection.
@@ -1500,19 +1521,28 @@ static void gtkui_connection_kill(void *conn)
    } else
       return; /* nothing is selected */
 
-   if (!c || !c->co)
+   /* it may have been deleted since the last refresh */
+   conntrack_lock();
+   if (!c || conntrack_get(0, c, NULL) == NULL) {
+      conntrack_unlock();
       return;
+   }
    
    /* kill it */
    switch (user_kill(c->co)) {
       case E_SUCCESS:
          /* set the status */
          c->co->status = CONN_KILLED;
+         conntrack_unlock();
          gtkui_message("The connection was killed !!");
          break;
       case -E_FATAL:
+         conntrack_unlock();
          gtkui_message("Cannot kill UDP connections !!");
          break;
+      default:
+         conntrack_unlock();
+         break;
    }
 }
 
@@ -1802,7 +1832,10 @@ static gboolean connfilter(GtkTreeModel *model, GtkTreeIter *iter, gpointer *dat
       }
    }
 
-   if (conn && conn->co) {
+   /* it may have been deleted since the last refresh */
+   conntrack_lock();
+
+   if (conn && conntrack_get(0, conn, NULL) != NULL) {
       /* protocol filter */
       switch (conn->co->L4_proto) {
          case NL_TYPE_UDP:
@@ -1848,6 +1881,8 @@ static gboolean connfilter(GtkTreeModel *model, GtkTreeIter *iter, gpointer *dat
       ret = FALSE;
    }
 
+   conntrack_unlock();
+
    return ret;
 }
 
@@ -445,23 +445,27 @@ void gtkui_button_callback(GtkWidget *widget, gpointer data)
                break;
             case HOST_TARGET1:
                DEBUG_MSG("gtkui_button_callback: add target1");
-               /* add the ip to the target */
-               add_ip_list(&hl->ip, EC_GBL_TARGET1);
-               gtkui_create_targets_array();
+               /* add the ip to the target, the matching is updated at the end */
+               insert_ip_list(&hl->ip, EC_GBL_TARGET1);
 
                USER_MSG("Host %s added to TARGET1\n", ip_addr_ntoa(&hl->ip, tmp));
                break;
             case HOST_TARGET2:
                DEBUG_MSG("gtkui_button_callback: add target2");
-               /* add the ip to the target */
-               add_ip_list(&hl->ip, EC_GBL_TARGET2);
-               gtkui_create_targets_array();
+               /* add the ip to the target, the matching is updated at the end */
+               insert_ip_list(&hl->ip, EC_GBL_TARGET2);
 
                USER_MSG("Host %s added to TARGET2\n", ip_addr_ntoa(&hl->ip, tmp));
                break;
          }
       }
 
+      /* once for all the selected hosts */
+      if (*type == HOST_TARGET1 || *type == HOST_TARGET2) {
+         commit_ip_list(*type == HOST_TARGET1 ? EC_GBL_TARGET1 : EC_GBL_TARGET2);
+         gtkui_create_targets_array();
+      }
+
       /* free the list of selections */
       g_list_free_full(list, (GDestroyNotify)gtk_tree_path_free);
    }
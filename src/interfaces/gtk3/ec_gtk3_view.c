@@ -24,6 +24,7 @@
 #include <ec_format.h>
 #include <ec_utils.h>
 #include <ec_encryption.h>
+#include <ec_metrics.h>
 
 /* proto */
 
@@ -47,7 +48,8 @@ static guint stats_idle; /* for removing the idle call */
 /* for stats window */
 static GtkWidget *stats_window, *packets_recv, *packets_drop, *packets_forw, 
                  *queue_len, *sample_rate, *recv_bottom, *recv_top, *interesting, 
-                 *rate_bottom, *rate_top, *through_bottom, *through_top;
+                 *rate_bottom, *rate_top, *through_bottom, *through_top,
+                 *hook_acct;
 
 /*******************************************/
 
@@ -230,6 +232,12 @@ void gtkui_show_stats(GSimpleAction *action, GVariant *value, gpointer data)
    gtk_widget_set_halign(through_top, GTK_ALIGN_START);
    gtk_grid_attach(GTK_GRID(grid), through_top, GTK_POS_LEFT+1, GTK_POS_TOP+11, 1, 1);
 
+   hook_acct    = gtk_label_new("");
+   gtk_label_set_selectable(GTK_LABEL (hook_acct), TRUE);
+   gtk_widget_set_halign(hook_acct, GTK_ALIGN_START);
+   gtk_widget_set_margin_top(hook_acct, 10);
+   gtk_grid_attach(GTK_GRID(grid), hook_acct, GTK_POS_LEFT, GTK_POS_TOP+12, 2, 1);
+
    gtk_widget_show_all(grid);
    gtk_widget_show(stats_window);
   
@@ -274,6 +282,7 @@ static void gtkui_stop_stats(void)
 static gboolean refresh_stats(gpointer data)
 {
    char line[50];
+   char *report, *markup;
 
    /* variable not used */
    (void) data;
@@ -291,7 +300,8 @@ static gboolean refresh_stats(gpointer data)
    gtk_label_set_text(GTK_LABEL (packets_drop), line);
    snprintf(line, 50, "%8"PRIu64"  bytes: %8"PRIu64" ", EC_GBL_STATS->ps_sent, EC_GBL_STATS->bs_sent);
    gtk_label_set_text(GTK_LABEL (packets_forw), line);
-   snprintf(line, 50, "%lu/%lu ", EC_GBL_STATS->queue_curr, EC_GBL_STATS->queue_max);
+   snprintf(line, 50, "%lu/%lu  drops: %lu ", EC_GBL_STATS->queue_curr, EC_GBL_STATS->queue_max,
+         EC_GBL_STATS->queue_drop);
    gtk_label_set_text(GTK_LABEL (queue_len), line);
    snprintf(line, 50, "%d ", EC_GBL_CONF->sampling_rate);
    gtk_label_set_text(GTK_LABEL (sample_rate), line);
@@ -317,6 +327,13 @@ static gboolean refresh_stats(gpointer data)
          EC_GBL_STATS->th.thru_worst, EC_GBL_STATS->th.thru_adv);
    gtk_label_set_text(GTK_LABEL (through_top), line);
 
+   /* the most expensive hooked functions */
+   report = metrics_acct_report(10);
+   markup = g_markup_printf_escaped("<tt>%s</tt>", report);
+   gtk_label_set_markup(GTK_LABEL (hook_acct), markup);
+   g_free(markup);
+   SAFE_FREE(report);
+
    return(TRUE);
 }
 
@@ -93,9 +93,6 @@ static void set_connfilter(GtkWidget *widget, gpointer *data);
 static void set_connfilter_host(GtkWidget *widget, gpointer *data);
 static gboolean connfilter(GtkTreeModel *model, GtkTreeIter *iter, gpointer *data);
 
-extern void conntrack_lock(void);
-extern void conntrack_unlock(void);
-
 /*** globals ***/
 
 /* connection list */
@@ -444,6 +441,9 @@ static gboolean refresh_connections(gpointer data)
       connections = NULL;
    }
 
+   /* the rows point to the connections, none can be freed while they are used */
+   conntrack_lock();
+
    /* remove old connections */
    for(row = connections; row; row = nextrow) {
        nextrow = row->next;
@@ -468,8 +468,10 @@ static gboolean refresh_connections(gpointer data)
    /* make sure we have a place to start searching for new rows */
    if(!lastconn) {
       listend = conntrack_get(0, NULL, NULL);
-      if(listend == NULL)
+      if(listend == NULL) {
+         conntrack_unlock();
          return(TRUE);
+      }
    } else {
       listend = lastconn->conn;
    }
@@ -486,8 +488,10 @@ static gboolean refresh_connections(gpointer data)
    gtkui_connection_list_row(1, &top);
    gtkui_connection_list_row(0, &bottom);
 
-   if(top.conn == NULL) 
+   if(top.conn == NULL) {
+      conntrack_unlock();
       return(TRUE);
+   }
 
    iter = top.iter; /* copy iter by value */
 
@@ -495,7 +499,8 @@ static gboolean refresh_connections(gpointer data)
    do {
       /* get the conntrack pointer for this row */
       gtk_tree_model_get (model, &iter, 11, &list, -1);
-      conntrack_get(0, list, &conn);
+      if(conntrack_get(0, list, &conn) == NULL)
+         continue;
 
       /* extract changing values from conntrack_print string */
       conntrack_flagstr(conn, flags, sizeof(flags));
@@ -512,6 +517,8 @@ static gboolean refresh_connections(gpointer data)
 
    /* finnaly apply the filter */
    gtk_tree_model_filter_refilter(GTK_TREE_MODEL_FILTER(filter.model));
+
+   conntrack_unlock();
   
    return(TRUE);
 }
@@ -651,8 +658,12 @@ static void gtkui_connection_detail(void)
    } else
       return; /* nothing is selected */
 
-   if(!c || !c->co)
+   /* it may have been deleted since the last refresh */
+   conntrack_lock();
+   if(!c || conntrack_get(0, c, NULL) == NULL) {
+      conntrack_unlock();
       return;
+   }
 
    header = gtk_header_bar_new();
    gtk_header_bar_set_title(GTK_HEADER_BAR(header), "Connection Details");
@@ -928,6 +939,8 @@ static void gtkui_connection_detail(void)
       }
    }
 
+   conntrack_unlock();
+
    hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
    gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
 
@@ -965,8 +978,16 @@ static void gtkui_connection_data(void)
    } else
       return; /* nothing is selected */
 
-   if(c == NULL || c->co == NULL)
-      return; /* just to be safe */
+   /* it may have been deleted since the last refresh */
+   conntrack_lock();
+   if(c == NULL || conntrack_get(0, c, NULL) == NULL) {
+      conntrack_unlock();
+      return;
+   }
+
+   /* once it is viewed the timeouter leaves it alone */
+   c->co->flags |= CONN_VIEWING;
+   conntrack_unlock();
   
    /* 
     * remove any hook on the open connection.
@@ -1509,19 +1530,28 @@ static void gtkui_connection_kill(void *conn)
    } else
       return; /* nothing is selected */
 
-   if (!c || !c->co)
+   /* it may have been deleted since the last refresh */
+   conntrack_lock();
+   if (!c || conntrack_get(0, c, NULL) == NULL) {
+      conntrack_unlock();
       return;
+   }
    
    /* kill it */
    switch (user_kill(c->co)) {
       case E_SUCCESS:
          /* set the status */
          c->co->status = CONN_KILLED;
+         conntrack_unlock();
          gtkui_message("The connection was killed !!");
          break;
       case -E_FATAL:
+         conntrack_unlock();
          gtkui_message("Cannot kill UDP connections !!");
          break;
+      default:
+         conntrack_unlock();
+         break;
    }
 }
 
@@ -1813,7 +1843,10 @@ static gboolean connfilter(GtkTreeModel *model, GtkTreeIter *iter, gpointer *dat
       }
    }
 
-   if (conn && conn->co) {
+   /* it may have been deleted since the last refresh */
+   conntrack_lock();
+
+   if (conn && conntrack_get(0, conn, NULL) != NULL) {
       /* protocol filter */
       switch (conn->co->L4_proto) {
          case NL_TYPE_UDP:
@@ -1859,6 +1892,8 @@ static gboolean connfilter(GtkTreeModel *model, GtkTreeIter *iter, gpointer *dat
       ret = FALSE;
    }
 
+   conntrack_unlock();
+
    return ret;
 }
 
@@ -30,6 +30,7 @@
 #include <ec_text.h>
 #include <ec_scan.h>
 #include <ec_mitm.h>
+#include <ec_metrics.h>
 
 #ifdef OS_WINDOWS
    #include <missing/termios_mingw.h>
@@ -554,6 +555,8 @@ static void text_run_filter(void) {
  */
 static void text_stats(void)
 {
+   char *report;
+
    DEBUG_MSG("text_stats (pcap) : %" PRIu64 " %" PRIu64 " %" PRIu64,
                                                 EC_GBL_STATS->ps_recv,
                                                 EC_GBL_STATS->ps_drop,
@@ -566,7 +569,7 @@ static void text_stats(void)
          EC_GBL_STATS->th.rate_adv, EC_GBL_STATS->th.rate_worst, 
          EC_GBL_STATS->th.thru_adv, EC_GBL_STATS->th.thru_worst); 
    
-   DEBUG_MSG("text_stats (queue) : %lu %lu", EC_GBL_STATS->queue_curr, EC_GBL_STATS->queue_max); 
+   DEBUG_MSG("text_stats (queue) : %lu %lu %lu", EC_GBL_STATS->queue_curr, EC_GBL_STATS->queue_max, EC_GBL_STATS->queue_drop); 
   
    
    fprintf(stdout, "\n Received packets    : %8" PRIu64 "\n", EC_GBL_STATS->ps_recv);
@@ -574,8 +577,20 @@ static void text_stats(void)
          (EC_GBL_STATS->ps_recv) ? (float)EC_GBL_STATS->ps_drop * 100 / EC_GBL_STATS->ps_recv : 0 );
    fprintf(stdout,   " Forwarded           : %8" PRIu64 "  bytes: %8" PRIu64 "\n\n",
            EC_GBL_STATS->ps_sent, EC_GBL_STATS->bs_sent);
-   
-   fprintf(stdout,   " Current queue len   : %lu/%lu\n", EC_GBL_STATS->queue_curr, EC_GBL_STATS->queue_max);
+
+   if (EC_GBL_IFACE->ring != NULL)
+      fprintf(stdout, " Ring blocks         : %8" PRIu64 "  losing: %8" PRIu64 "  freeze: %8" PRIu64 "\n\n",
+              EC_GBL_STATS->ring_blocks, EC_GBL_STATS->ring_lost, EC_GBL_STATS->ring_freeze);
+   
+   fprintf(stdout,   " Current queue len   : %lu/%lu  drops: %lu\n", EC_GBL_STATS->queue_curr, EC_GBL_STATS->queue_max,
+         EC_GBL_STATS->queue_drop);
+   fprintf(stdout,   " Packet pool (heap)  : alloc: %8" PRIu64 "  free: %8" PRIu64 "\n", 
+         EC_GBL_STATS->pool_heap_alloc, EC_GBL_STATS->pool_heap_free);
+   fprintf(stdout,   " IP fragments        : reassembled: %8" PRIu64 "  pending: %8" PRIu64 "  expired: %8" PRIu64 "  evicted: %8" PRIu64 "  dropped: %8" PRIu64 "\n",
+         EC_GBL_STATS->frag_reassembled, EC_GBL_STATS->frag_pending, EC_GBL_STATS->frag_expired, 
+         EC_GBL_STATS->frag_evicted, EC_GBL_STATS->frag_dropped);
+   fprintf(stdout,   " TCP streams         : memory: %8" PRIu64 "  out of order: %8" PRIu64 "  gaps: %8" PRIu64 "  dropped: %8" PRIu64 "\n",
+         EC_GBL_STATS->stream_mem, EC_GBL_STATS->stream_ooo, EC_GBL_STATS->stream_gaps, EC_GBL_STATS->stream_dropped);
    fprintf(stdout,   " Sampling rate       : %d\n\n", EC_GBL_CONF->sampling_rate);
    
    fprintf(stdout,   " Bottom Half received packet : pck: %8" PRIu64 "  byte: %8" PRIu64 "\n",
@@ -594,6 +609,13 @@ static void text_stats(void)
          EC_GBL_STATS->bh.thru_worst, EC_GBL_STATS->bh.thru_adv);
    fprintf(stdout,   " Top Half throughput     : worst: %8lu  adv: %8lu b/s\n\n", 
          EC_GBL_STATS->th.thru_worst, EC_GBL_STATS->th.thru_adv);
+
+   /* the cpu time of the hooked functions */
+   if (EC_GBL_CONF->hook_accounting) {
+      report = metrics_acct_report(20);
+      fprintf(stdout, "%s\n", report);
+      SAFE_FREE(report);
+   }
 }
 
 /*
@@ -27,6 +27,7 @@
 #include <ec_lua.h>
 #include <ec_error.h>
 #include <ec_packet.h>
+#include <ec_metrics.h>
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
@@ -37,6 +38,7 @@
 struct lua_hook_list {
   int hook_point;
   int func_ref;
+  struct metrics_acct *acct;    /* charged to the script */
   SLIST_ENTRY(lua_hook_list) next;
 };
 
@@ -241,18 +243,24 @@ void ec_lua_print_stack(FILE * io)
 int ec_lua_dispatch_hooked_packet(int point, struct packet_object * po)
 {
   struct lua_hook_list *lua_hook_entry;
-  int err_code;
+  int err_code, acct;
+  uint64_t t0 = 0;
 
   // Don't have to do anything if we don't have a state.
   if (_lua_state == NULL)
     return 0;
 
+  acct = EC_GBL_CONF->hook_accounting;
 
   SLIST_FOREACH(lua_hook_entry, &lua_hook_table, next) {
     if (point == lua_hook_entry->hook_point) {
+      if (acct)
+        t0 = metrics_clock();
       lua_rawgeti(_lua_state, LUA_REGISTRYINDEX, lua_hook_entry->func_ref);
       lua_pushlightuserdata(_lua_state, (void *) po);
       err_code = lua_pcall(_lua_state,1,0,0);
+      if (acct)
+        metrics_acct(lua_hook_entry->acct, metrics_clock() - t0);
       if (err_code != 0) {
         LUA_FATAL_ERROR("EC_LUA ec_lua_dispatch_hooked_packet Failed. Error %d: %s\n", 
             err_code, lua_tostring(_lua_state, -1));
@@ -276,12 +284,24 @@ static int l_log(lua_State* state)
 
 // This is called when a hook is added in lua-land. We'll use this in the 
 // near future to make our dispatching to lua much more efficient. 
+// The optional third argument is the name of the script, the cpu time of 
+// the hook is accounted to it.
 static int l_hook_add(lua_State* state)
 {
   int point, r;
   struct lua_hook_list *lua_hook_entry;
+  const char *script;
+  char label[32];
 
   point = lua_tointeger(state, 1);
+  script = luaL_optstring(state, 3, NULL);
+
+  SAFE_CALLOC(lua_hook_entry, 1, sizeof(struct lua_hook_list));
+
+  // The record copies the name, so it can be taken before it's popped.
+  snprintf(label, sizeof(label), "lua hook %d", point);
+  lua_hook_entry->acct = metrics_acct_add_owned(lua_hook_entry, label,
+      script != NULL ? script : "lua");
 
   // Set the top of the stack to point to the function.
   lua_settop(state, 2);
@@ -289,7 +309,6 @@ static int l_hook_add(lua_State* state)
   // Show a reference to the function into the registry.
   r = luaL_ref(state, LUA_REGISTRYINDEX);
   
-  SAFE_CALLOC(lua_hook_entry, 1, sizeof(struct lua_hook_list));
   lua_hook_entry->hook_point = point;
   lua_hook_entry->func_ref = r;
   SLIST_INSERT_HEAD(&lua_hook_table, lua_hook_entry, next);
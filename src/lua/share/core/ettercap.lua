@@ -225,8 +225,9 @@ local create_hook = function(script)
 end
 
 -- Adds a hook
-local hook_add = function (hook_point, func)
-  ettercap_c.hook_add(hook_point, func)
+-- @param name (string) The script the cpu time of the hook is charged to
+local hook_add = function (hook_point, func, name)
+  ettercap_c.hook_add(hook_point, func, name)
 end
 
 -- Processes all the --lua-script arguments into a single list of script
@@ -281,7 +282,7 @@ end
 -- @param args (table) A table of key,value tuples
 local ettercap_load_script = function (name, args)
   local script = assert(Script.new(name, args), "Failed to load: " .. name)
-  hook_add(script.hook_point, create_hook(script))
+  hook_add(script.hook_point, create_hook(script), name)
 end
 
 -- Primary entry point for ettercap lua environment
@@ -247,7 +247,7 @@ static void port_stealing_stop(void)
       TAILQ_FOREACH_SAFE(p, &s->packet_table, next, tmp_p) {
          packet_destroy_object(p->po);
          TAILQ_REMOVE(&s->packet_table, p, next);
-         SAFE_FREE(p->po);
+         packet_release_object(p->po);
          SAFE_FREE(p);
       }
       
@@ -403,7 +403,7 @@ static void send_queue(struct packet_object *po)
                 */
                packet_destroy_object(p->po);
                TAILQ_REMOVE(&s1->packet_table, p, next);
-               SAFE_FREE(p->po);
+               packet_release_object(p->po);
                SAFE_FREE(p);
 	      
                /* Sleep only if we have more than one packet to send */
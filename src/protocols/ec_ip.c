@@ -26,6 +26,7 @@
 #include <ec_checksum.h>
 #include <ec_session.h>
 #include <ec_inject.h>
+#include <ec_frag.h>
 
 
 /* globals */
@@ -78,6 +79,7 @@ void ip_init(void);
 int ip_match(void *id_sess, void *id_curr);
 void ip_create_session(struct ec_session **s, struct packet_object *po);
 size_t ip_create_ident(void **i, struct packet_object *po);            
+static void ip_defrag(struct ip_header *ip, struct packet_object *po);
 
 
 /*******************************************/
@@ -158,11 +160,6 @@ FUNC_DECODER(decode_ip)
       PACKET->fwd_len = t_len; 
    }
    
-   /* XXX - implement the handling of fragmented packet */
-   /* don't process fragmented packets */
-   if (ntohs(ip->frag_off) & IP_FRAG || ntohs(ip->frag_off) & IP_MF) 
-      return NULL;
-   
    /* 
     * if the checsum is wrong, don't parse it (avoid ettercap spotting) 
     * the checksum should be 0 ;)
@@ -178,6 +175,15 @@ FUNC_DECODER(decode_ip)
       }
    }
    
+   /* 
+    * the fragments are decoded only once the datagram is complete.
+    * they are forwarded as they are.
+    */
+   if (ntohs(ip->frag_off) & IP_FRAG || ntohs(ip->frag_off) & IP_MF) {
+      ip_defrag(ip, PACKET);
+      return NULL;
+   }
+   
    /* if it is a TCP packet, try to passive fingerprint it */
    if (ip->protocol == NL_TYPE_TCP) {
       /* initialize passive fingerprint */
@@ -264,6 +270,75 @@ FUNC_DECODER(decode_ip)
    return NULL;
 }
 
+/*
+ * hand the fragment to the reassembly engine and, once the
+ * datagram is complete, decode it as if it was received in
+ * a single packet.
+ * the reassembled datagram is never forwarded: the fragments
+ * were (or will be), so the filters can inspect it, but their
+ * modifications don't reach the wire.
+ */
+static void ip_defrag(struct ip_header *ip, struct packet_object *po)
+{
+   struct packet_object dpo;
+   struct ip_header *dip;
+   struct frag_key key;
+   struct frag_hdr hdr;
+   u_char *dgram;
+   size_t dgram_len, l3_off, hlen;
+   u_int16 frag_off = ntohs(ip->frag_off);
+   int len;
+
+   memset(&key, 0, sizeof(struct frag_key));
+   memcpy(&key.src, &po->L3.src, sizeof(struct ip_addr));
+   memcpy(&key.dst, &po->L3.dst, sizeof(struct ip_addr));
+   key.id = ntohs(ip->id);
+   key.proto = ip->protocol;
+
+   hlen = ip->ihl * 4;
+
+   hdr.buf = po->packet;
+   hdr.l3_off = (u_char *)ip - po->packet;
+   hdr.len = hdr.l3_off + hlen;
+
+   if (frag_insert(&key, &po->ts, (frag_off & IP_FRAG) << 3, (u_char *)ip + hlen,
+                   po->L3.payload_len, frag_off & IP_MF, UINT16_MAX - hlen,
+                   &hdr, &dgram, &dgram_len) != E_SUCCESS)
+      return;
+
+   /* the datagram starts with the headers of the first fragment */
+   l3_off = hdr.l3_off;
+   hlen = hdr.len - hdr.l3_off;
+
+   DEBUG_MSG("ip_defrag: datagram %#x from %s reassembled (%zu bytes)", key.id, 
+             int_ntoa(ip->saddr), dgram_len - l3_off);
+
+   /* now it is a whole datagram */
+   dip = (struct ip_header *)(dgram + l3_off);
+   dip->tot_len = htons(dgram_len - l3_off);
+   dip->frag_off = 0;
+   dip->csum = CSUM_INIT;
+   dip->csum = L3_checksum((u_char *)dip, hlen);
+
+   packet_create_object(&dpo, dgram, dgram_len);
+   memcpy(&dpo.ts, &po->ts, sizeof(struct timeval));
+   memcpy(&dpo.L2, &po->L2, sizeof(dpo.L2));
+   if (po->L2.header != NULL && (size_t)(po->L2.header - po->packet) < l3_off)
+      dpo.L2.header = dgram + (po->L2.header - po->packet);
+   else
+      dpo.L2.header = NULL;
+   dpo.flags = (po->flags & (PO_FROMIFACE | PO_FROMBRIDGE)) | PO_IGNORE;
+
+   /* this prevents the forwarding checks in decode_ip */
+   dpo.fwd_packet = (u_char *)dip;
+   dpo.fwd_len = dgram_len - l3_off;
+
+   decode_ip((u_char *)dip, dgram_len - l3_off, &len, &dpo);
+
+   packet_destroy_object(&dpo);
+   SAFE_FREE(dgram);
+}
+
 /*******************************************/
 FUNC_INJECTOR(inject_ip)
 {
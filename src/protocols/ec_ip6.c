@@ -24,6 +24,7 @@
 #include <ec_inject.h>
 #include <ec_inet.h>
 #include <ec_session.h>
+#include <ec_frag.h>
 //#include <ec_fingerprint.h>
 
 #define IP6_HDR_LEN 40
@@ -54,6 +55,15 @@ struct ip6_ext_header {
     /* Here must be options */
 };
 
+struct ip6_frag_header {
+   u_int8   next_hdr;
+   u_int8   reserved;
+   u_int16  frag_off;
+#define IP6_MF       0x0001
+#define IP6_OFFSET   0xfff8
+   u_int32  id;
+};
+
 struct ip6_ident {
    u_int32 magic;
 #define IP6_MAGIC    0x0306e77e
@@ -70,10 +80,12 @@ struct ip6_data {
 void ip6_init(void);
 FUNC_DECODER(decode_ip6);
 FUNC_DECODER(decode_ip6_ext);
+FUNC_DECODER(decode_ip6_frag);
 FUNC_INJECTOR(inject_ip6);
 static size_t ip6_create_ident(void **i, struct packet_object *po);
 static int ip6_match(void *ident_s, void *ident_c);
 static void ip6_create_session(struct ec_session **s, struct packet_object *po);
+static void ip6_defrag(struct ip6_frag_header *fh, struct packet_object *po);
 
 /*******************************************/
 
@@ -89,6 +101,7 @@ void __init ip6_init(void)
    add_decoder(NET6_LAYER, LO6_TYPE_HBH, decode_ip6_ext);
    add_decoder(NET6_LAYER, LO6_TYPE_RT, decode_ip6_ext);
    add_decoder(NET6_LAYER, LO6_TYPE_DST, decode_ip6_ext);
+   add_decoder(NET6_LAYER, LO6_TYPE_FR, decode_ip6_frag);
 
    add_injector(CHAIN_LINKED, IP6_MAGIC, inject_ip6);
 }
@@ -207,8 +220,13 @@ FUNC_DECODER(decode_ip6_ext)
    struct ip6_ext_header *ext_hdr;
 
    ext_hdr = (struct ip6_ext_header *)DECODE_DATA;
-   PACKET->L3.optlen += ext_hdr->hdr_len + 1;
-   DECODED_LEN = ext_hdr->hdr_len + 1;
+   /* the length is in 8 octets units, not including the first 8 */
+   DECODED_LEN = (ext_hdr->hdr_len + 1) * 8;
+   if (DECODED_LEN > DECODE_DATALEN || (u_int32)DECODED_LEN > PACKET->L3.payload_len)
+      return NULL;
+   PACKET->L3.optlen += DECODED_LEN;
+   /* the upper layer expects only its own length here */
+   PACKET->L3.payload_len -= DECODED_LEN;
 
    next_decoder = get_decoder(NET6_LAYER, ext_hdr->next_hdr);
    if(next_decoder == NULL) {
@@ -220,6 +238,120 @@ FUNC_DECODER(decode_ip6_ext)
    return NULL;
 }
 
+/*
+ * the fragments are decoded only once the datagram is complete.
+ * they are forwarded as they are.
+ */
+FUNC_DECODER(decode_ip6_frag)
+{
+   FUNC_DECODER_PTR(next_decoder);
+   struct ip6_frag_header *fh;
+
+   fh = (struct ip6_frag_header *)DECODE_DATA;
+   DECODED_LEN = sizeof(struct ip6_frag_header);
+   if (DECODED_LEN > DECODE_DATALEN || (u_int32)DECODED_LEN > PACKET->L3.payload_len)
+      return NULL;
+
+   /* an atomic fragment (RFC 6946) is a whole datagram */
+   if ((ntohs(fh->frag_off) & (IP6_OFFSET | IP6_MF)) == 0) {
+      PACKET->L3.optlen += DECODED_LEN;
+      PACKET->L3.payload_len -= DECODED_LEN;
+
+      next_decoder = get_decoder(NET6_LAYER, fh->next_hdr);
+      if(next_decoder == NULL) {
+         next_decoder = get_decoder(PROTO_LAYER, fh->next_hdr);
+      }
+
+      EXECUTE_DECODER(next_decoder);
+      return NULL;
+   }
+
+   ip6_defrag(fh, PACKET);
+
+   return NULL;
+}
+
+/*
+ * hand the fragment to the reassembly engine and, once the
+ * datagram is complete, decode it as if it was received in
+ * a single packet (see ip_defrag in ec_ip.c).
+ * the reassembled datagram is never forwarded.
+ */
+static void ip6_defrag(struct ip6_frag_header *fh, struct packet_object *po)
+{
+   struct packet_object dpo;
+   struct ip6_header *ip6, *dip6;
+   struct ip6_ext_header *ext;
+   struct frag_key key;
+   struct frag_hdr hdr;
+   u_char *dgram, *p, *data, *end, *next_hdr;
+   size_t dgram_len, l3_off, hdr_len, unfrag;
+   int len;
+
+   ip6 = (struct ip6_header *)po->L3.header;
+
+   /* the extension headers preceding the fragment header */
+   hdr.buf = po->packet;
+   hdr.l3_off = (u_char *)ip6 - po->packet;
+   hdr.len = (u_char *)fh - po->packet;
+   unfrag = (u_char *)fh - (u_char *)ip6 - IP6_HDR_LEN;
+
+   data = (u_char *)(fh + 1);
+   end = (u_char *)ip6 + IP6_HDR_LEN + ntohs(ip6->payload_len);
+   if (end > po->packet + po->len)
+      return;
+
+   memset(&key, 0, sizeof(struct frag_key));
+   memcpy(&key.src, &po->L3.src, sizeof(struct ip_addr));
+   memcpy(&key.dst, &po->L3.dst, sizeof(struct ip_addr));
+   key.id = ntohl(fh->id);
+   key.proto = fh->next_hdr;
+
+   /* the whole datagram has to fit the decoders buffer length */
+   if (frag_insert(&key, &po->ts, ntohs(fh->frag_off) & IP6_OFFSET, data, end - data,
+                   ntohs(fh->frag_off) & IP6_MF, UINT16_MAX - IP6_HDR_LEN - unfrag,
+                   &hdr, &dgram, &dgram_len) != E_SUCCESS)
+      return;
+
+   /* 
+    * the datagram starts with the headers of the first fragment,
+    * the extension headers of the others may be different
+    */
+   l3_off = hdr.l3_off;
+   hdr_len = hdr.len;
+
+   DEBUG_MSG("ip6_defrag: datagram %#x reassembled (%zu bytes)", key.id, dgram_len - l3_off);
+
+   /* drop the fragment header: the last header before it points to the payload */
+   dip6 = (struct ip6_header *)(dgram + l3_off);
+   dip6->payload_len = htons(dgram_len - l3_off - IP6_HDR_LEN);
+
+   next_hdr = &dip6->next_hdr;
+   for (p = (u_char *)(dip6 + 1); p < dgram + hdr_len; p += (ext->hdr_len + 1) * 8) {
+      ext = (struct ip6_ext_header *)p;
+      next_hdr = &ext->next_hdr;
+   }
+   *next_hdr = key.proto;
+
+   packet_create_object(&dpo, dgram, dgram_len);
+   memcpy(&dpo.ts, &po->ts, sizeof(struct timeval));
+   memcpy(&dpo.L2, &po->L2, sizeof(dpo.L2));
+   if (po->L2.header != NULL && (size_t)(po->L2.header - po->packet) < l3_off)
+      dpo.L2.header = dgram + (po->L2.header - po->packet);
+   else
+      dpo.L2.header = NULL;
+   dpo.flags = (po->flags & (PO_FROMIFACE | PO_FROMBRIDGE)) | PO_IGNORE;
+
+   /* this prevents the forwarding checks in decode_ip6 */
+   dpo.fwd_packet = (u_char *)dip6;
+   dpo.fwd_len = dgram_len - l3_off;
+
+   decode_ip6((u_char *)dip6, dgram_len - l3_off, &len, &dpo);
+
+   packet_destroy_object(&dpo);
+   SAFE_FREE(dgram);
+}
+
 FUNC_INJECTOR(inject_ip6)
 {
    struct ip6_header *ip6;
@@ -0,0 +1,160 @@
+
+#include <stdio.h>
+#include <check.h>
+
+#include <ec.h>
+#include <ec_libettercap.h>
+#include <ec_packet.h>
+#include <ec_connbuf.h>
+
+struct ec_globals *ec_gbls;
+
+#define PACKETS   1000
+
+static struct conn_buf cb;
+static struct ip_addr src[2];
+
+/* what connbuf_print() passed to the callback */
+static char printed[PACKETS][16];
+static int sides[PACKETS];
+static u_int nprinted;
+
+static void setup(void)
+{
+  struct in_addr in;
+
+  inet_aton("10.0.0.1", &in);
+  ip_addr_init(&src[0], AF_INET, (u_char *)&in);
+  inet_aton("10.0.0.2", &in);
+  ip_addr_init(&src[1], AF_INET, (u_char *)&in);
+
+  nprinted = 0;
+}
+
+static void teardown(void)
+{
+  connbuf_wipe(&cb);
+}
+
+static void print(u_char *text, size_t len, struct ip_addr *L3_src)
+{
+  fail_if(nprinted == PACKETS, "Too many records printed.");
+  fail_if(len >= sizeof(printed[0]), "Wrong length.");
+  fail_if(text[len] != '\0', "The data is not terminated.");
+
+  memcpy(printed[nprinted], text, len + 1);
+  sides[nprinted] = !ip_addr_cmp(L3_src, &src[0]) ? 0 : 1;
+  nprinted++;
+}
+
+static void add(u_int n, int side, size_t len)
+{
+  struct packet_object po;
+  char data[64];
+
+  memset(&po, 0, sizeof(po));
+  memset(data, '.', sizeof(data));
+  snprintf(data, sizeof(data), "%u", n);
+  data[strlen(data)] = '.';
+
+  memcpy(&po.L3.src, &src[side], sizeof(struct ip_addr));
+  po.DATA.disp_data = (u_char *)data;
+  po.DATA.disp_len = len;
+
+  connbuf_add(&cb, &po);
+}
+
+START_TEST (test_connbuf_order)
+{
+  u_int i;
+
+  connbuf_init(&cb, 4096);
+
+  for (i = 0; i < 10; i++)
+    add(i, i % 2, 8);
+
+  fail_if(connbuf_print(&cb, print) != 10 * 8, "Wrong number of printed chars.");
+  fail_if(nprinted != 10, "Wrong number of records.");
+
+  for (i = 0; i < 10; i++) {
+    fail_if(atoi(printed[i]) != (int)i, "The records are not in order.");
+    fail_if(sides[i] != (int)(i % 2), "Wrong side.");
+  }
+}
+END_TEST
+
+/* the oldest records are overwritten, the others are kept in order */
+START_TEST (test_connbuf_wrap)
+{
+  u_int i, j;
+
+  /* not a multiple of the record sizes, to exercise the padding */
+  connbuf_init(&cb, 250);
+
+  for (i = 0; i < PACKETS; i++) {
+    add(i, 0, 5 + i % 11);
+    fail_if(cb.size > cb.max_size, "Over the maximum size.");
+
+    nprinted = 0;
+    connbuf_print(&cb, print);
+
+    fail_if(nprinted == 0, "The ring is empty.");
+    fail_if(atoi(printed[nprinted - 1]) != (int)i, "The last record is not the newest.");
+    for (j = 1; j < nprinted; j++)
+      fail_if(atoi(printed[j]) != atoi(printed[j - 1]) + 1, "The records are not contiguous.");
+  }
+
+  /* at least half of the ring is used by the records */
+  fail_if(nprinted < 250 / 2 / (20 + 16 + 1), "Too few records kept.");
+}
+END_TEST
+
+START_TEST (test_connbuf_too_big)
+{
+  connbuf_init(&cb, 32);
+
+  add(1, 0, 8);
+  add(2, 0, 40);
+
+  connbuf_print(&cb, print);
+  fail_if(nprinted != 1 || atoi(printed[0]) != 1, "The oversized packet was stored.");
+}
+END_TEST
+
+START_TEST (test_connbuf_wipe)
+{
+  connbuf_init(&cb, 256);
+
+  add(1, 0, 8);
+  connbuf_wipe(&cb);
+
+  fail_if(connbuf_print(&cb, print) != 0, "The buffer was not emptied.");
+
+  add(2, 1, 8);
+  connbuf_print(&cb, print);
+  fail_if(nprinted != 1 || atoi(printed[0]) != 2, "The buffer was not reused.");
+}
+END_TEST
+
+Suite* ts_test_connbuf (void) {
+  Suite *suite = suite_create("ts_test_connbuf");
+  TCase *tcase = tcase_create("connbuf_ring");
+  tcase_add_checked_fixture(tcase, setup, teardown);
+  tcase_add_test(tcase, test_connbuf_order);
+  tcase_add_test(tcase, test_connbuf_wrap);
+  tcase_add_test(tcase, test_connbuf_too_big);
+  tcase_add_test(tcase, test_connbuf_wipe);
+  suite_add_tcase(suite, tcase);
+  return suite;
+}
+
+int main () {
+  int number_failed;
+  libettercap_init("test", "0.0.1");
+  Suite *suite = ts_test_connbuf();
+  SRunner *runner = srunner_create(suite);
+  srunner_run_all(runner, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(runner);
+  srunner_free(runner);
+  return number_failed;
+}
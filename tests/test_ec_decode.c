@@ -5,6 +5,7 @@
 #include <ec_libettercap.h>
 #include <ec_decode.h>
 #include <ec_proto.h>
+#include <ec_rcu.h>
 
 struct ec_globals *ec_gbls;
 
@@ -34,6 +35,50 @@ START_TEST (test_get_decoder_udp)
 }
 END_TEST
 
+static FUNC_DECODER(decode_one)
+{
+  (void) buf; (void) buflen; (void) len; (void) po;
+  return NULL;
+}
+
+static FUNC_DECODER(decode_two)
+{
+  (void) buf; (void) buflen; (void) len; (void) po;
+  return NULL;
+}
+
+/* a type too big to be indexed, every change rebuilds the lookup */
+#define SPARSE_TYPE  0x10000
+
+/* the replaced lookups are released, the new ones are consistent */
+START_TEST (test_decoder_rebuild)
+{
+  void **chain;
+  int i;
+
+  fail_if(get_decoder(APP_LAYER, PL_DEFAULT) == NULL, "Could not find default decoder.");
+
+  for (i = 0; i < 1000; i++) {
+    add_decoder(APP_LAYER_TCP, SPARSE_TYPE, decode_one);
+    fail_if(get_decoder(APP_LAYER_TCP, SPARSE_TYPE) != decode_one, "The new decoder is not found.");
+
+    add_decoder(APP_LAYER_TCP, SPARSE_TYPE, decode_two);
+
+    rcu_read_begin(RCU_DECODERS);
+    chain = get_decoders(APP_LAYER_TCP, SPARSE_TYPE);
+    fail_if(chain == NULL || chain[0] == NULL || chain[1] == NULL || chain[2] != NULL, "Wrong chain.");
+    /* from inside a read section it is only queued */
+    del_decoder(APP_LAYER_TCP, SPARSE_TYPE, decode_one);
+    fail_if(chain[0] != decode_one && chain[1] != decode_one, "The walked chain was changed.");
+    rcu_read_end(RCU_DECODERS);
+
+    fail_if(get_decoder(APP_LAYER_TCP, SPARSE_TYPE) != decode_two, "The decoder left is not found.");
+    del_decoder(APP_LAYER_TCP, SPARSE_TYPE, decode_two);
+    fail_if(get_decoder(APP_LAYER_TCP, SPARSE_TYPE) != NULL, "The decoder was not removed.");
+  }
+}
+END_TEST
+
 Suite* ts_test_decode (void) {
   Suite *suite = suite_create("ts_test_decode");
   TCase *tcase = tcase_create("get_decoder");
@@ -41,6 +86,7 @@ Suite* ts_test_decode (void) {
   tcase_add_test(tcase, test_get_decoder_ip);
   tcase_add_test(tcase, test_get_decoder_tcp);
   tcase_add_test(tcase, test_get_decoder_udp);
+  tcase_add_test(tcase, test_decoder_rebuild);
   suite_add_tcase(suite, tcase);
   return suite;
 }
@@ -0,0 +1,338 @@
+
+#include <stdio.h>
+#include <check.h>
+
+#include <ec.h>
+#include <ec_libettercap.h>
+#include <ec_packet.h>
+#include <ec_filter.h>
+#include <ec_filter_engine.h>
+
+struct ec_globals *ec_gbls;
+
+#define PROGRAMS  20000
+#define PACKETS   8
+#define OPS       32
+
+static u_char buf[2][256];
+static struct filter_op prog[OPS];
+
+static void setup(void)
+{
+  libettercap_init("test", "0.0.1");
+  filter_init_mutex();
+  srand(1);
+}
+
+static void po_init(struct packet_object *po, u_char *b, size_t len)
+{
+  memset(po, 0, sizeof(struct packet_object));
+  po->packet = b;
+  po->L2.header = b;
+  po->L3.header = b + 14;
+  po->L4.header = b + 34;
+  po->DATA.data = b + 54;
+  po->DATA.len = len;
+  po->DATA.disp_data = b + 54;
+  po->DATA.disp_len = len;
+}
+
+/* a random program of n instructions, only jumping forward */
+static void prog_random(size_t n)
+{
+  static u_char str[16] = "ab";
+  static const u_int8 test_size[] = { 0, 1, 2, 4, 16 };
+  static const u_int8 assign_size[] = { 1, 2, 4 };
+  struct filter_op *f;
+  size_t i;
+  int r;
+
+  memset(prog, 0, sizeof(prog));
+
+  for (i = 0; i < n - 1; i++) {
+    f = &prog[i];
+    r = rand() % 10;
+
+    if (r < 4) {
+      f->opcode = FOP_TEST;
+      f->op.test.level = 2 + rand() % 5;
+      f->op.test.op = rand() % 6;
+      f->op.test.size = test_size[rand() % 5];
+      f->op.test.offset = rand() % 8;
+      f->op.test.value = rand() % 4 ? rand() % 4 : rand();
+      if (f->op.test.size == 0) {
+        f->op.test.string = str;
+        f->op.test.slen = 1 + rand() % 2;
+      }
+      memset(f->op.test.ipaddr, rand() % 2, sizeof(f->op.test.ipaddr));
+    } else if (r < 5) {
+      f->opcode = (rand() % 3 == 0) ? FOP_ASSIGN : (rand() % 2 ? FOP_INC : FOP_DEC);
+      f->op.assign.level = 2 + rand() % 4;
+      f->op.assign.size = assign_size[rand() % 3];
+      f->op.assign.offset = rand() % 8;
+      f->op.assign.value = rand() % 300;
+    } else if (r < 9) {
+      f->opcode = (r < 8) ? FOP_JTRUE + rand() % 2 : FOP_JMP;
+      f->op.jmp = i + 1 + rand() % (n - i - 1);
+    } else {
+      f->opcode = FOP_FUNC;
+      f->op.func.op = FFUNC_SEARCH;
+      f->op.func.level = 5;
+      f->op.func.string = str;
+      f->op.func.slen = 1;
+    }
+  }
+
+  prog[n - 1].opcode = FOP_EXIT;
+}
+
+/* the decoded chain must do what the interpreter does */
+START_TEST (test_decode_equivalence)
+{
+  struct filter_env fenv;
+  struct packet_object a, b;
+  size_t n, j;
+  int i, k;
+
+  for (i = 0; i < PROGRAMS; i++) {
+    n = 2 + rand() % (OPS - 2);
+    prog_random(n);
+
+    memset(&fenv, 0, sizeof(fenv));
+    fenv.chain = prog;
+    fenv.len = n * sizeof(struct filter_op);
+
+    fail_if(filter_decode(&fenv) != E_SUCCESS, "The program was not decoded.");
+
+    for (k = 0; k < PACKETS; k++) {
+      for (j = 0; j < sizeof(buf[0]); j++)
+        buf[0][j] = buf[1][j] = rand() % 3 ? rand() % 4 : rand();
+
+      po_init(&a, buf[0], 100);
+      po_init(&b, buf[1], 100);
+
+      filter_engine(prog, &a);
+      filter_run(fenv.code, &b);
+
+      fail_if(memcmp(buf[0], buf[1], sizeof(buf[0])), "Different packet (program %d).", i);
+      fail_if(a.flags != b.flags, "Different flags (program %d).", i);
+    }
+
+    SAFE_FREE(fenv.code);
+  }
+}
+END_TEST
+
+/* a jump outside of the chain is left to the interpreter */
+START_TEST (test_decode_invalid)
+{
+  struct filter_env fenv;
+
+  memset(prog, 0, sizeof(prog));
+  prog[0].opcode = FOP_JMP;
+  prog[0].op.jmp = 10;
+  prog[1].opcode = FOP_EXIT;
+
+  memset(&fenv, 0, sizeof(fenv));
+  fenv.chain = prog;
+  fenv.len = 2 * sizeof(struct filter_op);
+
+  fail_if(filter_decode(&fenv) == E_SUCCESS, "The invalid program was decoded.");
+  fail_if(fenv.code != NULL, "The invalid program has a decoded chain.");
+}
+END_TEST
+
+/* the literal every match must contain, "" if there is none */
+static const char *literals[][2] = {
+  { "GET /index",       "GET /index" },
+  { "hel+o",            "hel" },
+  { "a{2,3}bcd",        "bcd" },
+  { "(abc)*xyz",        "xyz" },
+  { "abc\\.def",        "abc.def" },
+  { "\\d+hello",        "hello" },
+  { "abc|def",          "" },
+  { "(?i)hello",        "" },
+  { "[a-z]+foo",        "foo" },
+  /* the arguments of the escapes are not part of the literal */
+  { "\\x41BCD",         "BCD" },
+  { "\\x{263a}abc",     "abc" },
+  { "\\101BCD",         "BCD" },
+  { "ab\\12345",        "" },
+  { "\\cABCD",          "BCD" },
+  { "\\k<name>abc",     "abc" },
+  { "\\k'name'abc",     "abc" },
+  { "\\g{1}xyz",        "xyz" },
+  { "\\g-1xyz",         "xyz" },
+  { "\\p{Lu}abc",       "abc" },
+  { "\\pLabc",          "abc" },
+  { "\\Qa.b\\E",        "" },
+  { "\\k<name",         "" },
+};
+
+START_TEST (test_regex_literal)
+{
+  u_char *lit;
+  size_t i, len;
+
+  for (i = 0; i < sizeof(literals) / sizeof(literals[0]); i++) {
+    len = filter_regex_literal(literals[i][0], 0, &lit);
+
+    fail_if(len != strlen(literals[i][1]), "Wrong literal length for %s.", literals[i][0]);
+    fail_if(len > 0 && memcmp(lit, literals[i][1], len), "Wrong literal for %s.", literals[i][0]);
+    fail_if(len == 0 && lit != NULL, "Literal returned for %s.", literals[i][0]);
+
+    SAFE_FREE(lit);
+  }
+}
+END_TEST
+
+/* a payload made of words containing (or almost) the literals */
+static void payload_random(u_char *d, size_t *len)
+{
+  static const char *words[] = {
+    "hello", "HeLLo", "world", "wor1d", "xyz", "abcxyz", "foo", "bar",
+    "GET /index", "get /INDEX", ".com", "aabcd", "aaabcd", "zzz", "", "ab"
+  };
+  size_t n = 0, l;
+  const char *w;
+
+  while (n < 300) {
+    w = words[rand() % 16];
+    if ((l = strlen(w)) == 0) {
+      d[n++] = '\0';
+      continue;
+    }
+    memcpy(d + n, w, l);
+    n += l;
+    if (rand() % 2)
+      d[n++] = ' ';
+  }
+
+  d[n] = '\0';
+  *len = n;
+}
+
+/* the prefilter of the automaton must not change the results */
+START_TEST (test_literal_equivalence)
+{
+  static const char *strings[] = { "hello", "foo", "xyz", "GET /", "com", "abc", "o w", "zz" };
+  static const char *regexes[] = {
+    "hel+o", "wor.d", "(abc)*xyz", "abc|def", "[a-z]+foo", "Hello",
+    "\\.com", "a{2,3}bcd", "GET /index", "index$", "^get", "x?yz+"
+  };
+  static u_char data[2][2048];
+  struct filter_list list;
+  struct filter_env *fenv = &list.env;
+  struct filter_op *f;
+  struct packet_object a, b;
+  size_t n, i, len;
+  int p, k, r, scanned = 0;
+
+  EC_GBL_PCAP->snaplen = 2000;
+
+  for (p = 0; p < PROGRAMS / 10; p++) {
+    n = 2 + rand() % 20;
+    memset(prog, 0, sizeof(prog));
+
+    for (i = 0; i < n - 1; i++) {
+      f = &prog[i];
+      r = rand() % 10;
+
+      if (r < 6) {
+        f->opcode = FOP_FUNC;
+        f->op.func.level = 5 + (r < 5 ? rand() % 2 : 0);
+        if (r < 3) {
+          f->op.func.op = FFUNC_SEARCH;
+          f->op.func.string = (u_char *)strings[rand() % 8];
+        } else if (r < 5) {
+          f->op.func.op = FFUNC_REGEX;
+          f->op.func.string = (u_char *)regexes[rand() % 12];
+        } else {
+          f->op.func.op = FFUNC_REPLACE;
+          f->op.func.string = (u_char *)strings[rand() % 8];
+          f->op.func.replace = (u_char *)strings[rand() % 8];
+          f->op.func.rlen = strlen((char *)f->op.func.replace);
+        }
+        f->op.func.slen = strlen((char *)f->op.func.string);
+      } else if (r < 7) {
+        f->opcode = FOP_ASSIGN;
+        f->op.assign.level = 5;
+        f->op.assign.size = 1;
+        f->op.assign.offset = rand() % 40;
+        f->op.assign.value = "hxyzfo"[rand() % 6];
+      } else {
+        f->opcode = (r < 9) ? FOP_JTRUE + rand() % 2 : FOP_JMP;
+        f->op.jmp = i + 1 + rand() % (n - i - 1);
+      }
+    }
+
+    prog[n - 1].opcode = FOP_EXIT;
+
+    memset(&list, 0, sizeof(list));
+    list.enabled = 1;
+    fenv->chain = prog;
+    fenv->len = n * sizeof(struct filter_op);
+
+    fail_if(filter_compile_regex(fenv) != E_SUCCESS, "The regex were not compiled.");
+    fail_if(filter_decode(fenv) != E_SUCCESS, "The program was not decoded.");
+    filter_literals_add(fenv);
+    scanned += filter_literals_ready(fenv);
+
+    /* the decoded chain runs as a loaded filter */
+    *EC_GBL_FILTERS = &list;
+
+    for (k = 0; k < PACKETS; k++) {
+      payload_random(data[0] + 54, &len);
+      memcpy(data[1], data[0], sizeof(data[0]));
+
+      po_init(&a, data[0], len);
+      po_init(&b, data[1], len);
+
+      filter_engine(prog, &a);
+      filter_packet(&b);
+
+      fail_if(memcmp(data[0], data[1], sizeof(data[0])), "Different packet (program %d).", p);
+      fail_if(a.flags != b.flags, "Different flags (program %d).", p);
+      fail_if(a.DATA.len != b.DATA.len, "Different length (program %d).", p);
+    }
+
+    *EC_GBL_FILTERS = NULL;
+
+    filter_literals_del(fenv);
+    SAFE_FREE(fenv->code);
+    filter_free_regex(fenv);
+  }
+
+  fail_if(scanned == 0, "The automaton was never used.");
+  fail_if(filter_literals_refs() != 0, "Literals still referenced.");
+}
+END_TEST
+
+Suite* ts_test_filter (void) {
+  Suite *suite = suite_create("ts_test_filter");
+  TCase *tcase = tcase_create("filter_decode");
+  tcase_add_checked_fixture(tcase, setup, NULL);
+  tcase_set_timeout(tcase, 60);
+  tcase_add_test(tcase, test_decode_equivalence);
+  tcase_add_test(tcase, test_decode_invalid);
+  suite_add_tcase(suite, tcase);
+
+  tcase = tcase_create("filter_literals");
+  tcase_add_checked_fixture(tcase, setup, NULL);
+  tcase_set_timeout(tcase, 60);
+  tcase_add_test(tcase, test_regex_literal);
+  tcase_add_test(tcase, test_literal_equivalence);
+  suite_add_tcase(suite, tcase);
+
+  return suite;
+}
+
+int main () {
+  int number_failed;
+  Suite *suite = ts_test_filter();
+  SRunner *runner = srunner_create(suite);
+  srunner_run_all(runner, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(runner);
+  srunner_free(runner);
+  return number_failed;
+}
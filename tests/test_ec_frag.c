@@ -0,0 +1,195 @@
+
+#include <stdio.h>
+#include <check.h>
+
+#include <ec.h>
+#include <ec_libettercap.h>
+#include <ec_frag.h>
+#include <ec_stats.h>
+
+struct ec_globals *ec_gbls;
+
+static u_char payload[256];
+static u_char header[64];
+
+static void setup(void)
+{
+  u_int i;
+
+  libettercap_init("test", "0.0.1");
+  EC_GBL_CONF->frag_timeout = 30;
+  EC_GBL_CONF->frag_memory = 1024 * 1024;
+  EC_GBL_CONF->frag_policy = FRAG_POLICY_FIRST;
+
+  for (i = 0; i < sizeof(payload); i++)
+    payload[i] = i;
+  for (i = 0; i < sizeof(header); i++)
+    header[i] = 0xf0 | (i & 0xf);
+}
+
+static void key_init(struct frag_key *key, u_int32 id)
+{
+  memset(key, 0, sizeof(struct frag_key));
+  key->id = id;
+  key->proto = 17;
+}
+
+/* a 14 bytes link header followed by a network header of l3_len bytes */
+static void hdr_init(struct frag_hdr *hdr, size_t l3_len)
+{
+  hdr->buf = header;
+  hdr->l3_off = 14;
+  hdr->len = 14 + l3_len;
+}
+
+static int insert(struct frag_key *key, u_int32 off, size_t len, int more, size_t l3_len,
+                  struct frag_hdr *hdr, u_char **dgram, size_t *dgram_len)
+{
+  struct timeval ts = { 100, 0 };
+
+  hdr_init(hdr, l3_len);
+  return frag_insert(key, &ts, off, payload + off, len, more, FRAG_MAX_LEN - l3_len,
+                     hdr, dgram, dgram_len);
+}
+
+START_TEST (test_frag_in_order)
+{
+  struct frag_key key;
+  struct frag_hdr hdr;
+  u_char *dgram = NULL;
+  size_t dgram_len;
+
+  key_init(&key, 1);
+
+  fail_if(insert(&key, 0, 64, 1, 20, &hdr, &dgram, &dgram_len) != -E_NOTHANDLED, "Completed too early.");
+  fail_if(insert(&key, 64, 100, 0, 20, &hdr, &dgram, &dgram_len) != E_SUCCESS, "Not reassembled.");
+
+  fail_if(dgram_len != 34 + 164, "Wrong length.");
+  fail_if(memcmp(dgram, header, 34), "Wrong headers.");
+  fail_if(memcmp(dgram + 34, payload, 164), "Wrong payload.");
+  fail_if(EC_GBL_STATS->frag_pending != 0, "The datagram is still pending.");
+
+  SAFE_FREE(dgram);
+}
+END_TEST
+
+START_TEST (test_frag_out_of_order)
+{
+  struct frag_key key;
+  struct frag_hdr hdr;
+  u_char *dgram = NULL;
+  size_t dgram_len;
+
+  key_init(&key, 2);
+
+  fail_if(insert(&key, 128, 50, 0, 20, &hdr, &dgram, &dgram_len) != -E_NOTHANDLED, "Completed too early.");
+  fail_if(insert(&key, 64, 64, 1, 20, &hdr, &dgram, &dgram_len) != -E_NOTHANDLED, "Completed without the first.");
+  fail_if(insert(&key, 0, 64, 1, 20, &hdr, &dgram, &dgram_len) != E_SUCCESS, "Not reassembled.");
+
+  fail_if(dgram_len != 34 + 178, "Wrong length.");
+  fail_if(memcmp(dgram + 34, payload, 178), "Wrong payload.");
+
+  SAFE_FREE(dgram);
+}
+END_TEST
+
+/* the later fragments may drop the options which are not copied */
+START_TEST (test_frag_first_header)
+{
+  struct frag_key key;
+  struct frag_hdr hdr;
+  u_char *dgram = NULL;
+  size_t dgram_len;
+
+  key_init(&key, 3);
+
+  fail_if(insert(&key, 0, 64, 1, 40, &hdr, &dgram, &dgram_len) != -E_NOTHANDLED, "Completed too early.");
+  fail_if(insert(&key, 64, 16, 0, 20, &hdr, &dgram, &dgram_len) != E_SUCCESS, "Not reassembled.");
+
+  fail_if(hdr.len != 54, "Not the header of the first fragment.");
+  fail_if(hdr.l3_off != 14, "Wrong network header offset.");
+  fail_if(dgram_len != 54 + 80, "Wrong length.");
+  fail_if(memcmp(dgram, header, 54), "Wrong headers.");
+  fail_if(memcmp(dgram + 54, payload, 80), "Wrong payload.");
+
+  SAFE_FREE(dgram);
+}
+END_TEST
+
+START_TEST (test_frag_overlap_drop)
+{
+  struct frag_key key;
+  struct frag_hdr hdr;
+  u_char *dgram = NULL;
+  size_t dgram_len;
+
+  EC_GBL_CONF->frag_policy = FRAG_POLICY_DROP;
+  key_init(&key, 4);
+
+  fail_if(insert(&key, 0, 64, 1, 20, &hdr, &dgram, &dgram_len) != -E_NOTHANDLED, "Completed too early.");
+  fail_if(insert(&key, 32, 64, 0, 20, &hdr, &dgram, &dgram_len) != -E_INVALID, "Overlap accepted.");
+  fail_if(EC_GBL_STATS->frag_pending != 0, "The datagram was not discarded.");
+}
+END_TEST
+
+START_TEST (test_frag_invalid)
+{
+  struct frag_key key;
+  struct frag_hdr hdr;
+  u_char *dgram = NULL;
+  size_t dgram_len;
+
+  key_init(&key, 5);
+
+  /* only the last fragment can have a length which is not a multiple of 8 */
+  fail_if(insert(&key, 0, 63, 1, 20, &hdr, &dgram, &dgram_len) != -E_INVALID, "Odd length accepted.");
+
+  /* nothing may go beyond the last fragment */
+  fail_if(insert(&key, 64, 16, 0, 20, &hdr, &dgram, &dgram_len) != -E_NOTHANDLED, "Completed too early.");
+  fail_if(insert(&key, 80, 16, 1, 20, &hdr, &dgram, &dgram_len) != -E_INVALID, "Data after the end accepted.");
+}
+END_TEST
+
+START_TEST (test_frag_evict)
+{
+  struct frag_key key;
+  struct frag_hdr hdr;
+  u_char *dgram = NULL;
+  size_t dgram_len;
+  u_int32 i;
+
+  EC_GBL_CONF->frag_memory = 4096;
+
+  for (i = 0; i < 100; i++) {
+    key_init(&key, 100 + i);
+    insert(&key, 0, 64, 1, 20, &hdr, &dgram, &dgram_len);
+    fail_if(EC_GBL_STATS->frag_mem > 4096, "Over the memory limit.");
+  }
+
+  fail_if(EC_GBL_STATS->frag_evicted == 0, "Nothing was evicted.");
+}
+END_TEST
+
+Suite* ts_test_frag (void) {
+  Suite *suite = suite_create("ts_test_frag");
+  TCase *tcase = tcase_create("frag_insert");
+  tcase_add_checked_fixture(tcase, setup, NULL);
+  tcase_add_test(tcase, test_frag_in_order);
+  tcase_add_test(tcase, test_frag_out_of_order);
+  tcase_add_test(tcase, test_frag_first_header);
+  tcase_add_test(tcase, test_frag_overlap_drop);
+  tcase_add_test(tcase, test_frag_invalid);
+  tcase_add_test(tcase, test_frag_evict);
+  suite_add_tcase(suite, tcase);
+  return suite;
+}
+
+int main () {
+  int number_failed;
+  Suite *suite = ts_test_frag();
+  SRunner *runner = srunner_create(suite);
+  srunner_run_all(runner, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(runner);
+  srunner_free(runner);
+  return number_failed;
+}
@@ -0,0 +1,150 @@
+
+#include <stdio.h>
+#include <check.h>
+
+#include <ec.h>
+#include <ec_libettercap.h>
+#include <ec_packet.h>
+#include <ec_stats.h>
+
+struct ec_globals *ec_gbls;
+
+#define DUPS   100
+
+static void fill_po(struct packet_object *po, u_char *buf, u_int len)
+{
+  packet_create_object(po, buf, len);
+  po->L2.header = buf;
+  po->L3.header = buf + 14;
+  po->L4.header = buf + 34;
+  po->DATA.data = buf + 54;
+  po->DATA.len = len - 54;
+}
+
+START_TEST (test_dup_packet)
+{
+  struct packet_object po, *dup;
+  u_char buf[128];
+  u_int i;
+
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = i;
+  fill_po(&po, buf, sizeof(buf));
+
+  dup = packet_dup(&po, PO_DUP_PACKET);
+
+  fail_if(!(dup->flags & PO_DUP), "The duplicate is not flagged.");
+  fail_if(dup->packet == po.packet, "The buffer was not duplicated.");
+  fail_if(memcmp(dup->packet, buf, sizeof(buf)), "The buffer was not copied.");
+  fail_if(dup->DATA.data != dup->packet + 54, "The pointers were not adjusted.");
+
+  packet_destroy_object(dup);
+  packet_release_object(dup);
+}
+END_TEST
+
+START_TEST (test_dup_reuse)
+{
+  struct packet_object po, *dup;
+  u_char buf[128];
+  uint64_t alloc;
+  u_int i;
+
+  memset(buf, 0, sizeof(buf));
+  fill_po(&po, buf, sizeof(buf));
+
+  dup = packet_dup(&po, PO_DUP_PACKET);
+  packet_destroy_object(dup);
+  packet_release_object(dup);
+
+  alloc = EC_GBL_STATS->pool_heap_alloc;
+
+  for (i = 0; i < DUPS; i++) {
+    dup = packet_dup(&po, PO_DUP_PACKET);
+    packet_destroy_object(dup);
+    packet_release_object(dup);
+  }
+
+  fail_if(EC_GBL_STATS->pool_heap_alloc != alloc, "The pool did not reuse the duplicates.");
+}
+END_TEST
+
+START_TEST (test_dup_forged)
+{
+  struct packet_object *po, *dup;
+  u_char *buf;
+
+  SAFE_CALLOC(buf, 128, sizeof(u_char));
+  po = packet_allocate_object(buf, 128);
+
+  /* the duplicate of a forged packet comes from the pool anyway */
+  dup = packet_dup(po, PO_DUP_PACKET);
+  fail_if(!(dup->flags & PO_FORGED), "The duplicate lost the forged flag.");
+
+  packet_destroy_object(dup);
+  packet_release_object(dup);
+
+  packet_destroy_object(po);
+}
+END_TEST
+
+static void * dup_thread(void *arg)
+{
+  struct packet_object po, *dup[DUPS];
+  u_char buf[128];
+  u_int i;
+
+  (void) arg;
+
+  memset(buf, 0, sizeof(buf));
+  fill_po(&po, buf, sizeof(buf));
+
+  for (i = 0; i < DUPS; i++)
+    dup[i] = packet_dup(&po, PO_DUP_PACKET);
+
+  for (i = 0; i < DUPS; i++) {
+    packet_destroy_object(dup[i]);
+    packet_release_object(dup[i]);
+  }
+
+  return NULL;
+}
+
+START_TEST (test_thread_exit)
+{
+  pthread_t pid;
+
+  pthread_create(&pid, NULL, dup_thread, NULL);
+  pthread_join(pid, NULL);
+
+  /*
+   * DUPS objects and DUPS buffers were allocated, on exit one
+   * batch per class went to the depot and the rest to the heap
+   */
+  fail_if(EC_GBL_STATS->pool_heap_alloc != 2 * DUPS, "Unexpected allocations.");
+  fail_if(EC_GBL_STATS->pool_heap_alloc - EC_GBL_STATS->pool_heap_free != 2 * 64,
+          "The cache of the thread was not drained.");
+}
+END_TEST
+
+Suite* ts_test_packet (void) {
+  Suite *suite = suite_create("ts_test_packet");
+  TCase *tcase = tcase_create("packet_dup");
+  tcase_add_test(tcase, test_dup_packet);
+  tcase_add_test(tcase, test_dup_reuse);
+  tcase_add_test(tcase, test_dup_forged);
+  tcase_add_test(tcase, test_thread_exit);
+  suite_add_tcase(suite, tcase);
+  return suite;
+}
+
+int main () {
+  int number_failed;
+  libettercap_init("test", "0.0.1");
+  Suite *suite = ts_test_packet();
+  SRunner *runner = srunner_create(suite);
+  srunner_run_all(runner, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(runner);
+  srunner_free(runner);
+  return number_failed;
+}
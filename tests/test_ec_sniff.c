@@ -0,0 +1,147 @@
+
+#include <stdio.h>
+#include <check.h>
+
+#include <ec.h>
+#include <ec_libettercap.h>
+#include <ec_inet.h>
+#include <ec_sniff.h>
+
+struct ec_globals *ec_gbls;
+
+#ifdef WITH_IPV6
+  #define TARGET(ips)  "/" ips "//"
+#else
+  #define TARGET(ips)  "/" ips "/"
+#endif
+
+static struct target_env target;
+
+static void setup(void)
+{
+  libettercap_init("test", "0.0.1");
+  memset(&target, 0, sizeof(target));
+}
+
+static void ip_init(struct ip_addr *ip, const char *str)
+{
+  struct in_addr in;
+
+  inet_aton(str, &in);
+  ip_addr_init(ip, AF_INET, (u_char *)&in);
+}
+
+static int match(const char *str)
+{
+  struct ip_addr ip;
+
+  ip_init(&ip, str);
+  return cmp_ip_list(&ip, &target);
+}
+
+static u_int count_ranges(void)
+{
+  return target.ranges != NULL ? target.ranges->n : 0;
+}
+
+START_TEST (test_ranges_compile)
+{
+  char str[] = TARGET("10.0.0-1.1-254;192.168.1.7");
+
+  fail_if(compile_target(str, &target) != E_SUCCESS, "The target was not compiled.");
+
+  /* 10.0.0.1-254, 10.0.1.1-254 and 192.168.1.7 */
+  fail_if(count_ranges() != 3, "The addresses were not merged.");
+
+  fail_if(!match("10.0.0.1"), "First address not matched.");
+  fail_if(!match("10.0.0.254"), "Last address of the interval not matched.");
+  fail_if(!match("10.0.1.100"), "Address in the second interval not matched.");
+  fail_if(!match("192.168.1.7"), "Single address not matched.");
+
+  fail_if(match("10.0.0.0"), "Address before the interval matched.");
+  fail_if(match("10.0.0.255"), "Address between the intervals matched.");
+  fail_if(match("10.0.2.1"), "Address after the intervals matched.");
+  fail_if(match("192.168.1.8"), "Address after the single one matched.");
+}
+END_TEST
+
+START_TEST (test_ranges_add_del)
+{
+  struct ip_addr ip;
+
+  ip_init(&ip, "10.0.0.2");
+  add_ip_list(&ip, &target);
+  ip_init(&ip, "10.0.0.4");
+  add_ip_list(&ip, &target);
+
+  fail_if(count_ranges() != 2, "Wrong number of intervals.");
+  fail_if(match("10.0.0.3"), "The gap matched.");
+
+  /* filling the gap merges them */
+  ip_init(&ip, "10.0.0.3");
+  add_ip_list(&ip, &target);
+  fail_if(count_ranges() != 1, "The intervals were not merged.");
+  fail_if(!match("10.0.0.3"), "The new address not matched.");
+
+  /* and removing it splits them again */
+  del_ip_list(&ip, &target);
+  fail_if(count_ranges() != 2, "The interval was not split.");
+  fail_if(match("10.0.0.3"), "The removed address matched.");
+  fail_if(!match("10.0.0.2") || !match("10.0.0.4"), "The other addresses were lost.");
+}
+END_TEST
+
+START_TEST (test_ranges_batch)
+{
+  struct ip_addr ip;
+  char str[MAX_ASCII_ADDR_LEN];
+  u_int i;
+
+  for (i = 1; i <= 100; i++) {
+    snprintf(str, sizeof(str), "10.0.%u.%u", i / 50, i % 50);
+    ip_init(&ip, str);
+    fail_if(insert_ip_list(&ip, &target) != E_SUCCESS, "The address was not inserted.");
+  }
+
+  /* the matching is updated only by the commit */
+  fail_if(match("10.0.0.1"), "Matched before the commit.");
+
+  ip_init(&ip, "10.0.0.1");
+  fail_if(insert_ip_list(&ip, &target) != -E_DUPLICATE, "Duplicate inserted.");
+
+  commit_ip_list(&target);
+
+  fail_if(count_ranges() != 3, "Wrong number of intervals.");
+  fail_if(!match("10.0.0.1") || !match("10.0.1.49") || !match("10.0.2.0"), "Address not matched.");
+  fail_if(match("10.0.0.0") || match("10.0.0.50") || match("10.0.2.1"), "Address outside matched.");
+
+  ip_init(&ip, "10.0.1.10");
+  fail_if(remove_ip_list(&ip, &target) != E_SUCCESS, "The address was not removed.");
+  fail_if(remove_ip_list(&ip, &target) != -E_NOTFOUND, "The address was removed twice.");
+  commit_ip_list(&target);
+
+  fail_if(count_ranges() != 4, "The interval was not split.");
+  fail_if(match("10.0.1.10"), "The removed address matched.");
+}
+END_TEST
+
+Suite* ts_test_sniff (void) {
+  Suite *suite = suite_create("ts_test_sniff");
+  TCase *tcase = tcase_create("ip_ranges");
+  tcase_add_checked_fixture(tcase, setup, NULL);
+  tcase_add_test(tcase, test_ranges_compile);
+  tcase_add_test(tcase, test_ranges_add_del);
+  tcase_add_test(tcase, test_ranges_batch);
+  suite_add_tcase(suite, tcase);
+  return suite;
+}
+
+int main () {
+  int number_failed;
+  Suite *suite = ts_test_sniff();
+  SRunner *runner = srunner_create(suite);
+  srunner_run_all(runner, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(runner);
+  srunner_free(runner);
+  return number_failed;
+}
@@ -0,0 +1,238 @@
+
+#include <stdio.h>
+#include <check.h>
+
+/* ef.h first, it names the program before ec.h does */
+#include <ef.h>
+#include <ef_functions.h>
+#include <ec_libettercap.h>
+#include <ec_packet.h>
+#include <ec_filter.h>
+#include <ec_filter_engine.h>
+
+struct ec_globals *ec_gbls;
+
+/* the optimizer is part of etterfilter, its globals are here */
+struct ef_globals *ef_gbls;
+static struct ef_globals ef_options;
+
+void ef_debug(u_char level, const char *message, ...)
+{
+  (void) level;
+  (void) message;
+}
+
+#define PROGRAMS  20000
+#define PACKETS   8
+#define OPS       40
+#define TESTS     4
+
+static u_char buf[2][256];
+static struct filter_op prog[2][OPS];
+static struct filter_op tests[TESTS];
+
+static void setup(void)
+{
+  static const u_int8 test_size[] = { 1, 2, 4 };
+  int i;
+
+  libettercap_init("test", "0.0.1");
+  filter_init_mutex();
+  srand(1);
+
+  ef_gbls = &ef_options;
+
+  /* a few tests, so that the same one is often repeated */
+  memset(tests, 0, sizeof(tests));
+  for (i = 0; i < TESTS; i++) {
+    tests[i].opcode = FOP_TEST;
+    tests[i].op.test.level = 2 + rand() % 4;
+    tests[i].op.test.op = rand() % 6;
+    tests[i].op.test.size = test_size[rand() % 3];
+    tests[i].op.test.offset = rand() % 4;
+    tests[i].op.test.value = rand() % 3;
+  }
+}
+
+static void po_init(struct packet_object *po, u_char *b, size_t len)
+{
+  memset(po, 0, sizeof(struct packet_object));
+  po->packet = b;
+  po->L2.header = b;
+  po->L3.header = b + 14;
+  po->L4.header = b + 34;
+  po->DATA.data = b + 54;
+  po->DATA.len = len;
+  po->DATA.disp_data = b + 54;
+  po->DATA.disp_len = len;
+}
+
+/*
+ * a random program of n instructions, only jumping forward.
+ * the jumps are many, so they often land on other jumps, on the
+ * exit or on the test they follow.
+ */
+static void prog_random(size_t n)
+{
+  static u_char str[16] = "ab";
+  struct filter_op *f;
+  size_t i;
+  int r;
+
+  memset(prog[0], 0, sizeof(prog[0]));
+
+  for (i = 0; i < n - 1; i++) {
+    f = &prog[0][i];
+    r = rand() % 20;
+
+    if (r < 6) {
+      memcpy(f, &tests[rand() % TESTS], sizeof(struct filter_op));
+    } else if (r < 7) {
+      f->opcode = FOP_FUNC;
+      f->op.func.op = FFUNC_SEARCH;
+      f->op.func.level = 5;
+      f->op.func.string = str;
+      f->op.func.slen = 1 + rand() % 2;
+    } else if (r < 9) {
+      f->opcode = (rand() % 3 == 0) ? FOP_ASSIGN : (rand() % 2 ? FOP_INC : FOP_DEC);
+      f->op.assign.level = 2 + rand() % 4;
+      f->op.assign.size = 1;
+      f->op.assign.offset = rand() % 4;
+      f->op.assign.value = rand() % 3;
+    } else if (r < 19) {
+      f->opcode = (r < 15) ? FOP_JTRUE + rand() % 2 : FOP_JMP;
+      /* the next one, a near one or anywhere after */
+      switch (rand() % 3) {
+        case 0:
+          f->op.jmp = i + 1;
+          break;
+        case 1:
+          /* MIN() evaluates its arguments twice */
+          r = i + 1 + rand() % 3;
+          f->op.jmp = MIN((size_t)r, n - 1);
+          break;
+        default:
+          f->op.jmp = i + 1 + rand() % (n - i - 1);
+          break;
+      }
+    } else {
+      f->opcode = FOP_EXIT;
+    }
+  }
+
+  prog[0][n - 1].opcode = FOP_EXIT;
+}
+
+/* the optimized program must do what the original does */
+START_TEST (test_optimizer_equivalence)
+{
+  struct packet_object a, b;
+  size_t n, m, j, total = 0, removed = 0;
+  int i, k;
+
+  for (i = 0; i < PROGRAMS; i++) {
+    n = 2 + rand() % (OPS - 2);
+    prog_random(n);
+
+    memcpy(prog[1], prog[0], sizeof(prog[0]));
+    m = optimize_code(prog[1], n);
+
+    fail_if(m == 0 || m > n, "Wrong number of instructions (program %d).", i);
+    fail_if(prog[1][m - 1].opcode != FOP_EXIT, "The exit was removed (program %d).", i);
+    for (j = 0; j < m; j++)
+      fail_if((prog[1][j].opcode == FOP_JMP || prog[1][j].opcode == FOP_JTRUE ||
+               prog[1][j].opcode == FOP_JFALSE) && prog[1][j].op.jmp >= m,
+              "Jump outside of the program (program %d).", i);
+
+    total += n;
+    removed += n - m;
+
+    for (k = 0; k < PACKETS; k++) {
+      for (j = 0; j < sizeof(buf[0]); j++)
+        buf[0][j] = buf[1][j] = rand() % 3 ? rand() % 3 : rand();
+
+      po_init(&a, buf[0], 100);
+      po_init(&b, buf[1], 100);
+
+      filter_engine(prog[0], &a);
+      filter_engine(prog[1], &b);
+
+      fail_if(memcmp(buf[0], buf[1], sizeof(buf[0])), "Different packet (program %d).", i);
+      fail_if(a.flags != b.flags, "Different flags (program %d).", i);
+    }
+  }
+
+  /* the rewrites were exercised */
+  fail_if(removed < total / 10, "Too few instructions removed.");
+}
+END_TEST
+
+/* a jump on a jump lands on the final destination */
+START_TEST (test_optimizer_threading)
+{
+  size_t m;
+
+  memset(prog[0], 0, sizeof(prog[0]));
+
+  /* 0: test, 1: jfalse 3, 2: assign, 3: jmp 5, 4: assign, 5: exit */
+  memcpy(&prog[0][0], &tests[0], sizeof(struct filter_op));
+  prog[0][1].opcode = FOP_JFALSE;
+  prog[0][1].op.jmp = 3;
+  prog[0][2].opcode = FOP_ASSIGN;
+  prog[0][2].op.assign.level = 5;
+  prog[0][2].op.assign.size = 1;
+  prog[0][3].opcode = FOP_JMP;
+  prog[0][3].op.jmp = 5;
+  prog[0][4].opcode = FOP_ASSIGN;
+  prog[0][4].op.assign.level = 5;
+  prog[0][4].op.assign.size = 1;
+  prog[0][5].opcode = FOP_EXIT;
+
+  m = optimize_code(prog[0], 6);
+
+  /* the jump to the exit is an exit, the unreachable assign is gone */
+  fail_if(m != 5, "Wrong number of instructions: %d.", (int)m);
+  fail_if(prog[0][1].opcode != FOP_JFALSE || prog[0][1].op.jmp != 4, "The jump was not threaded.");
+  fail_if(prog[0][2].opcode != FOP_ASSIGN, "The assign was removed.");
+  fail_if(prog[0][3].opcode != FOP_EXIT, "The jump to the exit was kept.");
+  fail_if(prog[0][4].opcode != FOP_EXIT, "The exit is not the last.");
+}
+END_TEST
+
+/* with -n nothing is changed */
+START_TEST (test_optimizer_disabled)
+{
+  size_t n = 20;
+
+  prog_random(n);
+  memcpy(prog[1], prog[0], sizeof(prog[0]));
+
+  ef_options.no_optimize = 1;
+  fail_if(optimize_code(prog[1], n) != n, "The program was optimized.");
+  ef_options.no_optimize = 0;
+
+  fail_if(memcmp(prog[0], prog[1], sizeof(prog[0])), "The program was changed.");
+}
+END_TEST
+
+Suite* ts_test_optimizer (void) {
+  Suite *suite = suite_create("ts_test_optimizer");
+  TCase *tcase = tcase_create("optimize_code");
+  tcase_add_checked_fixture(tcase, setup, NULL);
+  tcase_set_timeout(tcase, 60);
+  tcase_add_test(tcase, test_optimizer_equivalence);
+  tcase_add_test(tcase, test_optimizer_threading);
+  tcase_add_test(tcase, test_optimizer_disabled);
+  suite_add_tcase(suite, tcase);
+  return suite;
+}
+
+int main () {
+  int number_failed;
+  Suite *suite = ts_test_optimizer();
+  SRunner *runner = srunner_create(suite);
+  srunner_run_all(runner, CK_VERBOSE);
+  number_failed = srunner_ntests_failed(runner);
+  srunner_free(runner);
+  return number_failed;
+}
@@ -267,6 +267,15 @@ size_t compile_tree(struct filter_op **fop)
    /* always append the exit function to a script */
    SAFE_REALLOC(array, i * sizeof(struct filter_op));
    array[i - 1].opcode = FOP_EXIT;
+
+   if (!EF_GBL_OPTIONS->no_optimize) {
+      USER_MSG(" Optimizing the code ");
+
+      /* the jumps can be followed only now that they are real offsets */
+      i = optimize_code(array, i);
+
+      USER_MSG(" done.\n\n");
+   }
    
    /* return the pointer to the array */
    *fop = array;
@@ -344,6 +353,9 @@ static void unfold_ifblk(struct block **blk)
    /* cast the if block */
    ifblk = (*blk)->un.ifb;
   
+   /* evaluate the cheap conditions first */
+   optimize_conds(&ifblk->conds);
+
    /* compile the conditions */
    unfold_conds(ifblk->conds, a, b);
    
@@ -0,0 +1,402 @@
+/*
+    etterfilter -- the optimizer
+
+    Copyright (C) ALoR & NaGA
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+*/
+
+#include <ef.h>
+#include <ef_functions.h>
+
+/*
+ * the optimizer works in two places:
+ *
+ * before the unfolding, the conditions of an if block joined only by
+ * && (or only by ||) are reordered so that the tests on the headers
+ * are evaluated before search(), regex() and pcre_regex(). it is done
+ * only if all the conditions are free of side effects, and a condition
+ * is never moved before another one which may be guarding it (see
+ * fop_can_swap).
+ *
+ * after the unfolding, on the array of filter_op with real offsets:
+ *
+ *  - the jumps landing on other jumps are threaded to the final
+ *    destination. a conditional jump landing on another conditional
+ *    jump knows its outcome, since the flag is not changed in between.
+ *    a jump always landing on the exit becomes an exit.
+ *  - a jump taken just after a test, landing on the same test, skips
+ *    it: the result can't be different. this way the test repeated at
+ *    the beginning of consecutive if blocks is evaluated once when it
+ *    fails.
+ *  - the unreachable instructions, the jumps to the next instruction
+ *    and the tests whose result is never used are removed.
+ *
+ * the passes are repeated until nothing changes.
+ *
+ * the conditions are not folded: a condition always reads the packet,
+ * so its result is never known at compile time.
+ *
+ * nothing is done if the optimizer is disabled (-n).
+ */
+
+#define OPT_PASSES_MAX  16
+
+/* the levels from 5 (DATA and DECODED) are the payload */
+#define FOP_LEVEL_DATA  5
+
+#define FOP_IS_JUMP(f)  ((f)->opcode == FOP_JMP || (f)->opcode == FOP_JTRUE || (f)->opcode == FOP_JFALSE)
+#define FOP_IS_COND(f)  ((f)->opcode == FOP_JTRUE || (f)->opcode == FOP_JFALSE)
+
+static struct {
+   u_int32 reordered;
+   u_int32 threaded;
+   u_int32 retests;
+   u_int32 exits;
+} opt_stats;
+
+/* protos */
+
+static int fop_cost(struct filter_op *fop);
+static int fop_can_swap(struct filter_op *a, struct filter_op *b);
+static int fop_same_test(struct filter_op *a, struct filter_op *b);
+static int thread_jumps(struct filter_op *fop, size_t n);
+static size_t remove_dead(struct filter_op *fop, size_t n);
+
+/*******************************************/
+
+/*
+ * the cost of a condition, -1 if it has side effects
+ */
+static int fop_cost(struct filter_op *fop)
+{
+   switch (fop->opcode) {
+      case FOP_TEST:
+         return 0;
+
+      case FOP_FUNC:
+         switch (fop->op.func.op) {
+            case FFUNC_SEARCH:
+               return 1;
+            case FFUNC_REGEX:
+               return 2;
+            case FFUNC_PCRE:
+               /* with the replacement it modifies the packet */
+               return (fop->op.func.rlen == 0) ? 2 : -1;
+         }
+         break;
+   }
+
+   return -1;
+}
+
+/*
+ * can the condition 'b' be evaluated before 'a' ?
+ * a test on the headers (L2 to L4) can't depend on the payload inspected
+ * by a function, while a test on the payload may be guarded by it (e.g.
+ * search() checking the content before a test at a fixed offset). two
+ * functions are swapped only if they read the same buffer.
+ */
+static int fop_can_swap(struct filter_op *a, struct filter_op *b)
+{
+   if (a->opcode == FOP_FUNC && b->opcode == FOP_FUNC)
+      return a->op.func.level == b->op.func.level;
+
+   if (a->opcode == FOP_FUNC && b->opcode == FOP_TEST)
+      return b->op.test.level < FOP_LEVEL_DATA;
+
+   return 0;
+}
+
+/*
+ * two conditions without side effects giving the same result
+ */
+static int fop_same_test(struct filter_op *a, struct filter_op *b)
+{
+   if (a->opcode != b->opcode || fop_cost(a) < 0)
+      return 0;
+
+   if (a->opcode == FOP_TEST)
+      return a->op.test.op == b->op.test.op &&
+             a->op.test.level == b->op.test.level &&
+             a->op.test.size == b->op.test.size &&
+             a->op.test.offset == b->op.test.offset &&
+             a->op.test.value == b->op.test.value &&
+             !memcmp(a->op.test.ipaddr, b->op.test.ipaddr, sizeof(a->op.test.ipaddr)) &&
+             a->op.test.slen == b->op.test.slen &&
+             (a->op.test.slen == 0 || !memcmp(a->op.test.string, b->op.test.string, a->op.test.slen));
+
+   return a->op.func.op == b->op.func.op &&
+          a->op.func.level == b->op.func.level &&
+          a->op.func.rlen == b->op.func.rlen &&
+          a->op.func.slen == b->op.func.slen &&
+          (a->op.func.slen == 0 || !memcmp(a->op.func.string, b->op.func.string, a->op.func.slen));
+}
+
+/*
+ * move the cheap conditions of an if block before the expensive ones.
+ * the relative order of the conditions with the same cost is kept, and
+ * a condition stops before the first one it can't be swapped with.
+ */
+void optimize_conds(struct condition **cnd)
+{
+   struct condition *c, **v, *tmp;
+   size_t n = 0, i, j;
+   u_int16 op = COND_AND;
+   int moved = 0;
+
+   if (EF_GBL_OPTIONS->no_optimize)
+      return;
+
+   for (c = *cnd; c != NULL; c = c->next) {
+      if (fop_cost(&c->fop) < 0)
+         return;
+      /* mixed operators are evaluated left-to-right, keep them as they are */
+      if (c->next != NULL) {
+         if (n > 0 && c->op != op)
+            return;
+         op = c->op;
+      }
+      n++;
+   }
+
+   if (n < 2)
+      return;
+
+   SAFE_CALLOC(v, n, sizeof(struct condition *));
+
+   for (i = 0, c = *cnd; c != NULL; c = c->next)
+      v[i++] = c;
+
+   /* a stable insertion sort, the lists are short */
+   for (i = 1; i < n; i++) {
+      tmp = v[i];
+      for (j = i; j > 0 && fop_cost(&v[j - 1]->fop) > fop_cost(&tmp->fop) &&
+                  fop_can_swap(&v[j - 1]->fop, &tmp->fop); j--)
+         v[j] = v[j - 1];
+      if (j != i)
+         moved = 1;
+      v[j] = tmp;
+   }
+
+   if (moved) {
+      /* relink them, the last one always has the default operator */
+      for (i = 0; i < n - 1; i++) {
+         v[i]->next = v[i + 1];
+         v[i]->op = op;
+      }
+      v[n - 1]->next = NULL;
+      v[n - 1]->op = COND_AND;
+
+      *cnd = v[0];
+      opt_stats.reordered++;
+
+      ef_debug(1, "<");
+   }
+
+   SAFE_FREE(v);
+}
+
+/*
+ * redirect the jumps to their final destination.
+ * returns 1 if something was changed
+ */
+static int thread_jumps(struct filter_op *fop, size_t n)
+{
+   struct filter_op *f;
+   u_int8 *target;
+   size_t i, steps;
+   u_int16 t;
+   int changed = 0;
+
+   SAFE_CALLOC(target, n, sizeof(u_int8));
+
+   /* the instructions reached by a jump */
+   for (i = 0; i < n; i++)
+      if (FOP_IS_JUMP(&fop[i]) && fop[i].op.jmp < n)
+         target[fop[i].op.jmp] = 1;
+
+   for (i = 0; i < n; i++) {
+
+      if (!FOP_IS_JUMP(&fop[i]))
+         continue;
+
+      t = fop[i].op.jmp;
+
+      /* the bound protects from loops */
+      for (steps = 0; steps < n && t < n; steps++) {
+         f = &fop[t];
+
+         if (f->opcode == FOP_JMP)
+            t = f->op.jmp;
+         else if (FOP_IS_COND(&fop[i]) && f->opcode == fop[i].opcode)
+            /* same flag, it jumps too */
+            t = f->op.jmp;
+         else if (FOP_IS_COND(&fop[i]) && FOP_IS_COND(f))
+            /* same flag, it falls through */
+            t++;
+         else if (i > 0 && !target[i] && fop_same_test(&fop[i - 1], f)) {
+            /* the flag is still the result of the same test */
+            t++;
+            opt_stats.retests++;
+         } else
+            break;
+      }
+
+      if (t < n && t != fop[i].op.jmp) {
+         ef_debug(1, "*");
+         fop[i].op.jmp = t;
+         target[t] = 1;
+         opt_stats.threaded++;
+         changed = 1;
+      }
+
+      /* nothing to do at the destination */
+      if (fop[i].opcode == FOP_JMP && fop[i].op.jmp < n && fop[fop[i].op.jmp].opcode == FOP_EXIT) {
+         fop[i].opcode = FOP_EXIT;
+         opt_stats.exits++;
+         changed = 1;
+      }
+   }
+
+   SAFE_FREE(target);
+
+   return changed;
+}
+
+/*
+ * remove the instructions having no effect and fix the offsets.
+ * returns the new number of instructions
+ */
+static size_t remove_dead(struct filter_op *fop, size_t n)
+{
+   u_int8 *reach;
+   u_int16 *stack, *offset;
+   size_t i, j, sp = 0;
+
+   SAFE_CALLOC(reach, n, sizeof(u_int8));
+   SAFE_CALLOC(stack, n, sizeof(u_int16));
+   SAFE_CALLOC(offset, n + 1, sizeof(u_int16));
+
+   /* mark the reachable instructions */
+   reach[0] = 1;
+   stack[sp++] = 0;
+
+   while (sp > 0) {
+      i = stack[--sp];
+
+      switch (fop[i].opcode) {
+         case FOP_EXIT:
+            continue;
+         case FOP_JMP:
+            j = fop[i].op.jmp;
+            break;
+         case FOP_JTRUE:
+         case FOP_JFALSE:
+            j = fop[i].op.jmp;
+            if (j < n && !reach[j]) {
+               reach[j] = 1;
+               stack[sp++] = j;
+            }
+            j = i + 1;
+            break;
+         default:
+            j = i + 1;
+            break;
+      }
+
+      if (j < n && !reach[j]) {
+         reach[j] = 1;
+         stack[sp++] = j;
+      }
+   }
+
+   for (i = 0; i < n; i++) {
+      /* a jump to the next instruction */
+      if (FOP_IS_JUMP(&fop[i]) && fop[i].op.jmp == i + 1)
+         reach[i] = 0;
+      /* a test whose result is overwritten (or not used at all) */
+      if (i + 1 < n && fop_cost(&fop[i]) >= 0 && !FOP_IS_JUMP(&fop[i + 1]))
+         reach[i] = 0;
+   }
+
+   /* the script always terminates with the exit */
+   reach[n - 1] = 1;
+
+   /*
+    * the removed instructions are replaced by the next one kept,
+    * they have no effect on the flag used after them
+    */
+   for (i = 0, j = 0; i < n; i++) {
+      offset[i] = j;
+      if (reach[i])
+         j++;
+   }
+   offset[n] = j;
+
+   for (i = 0, j = 0; i < n; i++) {
+      if (!reach[i]) {
+         ef_debug(1, "-");
+         continue;
+      }
+      if (FOP_IS_JUMP(&fop[i]))
+         fop[i].op.jmp = offset[MIN(fop[i].op.jmp, n)];
+      if (i != j)
+         memcpy(&fop[j], &fop[i], sizeof(struct filter_op));
+      j++;
+   }
+
+   SAFE_FREE(reach);
+   SAFE_FREE(stack);
+   SAFE_FREE(offset);
+
+   return j;
+}
+
+/*
+ * optimize the compiled array of filter_op (terminated by the exit).
+ * returns the new number of instructions
+ */
+size_t optimize_code(struct filter_op *fop, size_t n)
+{
+   size_t before = n, prev;
+   int changed, passes = 0;
+
+   if (EF_GBL_OPTIONS->no_optimize)
+      return n;
+
+   do {
+      prev = n;
+      changed = thread_jumps(fop, n);
+      n = remove_dead(fop, n);
+   } while ((changed || n != prev) && ++passes < OPT_PASSES_MAX);
+
+   if (EF_GBL_OPTIONS->optimize_report) {
+      USER_MSG("\n -> Optimizer: %d instructions before, %d after.\n", (int)before - 1, (int)n - 1);
+      USER_MSG("      %d conditions reordered\n", (int)opt_stats.reordered);
+      USER_MSG("      %d jumps threaded\n", (int)opt_stats.threaded);
+      USER_MSG("      %d jumps to the exit replaced\n", (int)opt_stats.exits);
+      USER_MSG("      %d repeated tests skipped\n", (int)opt_stats.retests);
+      USER_MSG("      %d instructions removed\n\n", (int)(before - n));
+   }
+
+   return n;
+}
+
+/* EOF */
+
+// vim:ts=3:expandtab
+
@@ -46,6 +46,8 @@ void ef_usage(void)
    fprintf(stdout, "  -t, --test <file>           test the file (debug mode)\n");
    fprintf(stdout, "  -d, --debug                 print some debug info while compiling\n");
    fprintf(stdout, "  -w, --suppress-warnings     ignore warnings during compilation\n");
+   fprintf(stdout, "  -O, --optimizer-report      print what the optimizer has done\n");
+   fprintf(stdout, "  -n, --no-optimizer          do not optimize the compiled code\n");
    
    fprintf(stdout, "\nStandard Options:\n");
    fprintf(stdout, "  -v, --version               prints the version and exit\n");
@@ -69,6 +71,8 @@ void parse_options(int argc, char **argv)
       { "output", required_argument, NULL, 'o' },
       { "debug", no_argument, NULL, 'd' },
       { "suppress-warning", no_argument, NULL, 'w' },
+      { "optimizer-report", no_argument, NULL, 'O' },
+      { "no-optimizer", no_argument, NULL, 'n' },
       
       { 0 , 0 , 0 , 0}
    };
@@ -76,7 +80,7 @@ void parse_options(int argc, char **argv)
    
    optind = 0;
 
-   while ((c = getopt_long (argc, argv, "do:ht:vw", long_options, (int *)0)) != EOF) {
+   while ((c = getopt_long (argc, argv, "do:ht:vwOn", long_options, (int *)0)) != EOF) {
 
       switch (c) {
 
@@ -96,6 +100,14 @@ void parse_options(int argc, char **argv)
          case 'w':
                   EF_GBL_OPTIONS->suppress_warnings = 1;
                   break;
+
+         case 'O':
+                  EF_GBL_OPTIONS->optimize_report = 1;
+                  break;
+
+         case 'n':
+                  EF_GBL_OPTIONS->no_optimize = 1;
+                  break;
                   
          case 'h':
                   ef_usage();